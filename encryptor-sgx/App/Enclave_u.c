@@ -33,6 +33,20 @@ typedef struct ms_crypt_command_t {
 	int ms_decrypt;
 } ms_crypt_command_t;
 
+typedef struct ms_crypt_commands_t {
+	long int ms_retval;
+	unsigned char* ms_pvm;
+	size_t ms_pvm_size;
+	const struct nvme_command_alias* ms_cmds;
+	struct crypt_desc* ms_descs;
+	size_t ms_ncmds;
+} ms_crypt_commands_t;
+
+typedef struct ms_crypt_ring_run_t {
+	long int ms_retval;
+	void* ms_ring;
+} ms_crypt_ring_run_t;
+
 typedef struct ms_sl_init_switchless_t {
 	sgx_status_t ms_retval;
 	void* ms_sl_data;
@@ -42,6 +56,10 @@ typedef struct ms_sl_run_switchless_tworker_t {
 	sgx_status_t ms_retval;
 } ms_sl_run_switchless_tworker_t;
 
+typedef struct ms_crypt_ring_wait_t {
+	unsigned int ms_usec;
+} ms_crypt_ring_wait_t;
+
 typedef struct ms_sgx_oc_cpuidex_t {
 	int* ms_cpuinfo;
 	int ms_leaf;
@@ -70,6 +88,14 @@ typedef struct ms_sgx_thread_set_multiple_untrusted_events_ocall_t {
 	size_t ms_total;
 } ms_sgx_thread_set_multiple_untrusted_events_ocall_t;
 
+static sgx_status_t SGX_CDECL Enclave_crypt_ring_wait(void* pms)
+{
+	ms_crypt_ring_wait_t* ms = SGX_CAST(ms_crypt_ring_wait_t*, pms);
+	crypt_ring_wait(ms->ms_usec);
+
+	return SGX_SUCCESS;
+}
+
 static sgx_status_t SGX_CDECL Enclave_sgx_oc_cpuidex(void* pms)
 {
 	ms_sgx_oc_cpuidex_t* ms = SGX_CAST(ms_sgx_oc_cpuidex_t*, pms);
@@ -112,10 +138,11 @@ static sgx_status_t SGX_CDECL Enclave_sgx_thread_set_multiple_untrusted_events_o
 
 static const struct {
 	size_t nr_ocall;
-	void * table[5];
+	void * table[6];
 } ocall_table_Enclave = {
-	5,
+	6,
 	{
+		(void*)Enclave_crypt_ring_wait,
 		(void*)Enclave_sgx_oc_cpuidex,
 		(void*)Enclave_sgx_thread_wait_untrusted_event_ocall,
 		(void*)Enclave_sgx_thread_set_untrusted_event_ocall,
@@ -175,12 +202,36 @@ sgx_status_t crypt_command(sgx_enclave_id_t eid, long int* retval, unsigned char
 	return status;
 }
 
+sgx_status_t crypt_commands(sgx_enclave_id_t eid, long int* retval, unsigned char* pvm, size_t pvm_size, const struct nvme_command_alias* cmds, struct crypt_desc* descs, size_t ncmds)
+{
+	sgx_status_t status;
+	ms_crypt_commands_t ms;
+	ms.ms_pvm = pvm;
+	ms.ms_pvm_size = pvm_size;
+	ms.ms_cmds = cmds;
+	ms.ms_descs = descs;
+	ms.ms_ncmds = ncmds;
+	status = sgx_ecall_switchless(eid, 4, &ocall_table_Enclave, &ms);
+	if (status == SGX_SUCCESS && retval) *retval = ms.ms_retval;
+	return status;
+}
+
+sgx_status_t crypt_ring_run(sgx_enclave_id_t eid, long int* retval, void* ring)
+{
+	sgx_status_t status;
+	ms_crypt_ring_run_t ms;
+	ms.ms_ring = ring;
+	status = sgx_ecall(eid, 5, &ocall_table_Enclave, &ms);
+	if (status == SGX_SUCCESS && retval) *retval = ms.ms_retval;
+	return status;
+}
+
 sgx_status_t sl_init_switchless(sgx_enclave_id_t eid, sgx_status_t* retval, void* sl_data)
 {
 	sgx_status_t status;
 	ms_sl_init_switchless_t ms;
 	ms.ms_sl_data = sl_data;
-	status = sgx_ecall(eid, 4, &ocall_table_Enclave, &ms);
+	status = sgx_ecall(eid, 6, &ocall_table_Enclave, &ms);
 	if (status == SGX_SUCCESS && retval) *retval = ms.ms_retval;
 	return status;
 }
@@ -189,7 +240,7 @@ sgx_status_t sl_run_switchless_tworker(sgx_enclave_id_t eid, sgx_status_t* retva
 {
 	sgx_status_t status;
 	ms_sl_run_switchless_tworker_t ms;
-	status = sgx_ecall(eid, 5, &ocall_table_Enclave, &ms);
+	status = sgx_ecall(eid, 7, &ocall_table_Enclave, &ms);
 	if (status == SGX_SUCCESS && retval) *retval = ms.ms_retval;
 	return status;
 }
@@ -23,6 +23,20 @@ typedef struct nvme_command_alias {
 } nvme_command_alias;
 #endif
 
+#ifndef _crypt_desc
+#define _crypt_desc
+typedef struct crypt_desc {
+	unsigned char* outbuf;
+	size_t outbuf_size;
+	int decrypt;
+	long int result;
+} crypt_desc;
+#endif
+
+#ifndef CRYPT_RING_WAIT_DEFINED__
+#define CRYPT_RING_WAIT_DEFINED__
+void SGX_UBRIDGE(SGX_NOCONVENTION, crypt_ring_wait, (unsigned int usec));
+#endif
 #ifndef SGX_OC_CPUIDEX_DEFINED__
 #define SGX_OC_CPUIDEX_DEFINED__
 void SGX_UBRIDGE(SGX_CDECL, sgx_oc_cpuidex, (int cpuinfo[4], int leaf, int subleaf));
@@ -48,6 +62,8 @@ sgx_status_t put_key(sgx_enclave_id_t eid, int* retval, unsigned char key[32], i
 sgx_status_t crypt_buffer_inplace(sgx_enclave_id_t eid, long int* retval, size_t slba, unsigned char* buf, size_t nr_blocks, int decrypt);
 sgx_status_t crypt_command_inplace(sgx_enclave_id_t eid, long int* retval, unsigned char* pvm, size_t pvm_size, const struct nvme_command_alias* cmd, int decrypt);
 sgx_status_t crypt_command(sgx_enclave_id_t eid, long int* retval, unsigned char* pvm, size_t pvm_size, const struct nvme_command_alias* cmd, unsigned char* outbuf, size_t outbuf_size, int decrypt);
+sgx_status_t crypt_commands(sgx_enclave_id_t eid, long int* retval, unsigned char* pvm, size_t pvm_size, const struct nvme_command_alias* cmds, struct crypt_desc* descs, size_t ncmds);
+sgx_status_t crypt_ring_run(sgx_enclave_id_t eid, long int* retval, void* ring);
 sgx_status_t sl_init_switchless(sgx_enclave_id_t eid, sgx_status_t* retval, void* sl_data);
 sgx_status_t sl_run_switchless_tworker(sgx_enclave_id_t eid, sgx_status_t* retval);
 
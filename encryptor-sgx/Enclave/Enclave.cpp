@@ -1,32 +1,101 @@
 #include "Enclave.hpp"
 #include "Enclave_t.h"
 #include "sgx_trts.h"
+#include "sgx_thread.h"
 
+#include <immintrin.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <vector>
 #include <span>
 #include <atomic>
+#include <map>
 #include <mutex>
 #include "crypto/tbc.hpp"
 #include "crypto/aes_xts_ipp.hpp"
 #include "cmdbuf_en.hpp"
 #include "nvme_en.hpp"
+#include "sgx/crypt_ring.hpp"
 
 struct nvme_command_alias;
 
-static std::unique_ptr<tweakable_block_cipher> engine;
+static std::array<unsigned char, 32> g_key;
 static std::atomic<int> g_lba_shift(-1);
 static std::mutex g_wrlock;
 
+// engines keep per-call state (the tweak), so every TCS gets its own
+// TLS only holds a plain pointer; the engines themselves are owned by g_engines
+static std::map<sgx_thread_t, std::unique_ptr<tweakable_block_cipher>> g_engines;
+static thread_local tweakable_block_cipher *t_engine = nullptr;
+
+static tweakable_block_cipher &thread_engine(int lbas) {
+    if (t_engine) {
+        return *t_engine;
+    }
+    // TLS may be reset between ecalls depending on TCSPolicy, so look the TCS up before creating a new engine
+    std::lock_guard<std::mutex> lock(g_wrlock);
+    auto &eng = g_engines[sgx_thread_self()];
+    if (!eng) {
+        eng = std::make_unique<aes_xts_ipp>(std::span<const unsigned char>(g_key.data(), g_key.size()), 1 << lbas);
+    }
+    t_engine = eng.get();
+    return *t_engine;
+}
+
 int put_key(unsigned char key[32], int lba_shift) {
     std::lock_guard<std::mutex> lock(g_wrlock);
     if (g_lba_shift.load(std::memory_order_acquire) >= 0) {
         return -EPERM;
     }
-    engine = std::make_unique<aes_xts_ipp>(std::span<unsigned char>(key, 32), 1 << lba_shift);
+    std::copy(key, key + g_key.size(), g_key.begin());
     g_lba_shift.exchange(lba_shift, std::memory_order_release);
     return 0;
 }
 
+// outbuf == nullptr: crypt in place, returns the number of bytes processed
+// otherwise returns the number of bytes written to outbuf
+static long crypt_one(
+    tweakable_block_cipher &eng,
+    const std::shared_ptr<mapping> &vm,
+    const struct nvme_command &cmd,
+    int lbas,
+    unsigned char *outbuf,
+    size_t outbuf_size,
+    int decrypt) {
+    try {
+        if (!outbuf) {
+            long bytes_done = 0;
+            for (auto it = nvme_cmd_lba_iter_en(vm, cmd, lbas); !it.at_end(); it++) {
+                auto src = *it;
+                bool success = decrypt ? eng.decrypt(src, src, it.lba()) : eng.encrypt(src, src, it.lba());
+                if (!success) {
+                    return -EIO;
+                }
+                bytes_done += src.size();
+            }
+            return bytes_done;
+        }
+
+        std::span<unsigned char> outspan(outbuf, outbuf_size);
+        for (auto it = nvme_cmd_lba_iter_en(vm, cmd, lbas); !it.at_end(); it++) {
+            auto src = *it;
+            if (outspan.size() < src.size()) {
+                break;
+            }
+            bool success = decrypt ? eng.decrypt(outspan, src, it.lba()) : eng.encrypt(outspan, src, it.lba());
+            if (!success) {
+                return -EIO;
+            }
+            outspan = outspan.subspan(src.size());
+        }
+        return outbuf_size - outspan.size();
+    } catch (const std::contract_violation_error &) {
+        return -EFAULT;
+    }
+}
+
 long crypt_buffer_inplace(size_t slba, unsigned char *buf, size_t nr_blocks, int decrypt) {
     auto lbas = g_lba_shift.load(std::memory_order_acquire);
     if (lbas < 0) {
@@ -36,12 +105,13 @@ long crypt_buffer_inplace(size_t slba, unsigned char *buf, size_t nr_blocks, int
     if (!sgx_is_outside_enclave(encbuf.data(), encbuf.size())) {
         return -EFAULT;
     }
+    auto &eng = thread_engine(lbas);
     try {
         long bytes_done = 0;
         for (size_t eli = 0; eli < nr_blocks; eli++) {
             auto lba = slba + eli;
             auto src = encbuf.subspan(eli << lbas, 1 << lbas);
-            bool success = decrypt ? engine->decrypt(src, src, lba) : engine->encrypt(src, src, lba);
+            bool success = decrypt ? eng.decrypt(src, src, lba) : eng.encrypt(src, src, lba);
             if (!success) {
                 return -EIO;
             }
@@ -61,22 +131,9 @@ long crypt_command_inplace(unsigned char *pvm, size_t pvm_size, const struct nvm
     if (!sgx_is_outside_enclave(pvm, pvm_size)) {
         return -EFAULT;
     }
-    try {
-        auto cmd = reinterpret_cast<const struct nvme_command *>(_cmd);
-        auto vm = std::make_shared<mapping>(pvm, pvm_size);
-        long bytes_done = 0;
-        for (auto it = nvme_cmd_lba_iter_en(vm, *cmd, lbas); !it.at_end(); it++) {
-            auto src = *it;
-            bool success = decrypt ? engine->decrypt(src, src, it.lba()) : engine->encrypt(src, src, it.lba());
-            if (!success) {
-                return -EIO;
-            }
-            bytes_done += src.size();
-        }
-        return bytes_done;
-    } catch (const std::contract_violation_error &e) {
-        return -EFAULT;
-    }
+    auto cmd = reinterpret_cast<const struct nvme_command *>(_cmd);
+    auto vm = std::make_shared<mapping>(pvm, pvm_size);
+    return crypt_one(thread_engine(lbas), vm, *cmd, lbas, nullptr, 0, decrypt);
 }
 
 long crypt_command(
@@ -93,23 +150,147 @@ long crypt_command(
     if (!sgx_is_outside_enclave(pvm, pvm_size) || !sgx_is_outside_enclave(outbuf, outbuf_size)) {
         return -EFAULT;
     }
-    try {
-        auto cmd = reinterpret_cast<const struct nvme_command *>(_cmd);
-        auto vm = std::make_shared<mapping>(pvm, pvm_size);
-        std::span<unsigned char> outspan(outbuf, outbuf_size);
-        for (auto it = nvme_cmd_lba_iter_en(vm, *cmd, lbas); !it.at_end(); it++) {
-            auto src = *it;
-            if (outspan.size() < src.size()) {
-                break;
-            }
-            bool success = decrypt ? engine->decrypt(outspan, src, it.lba()) : engine->encrypt(outspan, src, it.lba());
-            if (!success) {
+    auto cmd = reinterpret_cast<const struct nvme_command *>(_cmd);
+    auto vm = std::make_shared<mapping>(pvm, pvm_size);
+    return crypt_one(thread_engine(lbas), vm, *cmd, lbas, outbuf, outbuf_size, decrypt);
+}
+
+long crypt_commands(
+    unsigned char *pvm,
+    size_t pvm_size,
+    const struct nvme_command_alias *_cmds,
+    struct crypt_desc *descs,
+    size_t ncmds) {
+    auto lbas = g_lba_shift.load(std::memory_order_acquire);
+    if (lbas < 0) {
+        return -EPERM;
+    }
+    if (!sgx_is_outside_enclave(pvm, pvm_size)) {
+        return -EFAULT;
+    }
+    auto cmds = reinterpret_cast<const struct nvme_command *>(_cmds);
+    auto vm = std::make_shared<mapping>(pvm, pvm_size);
+    auto &eng = thread_engine(lbas);
+    for (size_t i = 0; i < ncmds; i++) {
+        auto &desc = descs[i];
+        if (desc.outbuf && !sgx_is_outside_enclave(desc.outbuf, desc.outbuf_size)) {
+            desc.result = -EFAULT;
+            continue;
+        }
+        desc.result = crypt_one(eng, vm, cmds[i], lbas, desc.outbuf, desc.outbuf_size, desc.decrypt);
+    }
+    return static_cast<long>(ncmds);
+}
+
+// idle passes over the SQs spent spinning before the ring worker sleeps outside the enclave
+static constexpr unsigned int ring_idle_spins = 2048;
+static constexpr unsigned int ring_idle_wait_us = 50;
+
+static bool ring_is_outside(const struct crypt_ring &ring) {
+    if (!sgx_is_outside_enclave(ring.pvm, ring.pvm_size) || ring.nr_sq > CRYPT_RING_MAX_SQ) {
+        return false;
+    }
+    for (size_t i = 0; i < ring.nr_sq; i++) {
+        auto &sq = ring.sq[i];
+        if (!sgx_is_outside_enclave(sq.cmdbuf, NMNTFY_SQ_DATA_NR_PAGES << NVME_PAGE_SHIFT) ||
+            !sgx_is_outside_enclave(const_cast<int *>(sq.head), sizeof(int)) ||
+            !sgx_is_outside_enclave(const_cast<int *>(sq.tail), sizeof(int))) {
+            return false;
+        }
+    }
+    size_t staging_size = 0;
+    if (__builtin_mul_overflow(ring.nr_slots, ring.slot_size, &staging_size)) {
+        return false;
+    }
+    return sgx_is_outside_enclave(ring.cq, CRYPT_RING_CQ_COUNT * sizeof(struct crypt_completion)) &&
+           sgx_is_outside_enclave(const_cast<int *>(ring.cq_head), sizeof(int)) &&
+           sgx_is_outside_enclave(const_cast<int *>(ring.cq_tail), sizeof(int)) &&
+           sgx_is_outside_enclave(ring.slots, CRYPT_RING_SLOT_COUNT * sizeof(uint32_t)) &&
+           sgx_is_outside_enclave(const_cast<int *>(ring.slots_head), sizeof(int)) &&
+           sgx_is_outside_enclave(const_cast<int *>(ring.slots_tail), sizeof(int)) &&
+           sgx_is_outside_enclave(ring.staging, staging_size);
+}
+
+long crypt_ring_run(void *_ring) {
+    auto lbas = g_lba_shift.load(std::memory_order_acquire);
+    if (lbas < 0) {
+        return -EPERM;
+    }
+    if (!sgx_is_outside_enclave(_ring, sizeof(struct crypt_ring))) {
+        return -EFAULT;
+    }
+    // the host may rewrite the descriptor at any time; only the stop flag is read from it after this
+    struct crypt_ring ring;
+    memcpy(&ring, _ring, sizeof(ring));
+    auto stop = &static_cast<struct crypt_ring *>(_ring)->stop;
+    if (!ring_is_outside(ring)) {
+        return -EFAULT;
+    }
+
+    auto &eng = thread_engine(lbas);
+
+    auto vm = std::make_shared<mapping>(ring.pvm, ring.pvm_size);
+    std::vector<nsqbuf_en_t> sqs;
+    sqs.reserve(ring.nr_sq);
+    for (size_t i = 0; i < ring.nr_sq; i++) {
+        sqs.emplace_back(ring.sq[i].cmdbuf, ring.sq[i].head, ring.sq[i].tail);
+    }
+    crypt_cqbuf_t<cmdbuf_en_direction::producer> cq(ring.cq, ring.cq_head, ring.cq_tail);
+    crypt_slotbuf_t<cmdbuf_en_direction::consumer> slots(ring.slots, ring.slots_head, ring.slots_tail);
+
+    std::array<struct nvme_command, 16> cmds;
+    long processed = 0;
+    unsigned int idle = 0;
+    while (!__atomic_load_n(stop, __ATOMIC_ACQUIRE)) {
+        if (idle >= ring_idle_spins) {
+            // stays saturated until work shows up, so an idle ring polls once per wait
+            if (crypt_ring_wait(ring_idle_wait_us) != SGX_SUCCESS) {
                 return -EIO;
             }
-            outspan = outspan.subspan(src.size());
+        } else if (idle) {
+            _mm_pause();
+        }
+        idle = std::min(idle + 1, ring_idle_spins);
+        for (size_t qi = 0; qi < sqs.size(); qi++) {
+            int new_tail = 0;
+            // never take more commands than we can report back
+            int ncmds = std::min({static_cast<int>(cmds.size()), sqs[qi].peek_items(new_tail), cq.peek_space()});
+            if (!ncmds) {
+                continue;
+            }
+            sqs[qi].consume_raw(std::span<struct nvme_command>(cmds.data(), cmds.size()), new_tail, ncmds);
+            idle = 0;
+
+            for (int j = 0; j < ncmds; j++) {
+                struct crypt_completion c = {};
+                c.cmd = cmds[j];
+                c.qi = static_cast<uint32_t>(qi);
+                c.slot = CRYPT_RING_NO_SLOT;
+                if (c.cmd.common.opcode == nvme_cmd_read) {
+                    c.result = crypt_one(eng, vm, c.cmd, lbas, nullptr, 0, 1);
+                } else if (c.cmd.common.opcode == nvme_cmd_write && !(c.cmd.common.flags & NVME_CMD_SGL_ALL)) {
+                    uint32_t slot = CRYPT_RING_NO_SLOT;
+                    while (!slots.consume(std::span<uint32_t>(&slot, 1))) {
+                        if (__atomic_load_n(stop, __ATOMIC_ACQUIRE)) {
+                            return processed;
+                        }
+                        _mm_pause();
+                    }
+                    c.slot = slot;
+                    auto nbytes = (static_cast<size_t>(c.cmd.rw.length) + 1) << lbas;
+                    if (slot >= ring.nr_slots || nbytes > ring.slot_size) {
+                        // larger writes would only be staged in part
+                        c.result = -EINVAL;
+                    } else {
+                        auto outbuf = ring.staging + slot * ring.slot_size;
+                        c.result = crypt_one(eng, vm, c.cmd, lbas, outbuf, ring.slot_size, 0);
+                    }
+                }
+                // everything else is handled by the host
+                cq.produce(std::span<const struct crypt_completion>(&c, 1));
+            }
+            processed += ncmds;
         }
-        return outbuf_size - outspan.size();
-    } catch (const std::contract_violation_error &) {
-        return -EFAULT;
     }
+    return processed;
 }
@@ -59,6 +59,20 @@ typedef struct ms_crypt_command_t {
 	int ms_decrypt;
 } ms_crypt_command_t;
 
+typedef struct ms_crypt_commands_t {
+	long int ms_retval;
+	unsigned char* ms_pvm;
+	size_t ms_pvm_size;
+	const struct nvme_command_alias* ms_cmds;
+	struct crypt_desc* ms_descs;
+	size_t ms_ncmds;
+} ms_crypt_commands_t;
+
+typedef struct ms_crypt_ring_run_t {
+	long int ms_retval;
+	void* ms_ring;
+} ms_crypt_ring_run_t;
+
 typedef struct ms_sl_init_switchless_t {
 	sgx_status_t ms_retval;
 	void* ms_sl_data;
@@ -68,6 +82,10 @@ typedef struct ms_sl_run_switchless_tworker_t {
 	sgx_status_t ms_retval;
 } ms_sl_run_switchless_tworker_t;
 
+typedef struct ms_crypt_ring_wait_t {
+	unsigned int ms_usec;
+} ms_crypt_ring_wait_t;
+
 typedef struct ms_sgx_oc_cpuidex_t {
 	int* ms_cpuinfo;
 	int ms_leaf;
@@ -246,6 +264,112 @@ err:
 	return status;
 }
 
+static sgx_status_t SGX_CDECL sgx_crypt_commands(void* pms)
+{
+	CHECK_REF_POINTER(pms, sizeof(ms_crypt_commands_t));
+	//
+	// fence after pointer checks
+	//
+	sgx_lfence();
+	ms_crypt_commands_t* ms = SGX_CAST(ms_crypt_commands_t*, pms);
+	sgx_status_t status = SGX_SUCCESS;
+	unsigned char* _tmp_pvm = ms->ms_pvm;
+	const struct nvme_command_alias* _tmp_cmds = ms->ms_cmds;
+	size_t _tmp_ncmds = ms->ms_ncmds;
+	size_t _len_cmds = _tmp_ncmds * sizeof(struct nvme_command_alias);
+	struct nvme_command_alias* _in_cmds = NULL;
+	struct crypt_desc* _tmp_descs = ms->ms_descs;
+	size_t _len_descs = _tmp_ncmds * sizeof(struct crypt_desc);
+	struct crypt_desc* _in_descs = NULL;
+
+	if (sizeof(*_tmp_cmds) != 0 &&
+		(size_t)_tmp_ncmds > (SIZE_MAX / sizeof(*_tmp_cmds))) {
+		return SGX_ERROR_INVALID_PARAMETER;
+	}
+
+	if (sizeof(*_tmp_descs) != 0 &&
+		(size_t)_tmp_ncmds > (SIZE_MAX / sizeof(*_tmp_descs))) {
+		return SGX_ERROR_INVALID_PARAMETER;
+	}
+
+	CHECK_UNIQUE_POINTER(_tmp_cmds, _len_cmds);
+	CHECK_UNIQUE_POINTER(_tmp_descs, _len_descs);
+
+	//
+	// fence after pointer checks
+	//
+	sgx_lfence();
+
+	if (_tmp_cmds != NULL && _len_cmds != 0) {
+		if ( _len_cmds % sizeof(*_tmp_cmds) != 0)
+		{
+			status = SGX_ERROR_INVALID_PARAMETER;
+			goto err;
+		}
+		_in_cmds = (struct nvme_command_alias*)malloc(_len_cmds);
+		if (_in_cmds == NULL) {
+			status = SGX_ERROR_OUT_OF_MEMORY;
+			goto err;
+		}
+
+		if (memcpy_s(_in_cmds, _len_cmds, _tmp_cmds, _len_cmds)) {
+			status = SGX_ERROR_UNEXPECTED;
+			goto err;
+		}
+
+	}
+	if (_tmp_descs != NULL && _len_descs != 0) {
+		if ( _len_descs % sizeof(*_tmp_descs) != 0)
+		{
+			status = SGX_ERROR_INVALID_PARAMETER;
+			goto err;
+		}
+		_in_descs = (struct crypt_desc*)malloc(_len_descs);
+		if (_in_descs == NULL) {
+			status = SGX_ERROR_OUT_OF_MEMORY;
+			goto err;
+		}
+
+		if (memcpy_s(_in_descs, _len_descs, _tmp_descs, _len_descs)) {
+			status = SGX_ERROR_UNEXPECTED;
+			goto err;
+		}
+
+	}
+
+	ms->ms_retval = crypt_commands(_tmp_pvm, ms->ms_pvm_size, (const struct nvme_command_alias*)_in_cmds, _in_descs, _tmp_ncmds);
+	if (_in_descs) {
+		if (memcpy_s(_tmp_descs, _len_descs, _in_descs, _len_descs)) {
+			status = SGX_ERROR_UNEXPECTED;
+			goto err;
+		}
+	}
+
+err:
+	if (_in_cmds) free(_in_cmds);
+	if (_in_descs) free(_in_descs);
+	return status;
+}
+
+static sgx_status_t SGX_CDECL sgx_crypt_ring_run(void* pms)
+{
+	CHECK_REF_POINTER(pms, sizeof(ms_crypt_ring_run_t));
+	//
+	// fence after pointer checks
+	//
+	sgx_lfence();
+	ms_crypt_ring_run_t* ms = SGX_CAST(ms_crypt_ring_run_t*, pms);
+	sgx_status_t status = SGX_SUCCESS;
+	void* _tmp_ring = ms->ms_ring;
+
+
+
+	ms->ms_retval = crypt_ring_run(_tmp_ring);
+
+
+	return status;
+}
+
 static sgx_status_t SGX_CDECL sgx_sl_init_switchless(void* pms)
 {
 	CHECK_REF_POINTER(pms, sizeof(ms_sl_init_switchless_t));
@@ -285,14 +409,16 @@ static sgx_status_t SGX_CDECL sgx_sl_run_switchless_tworker(void* pms)
 
 SGX_EXTERNC const struct {
 	size_t nr_ecall;
-	struct {void* ecall_addr; uint8_t is_priv; uint8_t is_switchless;} ecall_table[6];
+	struct {void* ecall_addr; uint8_t is_priv; uint8_t is_switchless;} ecall_table[8];
 } g_ecall_table = {
-	6,
+	8,
 	{
 		{(void*)(uintptr_t)sgx_put_key, 0, 0},
 		{(void*)(uintptr_t)sgx_crypt_buffer_inplace, 0, 1},
 		{(void*)(uintptr_t)sgx_crypt_command_inplace, 0, 1},
 		{(void*)(uintptr_t)sgx_crypt_command, 0, 1},
+		{(void*)(uintptr_t)sgx_crypt_commands, 0, 1},
+		{(void*)(uintptr_t)sgx_crypt_ring_run, 0, 0},
 		{(void*)(uintptr_t)sgx_sl_init_switchless, 0, 0},
 		{(void*)(uintptr_t)sgx_sl_run_switchless_tworker, 0, 0},
 	}
@@ -300,19 +426,47 @@ SGX_EXTERNC const struct {
 
 SGX_EXTERNC const struct {
 	size_t nr_ocall;
-	uint8_t entry_table[5][6];
+	uint8_t entry_table[6][8];
 } g_dyn_entry_table = {
-	5,
+	6,
 	{
-		{0, 0, 0, 0, 0, 0, },
-		{0, 0, 0, 0, 0, 0, },
-		{0, 0, 0, 0, 0, 0, },
-		{0, 0, 0, 0, 0, 0, },
-		{0, 0, 0, 0, 0, 0, },
+		{0, 0, 0, 0, 0, 0, 0, 0, },
+		{0, 0, 0, 0, 0, 0, 0, 0, },
+		{0, 0, 0, 0, 0, 0, 0, 0, },
+		{0, 0, 0, 0, 0, 0, 0, 0, },
+		{0, 0, 0, 0, 0, 0, 0, 0, },
+		{0, 0, 0, 0, 0, 0, 0, 0, },
 	}
 };
 
 
+sgx_status_t SGX_CDECL crypt_ring_wait(unsigned int usec)
+{
+	sgx_status_t status = SGX_SUCCESS;
+
+	ms_crypt_ring_wait_t* ms = NULL;
+	size_t ocalloc_size = sizeof(ms_crypt_ring_wait_t);
+	void *__tmp = NULL;
+
+
+	__tmp = sgx_ocalloc(ocalloc_size);
+	if (__tmp == NULL) {
+		sgx_ocfree();
+		return SGX_ERROR_UNEXPECTED;
+	}
+	ms = (ms_crypt_ring_wait_t*)__tmp;
+	__tmp = (void *)((size_t)__tmp + sizeof(ms_crypt_ring_wait_t));
+	ocalloc_size -= sizeof(ms_crypt_ring_wait_t);
+
+	ms->ms_usec = usec;
+	status = sgx_ocall(0, ms);
+
+	if (status == SGX_SUCCESS) {
+	}
+	sgx_ocfree();
+	return status;
+}
+
 sgx_status_t SGX_CDECL sgx_oc_cpuidex(int cpuinfo[4], int leaf, int subleaf)
 {
 	sgx_status_t status = SGX_SUCCESS;
@@ -354,7 +508,7 @@ sgx_status_t SGX_CDECL sgx_oc_cpuidex(int cpuinfo[4], int leaf, int subleaf)
 	
 	ms->ms_leaf = leaf;
 	ms->ms_subleaf = subleaf;
-	status = sgx_ocall(0, ms);
+	status = sgx_ocall(1, ms);
 
 	if (status == SGX_SUCCESS) {
 		if (cpuinfo) {
@@ -387,7 +541,7 @@ sgx_status_t SGX_CDECL sgx_thread_wait_untrusted_event_ocall(int* retval, const
 	ocalloc_size -= sizeof(ms_sgx_thread_wait_untrusted_event_ocall_t);
 
 	ms->ms_self = self;
-	status = sgx_ocall(1, ms);
+	status = sgx_ocall(2, ms);
 
 	if (status == SGX_SUCCESS) {
 		if (retval) *retval = ms->ms_retval;
@@ -415,7 +569,7 @@ sgx_status_t SGX_CDECL sgx_thread_set_untrusted_event_ocall(int* retval, const v
 	ocalloc_size -= sizeof(ms_sgx_thread_set_untrusted_event_ocall_t);
 
 	ms->ms_waiter = waiter;
-	status = sgx_ocall(2, ms);
+	status = sgx_ocall(3, ms);
 
 	if (status == SGX_SUCCESS) {
 		if (retval) *retval = ms->ms_retval;
@@ -444,7 +598,7 @@ sgx_status_t SGX_CDECL sgx_thread_setwait_untrusted_events_ocall(int* retval, co
 
 	ms->ms_waiter = waiter;
 	ms->ms_self = self;
-	status = sgx_ocall(3, ms);
+	status = sgx_ocall(4, ms);
 
 	if (status == SGX_SUCCESS) {
 		if (retval) *retval = ms->ms_retval;
@@ -494,7 +648,7 @@ sgx_status_t SGX_CDECL sgx_thread_set_multiple_untrusted_events_ocall(int* retva
 	}
 	
 	ms->ms_total = total;
-	status = sgx_ocall(4, ms);
+	status = sgx_ocall(5, ms);
 
 	if (status == SGX_SUCCESS) {
 		if (retval) *retval = ms->ms_retval;
@@ -22,13 +22,26 @@ typedef struct nvme_command_alias {
 } nvme_command_alias;
 #endif
 
+#ifndef _crypt_desc
+#define _crypt_desc
+typedef struct crypt_desc {
+	unsigned char* outbuf;
+	size_t outbuf_size;
+	int decrypt;
+	long int result;
+} crypt_desc;
+#endif
+
 int put_key(unsigned char key[32], int lba_shift);
 long int crypt_buffer_inplace(size_t slba, unsigned char* buf, size_t nr_blocks, int decrypt);
 long int crypt_command_inplace(unsigned char* pvm, size_t pvm_size, const struct nvme_command_alias* cmd, int decrypt);
 long int crypt_command(unsigned char* pvm, size_t pvm_size, const struct nvme_command_alias* cmd, unsigned char* outbuf, size_t outbuf_size, int decrypt);
+long int crypt_commands(unsigned char* pvm, size_t pvm_size, const struct nvme_command_alias* cmds, struct crypt_desc* descs, size_t ncmds);
+long int crypt_ring_run(void* ring);
 sgx_status_t sl_init_switchless(void* sl_data);
 sgx_status_t sl_run_switchless_tworker(void);
 
+sgx_status_t SGX_CDECL crypt_ring_wait(unsigned int usec);
 sgx_status_t SGX_CDECL sgx_oc_cpuidex(int cpuinfo[4], int leaf, int subleaf);
 sgx_status_t SGX_CDECL sgx_thread_wait_untrusted_event_ocall(int* retval, const void* self);
 sgx_status_t SGX_CDECL sgx_thread_set_untrusted_event_ocall(int* retval, const void* waiter);
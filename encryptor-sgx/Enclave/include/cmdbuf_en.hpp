@@ -3,6 +3,8 @@
 #include <span>
 
 #include <algorithm>
+#include <cstring>
+#include <limits>
 #include <type_traits>
 
 #include "nvme_core.hpp"
@@ -15,6 +17,7 @@ enum class cmdbuf_en_direction { producer, consumer };
 template <typename T, size_t count, cmdbuf_en_direction direction>
 class cmdbuf_en {
     static_assert(count < size_t(std::numeric_limits<int>::max()));
+    static_assert(count && !(count & (count - 1)), "indices are masked with count - 1");
     static_assert(!(count * sizeof(T) % NVME_PAGE_SIZE));
 
 public:
@@ -45,8 +48,12 @@ public:
 
     inline int peek_space(int &new_head) const {
         static_assert(direction == cmdbuf_en_direction::producer, "only usable in producer queues");
-        new_head = *_head;
-        int tail = __atomic_load_n(_tail, __ATOMIC_ACQUIRE);
+        int tail = 0;
+        // both indices live in untrusted memory; a torn or hostile value means no space
+        if (!load_index<__ATOMIC_RELAXED>(_head, new_head) || !load_index<__ATOMIC_ACQUIRE>(_tail, tail)) {
+            new_head = 0;
+            return 0;
+        }
         return circ_space(new_head, tail, count);
     }
 
@@ -57,6 +64,8 @@ public:
 
     inline void produce_raw(std::span<const T> in, int head, size_t to_produce) {
         static_assert(direction == cmdbuf_en_direction::producer, "only usable in producer queues");
+        to_produce = std::min({to_produce, in.size(), count - 1});
+        head &= static_cast<int>(count - 1);
         if (to_produce >= 1) {
             for (size_t i = 0; i < to_produce; i++) {
                 _cmdbuf[head] = in[i];
@@ -75,8 +84,11 @@ public:
 
     inline int peek_items(int &new_tail) const {
         static_assert(direction == cmdbuf_en_direction::consumer, "only usable in consumer queues");
-        int head = __atomic_load_n(_head, __ATOMIC_ACQUIRE);
-        new_tail = *_tail;
+        int head = 0;
+        if (!load_index<__ATOMIC_ACQUIRE>(_head, head) || !load_index<__ATOMIC_RELAXED>(_tail, new_tail)) {
+            new_tail = 0;
+            return 0;
+        }
         return circ_cnt(head, new_tail, count);
     }
 
@@ -87,9 +99,12 @@ public:
 
     inline void consume_raw(std::span<T> out, int tail, size_t to_consume) {
         static_assert(direction == cmdbuf_en_direction::consumer, "only usable in consumer queues");
+        to_consume = std::min({to_consume, out.size(), count - 1});
+        tail &= static_cast<int>(count - 1);
         if (to_consume >= 1) {
+            // copy into caller memory before anything looks at the entries, the host may rewrite them at any time
             for (size_t i = 0; i < to_consume; i++) {
-                out[i] = _cmdbuf[tail];
+                memcpy(&out[i], &_cmdbuf[tail], sizeof(T));
                 tail = (tail + 1) & (count - 1);
             }
             __atomic_store_n(_tail, tail, __ATOMIC_RELEASE);
@@ -104,6 +119,18 @@ public:
     }
 
 private:
+    // reads an index exactly once; indices are always stored masked, so anything outside the ring is rejected
+    // instead of being used and no peek can ever report more than count - 1 entries
+    template <int memorder, typename P>
+    static inline bool load_index(P ptr, int &out) {
+        int val = __atomic_load_n(ptr, memorder);
+        if (static_cast<unsigned int>(val) >= count) {
+            return false;
+        }
+        out = val & static_cast<int>(count - 1);
+        return true;
+    }
+
     // linux/circ_buf.h
     static inline int circ_cnt(int head, int tail, size_t size) {
         return (head - tail) & (size - 1);
@@ -49,6 +49,7 @@ static void worker_func(
     const char *arg_crypto_impl,
     size_t arg_block_size,
     const std::array<unsigned char, 32> &key,
+    unsigned int arg_merge_window_us,
     unsigned char *pvm,
     off_t pvm_size) {
     if (!pvm || !pvm_size || sqids.empty() || sqids.size() != sqfds.size()) {
@@ -61,7 +62,7 @@ static void worker_func(
     }
 
     auto engine = make_engine(key, arg_crypto_impl, arg_block_size);
-    nvme_encryptor_aio controller(vm, sqfds.front(), bfd, std::move(engine));
+    nvme_encryptor_aio controller(vm, sqfds.front(), bfd, std::move(engine), arg_merge_window_us);
 
     std::vector<nsqbuf_t> nsqbuf;
     std::vector<ncqbuf_t> ncqbuf;
@@ -107,7 +108,7 @@ static void worker_func(
                 break;
             }
         }
-        if (submitted_async) {
+        if (submitted_async || controller.merge_pending()) {
             controller.sq_kick();
         }
 
@@ -116,18 +117,19 @@ static void worker_func(
             // we know that all of our tickets are sq_tickets
             // so do this to save a virtual call
             auto t = static_cast<sq_ticket *>(controller.cqe_get_data(cqe));
-            auto [qi, ucid] = unmake_tag(t->tag);
-            delete t;
-
             if (cqe->res < 0)
                 printf("unhappy %p %#x %d\n", t, t->tag, cqe->res);
 
             auto status = cqe->res < 0 ? (NVME_SC_DNR | NVME_SC_INTERNAL) : NVME_SC_SUCCESS;
-            nmntfy_response resp{
-                .ucid = ucid,
-                .status = static_cast<__u16>(status),
-            };
-            cq_produce_one(ncqbuf[qi], resp);
+            for_each_tag(t, [&](uint32_t tag) {
+                auto [qi, ucid] = unmake_tag(tag);
+                nmntfy_response resp{
+                    .ucid = ucid,
+                    .status = static_cast<__u16>(status),
+                };
+                cq_produce_one(ncqbuf[qi], resp);
+            });
+            delete t;
             controller.commit_completion(cqe);
         }
 
@@ -138,6 +140,10 @@ static void worker_func(
             clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
             if (now - last > 1000000l * busypoll_ms) {
                 // timeout
+                if (controller.merge_pending()) {
+                    // nothing kicks the merger while we sleep
+                    controller.flush_merges();
+                }
                 for (auto &pfd : pollfds) {
                     pfd.events = POLLIN;
                 }
@@ -161,9 +167,10 @@ int main(int argc, char **argv) { // NOLINT
     const char *arg_keyfile = nullptr;
     size_t nthreads = 0;
     size_t arg_below_4g_mem_size = 2ull << 30;
+    unsigned int arg_merge_window_us = 0;
     int o = 0;
 
-    while ((o = getopt(argc, argv, "g:d:m:b:e:B:k:j:il:")) != -1) {
+    while ((o = getopt(argc, argv, "g:d:m:b:e:B:k:j:il:w:")) != -1) {
         switch (o) {
         case 'g':
             arg_iommu_group = optarg;
@@ -195,6 +202,9 @@ int main(int argc, char **argv) { // NOLINT
         case 'l':
             arg_below_4g_mem_size = strtoull(optarg, NULL, 0);
             break;
+        case 'w':
+            arg_merge_window_us = static_cast<unsigned int>(strtoul(optarg, NULL, 0));
+            break;
         default:
             printf("unknown flag %d\n", o);
             return 1;
@@ -259,6 +269,7 @@ int main(int argc, char **argv) { // NOLINT
             arg_crypto_impl,
             arg_block_size,
             key,
+            arg_merge_window_us,
             static_cast<unsigned char *>(pvm),
             pvm_size);
 
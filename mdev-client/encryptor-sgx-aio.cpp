@@ -1,5 +1,6 @@
 #include <array>
 #include <bit>
+#include <chrono>
 #include <cstring>
 #include <cstdio>
 #include <iostream>
@@ -24,20 +25,25 @@
 
 constexpr size_t MAX_VIRTUAL_QUEUES = 16;
 constexpr size_t NOTIFYFD_BURST = 16;
+// commands handed to the enclave per transition, across all queues of a worker
+constexpr size_t ENCLAVE_BATCH = 64;
 constexpr size_t COMPLETION_BURST = 128;
 constexpr int sleeppoll_ms = 100;
 constexpr long busypoll_ms = 500;
 constexpr unsigned int busypoll_loops = 20;
+// ring mode has no doorbell to sleep on, so an idle worker naps for longer and longer, up to the max
+constexpr std::chrono::microseconds ring_nap_min{50};
+constexpr std::chrono::microseconds ring_nap_max{1000};
 static const std::string esopath = "../encryptor-sgx/enclave.signed.so";
 
 static void worker_func(
     std::vector<size_t> sqids,
     std::vector<int> sqfds,
     const char *arg_blkdev,
-    int arg_lba_shift,
-    const std::array<unsigned char, 32> &key,
+    const prp_en_pool &pool,
     unsigned char *pvm,
-    off_t pvm_size) {
+    off_t pvm_size,
+    bool ring_mode) {
     if (!pvm || !pvm_size || sqids.empty() || sqids.size() != sqfds.size()) {
         return;
     }
@@ -47,14 +53,15 @@ static void worker_func(
         throw std::system_error(errno, std::generic_category(), "cannot open blkdev file");
     }
 
-    nvme_encryptor_sgx_aio controller(vm, sqfds.front(), bfd, esopath, false, key, arg_lba_shift);
+    nvme_encryptor_sgx_aio controller(vm, sqfds.front(), bfd, pool);
 
     std::vector<nsqbuf_t> nsqbuf;
     std::vector<ncqbuf_t> ncqbuf;
     std::vector<pollfd> pollfds;
     timespec last{};
+    auto ring_nap = ring_nap_min;
 
-    std::array<nvme_command, NOTIFYFD_BURST> cmds{};
+    std::array<nvme_command, ENCLAVE_BATCH> cmds{};
     std::span<nvme_command> cmdspan(cmds);
     std::array<io_uring_cqe *, COMPLETION_BURST> cqebuf{};
 
@@ -64,34 +71,69 @@ static void worker_func(
         pollfds.push_back(pollfd{.fd = sqfd, .events = POLLIN});
     }
 
+    std::array<uint32_t, ENCLAVE_BATCH> tags{};
+    std::array<bool, ENCLAVE_BATCH> asyncs{};
+    std::array<__u16, ENCLAVE_BATCH> statuses{};
+
+    if (ring_mode) {
+        controller.ring_start(std::span(nsqbuf));
+    }
+
     while (true) {
         bool succeeded = false, submitted_async = false;
-        for (unsigned int ntry = 0; ntry < busypoll_loops; ntry++) {
-            for (size_t qi = 0; qi < sqfds.size(); qi++) {
-                int new_tail = 0;
-                int ncmds = std::min(static_cast<int>(cmdspan.size()), nsqbuf[qi].peek_items(new_tail));
-                if (ncmds) {
+        if (ring_mode) {
+            // the enclave worker consumes the SQs, we only forward its results to the backend
+            auto nimm = controller.ring_poll(std::span(tags), std::span(statuses), submitted_async);
+            for (size_t j = 0; j < nimm; j++) {
+                auto [qi, ucid] = unmake_tag(tags[j]);
+                nmntfy_response resp{
+                    .ucid = ucid,
+                    .status = statuses[j],
+                };
+                cq_produce_one(ncqbuf[qi], resp);
+            }
+            succeeded = nimm || submitted_async;
+        } else {
+            for (unsigned int ntry = 0; ntry < busypoll_loops; ntry++) {
+                // gather from all queues so that the whole pass costs a single enclave transition
+                size_t nbatch = 0;
+                for (size_t qi = 0; qi < sqfds.size() && nbatch < cmds.size(); qi++) {
+                    int new_tail = 0;
+                    int ncmds = std::min(
+                        {static_cast<int>(NOTIFYFD_BURST),
+                         static_cast<int>(cmds.size() - nbatch),
+                         nsqbuf[qi].peek_items(new_tail)});
+                    if (ncmds) {
+                        nsqbuf[qi].consume_raw(cmdspan.subspan(nbatch), new_tail, ncmds);
+                        for (int j = 0; j < ncmds; j++) {
+                            tags[nbatch + j] = make_tag(qi, cmds[nbatch + j].common.command_id);
+                        }
+                        nbatch += ncmds;
+                    }
+                }
+                if (nbatch) {
                     succeeded = true;
-                    nsqbuf[qi].consume_raw(cmdspan, new_tail, ncmds);
-                    for (int j = 0; j < ncmds; j++) {
-                        auto tag = make_tag(qi, cmds[j].common.command_id);
-                        __u16 status = 0;
-                        auto async = controller.submit_async(sqids[qi], cmds[j], tag, status);
-                        if (async) {
-                            submitted_async = true;
-                        } else {
+                    auto nasync = controller.submit_burst_async(
+                        cmdspan.subspan(0, nbatch),
+                        std::span(tags).subspan(0, nbatch),
+                        std::span(asyncs).subspan(0, nbatch),
+                        std::span(statuses).subspan(0, nbatch));
+                    if (nasync) {
+                        submitted_async = true;
+                    }
+                    for (size_t j = 0; j < nbatch; j++) {
+                        if (!asyncs[j]) {
+                            auto [qi, ucid] = unmake_tag(tags[j]);
                             nmntfy_response resp{
-                                .ucid = cmds[j].common.command_id,
-                                .status = status,
+                                .ucid = ucid,
+                                .status = statuses[j],
                             };
                             cq_produce_one(ncqbuf[qi], resp);
                         }
                     }
+                    break;
                 }
             }
-            if (succeeded) {
-                break;
-            }
         }
         if (submitted_async) {
             controller.sq_kick();
@@ -114,6 +156,17 @@ static void worker_func(
 
         if (succeeded) {
             clock_gettime(CLOCK_MONOTONIC_COARSE, &last);
+            ring_nap = ring_nap_min;
+        } else if (ring_mode) {
+            // the SQ doorbells are consumed by the enclave, so there is nothing to sleep on
+            timespec now{};
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+            if (now - last > 1000000l * busypoll_ms) {
+                std::this_thread::sleep_for(ring_nap);
+                ring_nap = std::min(ring_nap * 2, ring_nap_max);
+            } else {
+                _mm_pause();
+            }
         } else {
             timespec now{};
             clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
@@ -141,9 +194,10 @@ int main(int argc, char **argv) { // NOLINT
     const char *arg_keyfile = nullptr;
     size_t nthreads = 0;
     size_t arg_below_4g_mem_size = 2ull << 30;
+    bool arg_ring_mode = false;
     int o = 0;
 
-    while ((o = getopt(argc, argv, "g:d:m:b:e:B:k:j:il:")) != -1) {
+    while ((o = getopt(argc, argv, "g:d:m:b:e:B:k:j:il:R")) != -1) {
         switch (o) {
         case 'g':
             arg_iommu_group = optarg;
@@ -169,6 +223,9 @@ int main(int argc, char **argv) { // NOLINT
         case 'l':
             arg_below_4g_mem_size = strtoull(optarg, NULL, 0);
             break;
+        case 'R':
+            arg_ring_mode = true;
+            break;
         default:
             printf("unknown flag %d\n", o);
             return 1;
@@ -223,6 +280,21 @@ int main(int argc, char **argv) { // NOLINT
         worker_sqfds[(i - 1) % nthreads].push_back(sqfds[i]);
     }
 
+    // ring mode keeps one more thread per worker inside the enclave
+    auto ntcs = prp_en_pool::tcs_needed(nthreads, arg_ring_mode ? nthreads : 0);
+    if (ntcs > ENCLAVE_TCS_NUM) {
+        fprintf(
+            stderr,
+            "%zu workers need %zu enclave threads but the enclave has %u\n",
+            nthreads,
+            ntcs,
+            ENCLAVE_TCS_NUM);
+        return 1;
+    }
+
+    // a single enclave serves all workers, each worker thread enters it through its own TCS
+    prp_en_pool pool(esopath, false, key, arg_lba_shift, nthreads);
+
     std::vector<std::thread> workers;
     for (size_t tid = 0; tid < nthreads; tid++) {
         auto &t = workers.emplace_back(
@@ -230,10 +302,10 @@ int main(int argc, char **argv) { // NOLINT
             worker_sqids[tid],
             worker_sqfds[tid],
             arg_blkdev,
-            arg_lba_shift,
-            key,
+            std::cref(pool),
             static_cast<unsigned char *>(pvm),
-            pvm_size);
+            pvm_size,
+            arg_ring_mode);
 
         std::ostringstream tn;
         tn << "worker" << tid;
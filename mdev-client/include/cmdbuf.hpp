@@ -25,6 +25,12 @@ class cmdbuf {
     static_assert(!(count * sizeof(T) % NVME_PAGE_SIZE));
 
 public:
+    using cmdbuf_pointer = std::conditional_t<direction == cmdbuf_direction::producer, T *, const T *>;
+    using head_pointer =
+        std::conditional_t<direction == cmdbuf_direction::producer, volatile int *, const volatile int *>;
+    using tail_pointer =
+        std::conditional_t<direction == cmdbuf_direction::producer, const volatile int *, volatile int *>;
+
     explicit cmdbuf(int fd, size_t map_start_pg) {
         if (fd < 0) {
             return;
@@ -145,13 +151,18 @@ public:
         return to_consume;
     }
 
-private:
-    using cmdbuf_pointer = std::conditional_t<direction == cmdbuf_direction::producer, T *, const T *>;
-    using head_pointer =
-        std::conditional_t<direction == cmdbuf_direction::producer, volatile int *, const volatile int *>;
-    using tail_pointer =
-        std::conditional_t<direction == cmdbuf_direction::producer, const volatile int *, volatile int *>;
+    // raw mappings, for handing the ring over to another agent (e.g. an enclave worker)
+    constexpr cmdbuf_pointer data() const {
+        return _cmdbuf;
+    }
+    constexpr head_pointer head() const {
+        return _head;
+    }
+    constexpr tail_pointer tail() const {
+        return _tail;
+    }
 
+private:
 #ifdef _DEBUG
     inline void check() const {
         if (!_cmdbuf || !_head || !_tail) {
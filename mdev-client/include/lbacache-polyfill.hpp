@@ -24,11 +24,3 @@ long bpf_map_update_elem(std::array<T, N> *a, u32 *i, T *val, u64 flags) {
     (*a)[*i] = *val;
     return 0;
 }
-
-template <class T, size_t N>
-long bpf_arraymap_elem_band(std::array<T, N> *a, T *val) {
-    assert(a && val);
-    for (auto it = a->begin(); it != a->end(); it++)
-        *it &= *val;
-    return N;
-}
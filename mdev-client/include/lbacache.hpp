@@ -7,6 +7,8 @@
 #define XCACHE_ASSOC 4
 #define XCACHE_LINES 65536
 #define XCACHE_SIZE (XCACHE_ASSOC * XCACHE_LINES)
+// clusters one command can span, lengths are 16 bits
+#define CMD_MAX_CLUSTERS (65536 / CLUSTER_LBAS + 1)
 
 enum AuxBits {
     AUXBITS_VALID = 0x1,
@@ -46,6 +48,24 @@ enum AuxCommand {
 std::array<u64, XCACHE_SIZE> cache_tag;
 std::array<u64, XCACHE_SIZE> cache_plba;
 std::array<u32, XCACHE_LINES> cache_meta;
+// the snapshot epoch each entry was cached in, a snapshot takes writability away from everything cached before it
+std::array<u32, XCACHE_SIZE> cache_epoch;
+// bumped by every snapshot
+std::array<u32, 1> snap_epoch;
+// entries cached in an epoch before this one are gone, deallocates move it up to the current epoch
+std::array<u32, 1> valid_epoch;
+
+static u32 lba_epoch(void) {
+    u32 zero = 0;
+    u32 *epoch = bpf_map_lookup_elem(&snap_epoch, &zero);
+    return epoch ? *epoch : 0;
+}
+
+static u32 lba_valid_epoch(void) {
+    u32 zero = 0;
+    u32 *valid = bpf_map_lookup_elem(&valid_epoch, &zero);
+    return valid ? *valid : 0;
+}
 
 // https://en.wikipedia.org/wiki/Pseudo-LRU#Bit-PLRU
 // https://github.com/karlmcguire/plru
@@ -54,6 +74,8 @@ std::array<u32, XCACHE_LINES> cache_meta;
 static u64 lba_lookup(u64 vlba, u16 length0, u32 *aux) {
     VLBA_RESOLVE(vlba);
     int i;
+    u32 epoch = lba_epoch();
+    u32 valid = lba_valid_epoch();
     *aux = 0;
     if (vblk != (vlba + length0) / CLUSTER_LBAS)
         return U64_MAX;
@@ -69,10 +91,13 @@ static u64 lba_lookup(u64 vlba, u16 length0, u32 *aux) {
                 if ((*meta & META_MRU_MASK) == META_MRU_MASK)
                     *meta = (*meta & ~META_MRU_MASK) | (META_MRU << i);
                 u64 *plba = bpf_map_lookup_elem(&cache_plba, &ci);
-                if (!plba)
+                u32 *cepoch = bpf_map_lookup_elem(&cache_epoch, &ci);
+                if (!plba || !cepoch || (s32)(*cepoch - valid) < 0)
                     return U64_MAX;
                 bpf_map_update_elem(&cache_meta, &idx, meta, BPF_ANY);
                 *aux = AUX_GET(*meta, i);
+                if (*cepoch != epoch)
+                    *aux &= ~AUXBITS_WRITABLE;
                 return *plba + off;
             }
         }
@@ -80,7 +105,8 @@ static u64 lba_lookup(u64 vlba, u16 length0, u32 *aux) {
     return U64_MAX;
 }
 
-static u64 lba_update(u64 vlba, u64 plba, u32 aux) {
+// epoch: when the command that brought the translation was sent to the server
+static u64 lba_update(u64 vlba, u64 plba, u32 aux, u32 epoch) {
     VLBA_RESOLVE(vlba);
     int i;
     u32 *meta = bpf_map_lookup_elem(&cache_meta, &idx);
@@ -112,6 +138,7 @@ static u64 lba_update(u64 vlba, u64 plba, u32 aux) {
     ci = idx * XCACHE_ASSOC + i;
     bpf_map_update_elem(&cache_tag, &ci, &tag, BPF_ANY);
     bpf_map_update_elem(&cache_plba, &ci, &plba, BPF_ANY);
+    bpf_map_update_elem(&cache_epoch, &ci, &epoch, BPF_ANY);
     bpf_map_update_elem(&cache_meta, &idx, meta, BPF_ANY);
     return plba + off;
 }
@@ -139,13 +166,70 @@ static void lba_flush_range(u64 vlba, u16 length0) {
     }
 }
 
-static long lba_clear_flag_all(u32 aux) {
-    u32 meta_mask = 0;
-    int i;
-    for (i = 0; i < AUX_MAX_ASSOC; i++)
-        meta_mask |= aux << (i * AUX_SHIFT);
-    meta_mask = ~meta_mask;
-    return bpf_arraymap_elem_band(&cache_meta, &meta_mask);
+// a command spanning several clusters hits only if they're cached back to back with the same flags
+static u64 lba_lookup_range(u64 vlba, u16 length0, u32 *aux) {
+    u64 last = (vlba + length0) / CLUSTER_LBAS;
+    u64 ret = lba_lookup(vlba, 0, aux);
+    u64 cur = vlba / CLUSTER_LBAS * CLUSTER_LBAS;
+    int n;
+    for (n = 1; ret != U64_MAX && n < CMD_MAX_CLUSTERS && cur / CLUSTER_LBAS + n <= last; n++) {
+        u32 next_aux;
+        u64 next = lba_lookup(cur + n * CLUSTER_LBAS, 0, &next_aux);
+        if (next != ret - vlba % CLUSTER_LBAS + n * CLUSTER_LBAS || next_aux != *aux)
+            return U64_MAX;
+    }
+    return ret;
+}
+
+// the server only forwards a command spanning several clusters if they're back to back with the same flags
+static u64 lba_update_range(u64 vlba, u16 length0, u64 plba, u32 aux, u32 epoch) {
+    u64 last = (vlba + length0) / CLUSTER_LBAS;
+    u64 ret = lba_update(vlba, plba, aux, epoch);
+    u64 cur = vlba / CLUSTER_LBAS * CLUSTER_LBAS;
+    int n;
+    for (n = 1; ret != U64_MAX && n < CMD_MAX_CLUSTERS && cur / CLUSTER_LBAS + n <= last; n++)
+        if (lba_update(cur + n * CLUSTER_LBAS, plba + n * CLUSTER_LBAS, aux, epoch) == U64_MAX)
+            return U64_MAX;
+    return ret;
+}
+
+// lba_flush_range only takes one cluster at a time, and the loop has to be bounded
+static void lba_flush_clusters(u64 vlba, u16 length0) {
+    u64 last = (vlba + length0) / CLUSTER_LBAS;
+    int n;
+    for (n = 0; n < CMD_MAX_CLUSTERS && vlba / CLUSTER_LBAS <= last; n++) {
+        lba_flush_range(vlba / CLUSTER_LBAS * CLUSTER_LBAS, 0);
+        vlba += CLUSTER_LBAS;
+    }
+}
+
+// constant time however big the cache is, lba_lookup compares each entry's epoch instead
+static long lba_new_epoch(void) {
+    u32 zero = 0;
+    u32 *epoch = bpf_map_lookup_elem(&snap_epoch, &zero);
+    if (!epoch)
+        return -1;
+    __sync_fetch_and_add(epoch, 1);
+    return 0;
+}
+
+// a deallocate may free clusters anywhere in the ranges it keeps in guest memory, so everything cached goes
+// translations of commands already sent carry an older epoch and are dropped as well once they're cached
+static long lba_drop_all(void) {
+    u32 zero = 0;
+    u32 *epoch = bpf_map_lookup_elem(&snap_epoch, &zero);
+    u32 *valid = bpf_map_lookup_elem(&valid_epoch, &zero);
+    if (!epoch || !valid)
+        return -1;
+    __sync_fetch_and_add(epoch, 1);
+    *valid = *epoch;
+    return 0;
+}
+
+// the epoch goes along with commands sent to the server in a reserved field, and is gone before the device sees them
+// a translation answered after a snapshot is then cached as belonging to the epoch before it
+static void lba_stamp_epoch(struct bpf_io_ctx *ctx) {
+    ctx->cmd.rw.rsvd2 = lba_epoch();
 }
 
 static int nm_do_rw(struct bpf_io_ctx *ctx) {
@@ -154,31 +238,45 @@ static int nm_do_rw(struct bpf_io_ctx *ctx) {
     u64 slba = ctx->cmd.rw.slba;
     u16 length0 = ctx->cmd.rw.length;
 
-    val = lba_lookup(slba, length0, &aux);
+    val = lba_lookup_range(slba, length0, &aux);
     if (val != U64_MAX && ((ctx->cmd.common.opcode == nvme_cmd_read) || (aux & AUXBITS_WRITABLE))) {
         // direct translation succeeded
         ctx->cmd.rw.slba = val;
         return NMBPF_SEND_HQ | NMBPF_WILL_COMPLETE_HQ;
     } else {
         if (ctx->cmd.common.opcode != nvme_cmd_read)
-            lba_flush_range(slba, length0);
+            lba_flush_clusters(slba, length0);
+        lba_stamp_epoch(ctx);
         return NMBPF_SEND_FD | NMBPF_HOOK_NFD_WRITE | NMBPF_WAIT_FOR_HOOK;
     }
 }
 
+// write zeroes may free every cluster it touches, with or without DEAC, and even partially with subclusters
+// a freed cluster can be handed out again right away, so translations still in flight must not be cached either
+static int nm_do_write_zeroes(struct bpf_io_ctx *ctx) {
+    if (lba_drop_all() < 0)
+        return NVME_SC_DNR | NVME_SC_INTERNAL;
+    lba_stamp_epoch(ctx);
+    return NMBPF_SEND_FD | NMBPF_HOOK_NFD_WRITE | NMBPF_WAIT_FOR_HOOK;
+}
+
 static int nm_on_rw_respond(struct bpf_io_ctx *ctx) {
     u64 val;
+    u32 epoch = (u32)ctx->cmd.rw.rsvd2;
 
+    ctx->cmd.rw.rsvd2 = 0;
     // aux = [ctrl, paddr_lo, paddr_hi]
     // ctrl = cmd (AUX_CMD_MASK) | auxbits
     if (ctx->aux[0] & AUXBITS_VALID) {
         u64 plba;
         val = (u64)ctx->aux[1] | ((u64)ctx->aux[2] << 32);
-        plba = lba_update(
+        plba = lba_update_range(
             ctx->cmd.rw.slba,
+            ctx->cmd.rw.length,
             /* truncate the block offset */
             val / CLUSTER_SIZE * CLUSTER_LBAS,
-            ctx->aux[0] & AUX_MASK);
+            ctx->aux[0] & AUX_MASK,
+            epoch);
         if (plba == U64_MAX) {
             // this really shouldn't happen but...
             return NVME_SC_DNR | NVME_SC_INTERNAL;
@@ -190,7 +288,7 @@ static int nm_on_rw_respond(struct bpf_io_ctx *ctx) {
         }
     } else {
         if (!(ctx->aux[0] & AUXCMD_KEEP))
-            lba_flush_range(ctx->cmd.rw.slba, ctx->cmd.rw.length);
+            lba_flush_clusters(ctx->cmd.rw.slba, ctx->cmd.rw.length);
         return ctx->data;
     }
 }
@@ -202,7 +300,6 @@ int nvme_run_bpf(struct bpf_io_ctx *ctx) {
     switch (ctx->cmd.common.opcode) {
     case nvme_cmd_read:
     case nvme_cmd_write:
-    case nvme_cmd_write_zeroes:
         switch (ctx->current_hook) {
         case NMBPF_HOOK_VSQ:
             return nm_do_rw(ctx);
@@ -211,14 +308,25 @@ int nvme_run_bpf(struct bpf_io_ctx *ctx) {
         default:
             return NMBPF_SEND_HQ | NMBPF_WILL_COMPLETE_HQ;
         }
-    case 0x81: { // snapshot
-        long ret = lba_clear_flag_all(AUXBITS_WRITABLE);
-        if (ret < 0)
+    case nvme_cmd_write_zeroes:
+        switch (ctx->current_hook) {
+        case NMBPF_HOOK_VSQ:
+            return nm_do_write_zeroes(ctx);
+        case NMBPF_HOOK_NFD_WRITE:
+            return nm_on_rw_respond(ctx);
+        default:
+            return NMBPF_SEND_HQ | NMBPF_WILL_COMPLETE_HQ;
+        }
+    case 0x81: // snapshot
+        if (lba_new_epoch() < 0)
+            return NVME_SC_DNR | NVME_SC_INTERNAL;
+        return NMBPF_SEND_FD | NMBPF_WILL_COMPLETE_FD;
+    case 0x82: // delete snapshot, the writable one stays as it is
+        return NMBPF_SEND_FD | NMBPF_WILL_COMPLETE_FD;
+    case nvme_cmd_dsm:
+        if ((ctx->cmd.dsm.attributes & NVME_DSMGMT_AD) && lba_drop_all() < 0)
             return NVME_SC_DNR | NVME_SC_INTERNAL;
-        if (ret != XCACHE_LINES)
-            return NVME_SC_INTERNAL;
         return NMBPF_SEND_FD | NMBPF_WILL_COMPLETE_FD;
-    }
     default:
         return NMBPF_SEND_HQ | NMBPF_WILL_COMPLETE_HQ;
     }
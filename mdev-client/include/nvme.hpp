@@ -74,6 +74,9 @@ protected:
     constexpr const std::shared_ptr<mapping> &vm() const {
         return _vm;
     }
+    constexpr int nfd() const {
+        return _nfd;
+    }
     inline int ns_lba_shift(__u32 nsid) {
         auto &idns = id_vns(nsid);
         if (!idns) {
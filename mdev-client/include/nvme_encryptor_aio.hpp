@@ -7,6 +7,7 @@
 #include "nvme.hpp"
 #include "crypto/tbc.hpp"
 #include "util/uring.hpp"
+#include "util/write_merger.hpp"
 
 class nvme_encryptor_aio final : public nvme {
 public:
@@ -14,8 +15,10 @@ public:
         const std::shared_ptr<mapping> &vm,
         int nfd,
         int bfd,
-        std::unique_ptr<tweakable_block_cipher> &&engine)
-        : nvme(vm, nfd), _bfd{{bfd}}, _engine(std::move(engine)), _ring(2048, 0, std::span(_bfd)) {
+        std::unique_ptr<tweakable_block_cipher> &&engine,
+        unsigned int merge_window_us = 0)
+        : nvme(vm, nfd), _bfd{{bfd}}, _engine(std::move(engine)), _ring(2048, 0, std::span(_bfd)),
+          _merger(merge_window_us) {
     }
     nvme_encryptor_aio(const nvme_encryptor_aio &) = delete;
     nvme_encryptor_aio &operator=(const nvme_encryptor_aio &) = delete;
@@ -24,6 +27,16 @@ public:
     ~nvme_encryptor_aio() = default;
 
     inline int sq_kick() {
+        _merger.tick(_ring);
+        return _ring.sq_kick();
+    }
+    // writes are being held back for merging, keep kicking
+    inline bool merge_pending() const {
+        return _merger.pending();
+    }
+    // submits the held run right away, before sleeping without kicks
+    inline int flush_merges() {
+        _merger.flush(_ring);
         return _ring.sq_kick();
     }
 
@@ -34,12 +47,16 @@ public:
         return static_cast<sq_ticket *>(io_uring_cqe_get_data(cqe));
     }
     inline std::span<sq_ticket *> commit_completions(cq_window &wnd, const std::span<sq_ticket *> &ticketbuf) {
-        return _ring.cq_commit(wnd, ticketbuf);
+        auto tickets = _ring.cq_commit(wnd, ticketbuf);
+        _merger.completed(tickets.size());
+        return tickets;
     }
     inline void commit_completions(cq_window &wnd) {
+        _merger.completed(wnd.cqes.size());
         return _ring.cq_commit(wnd);
     }
     inline void commit_completion(io_uring_cqe *cqe) {
+        _merger.completed();
         return _ring.cq_commit(cqe);
     }
 
@@ -51,4 +68,5 @@ private:
     std::array<int, 1> _bfd;
     std::unique_ptr<tweakable_block_cipher> _engine;
     uring _ring;
+    write_merger _merger;
 };
@@ -1,15 +1,59 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <thread>
 #include <vector>
 #include <utility>
 #include <sys/uio.h>
 
 #include "nvme.hpp"
+#include "cmdbuf.hpp"
 #include "sgx/prp_en.hpp"
+#include "sgx/crypt_ring.hpp"
 #include "util/uring.hpp"
 
+// state of the enclave ring worker, see crypt_ring.hpp
+struct sgx_ring_state {
+    explicit sgx_ring_state(size_t nr_slots, size_t slot_size);
+    sgx_ring_state(const sgx_ring_state &) = delete;
+    sgx_ring_state &operator=(const sgx_ring_state &) = delete;
+    sgx_ring_state(sgx_ring_state &&) = delete;
+    sgx_ring_state &operator=(sgx_ring_state &&) = delete;
+    ~sgx_ring_state();
+
+    struct crypt_ring desc {};
+    size_t mem_size;
+    unique_handle<unsigned char> mem;
+    std::unique_ptr<crypt_cqbuf_t<cmdbuf_en_direction::consumer>> cq;
+    std::unique_ptr<crypt_slotbuf_t<cmdbuf_en_direction::producer>> slots;
+    std::thread worker;
+    // set once the worker has returned with an error
+    std::atomic<bool> failed = false;
+    long error = 0;
+};
+
+// backend write of an enclave staging slot, gives the slot back to the enclave when done
+struct slot_ticket final : public sq_ticket {
+    slot_ticket(uint32_t _tag, crypt_slotbuf_t<cmdbuf_en_direction::producer> *_slots, uint32_t _slot)
+        : sq_ticket(_tag), slots(_slots), slot(_slot) {
+    }
+    slot_ticket(const slot_ticket &) = delete;
+    slot_ticket &operator=(const slot_ticket &) = delete;
+    ~slot_ticket() {
+        // the slot ring is larger than the slot count, so this never fails
+        slots->produce(std::span<const uint32_t>(&slot, 1));
+    }
+    crypt_slotbuf_t<cmdbuf_en_direction::producer> *slots;
+    uint32_t slot;
+};
+
 class nvme_encryptor_sgx_aio final : public nvme {
 public:
+    static constexpr size_t ring_nr_slots = 64;
+    // staging slot size when the controller reports no transfer limit (mdts == 0)
+    static constexpr size_t ring_max_slot_size = 1 << 20;
+
     explicit nvme_encryptor_sgx_aio(
         const std::shared_ptr<mapping> &vm,
         int nfd,
@@ -21,6 +65,10 @@ public:
         : nvme(vm, nfd), _bfd{{bfd}}, _vm(vm), _e(epath, edebug, _vm->data(), _vm->size(), key, lba_shift),
           _ring(2048, 0, std::span(_bfd)) {
     }
+    // enters the enclave shared through pool, from whichever thread uses this controller
+    explicit nvme_encryptor_sgx_aio(const std::shared_ptr<mapping> &vm, int nfd, int bfd, const prp_en_pool &pool)
+        : nvme(vm, nfd), _bfd{{bfd}}, _vm(vm), _e(pool.get(_vm->data(), _vm->size())), _ring(2048, 0, std::span(_bfd)) {
+    }
     nvme_encryptor_sgx_aio(const nvme_encryptor_sgx_aio &) = delete;
     nvme_encryptor_sgx_aio &operator=(const nvme_encryptor_sgx_aio &) = delete;
     nvme_encryptor_sgx_aio(nvme_encryptor_sgx_aio &&) = default;
@@ -33,6 +81,21 @@ public:
 
     // true: async, false: immediate return
     bool submit_async(size_t sq, const nvme_command &cmd, uint32_t tag, __u16 &outstatus);
+    // same as submit_async for each command, with a single enclave transition for the whole burst
+    // returns the number of commands that went async
+    size_t submit_burst_async(
+        std::span<const nvme_command> cmds,
+        std::span<const uint32_t> tags,
+        std::span<bool> outasync,
+        std::span<__u16> outstatus);
+
+    // ring mode: an enclave thread consumes the SQs directly and this controller only forwards its results
+    // the controller must not be moved while the ring is running
+    void ring_start(std::span<nsqbuf_t> sqs);
+    void ring_stop();
+    // drains enclave results, returns the number of commands that completed immediately
+    size_t ring_poll(std::span<uint32_t> outtags, std::span<__u16> outstatus, bool &submitted_async);
+
     cq_window get_pending_completions(std::span<io_uring_cqe *> cqebuf);
     static inline sq_ticket *cqe_get_data(io_uring_cqe *cqe) {
         return static_cast<sq_ticket *>(io_uring_cqe_get_data(cqe));
@@ -48,12 +111,25 @@ public:
     }
 
 private:
+    struct burst_item {
+        size_t index;
+        // writes only
+        std::unique_ptr<mem_ticket<sq_ticket>> ticket;
+        size_t nbytes;
+        off_t offset;
+    };
+
     __u16 receive_read(size_t sq, const nvme_command &cmd);
     void submit_write_async(size_t sq, const nvme_command &cmd, uint32_t tag);
     void submit_write_zeroes_async(size_t sq, const nvme_command &cmd, uint32_t tag);
     void submit_flush_async(size_t sq, const nvme_command &cmd, uint32_t tag);
+    bool ring_complete_one(const crypt_completion &c, __u16 &outstatus);
     std::array<int, 1> _bfd;
     std::shared_ptr<mapping> _vm;
     prp_en _e;
     uring _ring;
+    std::vector<nvme_command> _burst_cmds;
+    std::vector<crypt_desc> _burst_descs;
+    std::vector<burst_item> _burst_items;
+    std::unique_ptr<sgx_ring_state> _rs;
 };
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+#include <sys/uio.h>
+
+#include "nvme.hpp"
+#include "util/journal.hpp"
+#include "util/uring.hpp"
+
+// record write into the journal, owns the whole record: header block, data and padding
+// the data is copied out of the guest so that the checksum always matches what reaches the disk
+struct journal_ticket final : public iovec_ticket<sq_ticket> {
+    struct deleter {
+        void operator()(unsigned char *p) {
+            mi_free(p);
+        }
+    };
+
+    journal_ticket(uint32_t _tag, uint64_t _seq, off_t _offset, uint64_t _len)
+        : iovec_ticket<sq_ticket>(_tag), seq(_seq), offset(_offset), len(_len),
+          record(static_cast<unsigned char *>(mi_new_aligned(_len, replica_journal::block_size))) {
+    }
+    uint64_t seq;
+    off_t offset;
+    uint64_t len;
+    std::unique_ptr<unsigned char[], deleter> record;
+    unsigned int tries = 0;
+};
+
+// Asynchronous replication: guest writes complete once they are durable in the journal (fixed file 0),
+// the journal's shipper thread forwards them to the targets in the background.
+// Commands that do not fit under the journal's lag limit are held back until it has room again.
+class nvme_journal_aio final : public nvme {
+public:
+    explicit nvme_journal_aio(const std::shared_ptr<mapping> &vm, int nfd, std::shared_ptr<replica_journal> journal);
+    nvme_journal_aio(const nvme_journal_aio &) = delete;
+    nvme_journal_aio &operator=(const nvme_journal_aio &) = delete;
+    nvme_journal_aio(nvme_journal_aio &&) = default;
+    nvme_journal_aio &operator=(nvme_journal_aio &&) = default;
+    ~nvme_journal_aio() = default;
+
+    inline int sq_kick() {
+        return _ring.sq_kick();
+    }
+
+    __u16 submit_async(size_t sq, const nvme_command &cmd, uint32_t tag);
+    cq_window get_pending_completions(std::span<io_uring_cqe *> cqebuf);
+    static inline sq_ticket *cqe_get_data(io_uring_cqe *cqe) {
+        return static_cast<sq_ticket *>(io_uring_cqe_get_data(cqe));
+    }
+    // consumes one journal completion, guest commands are answered by poll()
+    void complete(io_uring_cqe *cqe);
+    // retries held back commands and calls fn(tag, status) for each guest command that is now durable
+    template <typename F>
+    void poll(F &&fn) {
+        while (!_deferred.empty()) {
+            auto &d = _deferred.front();
+            auto status = try_submit(d.cmd, d.tag);
+            if (status == busy_status) {
+                break;
+            } else if (status != NVME_SC_SUCCESS) {
+                fn(d.tag, status);
+            }
+            _deferred.pop_front();
+        }
+        for (auto tag : _ready) {
+            fn(tag, static_cast<__u16>(NVME_SC_SUCCESS));
+        }
+        _ready.clear();
+        auto durable = _journal->durable_seq();
+        while (!_unacked.empty() && _unacked.begin()->first < durable) {
+            fn(_unacked.begin()->second, static_cast<__u16>(NVME_SC_SUCCESS));
+            _unacked.erase(_unacked.begin());
+        }
+    }
+    // commands are waiting for the journal, keep polling
+    inline bool busy() const {
+        return !_deferred.empty() || !_ready.empty() || !_unacked.empty();
+    }
+
+    void print_stats(FILE *f, const char *prefix) const;
+
+private:
+    // never returned to the guest, the command is deferred instead
+    static constexpr __u16 busy_status = 0xffff;
+    struct deferred_cmd {
+        nvme_command cmd;
+        uint32_t tag;
+    };
+
+    __u16 try_submit(const nvme_command &cmd, uint32_t tag);
+    __u16 submit_write_async(const nvme_command &cmd, uint32_t tag);
+    __u16 submit_write_zeroes_async(const nvme_command &cmd, uint32_t tag);
+    journal_ticket *
+    make_record(uint32_t tag, journal_record::kind k, off_t offset, size_t nbytes, std::span<const iovec> data);
+
+    std::shared_ptr<replica_journal> _journal;
+    std::array<int, 1> _jfd;
+    uring _ring;
+    std::deque<deferred_cmd> _deferred;
+    // seq -> tag of records waiting to become durable
+    std::map<uint64_t, uint32_t> _unacked;
+    // answered on the next poll
+    std::vector<uint32_t> _ready;
+};
@@ -1,15 +1,39 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <set>
 #include <utility>
+#include <vector>
 #include <sys/uio.h>
 
 #include "nvme.hpp"
+#include "util/dirty_bitmap.hpp"
+#include "util/remote.hpp"
+#include "util/replica.hpp"
+#include "util/time.hpp"
 #include "util/uring.hpp"
+#include "util/write_merger.hpp"
 
+// Mirrors guest writes to every backend in bfds (registered as fixed files 0..N-1).
+// A guest command completes once quorum backends have acknowledged it, or fails once that is no longer possible.
+// With quorum < N, local replicas write from a private copy of the payload, since they may outlive the guest command.
+// A flush only counts towards the quorum on replicas that have completed every earlier write.
+// With a bitmap, writes are logged as dirty regions so that diverged replicas can be resynced without a full copy.
+// Writes that dirty a region are held back until a datasync of the bitmap, queued on the ring once per batch, is done.
+// Backends that are connected sockets are driven through the remote replica protocol instead of file I/O.
 class nvme_sender_aio final : public nvme {
 public:
-    explicit nvme_sender_aio(const std::shared_ptr<mapping> &vm, int nfd, int bfd)
-        : nvme(vm, nfd), _bfd{{bfd}}, _ring(2048, 0, std::span(_bfd)) {
+    explicit nvme_sender_aio(
+        const std::shared_ptr<mapping> &vm,
+        int nfd,
+        std::span<const int> bfds,
+        unsigned int quorum,
+        unsigned int merge_window_us = 0,
+        std::shared_ptr<dirty_bitmap> bitmap = nullptr);
+    explicit nvme_sender_aio(const std::shared_ptr<mapping> &vm, int nfd, int bfd, unsigned int merge_window_us = 0)
+        : nvme_sender_aio(vm, nfd, std::span<const int>(&bfd, 1), 1, merge_window_us) {
     }
     nvme_sender_aio(const nvme_sender_aio &) = delete;
     nvme_sender_aio &operator=(const nvme_sender_aio &) = delete;
@@ -18,6 +42,28 @@ public:
     ~nvme_sender_aio() = default;
 
     inline int sq_kick() {
+        if (!_held.empty() || (_bitmap && !_bitmap->durable(_sync_wanted))) {
+            release_held();
+        }
+        for (auto &m : _mergers) {
+            m.tick(_ring);
+        }
+        for (auto &rc : _remotes) {
+            if (rc) {
+                rc->kick(_ring);
+            }
+        }
+        return _ring.sq_kick();
+    }
+    // writes are being held back for merging, keep kicking
+    inline bool merge_pending() const {
+        return std::any_of(_mergers.begin(), _mergers.end(), [](const write_merger &m) { return m.pending(); });
+    }
+    // submits the held runs right away, before sleeping without kicks
+    inline int flush_merges() {
+        for (auto &m : _mergers) {
+            m.flush(_ring);
+        }
         return _ring.sq_kick();
     }
 
@@ -26,20 +72,218 @@ public:
     static inline sq_ticket *cqe_get_data(io_uring_cqe *cqe) {
         return static_cast<sq_ticket *>(io_uring_cqe_get_data(cqe));
     }
-    inline std::span<sq_ticket *> commit_completions(cq_window &wnd, const std::span<sq_ticket *> &ticketbuf) {
-        return _ring.cq_commit(wnd, ticketbuf);
+    // consumes one backend completion, calls fn(tag, status) for each guest command it answers
+    template <typename F>
+    void complete(io_uring_cqe *cqe, F &&fn) {
+        auto t = cqe_get_data(cqe);
+        auto res = cqe->res;
+        _ring.cq_commit(cqe);
+        timespec now{};
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if (t->tag == remote_tag) {
+            auto io = static_cast<remote_io_ticket *>(t);
+            io->client->complete(_ring, io, res, [&](sq_ticket *m, int mres) {
+                auto rt = static_cast<replica_ticket *>(m);
+                if (complete_one(rt, mres, now, fn)) {
+                    delete rt;
+                }
+            });
+        } else if (t->tag == bitmap_tag) {
+            auto bt = static_cast<bitmap_sync_ticket *>(t);
+            auto target = bt->target;
+            delete bt;
+            _bitmap_syncing = false;
+            if (res < 0) {
+                throw std::system_error(-res, std::generic_category(), "cannot sync dirty bitmap");
+            }
+            _bitmap->synced(target);
+            release_held();
+            release_replies(fn);
+        } else if (t->tag == merged_tag) {
+            auto mt = static_cast<merged_ticket *>(t);
+            // all members of a merged write go to the same replica
+            _mergers[static_cast<replica_ticket *>(mt->members.front())->replica].completed();
+            for (auto m : mt->members) {
+                complete_one(static_cast<replica_ticket *>(m), res, now, fn);
+            }
+            delete mt;
+        } else {
+            auto rt = static_cast<replica_ticket *>(t);
+            _mergers[rt->replica].completed();
+            if (complete_one(rt, res, now, fn)) {
+                delete rt;
+            }
+        }
     }
-    inline void commit_completions(cq_window &wnd) {
-        return _ring.cq_commit(wnd);
+
+    // answers commands whose remote replicas failed without a backend completion
+    template <typename F>
+    void poll(F &&fn) {
+        timespec now{};
+        for (auto &rc : _remotes) {
+            if (rc && rc->dead()) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                rc->drain([&](sq_ticket *m, int mres) {
+                    auto rt = static_cast<replica_ticket *>(m);
+                    if (complete_one(rt, mres, now, fn)) {
+                        delete rt;
+                    }
+                });
+            }
+        }
     }
-    inline void commit_completion(io_uring_cqe *cqe) {
-        return _ring.cq_commit(cqe);
+
+    inline size_t replica_count() const {
+        return _bfd.size();
     }
+    inline const replica_stats &stats(size_t replica) const {
+        return _stats[replica];
+    }
+    void print_stats(FILE *f, const char *prefix) const;
 
 private:
+    // per replica, the writes a flush on that replica has to wait for
+    struct replica_order {
+        // seq of writes still in flight
+        std::set<uint64_t> inflight;
+        // flushes that finished before some earlier write did, reissued once those writes are done
+        std::vector<replica_ticket *> parked;
+    };
+
+    struct bitmap_sync_ticket : public sq_ticket {
+        explicit bitmap_sync_ticket(uint64_t _target) : sq_ticket(bitmap_tag), target(_target) {
+        }
+        // sync_target() when the sync was queued
+        uint64_t target;
+    };
+
+    // a replica write or write zeroes waiting for the bitmap
+    struct held_write {
+        uint64_t mark;
+        replica_ticket *ticket;
+        int flags;
+    };
+
+    // a guest reply waiting for the bitmap to record the failures of its command
+    struct held_reply {
+        uint64_t mark;
+        uint32_t tag;
+        __u16 status;
+    };
+
+    template <typename F>
+    void reply(const replica_op &op, __u16 status, F &&fn) {
+        if (_bitmap && !_bitmap->durable(op.fail_mark)) {
+            _held_replies.push_back(held_reply{op.fail_mark, op.tag, status});
+            _sync_wanted = std::max(_sync_wanted, op.fail_mark);
+        } else {
+            fn(op.tag, status);
+        }
+    }
+
+    template <typename F>
+    void release_replies(F &&fn) {
+        auto waiting = std::stable_partition(_held_replies.begin(), _held_replies.end(), [this](const held_reply &h) {
+            return _bitmap->durable(h.mark);
+        });
+        std::vector<held_reply> ready(_held_replies.begin(), waiting);
+        _held_replies.erase(_held_replies.begin(), waiting);
+        for (auto &h : ready) {
+            fn(h.tag, h.status);
+        }
+    }
+
+    // returns false if the ticket was reissued and must not be freed
+    template <typename F>
+    bool complete_one(replica_ticket *rt, int res, const timespec &now, F &&fn) {
+        auto op = rt->op;
+        auto r = rt->replica;
+        auto &ord = _order[r];
+        if (op->k == replica_op::kind::flush) {
+            if (res >= 0 && !ord.inflight.empty() && *ord.inflight.begin() < rt->seq) {
+                // the fsync may have run ahead of writes the guest already considers done
+                ord.parked.push_back(rt);
+                return false;
+            }
+        } else {
+            ord.inflight.erase(rt->seq);
+        }
+
+        auto &st = _stats[r];
+        st.latency.record(now - op->start);
+        st.completed++;
+        if (res < 0) {
+            op->failed++;
+            st.failed++;
+            mark_stale(st, *op);
+            if (_bitmap) {
+                op->fail_mark = std::max(op->fail_mark, _bitmap->replica_failed(r));
+            }
+        } else if (op->k == replica_op::kind::flush && !st.stale.empty()) {
+            op->unsynced++;
+        } else {
+            op->acked++;
+        }
+
+        if (op->answered) {
+            st.late++;
+        } else if (op->acked >= _quorum) {
+            op->answered = true;
+            reply(*op, static_cast<__u16>(NVME_SC_SUCCESS), fn);
+        } else if (op->failed + op->unsynced > _bfd.size() - _quorum) {
+            op->answered = true;
+            reply(*op, static_cast<__u16>(NVME_SC_DNR | NVME_SC_INTERNAL), fn);
+        }
+
+        if (!--op->pending) {
+            if (_bitmap) {
+                settle(*op);
+            }
+            delete op;
+        }
+        if (!ord.parked.empty()) {
+            reissue_flushes(r);
+        }
+        return true;
+    }
+    static void mark_stale(replica_stats &st, const replica_op &op);
+    // all replicas have completed op, record its outcome in the bitmap
+    void settle(const replica_op &op);
+
     void submit_write_async(size_t sq, const nvme_command &cmd, uint32_t tag);
+    // one ticket per replica
+    std::vector<std::unique_ptr<replica_ticket>> make_tickets(replica_op *op) const;
+    // marks the bitmap and queues the tickets of a fully built write or write zeroes, which take over op
+    void queue_op(std::unique_ptr<replica_op> op, std::span<std::unique_ptr<replica_ticket>> tickets, int flags);
+    void queue_replica_write(replica_ticket *ticket, int flags);
+    void queue_replica_write_zeroes(replica_ticket *ticket);
+    // queues the write now, or once the bitmap has mark on disk
+    void queue_marked(replica_ticket *ticket, int flags, uint64_t mark);
+    // queues the held writes the bitmap is ready for, and a bitmap sync for the others
+    void release_held();
+    void queue_replica_flush(replica_ticket *ticket);
+    void reissue_flushes(unsigned int replica);
     void submit_write_zeroes_async(size_t sq, const nvme_command &cmd, uint32_t tag);
     void submit_flush_async(size_t sq, const nvme_command &cmd, uint32_t tag);
-    std::array<int, 1> _bfd;
+    static std::vector<std::unique_ptr<remote_client>> make_remotes(std::span<const int> bfds);
+    static std::vector<iovec> remote_buffers(std::span<std::unique_ptr<remote_client>> remotes);
+
+    std::vector<int> _bfd;
+    unsigned int _quorum;
+    // indexed by replica, null for local backends
+    std::vector<std::unique_ptr<remote_client>> _remotes;
+    std::vector<iovec> _fixed_bufs;
     uring _ring;
+    // one per replica, runs never span replicas
+    std::vector<write_merger> _mergers;
+    std::vector<replica_stats> _stats;
+    std::vector<replica_order> _order;
+    uint64_t _next_seq = 0;
+    std::shared_ptr<dirty_bitmap> _bitmap;
+    std::vector<held_write> _held;
+    std::vector<held_reply> _held_replies;
+    // bitmap mark that has to reach the disk even if no write is held for it
+    uint64_t _sync_wanted = 0;
+    bool _bitmap_syncing = false;
 };
@@ -1,17 +1,28 @@
 #pragma once
 
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <shared_mutex>
 #include <vector>
 #include <utility>
 #include <functional>
 #include <variant>
 #include <tuple>
 #include <sys/uio.h>
-#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
 
 #include "nvme.hpp"
 #include "util/uring.hpp"
+#include "util/cluster_locks.hpp"
+#include "util/replica.hpp"
 #include "xcow/xcow_snap.hpp"
 #include "xcow/xcow_file.hpp"
+#include "xcow/copy_offload.hpp"
+#include "xcow/file_deref.hpp"
+#include "xcow/cached_deref.hpp"
+#include "xcow/meta_log.hpp"
+#include "xcow/backing_image.hpp"
 #include "xcow/proto.hpp"
 
 static constexpr void set_aux(nmntfy_aux &aux, uint64_t paddr, uint32_t aux0) {
@@ -52,12 +63,72 @@ struct xcow_ticket;
 using nm_outcome = std::variant<std::monostate, nm_reply, xcow_ticket *>;
 
 struct xcow_ticket : public multi_ticket {
-    constexpr xcow_ticket(uint32_t _tag) : multi_ticket(_tag) {
+    xcow_ticket(uint32_t _tag) : multi_ticket(_tag) {
+        live_count++;
     }
+    ~xcow_ticket() override {
+        live_count--;
+    }
+
+    // tickets of this thread that haven't completed yet, the worker is idle once there are none
+    static inline thread_local size_t live_count = 0;
 
     nmntfy_aux aux{};
     uint64_t locked_cluster = UINT64_MAX;
+    // the first failure of the ticket, which completes with it even if the rest went well
+    __s32 failed = 0;
+    // commits the transaction once the ticket succeeds
     cleanup last;
+    // runs instead of last if the ticket fails
+    cleanup undo;
+    // completion sockets of copies offloaded to the helper thread, open until their reads complete
+    std::vector<FileDescriptor> copies;
+};
+
+// what waits for a cluster is given the status of the transaction that held it
+using xcow_locks = cluster_locks<nm_outcome(__s32 uring_status)>;
+
+struct xcow_stats {
+    uint64_t flushes = 0;
+    // metadata written back by flushes
+    uint64_t meta_pages = 0;
+    uint64_t meta_ranges = 0;
+    latency_histogram flush_latency;
+    // commands spanning several clusters, forwarded as a whole or split up
+    uint64_t multi_forwarded = 0;
+    uint64_t multi_split = 0;
+    // first writes to empty clusters that found a pre-zeroed cluster, or had to zero one themselves
+    uint64_t zero_pool_hits = 0;
+    uint64_t zero_pool_misses = 0;
+    // clusters that deallocates unmapped entirely or by subclusters, and those they left alone because they were only
+    // partly covered or in use
+    uint64_t deallocated = 0;
+    uint64_t dealloc_skipped = 0;
+};
+
+// How the clusters of a file are spread over the workers serving it. Each worker owns the cluster locks of its
+// clusters and runs every command changing them; the metadata itself is shared and guarded by meta_lock.
+struct xcow_shards {
+    // clusters go to workers in stripes so that commands rarely span more than one
+    static constexpr size_t stripe_bits = 4;
+    // route(): any worker may run the command, or every other worker has to be stopped first
+    static constexpr size_t any = SIZE_MAX;
+    static constexpr size_t exclusive = SIZE_MAX - 1;
+
+    explicit xcow_shards(size_t _count) : count(_count), locks(_count) {
+    }
+
+    size_t count;
+    // translation tables, allocators and the cluster locks of all workers; reads may share it
+    std::shared_mutex meta_lock;
+    // a worker only changes its own cluster locks, but anyone may look at them under meta_lock
+    std::vector<xcow_locks> locks;
+    // bumped by each snapshot, the other workers reopen the writable snapshot when they see it
+    std::atomic<uint64_t> snap_epoch = 0;
+
+    constexpr size_t owner(uint64_t vblk) const {
+        return ((vblk >> stripe_bits) * 0x9e37'79b9'7f4a'7c15ull >> 32) % count;
+    }
 };
 
 static constexpr uint16_t translate_uring_status(__s32 us) {
@@ -69,16 +140,17 @@ static constexpr uint16_t translate_uring_status(__s32 us) {
 
 class nvme_xcow final : public nvme {
 public:
-    // key: cluster index (vblk)
-    using workqueue_type = boost::unordered_multimap<uint64_t, std::function<nm_outcome(__s32 uring_status)>>;
-
     explicit nvme_xcow(
         const std::shared_ptr<mapping> &vm,
         int nfd,
         int bfd,
         xcow::XcowFile *file,
-        std::vector<bool> *clock,
-        workqueue_type *wq);
+        xcow_locks *locks,
+        xcow::FileDeref *deref = nullptr,
+        xcow::MetaLog *log = nullptr,
+        xcow::BackingImage *backing = nullptr,
+        xcow_shards *shards = nullptr,
+        xcow::CachedDeref *cache = nullptr);
     nvme_xcow(const nvme_xcow &) = delete;
     nvme_xcow &operator=(const nvme_xcow &) = delete;
     nvme_xcow(nvme_xcow &&) = default;
@@ -90,7 +162,10 @@ public:
     }
 
     // true: async, false: immediate return
+    // with shards, the caller holds meta_lock: shared for reads, exclusively for everything else
     nm_outcome submit_async(size_t sq, const nvme_command &cmd, uint32_t tag);
+    // the worker that has to run the command, or one of xcow_shards::any and xcow_shards::exclusive
+    size_t route(const nvme_command &cmd);
     cq_window get_pending_completions(std::span<io_uring_cqe *> cqebuf);
     static inline sq_ticket *cqe_get_data(io_uring_cqe *cqe) {
         return static_cast<sq_ticket *>(io_uring_cqe_get_data(cqe));
@@ -104,15 +179,81 @@ public:
     inline void commit_completion(io_uring_cqe *cqe) {
         return _ring.cq_commit(cqe);
     }
+    // takes one completion of the ring; the last one of a ticket commits or rolls back its transaction, replies and
+    // unlocks its cluster
+    // outcome is given the reply and the continuations that were waiting for the cluster, and returns true if it
+    // submitted anything; so does complete()
+    bool complete(io_uring_cqe *cqe, const std::function<bool(const nm_outcome &)> &outcome);
+
+    // works on pending snapshot deletions without getting in the way of locked clusters
+    // returns false once there's nothing left to do
+    bool merge_step();
+    // tops up the pool of pre-zeroed clusters with a single fallocate, meant for when there's nothing else to do
+    // returns true if it queued anything
+    bool refill_zero_pool();
+
+    // with a metadata log, replies to FUA writes and snapshot commands are only sent once the metadata they changed
+    // is logged; returns true if the reply was taken over, it then comes back later through a ticket
+    bool defer_reply(const nm_reply &reply);
+    // writes the logged metadata back to the map file if the log is filling up and no record is being written
+    void log_checkpoint();
+    // updates NUSE in the identify data the guest sees if it changed
+    // the clusters in use are counted a few l0 tables at a time first, returns true until they all are
+    bool report_usage();
+
+    void print_stats(FILE *f, const char *prefix);
 
 private:
     nm_outcome do_snapshot(size_t sq, const nvme_command &cmd, uint32_t tag);
+    nm_outcome do_snapshot_delete(size_t sq, const nvme_command &cmd, uint32_t tag);
     nm_outcome do_read(size_t sq, const nvme_command &cmd, uint32_t tag);
     nm_outcome do_write(size_t sq, const nvme_command &cmd, uint32_t tag);
     nm_outcome do_write_zeroes(size_t sq, const nvme_command &cmd, uint32_t tag);
     nm_outcome do_flush(size_t sq, const nvme_command &cmd, uint32_t tag);
+    nm_outcome do_dsm(size_t sq, const nvme_command &cmd, uint32_t tag);
+    // unmaps the clusters of [addr, addr + nbytes) that it covers entirely, and whole subclusters with extended l2
+    // deallocation is only a hint, the rest of the range is left as it is
+    void do_deallocate(uint64_t addr, uint64_t nbytes);
+    void set_id_vns(const nvme_id_ns &idns);
+    // links the write back of the metadata pages dirtied since the last flush to the ticket
+    void do_flush_meta(xcow_ticket *ticket);
+    // same for the units of the metadata cache, which are written from the cache itself
+    void do_flush_cache(xcow_ticket *ticket);
 
-    std::tuple<xcow_ticket *, uint64_t, uint64_t> do_alloc_one_tx(uint32_t tag, uint64_t vblk, xcow::XlateLeaf *entry);
+    // the ticket completes once the data written so far and the metadata referring to it are durable
+    void log_wait(xcow_ticket *ticket);
+    // writes the next record for the waiting tickets unless one is being written already
+    // all waiters that arrive while a record is in flight share the next one
+    void log_kick();
+
+    // allocates a cluster holding what the guest saw there before, be it zeroes, a copy or the backing image
+    // ext is nullptr without extended l2
+    std::tuple<xcow_ticket *, uint64_t, uint64_t> do_alloc_one_tx(
+        uint32_t tag,
+        uint64_t vblk,
+        xcow::XlateLeaf *entry,
+        xcow::XlateExt *ext = nullptr);
+    // the ticket holds the cluster lock and commits the entry to outoff once it completes successfully
+    // ext is nullptr without extended l2
+    void do_lock_tx(
+        xcow_ticket *ticket,
+        uint64_t vblk,
+        xcow::XlateLeaf *entry,
+        xcow::XlateExt *ext,
+        uint64_t outoff,
+        const xcow::XlateExt &newext = xcow::XlateBits::full_ext);
+    // allocates a cluster that the ticket's write will fill entirely
+    uint64_t do_alloc_full_tx(xcow_ticket *ticket, uint64_t vblk, xcow::XlateLeaf *entry, xcow::XlateExt *ext);
+    // writes one cluster of a multi-cluster command, the ticket count must already include it
+    nm_outcome do_write_part(
+        iovecs_ticket<xcow_ticket> *ticket,
+        const std::vector<iovec> &iovecs,
+        uint64_t addr,
+        size_t nbytes,
+        int flags);
+    // zeroes nbytes at addr within one cluster, the ticket count must already include it
+    // with deallocate, clusters zeroed entirely go back to being unallocated instead of becoming zero leaves
+    nm_outcome do_write_zeroes_part(xcow_ticket *ticket, uint64_t addr, size_t nbytes, bool deallocate);
     nm_outcome do_write_one(
         xcow_ticket *ticket,
         const std::vector<iovec> &iovecs,
@@ -120,8 +261,65 @@ private:
         uint64_t off,
         int flags);
 
+    // offloads a copy within the data file to the helper thread of _copy
+    // what is queued next must be linked to the returned read, which holds it back until the copy is done and cuts
+    // the chain if the copy failed
+    io_uring_sqe *queue_copy(xcow_ticket *ticket, off_t inoff, off_t outoff, size_t nbytes);
     using cow_ticket_type = mem_ticket<xcow_ticket>;
     std::pair<cow_ticket_type *, io_uring_sqe *> do_cow(uint32_t tag, off_t inoff, off_t outoff, size_t nbytes);
+    // copies a snapshotted cluster with data written at byte offset off
+    // the copy is offloaded to the filesystem if possible, otherwise only the old data outside of
+    // [off, off + data size) is read and the new cluster is written with a single writev
+    using merged_cow_ticket_type = mem_ticket<iovec_ticket<xcow_ticket>, 4096>;
+    xcow_ticket *do_merged_cow(
+        uint32_t tag,
+        uint64_t vblk,
+        xcow::XlateLeaf *entry,
+        size_t off,
+        std::span<const iovec> data,
+        int flags);
+
+    // the cluster has never been written, so the guest sees the backing image there
+    constexpr bool from_backing(xcow::XlateLeaf tl) {
+        return _backing && xcow::XlateBits::is_unallocated(tl);
+    }
+    // reads nbytes at addr from the backing image
+    void do_read_backing(iovecs_ticket<xcow_ticket> *ticket, uint64_t addr, size_t nbytes, nvme_cmd_lba_iter &lit);
+    // copies the cluster at addr from the backing image to outoff
+    cow_ticket_type *do_copy_up(uint32_t tag, uint64_t addr, uint64_t outoff);
+
+    // extended l2: host address of subcluster i as seen by the guest, UINT64_MAX if it reads as zeroes
+    uint64_t subcluster_source(xcow::XlateLeaf tl, const xcow::XlateExt &ext, size_t i);
+    // reads nbytes at byte offset off of a cluster whose subclusters are spread out
+    void do_read_sub(
+        iovecs_ticket<xcow_ticket> *ticket,
+        xcow::XlateLeaf tl,
+        const xcow::XlateExt &ext,
+        size_t off,
+        size_t nbytes,
+        nvme_cmd_lba_iter &lit);
+    // writes data at byte offset off into a cluster that isn't fully allocated, or into a new cluster taking over
+    // the old one's subclusters; only the partially written subclusters at both ends are filled in
+    xcow_ticket *do_write_sub(
+        uint32_t tag,
+        uint64_t vblk,
+        xcow::XlateLeaf *entry,
+        xcow::XlateExt *ext,
+        size_t off,
+        std::span<const iovec> data,
+        int flags);
+
+    // some cluster of [addr, addr + nbytes) is locked by a transaction
+    bool clusters_busy(uint64_t addr, uint64_t nbytes);
+    // the leaf of the first cluster if the clusters of [addr, addr + nbytes) lie back to back in the data file with
+    // the same flags, so that a command spanning them can be forwarded as a whole
+    std::optional<xcow::XlateLeaf> contiguous_leaf(uint64_t addr, uint64_t nbytes, bool write);
+    // a new data cluster for vblk, right after the one of the previous cluster if possible
+    uint64_t alloc_cluster(uint64_t vblk);
+    // a new data cluster for vblk that already reads as zeroes, if the pool has one
+    std::optional<uint64_t> take_zeroed_cluster(uint64_t vblk);
+    // reopens the writable snapshot if another worker took a snapshot since we last looked
+    void refresh_snap();
 
     constexpr size_t cluster_size() {
         return _snap.file().cluster_size();
@@ -129,11 +327,52 @@ private:
     constexpr size_t cluster_bits() {
         return _snap.file().cluster_bits();
     }
+    constexpr size_t subcluster_bits() {
+        return _snap.file().subcluster_bits();
+    }
+    constexpr size_t subcluster_size() {
+        return size_t(1) << subcluster_bits();
+    }
 
-    std::array<int, 1> _bfd;
+    // the data file, then the files of the backing image
+    std::vector<int> _bfd;
     xcow::XcowFile *_file;
     xcow::XcowSnap _snap;
     uring _ring;
-    std::vector<bool> *_clock;
-    workqueue_type *_wq;
+    // copies block their thread, so they run outside of the worker and meta_lock
+    std::unique_ptr<xcow::CopyOffload> _copy;
+    // whatever the reads of copy completion sockets return
+    unsigned char _copy_done = 0;
+    std::unique_ptr<unsigned char[], cow_ticket_type::deleter> _zeroes;
+    xcow_locks *_locks;
+
+    // tracks the metadata pages to write back on flush, unless there's a log
+    xcow::FileDeref *_deref;
+    xcow::MetaLog *_log;
+    xcow::BackingImage *_backing;
+    xcow_shards *_shards;
+    // keeps a budgeted part of the metadata in memory instead of mapping the map file, shared by the workers
+    xcow::CachedDeref *_cache;
+    uint64_t _snap_epoch = 0;
+    bool _log_busy = false;
+    std::vector<xcow_ticket *> _log_waiters;
+    // tags whose replies wait for the log
+    boost::unordered_set<uint32_t> _sync_tags;
+
+    xcow_stats _stats;
+    // the last cluster allocated and where it went, sequential writers continue from there
+    uint64_t _last_vblk = UINT64_MAX;
+    uint64_t _last_outoff = 0;
+    // l0 tables report_usage() counts at a time, each one is a cluster worth of leaves
+    static constexpr size_t count_tables_per_step = 32;
+
+    // the pool follows the allocation rate between these bounds
+    static constexpr size_t zero_pool_min = 16;
+    static constexpr size_t zero_pool_max = 1024;
+    // zeroed clusters ready to be handed out, parked on the free list until then
+    std::deque<uint64_t> _zero_pool;
+    // clusters of the refill in flight
+    size_t _zero_pending = 0;
+    size_t _zero_taken = 0;
+    size_t _zero_target = zero_pool_min;
 };
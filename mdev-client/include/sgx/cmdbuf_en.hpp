@@ -0,0 +1 @@
+../../../encryptor-sgx/Enclave/include/cmdbuf_en.hpp
\ No newline at end of file
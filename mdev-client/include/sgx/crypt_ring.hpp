@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "nvme_core.hpp"
+#include "cmdbuf_en.hpp"
+
+// Ring layout shared between the host and the enclave ring worker (crypt_ring_run).
+// The enclave consumes the notifyfd SQs directly, decrypts reads in place, encrypts writes into staging slots
+// handed out by the host and reports every command back through the completion ring.
+// All pointers refer to untrusted memory; the enclave copies the descriptor before use.
+
+constexpr size_t CRYPT_RING_MAX_SQ = 16;
+constexpr size_t CRYPT_RING_CQ_COUNT = 256;
+constexpr size_t CRYPT_RING_SLOT_COUNT = 1024;
+constexpr uint32_t CRYPT_RING_NO_SLOT = UINT32_MAX;
+
+struct crypt_completion {
+    struct nvme_command cmd;
+    // bytes processed or -errno
+    int64_t result;
+    uint32_t qi;
+    // staging slot holding the ciphertext of a write, CRYPT_RING_NO_SLOT otherwise
+    uint32_t slot;
+    uint8_t _rsvd[48];
+};
+static_assert(sizeof(crypt_completion) == 128, "crypt_completion must stay page-packable");
+
+struct crypt_ring_sq {
+    const struct nvme_command *cmdbuf;
+    const volatile int *head;
+    volatile int *tail;
+};
+
+struct crypt_ring {
+    unsigned char *pvm;
+    size_t pvm_size;
+
+    size_t nr_sq;
+    struct crypt_ring_sq sq[CRYPT_RING_MAX_SQ];
+
+    // enclave -> host
+    struct crypt_completion *cq;
+    volatile int *cq_head;
+    const volatile int *cq_tail;
+
+    // host -> enclave, indices of free staging slots
+    const uint32_t *slots;
+    const volatile int *slots_head;
+    volatile int *slots_tail;
+
+    unsigned char *staging;
+    size_t slot_size;
+    size_t nr_slots;
+
+    // set by the host to make crypt_ring_run return
+    volatile int stop;
+};
+
+template <cmdbuf_en_direction direction>
+using crypt_cqbuf_t = cmdbuf_en<struct crypt_completion, CRYPT_RING_CQ_COUNT, direction>;
+
+template <cmdbuf_en_direction direction>
+using crypt_slotbuf_t = cmdbuf_en<uint32_t, CRYPT_RING_SLOT_COUNT, direction>;
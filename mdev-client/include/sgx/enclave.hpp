@@ -27,7 +27,8 @@ public:
 
 class sgx_enclave {
 public:
-    explicit sgx_enclave(const std::string &filename, bool debug);
+    // nthreads: number of host threads expected to call into the enclave concurrently, sizes the switchless pool
+    explicit sgx_enclave(const std::string &filename, bool debug, unsigned int nthreads = 1);
     sgx_enclave(const sgx_enclave &) = delete;
     sgx_enclave &operator=(const sgx_enclave &) = delete;
     sgx_enclave(sgx_enclave &&);
@@ -1,16 +1,38 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <memory>
+#include <span>
 #include <stdexcept>
+#include <utility>
 
 #include "Enclave_u.h"
 #include "sgx/enclave.hpp"
 #include "sgx/Enclave_u.h"
+#include "sgx/crypt_ring.hpp"
 
 #include <sgx_error.h>
 
+// TCSNum of Enclave.config.xml, the enclave can't be entered by more threads than this at once
+constexpr unsigned int ENCLAVE_TCS_NUM = 48;
+
+static inline std::shared_ptr<sgx_enclave> make_keyed_enclave(
+    const std::string &filename,
+    bool debug,
+    std::array<unsigned char, 32> key,
+    int lba_shift,
+    unsigned int nthreads = 1) {
+    auto e = std::make_shared<sgx_enclave>(filename, debug, nthreads);
+    if (e->invoke(::put_key, key.data(), lba_shift) < 0) {
+        throw std::runtime_error("sgx put_key failed");
+    }
+    return e;
+}
+
 class prp_en {
 public:
+    // private enclave
     explicit prp_en(
         const std::string &filename,
         bool debug,
@@ -18,18 +40,19 @@ public:
         size_t pvm_size,
         std::array<unsigned char, 32> key,
         int lba_shift)
-        : _e(filename, debug), _pvm(pvm), _pvm_size(pvm_size) {
-        if (_e.invoke(::put_key, key.data(), lba_shift) < 0) {
-            throw std::runtime_error("sgx put_key failed");
-        }
+        : prp_en(make_keyed_enclave(filename, debug, key, lba_shift), pvm, pvm_size) {
+    }
+    // shared enclave, see prp_en_pool
+    explicit prp_en(std::shared_ptr<sgx_enclave> e, unsigned char *pvm, size_t pvm_size)
+        : _e(std::move(e)), _pvm(pvm), _pvm_size(pvm_size) {
     }
 
     inline long crypt_buffer_inplace(size_t slba, unsigned char *buf, size_t nr_blocks, int decrypt) {
-        return _e.invoke(::crypt_buffer_inplace, slba, buf, nr_blocks, decrypt);
+        return _e->invoke(::crypt_buffer_inplace, slba, buf, nr_blocks, decrypt);
     }
 
     inline long crypt_command_inplace(const struct nvme_command *cmd, int decrypt) {
-        return _e.invoke(
+        return _e->invoke(
             ::crypt_command_inplace,
             _pvm,
             _pvm_size,
@@ -38,7 +61,7 @@ public:
     }
 
     inline long crypt_command(const struct nvme_command *cmd, unsigned char *outbuf, size_t outbuf_size, int decrypt) {
-        return _e.invoke(
+        return _e->invoke(
             ::crypt_command,
             _pvm,
             _pvm_size,
@@ -48,8 +71,61 @@ public:
             decrypt);
     }
 
+    // one enclave transition for the whole batch, per-command results are returned in descs
+    inline long crypt_commands(std::span<const struct nvme_command> cmds, std::span<crypt_desc> descs) {
+        if (cmds.size() != descs.size()) {
+            throw std::invalid_argument("crypt_commands size mismatch");
+        }
+        return _e->invoke(
+            ::crypt_commands,
+            _pvm,
+            _pvm_size,
+            reinterpret_cast<const nvme_command_alias *>(cmds.data()),
+            descs.data(),
+            cmds.size());
+    }
+
+    // does not return until ring->stop is set
+    inline long crypt_ring_run(struct crypt_ring *ring) {
+        return _e->invoke(::crypt_ring_run, static_cast<void *>(ring));
+    }
+
+    constexpr unsigned char *pvm() const {
+        return _pvm;
+    }
+    constexpr size_t pvm_size() const {
+        return _pvm_size;
+    }
+
 private:
-    sgx_enclave _e;
+    std::shared_ptr<sgx_enclave> _e;
     unsigned char *_pvm;
     size_t _pvm_size;
 };
+
+// One enclave shared by several workers.
+// The enclave binds a TCS and a crypto engine to each calling host thread, so every worker thread that calls
+// through its own prp_en gets an independent entry point.
+class prp_en_pool {
+public:
+    explicit prp_en_pool(
+        const std::string &filename,
+        bool debug,
+        std::array<unsigned char, 32> key,
+        int lba_shift,
+        unsigned int nthreads)
+        : _e(make_keyed_enclave(filename, debug, key, lba_shift, nthreads)) {
+    }
+
+    // every worker and every switchless worker of the enclave holds a TCS, so does every ring worker
+    static constexpr size_t tcs_needed(size_t nthreads, size_t nring_threads) {
+        return 2 * std::max(nthreads, size_t{1}) + nring_threads;
+    }
+
+    inline prp_en get(unsigned char *pvm, size_t pvm_size) const {
+        return prp_en(_e, pvm, pvm_size);
+    }
+
+private:
+    std::shared_ptr<sgx_enclave> _e;
+};
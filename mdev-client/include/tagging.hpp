@@ -28,6 +28,9 @@ static constexpr uint16_t qi_admin = 0xfffe;
 // use an obviously invalid QID=0xffff
 static constexpr uint32_t busy_tag = make_tag(qi_invalid, 0xffff);
 static constexpr uint32_t noop_tag = make_tag(qi_invalid, 0xfffe);
+static constexpr uint32_t merged_tag = make_tag(qi_invalid, 0xfffd);
+static constexpr uint32_t remote_tag = make_tag(qi_invalid, 0xfffc);
+static constexpr uint32_t bitmap_tag = make_tag(qi_invalid, 0xfffb);
 
 static constexpr std::pair<uint16_t, uint16_t> unmake_tag(uint32_t tag) {
     return std::make_pair(tag >> 16, tag & 0xffff);
@@ -109,3 +112,31 @@ struct iovecs_ticket : public Family {
     }
     std::vector<std::vector<iovec>> iovecss;
 };
+
+// a single backend request completing several guest commands
+// members are owned by the merged ticket
+struct merged_ticket final : public sq_ticket {
+    merged_ticket() : sq_ticket(merged_tag) {
+    }
+    merged_ticket(const merged_ticket &) = delete;
+    merged_ticket &operator=(const merged_ticket &) = delete;
+    ~merged_ticket() {
+        for (auto m : members) {
+            delete m;
+        }
+    }
+    std::vector<sq_ticket *> members;
+    std::vector<iovec> iovecs;
+};
+
+// calls fn(tag) for each guest command completed by ticket t
+template <typename F>
+static inline void for_each_tag(sq_ticket *t, F &&fn) {
+    if (t->tag == merged_tag) {
+        for (auto m : static_cast<merged_ticket *>(t)->members) {
+            fn(m->tag);
+        }
+    } else {
+        fn(t->tag);
+    }
+}
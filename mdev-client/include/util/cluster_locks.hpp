@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <time.h>
+
+#include "util.hpp"
+#include "util/replica.hpp"
+#include "util/time.hpp"
+
+template <typename Signature, size_t inline_size = 128>
+class cluster_locks;
+
+// Exclusive locks on clusters, each with a FIFO queue of the work waiting for it.
+// Waiters are pooled and keep their continuation inline, so queueing doesn't allocate once the pool is warm.
+template <typename R, typename... Args, size_t inline_size>
+class cluster_locks<R(Args...), inline_size> {
+public:
+    struct stats_type {
+        uint64_t locked = 0;
+        // continuations queued because someone else held the cluster
+        uint64_t contended = 0;
+        uint64_t max_queue = 0;
+        // from queueing a contended continuation to running it
+        latency_histogram wait_latency;
+    };
+
+    cluster_locks() = default;
+    cluster_locks(const cluster_locks &) = delete;
+    cluster_locks &operator=(const cluster_locks &) = delete;
+    cluster_locks(cluster_locks &&) = default;
+    cluster_locks &operator=(cluster_locks &&) = default;
+    ~cluster_locks() {
+        for (auto &q : _queues)
+            while (auto w = pop_front(q))
+                release(w);
+    }
+
+    void resize(uint64_t nclusters) {
+        _held.resize((nclusters + 63) / 64);
+    }
+
+    inline bool held(uint64_t vblk) const {
+        return _held[vblk / 64] & (uint64_t{1} << (vblk % 64));
+    }
+
+    inline void lock(uint64_t vblk) {
+        assert(!held(vblk));
+        _held[vblk / 64] |= uint64_t{1} << (vblk % 64);
+        _stats.locked++;
+    }
+
+    // some cluster of [first, last) is held
+    bool busy(uint64_t first, uint64_t last) const {
+        last = std::min<uint64_t>(last, _held.size() * 64);
+        if (first >= last)
+            return false;
+        auto fw = first / 64, lw = (last - 1) / 64;
+        auto fmask = ~uint64_t{0} << (first % 64);
+        auto lmask = ~uint64_t{0} >> (63 - (last - 1) % 64);
+        if (fw == lw)
+            return _held[fw] & fmask & lmask;
+        if (_held[fw] & fmask || _held[lw] & lmask)
+            return true;
+        return std::any_of(_held.begin() + fw + 1, _held.begin() + lw, [](uint64_t w) { return w != 0; });
+    }
+
+    // runs f once the cluster is released, after what's queued already; vblk is held by someone else
+    template <typename F>
+    void wait(uint64_t vblk, F &&f) {
+        auto w = enqueue(vblk, std::forward<F>(f));
+        _stats.contended++;
+        clock_gettime(CLOCK_MONOTONIC, &w->queued);
+    }
+
+    // runs f once the transaction holding the cluster, which is ours, releases it
+    template <typename F>
+    void then(uint64_t vblk, F &&f) {
+        enqueue(vblk, std::forward<F>(f));
+    }
+
+    // releases the cluster and runs the queued continuations in order until one of them takes the cluster again
+    // sink receives what each continuation returned
+    template <typename Sink>
+    void unlock(uint64_t vblk, Args... args, Sink &&sink) {
+        assert(held(vblk));
+        _held[vblk / 64] &= ~(uint64_t{1} << (vblk % 64));
+        while (!held(vblk)) {
+            auto q = find(vblk);
+            if (!q)
+                break;
+            auto w = pop_front(*q);
+            if (!q->head)
+                erase(vblk);
+            if (w->queued.tv_sec || w->queued.tv_nsec) {
+                timespec now{};
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                _stats.wait_latency.record(now - w->queued);
+            }
+            auto cleaner = cleanup([&] { release(w); });
+            sink(w->invoke(w, args...));
+        }
+    }
+
+    inline const stats_type &stats() const {
+        return _stats;
+    }
+
+private:
+    struct waiter {
+        waiter *next;
+        R (*invoke)(waiter *, Args...);
+        void (*destroy)(waiter *);
+        timespec queued;
+        alignas(std::max_align_t) unsigned char storage[inline_size];
+    };
+
+    struct queue {
+        uint64_t vblk = UINT64_MAX;
+        waiter *head = nullptr;
+        waiter *tail = nullptr;
+        size_t length = 0;
+    };
+
+    static constexpr size_t chunk_waiters = 64;
+
+    template <typename F>
+    waiter *enqueue(uint64_t vblk, F &&f) {
+        using Fn = std::decay_t<F>;
+        static_assert(sizeof(Fn) <= inline_size, "continuation too large for a pooled waiter");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t));
+
+        auto w = acquire();
+        new (w->storage) Fn(std::forward<F>(f));
+        w->invoke = [](waiter *self, Args... args) -> R {
+            return (*std::launder(reinterpret_cast<Fn *>(self->storage)))(args...);
+        };
+        w->destroy = [](waiter *self) { std::launder(reinterpret_cast<Fn *>(self->storage))->~Fn(); };
+        w->queued = timespec{};
+
+        auto &q = find_or_insert(vblk);
+        if (q.tail)
+            q.tail->next = w;
+        else
+            q.head = w;
+        q.tail = w;
+        _stats.max_queue = std::max<uint64_t>(_stats.max_queue, ++q.length);
+        return w;
+    }
+
+    static waiter *pop_front(queue &q) {
+        auto w = q.head;
+        if (w) {
+            q.head = w->next;
+            if (!q.head)
+                q.tail = nullptr;
+            q.length--;
+        }
+        return w;
+    }
+
+    waiter *acquire() {
+        if (!_free) {
+            auto &chunk = _chunks.emplace_back(std::make_unique<waiter[]>(chunk_waiters));
+            for (size_t i = 0; i < chunk_waiters; i++) {
+                chunk[i].next = _free;
+                _free = &chunk[i];
+            }
+        }
+        auto w = _free;
+        _free = w->next;
+        w->next = nullptr;
+        return w;
+    }
+
+    void release(waiter *w) {
+        w->destroy(w);
+        w->next = _free;
+        _free = w;
+    }
+
+    // only contended clusters have a queue, they live in a small open addressing table
+    inline size_t slot_of(uint64_t vblk) const {
+        return (vblk * 0x9e37'79b9'7f4a'7c15ull >> 32) & (_queues.size() - 1);
+    }
+
+    queue *find(uint64_t vblk) {
+        if (_queues.empty())
+            return nullptr;
+        for (auto i = slot_of(vblk);; i = (i + 1) & (_queues.size() - 1)) {
+            if (_queues[i].vblk == vblk)
+                return &_queues[i];
+            else if (_queues[i].vblk == UINT64_MAX)
+                return nullptr;
+        }
+    }
+
+    queue &find_or_insert(uint64_t vblk) {
+        if (auto q = find(vblk))
+            return *q;
+        if ((_nqueues + 1) * 2 > _queues.size())
+            rehash(std::max<size_t>(_queues.size() * 2, 64));
+        auto i = slot_of(vblk);
+        while (_queues[i].vblk != UINT64_MAX)
+            i = (i + 1) & (_queues.size() - 1);
+        _queues[i].vblk = vblk;
+        _nqueues++;
+        return _queues[i];
+    }
+
+    void erase(uint64_t vblk) {
+        auto i = slot_of(vblk);
+        while (_queues[i].vblk != vblk)
+            i = (i + 1) & (_queues.size() - 1);
+        _queues[i] = queue{};
+        _nqueues--;
+        // shift the entries after it back so that lookups don't stop early
+        for (auto j = (i + 1) & (_queues.size() - 1); _queues[j].vblk != UINT64_MAX;
+             j = (j + 1) & (_queues.size() - 1)) {
+            auto home = slot_of(_queues[j].vblk);
+            if (((j - home) & (_queues.size() - 1)) >= ((j - i) & (_queues.size() - 1))) {
+                _queues[i] = _queues[j];
+                _queues[j] = queue{};
+                i = j;
+            }
+        }
+    }
+
+    void rehash(size_t size) {
+        auto old = std::exchange(_queues, std::vector<queue>(size));
+        for (auto &q : old) {
+            if (q.vblk == UINT64_MAX)
+                continue;
+            auto i = slot_of(q.vblk);
+            while (_queues[i].vblk != UINT64_MAX)
+                i = (i + 1) & (_queues.size() - 1);
+            _queues[i] = q;
+        }
+    }
+
+    std::vector<uint64_t> _held;
+    std::vector<queue> _queues;
+    size_t _nqueues = 0;
+    std::vector<std::unique_ptr<waiter[]>> _chunks;
+    waiter *_free = nullptr;
+    stats_type _stats;
+};
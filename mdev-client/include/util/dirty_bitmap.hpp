@@ -0,0 +1,141 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sys/types.h>
+
+#include "nvme_core.hpp"
+
+// Persistent write-intent bitmap for the replicator, one bit per 2^region_shift bytes of the volume.
+// A bit is set before a write to its region is submitted, and the write is held back until a sync of the file covers
+// the bit; the caller issues those syncs through its own ring, one per batch of writes. It is cleared
+// lazily by clean() once the region has had no writes in flight for a whole clean period, so hot regions do not
+// pay for a sync on every write. Regions whose write failed on some replica stay set ("sticky") until resync()
+// has copied them; after a restart every set bit is treated as sticky. Failures are recorded the same way: the call
+// returns a mark, and whatever depends on the failure being on disk waits for a sync that covers it.
+// All methods may be called concurrently from worker threads and the resync thread.
+class dirty_bitmap {
+public:
+    static constexpr uint64_t magic = 0x50414d5954524944; // "DIRTYMAP"
+    static constexpr uint32_t version = 1;
+    static constexpr uint32_t max_replicas = 32;
+
+    // creates the file if needed; an existing file must match dev_size, region_shift and nreplicas
+    explicit dirty_bitmap(const char *path, uint64_t dev_size, unsigned int region_shift, unsigned int nreplicas);
+    dirty_bitmap(const dirty_bitmap &) = delete;
+    dirty_bitmap &operator=(const dirty_bitmap &) = delete;
+    dirty_bitmap(dirty_bitmap &&) = delete;
+    dirty_bitmap &operator=(dirty_bitmap &&) = delete;
+    ~dirty_bitmap();
+
+    inline uint64_t region_size() const {
+        return uint64_t{1} << _region_shift;
+    }
+    inline uint64_t nr_regions() const {
+        return _nr_regions;
+    }
+    inline uint64_t dev_size() const {
+        return _dev_size;
+    }
+
+    inline int fd() const {
+        return _fd;
+    }
+
+    // guest write path
+    // returns the mark the write has to wait for, the write may go ahead once durable(mark)
+    uint64_t write_begin(off_t offset, size_t nbytes);
+    // nfailed: number of replicas on which the write failed, each previously reported through replica_failed
+    void write_end(off_t offset, size_t nbytes, unsigned int nfailed);
+    // the replica missed a write, called as soon as the replica completes
+    // returns the mark that makes the replica degraded on disk
+    uint64_t replica_failed(unsigned int replica);
+    // nothing is known about the state of the replicas anymore, e.g. after a failed flush
+    // returns the mark that makes every region dirty on disk
+    uint64_t mark_all(unsigned int nfailed);
+
+    inline bool durable(uint64_t mark) const {
+        return mark <= _durable.load(std::memory_order_seq_cst);
+    }
+    // a datasync of fd() issued after this call makes every mark up to the returned one durable
+    inline uint64_t sync_target() const {
+        return _marked.load(std::memory_order_seq_cst);
+    }
+    // the datasync issued after sync_target() returned target has completed
+    void synced(uint64_t target);
+
+    uint32_t degraded_mask() const;
+    // clears the degraded flags if no sticky region is left and no failure is still being settled
+    bool try_clear_degraded(uint32_t mask);
+
+    // finds the next sticky region at or after region, returns false if there is none
+    bool next_sticky(uint64_t &region) const;
+    size_t count_sticky() const;
+    // a region can be resynced only while no guest write to it is in flight
+    bool resync_begin(uint64_t region, uint32_t &gen) const;
+    // returns false if a guest write raced with the copy, in which case the region stays sticky
+    bool resync_end(uint64_t region, uint32_t gen);
+
+    // clears bits of regions that stayed quiet since the previous call, returns the number of bits cleared
+    size_t clean();
+
+private:
+    struct header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t region_shift;
+        uint64_t dev_size;
+        uint64_t nr_regions;
+        uint32_t nreplicas;
+        // replicas that missed writes since the last complete resync
+        uint32_t degraded;
+    };
+
+    inline uint64_t first_region(off_t offset) const {
+        return static_cast<uint64_t>(offset) >> _region_shift;
+    }
+    inline uint64_t last_region(off_t offset, size_t nbytes) const {
+        return (static_cast<uint64_t>(offset) + std::max(nbytes, size_t{1}) - 1) >> _region_shift;
+    }
+    static inline uint64_t bit(uint64_t region) {
+        return uint64_t{1} << (region % 64);
+    }
+    static constexpr size_t bits_per_page = NVME_PAGE_SIZE * 8;
+    // sets the bit, returns the mark that makes it durable
+    uint64_t mark(uint64_t region);
+    void sync_bits(uint64_t region);
+    void sync_header();
+
+    int _fd;
+    unsigned char *_map;
+    size_t _map_size;
+    header *_hdr;
+    // shared with the file, accessed with atomic builtins
+    uint64_t *_bits;
+    unsigned int _region_shift;
+    uint64_t _dev_size;
+    uint64_t _nr_regions;
+
+    // in-memory state, rebuilt on open
+    std::unique_ptr<std::atomic<uint64_t>[]> _sticky;
+    std::unique_ptr<std::atomic<uint16_t>[]> _inflight;
+    // bumped on every write to the region
+    std::unique_ptr<std::atomic<uint32_t>[]> _gen;
+    // generation seen by the previous clean pass, only touched by clean()
+    std::unique_ptr<uint32_t[]> _clean_gen;
+    // failures reported by replica_failed whose region is not sticky yet
+    std::atomic<uint64_t> _unsettled = 0;
+    // serializes 0->1 transitions, so that marks are published in order
+    std::mutex _mark_lock;
+    // latest mark of each page of bits, a write finding its bit already set waits for it too
+    std::unique_ptr<std::atomic<uint64_t>[]> _page_mark;
+    // mark of the latest degraded flag set
+    std::atomic<uint64_t> _header_mark = 0;
+    // latest mark whose bit is set, and latest mark known to be on disk
+    std::atomic<uint64_t> _marked = 0;
+    std::atomic<uint64_t> _durable = 0;
+};
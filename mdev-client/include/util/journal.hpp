@@ -0,0 +1,156 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "nvme_core.hpp"
+
+// On-disk record header, one block in front of the record data.
+struct journal_record {
+    enum class kind : uint32_t { write = 1, write_zeroes = 2 };
+
+    uint64_t magic;
+    uint64_t seq;
+    // bumped on every open, stale records from before a crash never chain onto newer ones
+    uint32_t epoch;
+    kind k;
+    // target range on the volume
+    uint64_t offset;
+    uint64_t nbytes;
+    // journal space taken by the record, header included
+    uint64_t len;
+    // of the record data, replica_journal::checksum
+    uint64_t checksum;
+
+    // bytes of data following the header block
+    inline uint64_t ndata() const {
+        return k == kind::write ? nbytes : 0;
+    }
+};
+
+// Ring-buffer journal for asynchronous replication.
+// Guest writes are appended to a preallocated O_DIRECT | O_DSYNC file and acknowledged once every record before them
+// is durable too, so that the journal always holds a prefix of the acknowledged writes. A shipper thread streams the
+// durable records to the targets in batches, syncs the targets and only then releases journal space. Records left
+// unshipped by a crash are found again by scanning from the persisted head and shipped on startup.
+// When the unshipped data exceeds max_lag_bytes or its oldest record is older than max_lag_ms, reserve() fails and the
+// caller has to hold back the guest until the shipper catches up.
+class replica_journal {
+public:
+    static constexpr uint64_t magic = 0x4c4e524a4f50524e; // "NRPOJRNL"
+    static constexpr uint64_t record_magic = 0x4443524c4e524a4e; // "NJRNLRCD"
+    static constexpr uint32_t version = 2;
+    static constexpr size_t block_size = NVME_PAGE_SIZE;
+
+    // creates and preallocates the file if needed; max_lag_ms = 0 disables the time limit
+    explicit replica_journal(
+        const char *path,
+        uint64_t capacity,
+        std::span<const char *const> targets,
+        uint64_t max_lag_bytes,
+        unsigned int max_lag_ms,
+        size_t batch_bytes = 8 << 20);
+    replica_journal(const replica_journal &) = delete;
+    replica_journal &operator=(const replica_journal &) = delete;
+    replica_journal(replica_journal &&) = delete;
+    replica_journal &operator=(replica_journal &&) = delete;
+    ~replica_journal();
+
+    inline int fd() const {
+        return _fd;
+    }
+    // largest record payload the ring can take
+    inline uint64_t max_data() const {
+        return _ring_size - block_size;
+    }
+    // FNV-1a over 64-bit words, record data is always a multiple of the LBA size
+    static uint64_t checksum(std::span<const unsigned char> data);
+
+    // reserves journal space for a record carrying nbytes of data
+    // returns false if the lag limit is reached, in which case nothing is reserved
+    bool reserve(size_t nbytes, uint64_t &seq, off_t &file_offset, uint64_t &len);
+    // the record was written out; records become durable in sequence order
+    void written(uint64_t seq);
+    // every record with a lower sequence number is durable
+    inline uint64_t durable_seq() const {
+        return _durable_seq.load(std::memory_order_acquire);
+    }
+    inline uint32_t epoch() const {
+        return _epoch;
+    }
+
+    void print_stats(FILE *f, const char *prefix);
+
+private:
+    struct superblock {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t epoch;
+        uint64_t capacity;
+        // logical position and sequence number of the oldest unshipped record
+        uint64_t head_pos;
+        uint64_t head_seq;
+    };
+    struct entry {
+        uint64_t seq;
+        // logical position, the file offset is block_size + pos % ring size
+        uint64_t pos;
+        uint64_t len;
+        timespec time;
+        bool written;
+    };
+    struct block_deleter {
+        void operator()(unsigned char *p) const;
+    };
+    using block_ptr = std::unique_ptr<unsigned char, block_deleter>;
+    static block_ptr alloc_blocks(size_t nbytes);
+
+    inline off_t file_offset(uint64_t pos) const {
+        return static_cast<off_t>(block_size + pos % _ring_size);
+    }
+    void write_superblock(uint64_t head_pos, uint64_t head_seq);
+    // reads len bytes of records at pos into _buf, growing it as needed
+    bool read_records(uint64_t pos, uint64_t len);
+    void recover(const superblock &sb);
+    void run();
+    // batch must be durable and contiguous in sequence
+    bool ship(std::span<const entry> batch);
+    bool write_targets(std::span<const iovec> iov, uint64_t offset);
+    bool zero_targets(uint64_t offset, uint64_t nbytes);
+
+    int _fd = -1;
+    // the shipper's own descriptor, reads do not need O_DSYNC
+    int _rfd = -1;
+    std::vector<int> _targets;
+    uint64_t _ring_size;
+    uint32_t _epoch = 0;
+    uint64_t _max_lag_bytes;
+    unsigned int _max_lag_ms;
+    size_t _batch_bytes;
+    block_ptr _sbbuf;
+    block_ptr _buf;
+    size_t _buf_size;
+
+    std::mutex _lock;
+    // unshipped records in sequence order, guarded by _lock
+    std::deque<entry> _entries;
+    uint64_t _head = 0;
+    uint64_t _tail = 0;
+    uint64_t _next_seq = 0;
+    std::atomic<uint64_t> _durable_seq = 0;
+    std::atomic<uint64_t> _shipped_bytes = 0;
+
+    std::atomic<bool> _stop = false;
+    std::thread _thread;
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <set>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "nvme_core.hpp"
+#include "util.hpp"
+#include "tagging.hpp"
+#include "util/uring.hpp"
+
+// Replica wire protocol. Requests are a header followed by nbytes of payload for writes; several requests are packed
+// into one frame on the stream, there is no framing beyond the headers. Every request gets a response carrying its
+// seq, responses come back in completion order. All fields are little endian.
+static constexpr uint32_t remote_request_magic = 0x51525652; // "RVRQ"
+static constexpr uint32_t remote_response_magic = 0x53525652; // "RVRS"
+
+enum class remote_op : uint16_t { write = 1, write_zeroes = 2, flush = 3 };
+// the write must be durable when acknowledged
+static constexpr uint16_t remote_flag_fua = 1;
+
+struct remote_request {
+    uint32_t magic;
+    remote_op op;
+    uint16_t flags;
+    uint64_t seq;
+    uint64_t offset;
+    uint64_t nbytes;
+};
+
+struct remote_response {
+    uint32_t magic;
+    // 0 or -errno
+    int32_t status;
+    uint64_t seq;
+};
+
+// "unix:<path>" or "tcp:<host>:<port>"
+bool is_remote_spec(const char *spec);
+int remote_connect(const char *spec);
+int remote_listen(const char *spec);
+
+class remote_client;
+
+// send and receive operations of a remote_client
+struct remote_io_ticket final : public sq_ticket {
+    remote_io_ticket(remote_client *_client) : sq_ticket(remote_tag), client(_client) {
+    }
+    remote_client *client;
+};
+
+// Sender side of a remote replica, driven by the ring of the controller that owns it.
+// Requests are copied into registered frames as they are queued, so the guest buffers can be reused as soon as the
+// quorum has answered. At most one frame is on the wire at a time, the others keep filling up until it is sent.
+// Both sides move their buffers with READ_FIXED / WRITE_FIXED on the socket on purpose: io_uring runs them through the
+// socket's read_iter / write_iter, which is a plain recv / send with no flags that ignores the offset, and the
+// registered pages stay pinned instead of being mapped again for every frame. Transfers may come up short like any
+// send or recv, and a peer that went away raises SIGPIPE, so the process must ignore it.
+class remote_client {
+public:
+    static constexpr size_t nr_frames = 16;
+    static constexpr size_t frame_size = 1 << 20;
+    static constexpr size_t recv_size = 64 << 10;
+
+    // fid: fixed file index of the connected socket
+    explicit remote_client(int fid);
+    remote_client(const remote_client &) = delete;
+    remote_client &operator=(const remote_client &) = delete;
+    remote_client(remote_client &&) = delete;
+    remote_client &operator=(remote_client &&) = delete;
+    ~remote_client();
+
+    // buffers to register with the ring, base is the index of the first one
+    inline std::span<const iovec> buffers() const {
+        return _iovecs;
+    }
+    inline void set_buf_base(int base) {
+        _buf_base = base;
+    }
+    inline bool dead() const {
+        return _dead;
+    }
+
+    void queue_write(sq_ticket *t, off_t offset, std::span<const iovec> data, bool fua);
+    void queue_write_zeroes(sq_ticket *t, off_t offset, size_t nbytes);
+    void queue_flush(sq_ticket *t);
+    // puts pending frames on the wire and keeps a receive posted
+    void kick(uring &ring);
+
+    // handles a completion of one of our io tickets, calls fn(ticket, res) for each request that got its answer
+    template <typename F>
+    void complete(uring &ring, remote_io_ticket *io, int res, F &&fn) {
+        if (io == &_send_ticket) {
+            on_send(res);
+        } else {
+            on_recv(res);
+        }
+        drain(fn);
+        kick(ring);
+    }
+    // calls fn(ticket, res) for requests that failed without a completion, e.g. after the connection went down
+    template <typename F>
+    void drain(F &&fn) {
+        auto done = std::move(_done);
+        _done.clear();
+        for (auto [t, res] : done) {
+            fn(t, res);
+        }
+    }
+
+private:
+    struct frame {
+        unsigned char *mem;
+        size_t size;
+        size_t used = 0;
+        size_t sent = 0;
+        // registered frame index, -1 for frames allocated when all registered frames were busy
+        int index;
+        std::unique_ptr<unsigned char[]> heap;
+        bool submitted = false;
+    };
+
+    void append(sq_ticket *t, remote_request req, std::span<const iovec> data);
+    void on_send(int res);
+    void on_recv(int res);
+    void fail_all(int err);
+
+    int _fid;
+    int _buf_base = 0;
+    unsigned char *_mem;
+    size_t _mem_size;
+    std::vector<iovec> _iovecs;
+    std::vector<int> _free_frames;
+    // front is the frame on the wire, back is the one being filled
+    std::deque<frame> _frames;
+    remote_io_ticket _send_ticket;
+    remote_io_ticket _recv_ticket;
+    bool _sending = false;
+    bool _receiving = false;
+    size_t _recv_used = 0;
+    bool _dead = false;
+    uint64_t _next_seq = 0;
+    std::unordered_map<uint64_t, sq_ticket *> _inflight;
+    std::vector<std::pair<sq_ticket *, int>> _done;
+};
+
+// Receiver side, serves one connection until the peer closes it.
+// Writes are submitted as soon as they are parsed and answered as they complete. A flush is only issued once every
+// write received before it has completed.
+class remote_receiver {
+public:
+    static constexpr size_t recv_size = 8 << 20;
+    static constexpr size_t send_size = 64 << 10;
+    static constexpr size_t max_inflight = 1024;
+
+    explicit remote_receiver(int sock, int bfd);
+    remote_receiver(const remote_receiver &) = delete;
+    remote_receiver &operator=(const remote_receiver &) = delete;
+    remote_receiver(remote_receiver &&) = delete;
+    remote_receiver &operator=(remote_receiver &&) = delete;
+    ~remote_receiver();
+
+    // returns when the connection is closed
+    void run();
+
+private:
+    struct request_ticket;
+
+    void parse();
+    void issue_flushes();
+    void respond(uint64_t seq, int status);
+    void kick();
+
+    std::array<int, 2> _fds;
+    size_t _mem_size;
+    unsigned char *_mem;
+    std::array<iovec, 2> _iovecs;
+    uring _ring;
+    sq_ticket _recv_ticket;
+    sq_ticket _send_ticket;
+    // unparsed requests are [_recv_start, _recv_used)
+    size_t _recv_start = 0;
+    size_t _recv_used = 0;
+    size_t _send_used = 0;
+    size_t _send_inflight = 0;
+    bool _receiving = false;
+    // no more requests will be read
+    bool _closed = false;
+    // no more responses can be sent
+    bool _broken = false;
+    size_t _inflight = 0;
+    // ordinals of writes being executed, and flushes waiting for the writes before them
+    uint64_t _next_write = 0;
+    std::set<uint64_t> _writes;
+    std::deque<std::pair<uint64_t, request_ticket *>> _flushes;
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mimalloc.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "nvme_core.hpp"
+#include "util.hpp"
+#include "tagging.hpp"
+
+// log2 buckets of microseconds, bucket i counts latencies in [2^(i-1), 2^i) us
+struct latency_histogram {
+    static constexpr size_t nr_buckets = 24;
+
+    inline void record(long ns) {
+        auto us = static_cast<uint64_t>(std::max(ns, 0l)) / 1000;
+        buckets[std::min(static_cast<size_t>(std::bit_width(us)), nr_buckets - 1)]++;
+        count++;
+    }
+    // upper bound in us of the bucket holding the given quantile
+    uint64_t percentile_us(unsigned int permille) const;
+
+    std::array<uint64_t, nr_buckets> buckets{};
+    uint64_t count = 0;
+};
+
+// byte ranges of a replica that missed writes, coalesced on insertion
+class extent_set {
+public:
+    void insert(off_t offset, size_t nbytes);
+    inline void insert_all() {
+        _all = true;
+    }
+    inline bool all() const {
+        return _all;
+    }
+    inline bool empty() const {
+        return !_all && _extents.empty();
+    }
+    inline size_t count() const {
+        return _extents.size();
+    }
+    inline void clear() {
+        _all = false;
+        _extents.clear();
+    }
+
+private:
+    bool _all = false;
+    // offset -> end
+    std::map<off_t, off_t> _extents;
+};
+
+struct replica_stats {
+    latency_histogram latency;
+    uint64_t completed = 0;
+    uint64_t failed = 0;
+    // completions that arrived after the guest command had already been answered by the quorum
+    uint64_t late = 0;
+    // regions that need resync before this replica is consistent again
+    extent_set stale;
+};
+
+// a guest command fanned out to every replica
+struct replica_op {
+    enum class kind { write, write_zeroes, flush };
+
+    replica_op(uint32_t _tag, kind _k, unsigned int nreplicas, off_t _offset, size_t _nbytes)
+        : tag(_tag), k(_k), pending(nreplicas), offset(_offset), nbytes(_nbytes) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    uint32_t tag;
+    kind k;
+    unsigned int pending;
+    unsigned int acked = 0;
+    unsigned int failed = 0;
+    // flushes that succeeded on a replica which had missed earlier writes, they count as failures for the quorum
+    unsigned int unsynced = 0;
+    // the guest has been answered
+    bool answered = false;
+    // dirty bitmap mark that records the failures so far, the reply waits for it
+    uint64_t fail_mark = 0;
+    off_t offset;
+    size_t nbytes;
+    timespec start;
+    // private copy of the payload for replicas that may still be reading it after the guest got its completion
+    std::unique_ptr<unsigned char, decltype(&mi_free)> bounce{nullptr, &mi_free};
+};
+
+// the part of a replica_op submitted to a single replica
+// the last replica_ticket of an op to complete deletes the op
+struct replica_ticket final : public iovec_ticket<sq_ticket> {
+    replica_ticket(replica_op *_op, unsigned int _replica) : iovec_ticket<sq_ticket>(_op->tag), op(_op), replica(_replica) {
+    }
+    replica_ticket(const replica_ticket &) = delete;
+    replica_ticket &operator=(const replica_ticket &) = delete;
+    replica_op *op;
+    unsigned int replica;
+    // writes: submission order; flushes: only writes ordered before this cover the flush
+    uint64_t seq = 0;
+};
+
+void print_replica_stats(FILE *f, const char *prefix, unsigned int replica, const replica_stats &st);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "util/dirty_bitmap.hpp"
+
+// Background copy of sticky regions from a healthy replica to all others, rate limited to bytes_per_sec.
+// Uses its own O_DIRECT descriptors so it never competes with the workers' rings.
+class resync_engine {
+public:
+    // paths must be in the same order as the replicas of the controllers sharing bitmap
+    explicit resync_engine(
+        std::shared_ptr<dirty_bitmap> bitmap,
+        std::span<const char *const> paths,
+        uint64_t bytes_per_sec,
+        unsigned int clean_interval_ms = 5000);
+    resync_engine(const resync_engine &) = delete;
+    resync_engine &operator=(const resync_engine &) = delete;
+    resync_engine(resync_engine &&) = delete;
+    resync_engine &operator=(resync_engine &&) = delete;
+    ~resync_engine();
+
+    inline uint64_t bytes_copied() const {
+        return _copied.load(std::memory_order_relaxed);
+    }
+
+private:
+    void run();
+    bool copy_region(uint64_t region, unsigned int source);
+    void throttle(size_t nbytes);
+
+    std::shared_ptr<dirty_bitmap> _bitmap;
+    std::vector<int> _fds;
+    uint64_t _bytes_per_sec;
+    unsigned int _clean_interval_ms;
+    struct buffer_deleter {
+        void operator()(unsigned char *p) const;
+    };
+    std::unique_ptr<unsigned char, buffer_deleter> _buf;
+    // token bucket state
+    timespec _window_start{};
+    uint64_t _window_bytes = 0;
+    std::atomic<uint64_t> _copied = 0;
+    std::atomic<bool> _stop = false;
+    std::thread _thread;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <optional>
+
+// Bounded lock-free queue between exactly one producer thread and one consumer thread.
+template <typename T, size_t count>
+class spsc_ring {
+    static_assert(std::has_single_bit(count));
+
+public:
+    spsc_ring() = default;
+    spsc_ring(const spsc_ring &) = delete;
+    spsc_ring &operator=(const spsc_ring &) = delete;
+    spsc_ring(spsc_ring &&) = delete;
+    spsc_ring &operator=(spsc_ring &&) = delete;
+    ~spsc_ring() = default;
+
+    // producer only, false if the ring is full
+    bool push(const T &v) {
+        auto head = _head.load(std::memory_order_relaxed);
+        if (head - _tail_cache == count) {
+            _tail_cache = _tail.load(std::memory_order_acquire);
+            if (head - _tail_cache == count)
+                return false;
+        }
+        _slots[head & (count - 1)] = v;
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer only
+    bool empty() const {
+        return _tail.load(std::memory_order_relaxed) == _head.load(std::memory_order_acquire);
+    }
+
+    // consumer only
+    std::optional<T> pop() {
+        auto tail = _tail.load(std::memory_order_relaxed);
+        if (tail == _head_cache) {
+            _head_cache = _head.load(std::memory_order_acquire);
+            if (tail == _head_cache)
+                return std::nullopt;
+        }
+        std::optional<T> ret(_slots[tail & (count - 1)]);
+        _tail.store(tail + 1, std::memory_order_release);
+        return ret;
+    }
+
+private:
+    std::array<T, count> _slots{};
+    // each side caches the other's index so that it only touches the other's cache line when it looks full/empty
+    alignas(64) std::atomic<size_t> _head = 0;
+    size_t _tail_cache = 0;
+    alignas(64) std::atomic<size_t> _tail = 0;
+    size_t _head_cache = 0;
+};
@@ -81,6 +81,10 @@ public:
     inline int sq_kick() {
         return io_uring_submit(_ring.get());
     }
+    // submits and blocks until at least wait_nr completions are ready
+    inline int sq_kick_wait(unsigned int wait_nr) {
+        return io_uring_submit_and_wait(_ring.get(), wait_nr);
+    }
 
     io_uring_sqe *queue_read(
         sq_ticket *ticket,
@@ -116,6 +120,15 @@ public:
         int flags = 0);
     io_uring_sqe *queue_fallocate(sq_ticket *ticket, bool fixed, int fid, int mode, off_t offset, off_t len);
     io_uring_sqe *queue_fsync(sq_ticket *ticket, bool fixed, int fid, unsigned int flags);
+    io_uring_sqe *queue_sync_file_range(
+        sq_ticket *ticket,
+        bool fixed,
+        int fid,
+        off_t offset,
+        unsigned int nbytes,
+        int flags);
+    // completes the ticket without doing any I/O, e.g. to keep a link chain when its work was done synchronously
+    io_uring_sqe *queue_nop(sq_ticket *ticket);
 
     cq_window cq_get_ready(const std::span<io_uring_cqe *> &cqebuf);
     std::span<sq_ticket *> cq_commit(cq_window &wnd, const std::span<sq_ticket *> &ticketbuf);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <span>
+
+#include <time.h>
+#include <sys/uio.h>
+
+#include "util/uring.hpp"
+
+// Coalesces writes to adjacent ranges of one backing file into a single vectored write.
+// Writes are staged into an open run; a write that starts where the run ends (and has the same RWF flags) is
+// appended to it regardless of which vSQ it came from. Each guest command keeps its own ticket and is completed
+// individually through merged_ticket/for_each_tag.
+// A run is held open across sq kicks only while the backend is busy, for at most window_us scaled by the
+// number of in-flight backend requests, so an idle backend never sees added latency.
+class write_merger {
+public:
+    static constexpr size_t max_merge_bytes = 1 << 20;
+    static constexpr size_t max_merge_iovecs = IOV_MAX;
+    // in-flight depth at which the full window is used
+    static constexpr size_t full_window_depth = 32;
+
+    // window_us == 0 disables merging
+    explicit write_merger(unsigned int window_us = 0) : _window_us(window_us) {
+    }
+    write_merger(const write_merger &) = delete;
+    write_merger &operator=(const write_merger &) = delete;
+    write_merger(write_merger &&) = default;
+    write_merger &operator=(write_merger &&) = default;
+    ~write_merger();
+
+    constexpr bool enabled() const {
+        return _window_us > 0;
+    }
+
+    // ticket->iovecs must stay valid until the ticket is completed
+    void queue_writev(uring &ring, iovec_ticket<sq_ticket> *ticket, bool fixed, int fid, off_t offset, int flags);
+    // buf must stay valid until the ticket is completed
+    void queue_write(
+        uring &ring,
+        sq_ticket *ticket,
+        const void *buf,
+        size_t nbytes,
+        bool fixed,
+        int fid,
+        off_t offset);
+
+    // submit the open run, if any
+    void flush(uring &ring);
+    // call before each sq kick; submits the open run unless it may still be held
+    void tick(uring &ring);
+    inline bool pending() const {
+        return !_run.members.empty();
+    }
+
+    // backend request accounting, used to size the window
+    inline void submitted(size_t count = 1) {
+        _inflight += count;
+    }
+    inline void completed(size_t count = 1) {
+        _inflight -= count;
+    }
+
+private:
+    struct run {
+        bool fixed;
+        int fid;
+        int flags;
+        off_t offset;
+        size_t nbytes;
+        timespec start;
+        // set when the first member owns its iovecs, so that a run of one can be submitted without copying
+        std::span<const iovec> first_iovecs;
+        std::vector<sq_ticket *> members;
+        std::vector<iovec> iovecs;
+    };
+
+    bool try_append(bool fixed, int fid, off_t offset, size_t nbytes, size_t niovecs, int flags) const;
+    void start(bool fixed, int fid, off_t offset, int flags);
+    long hold_ns() const;
+
+    unsigned int _window_us;
+    size_t _inflight = 0;
+    run _run{};
+};
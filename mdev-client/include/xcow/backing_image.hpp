@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "fildes.hpp"
+#include "xcow/xcowfmt.hpp"
+#include "xcow/file_deref.hpp"
+#include "xcow/xcow_file.hpp"
+#include "xcow/xcow_snap.hpp"
+
+namespace xcow {
+
+// Read-only view of the backing image of a file, following the whole chain of images below it.
+// The images are opened without O_DIRECT so that all files based on them share their page cache.
+class BackingImage {
+public:
+    // longest chain of images, mostly to catch loops
+    static constexpr size_t max_depth = 16;
+
+    // a run of the image that is stored contiguously
+    struct Extent {
+        // index into fds(), -1 if the run reads as zeroes
+        int fid;
+        uint64_t off;
+        size_t nbytes;
+    };
+
+    // opens the backing image of f, nullptr if it has none
+    static std::unique_ptr<BackingImage> open(const XcowFile &f);
+    explicit BackingImage(const XcowBacking &desc, size_t depth = 0);
+    BackingImage(const BackingImage &) = delete;
+    BackingImage &operator=(const BackingImage &) = delete;
+    BackingImage(BackingImage &&) = delete;
+    BackingImage &operator=(BackingImage &&) = delete;
+    ~BackingImage() = default;
+
+    // where the image has [addr, addr + nbytes), up to the first place where that changes
+    Extent locate(uint64_t addr, size_t nbytes) const;
+    // data files of the chain, the first one belongs to this image
+    inline const std::vector<int> &fds() const {
+        return _fds;
+    }
+
+private:
+    Extent locate_xcow(uint64_t addr, size_t nbytes) const;
+    Extent locate_next(uint64_t addr, size_t nbytes) const;
+
+    FileDescriptor _fd;
+    uint64_t _size = 0;
+    // xcow images only
+    FileDescriptor _mapfd;
+    std::unique_ptr<FileDeref> _deref;
+    std::unique_ptr<XcowFile> _file;
+    std::optional<XcowSnap> _snap;
+    std::unique_ptr<BackingImage> _next;
+    std::vector<int> _fds;
+};
+
+}; // namespace xcow
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+#include "xcow/deref.hpp"
+
+namespace xcow {
+
+// Metadata cache with an explicit memory budget, for map files too large to keep resident.
+// The file is laid out at its own offsets in a reserved anonymous region, so that deref() can hand out contiguous
+// spans across units; units are read in with O_DIRECT when they're first touched and dropped again by trim(). Only
+// trim() evicts, and it must be called when nothing holds memory returned by deref() other than pinned ranges.
+// Units are evicted in clock order (second chance), pinned and dirty ones stay.
+// deref(), prefetch(), pin() and unpin() may be called concurrently, everything else needs exclusive access. Units are
+// read without holding the lock, so a miss only waits for the reads of the units it needs.
+class CachedDeref : public xcow::Deref {
+public:
+    static constexpr size_t default_unit_size = 64 << 10;
+
+    struct stats_type {
+        // deref() calls that found every unit resident, or had to read some in
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t units_read = 0;
+        uint64_t evictions = 0;
+        uint64_t units_written = 0;
+        size_t resident = 0;
+        size_t pinned = 0;
+        size_t dirty = 0;
+    };
+
+    // budget is in bytes and rounded down to whole units, unit_size is a power of two of at least a page
+    CachedDeref(int fd, size_t budget, size_t unit_size = default_unit_size);
+    CachedDeref(const CachedDeref &) = delete;
+    CachedDeref &operator=(const CachedDeref &) = delete;
+    CachedDeref(CachedDeref &&) = delete;
+    CachedDeref &operator=(CachedDeref &&) = delete;
+    // writes back what's still dirty
+    ~CachedDeref() override;
+
+    // the descriptor that units are read from and written to, opened with O_DIRECT if the file supports it
+    inline int fd() const {
+        return _dfd >= 0 ? _dfd : _fd;
+    }
+    inline size_t size() const {
+        return _size;
+    }
+    inline size_t unit_size() const {
+        return size_t{1} << _unit_bits;
+    }
+    inline size_t budget() const {
+        return _budget << _unit_bits;
+    }
+    inline bool has_dirty() const {
+        return !_dirty.empty();
+    }
+    stats_type stats() const;
+
+    std::span<uint8_t> deref(uint64_t off, size_t nbytes) override;
+    // writes back the dirty units of the range and waits for them
+    void commit(uint64_t off, size_t nbytes) override;
+    void dirty(const void *p, size_t nbytes) override;
+    // reads in what's missing of the range, as long as it fits in the budget
+    void prefetch(uint64_t off, size_t nbytes) override;
+    void pin(const void *p, size_t nbytes) override;
+    void unpin(const void *p, size_t nbytes) override;
+
+    // evicts clean units until the cache fits in its budget again, returns how many
+    size_t trim();
+    // offsets of the units modified since the last call, in ascending order, for the caller to write back from deref()
+    // memory; they count as clean from now on, so trim() must wait for the writes as well
+    std::vector<uint64_t> take_dirty();
+    // units taken by take_dirty() that couldn't be written
+    void redirty(std::span<const uint64_t> units);
+
+private:
+    enum unit_state : uint8_t {
+        resident = 1,
+        // touched since the clock hand last went by
+        referenced = 2,
+        pinned = 4,
+        dirty_unit = 8,
+        // being read by some thread, the others wait for it
+        loading = 16,
+    };
+
+    // units [first, last]
+    void load(size_t first, size_t last);
+
+    int _fd;
+    int _dfd = -1;
+    uint8_t *_base = nullptr;
+    size_t _size = 0;
+    size_t _unit_bits;
+    size_t _budget;
+    std::unique_ptr<std::atomic<uint8_t>[]> _state;
+    // pins held on each unit, under _load_lock
+    std::unique_ptr<uint32_t[]> _pins;
+    size_t _nunits = 0;
+
+    // guards the unit states while units are read in and the pin counts, the rest is called with exclusive access
+    // anyway
+    std::mutex _load_lock;
+    std::condition_variable _loaded;
+    size_t _resident = 0;
+    size_t _pinned = 0;
+    size_t _hand = 0;
+    std::vector<uint64_t> _dirty;
+    std::atomic<uint64_t> _hits = 0;
+    std::atomic<uint64_t> _misses = 0;
+    uint64_t _units_read = 0;
+    uint64_t _evictions = 0;
+    uint64_t _units_written = 0;
+};
+
+} // namespace xcow
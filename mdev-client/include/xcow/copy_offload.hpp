@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <sys/types.h>
+
+#include "fildes.hpp"
+
+namespace xcow {
+
+// ordered from least to most efficient
+enum class CopyMethod {
+    // the caller copies the data itself
+    none,
+    // copy_file_range(), the kernel copies without a bounce buffer and may share extents on its own
+    copy_range,
+    // FICLONERANGE, the new cluster shares the old cluster's extents
+    reflink,
+};
+
+// Offloads cluster copies within the data file to the filesystem.
+// The best method is assumed at first and downgraded for good the first time the file refuses it.
+class CopyOffload {
+public:
+    explicit CopyOffload(int fd, CopyMethod max = CopyMethod::reflink);
+    CopyOffload(const CopyOffload &) = delete;
+    CopyOffload &operator=(const CopyOffload &) = delete;
+    ~CopyOffload();
+
+    CopyMethod method() const {
+        return _method.load(std::memory_order_relaxed);
+    }
+
+    // copies nbytes from inoff to outoff within the file
+    // returns false if the copy wasn't done, the caller then has to copy the data itself
+    bool copy(off_t inoff, off_t outoff, size_t nbytes);
+
+    // does the copy on a helper thread, reading the data itself if the filesystem won't
+    // returns a pipe that gets one byte once the copy is done, or none if it failed, so that a one byte read of it
+    // comes up short and cuts an io_uring link chain
+    FileDescriptor copy_async(off_t inoff, off_t outoff, size_t nbytes);
+
+private:
+    struct job {
+        off_t inoff;
+        off_t outoff;
+        size_t nbytes;
+        FileDescriptor done;
+    };
+
+    bool clone(off_t inoff, off_t outoff, size_t nbytes);
+    bool copy_range(off_t inoff, off_t outoff, size_t nbytes);
+    bool copy_bounce(off_t inoff, off_t outoff, size_t nbytes);
+    void run();
+
+    int _fd;
+    std::atomic<CopyMethod> _method;
+    std::mutex _lock;
+    std::condition_variable _cv;
+    std::deque<job> _jobs;
+    bool _stop = false;
+    // started with the first asynchronous copy
+    std::thread _helper;
+};
+
+// gives a range of the data file back to the filesystem or device, returns false if that isn't supported
+bool punch_hole(int fd, off_t off, size_t nbytes);
+
+}; // namespace xcow
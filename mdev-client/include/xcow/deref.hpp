@@ -23,8 +23,17 @@ struct Deref {
     }
     virtual void commit([[maybe_unused]] uint64_t off, [[maybe_unused]] size_t nbytes) {
     }
+    // records that memory returned by deref() was modified
+    virtual void dirty([[maybe_unused]] const void *p, [[maybe_unused]] size_t nbytes) {
+    }
     virtual void prefetch([[maybe_unused]] uint64_t off, [[maybe_unused]] size_t nbytes) {
     }
+    // memory returned by deref() that is kept around across calls, a cache must not evict it
+    virtual void pin([[maybe_unused]] const void *p, [[maybe_unused]] size_t nbytes) {
+    }
+    // undoes one pin() of the same range, pins of overlapping ranges are counted
+    virtual void unpin([[maybe_unused]] const void *p, [[maybe_unused]] size_t nbytes) {
+    }
 };
 
 } // namespace xcow
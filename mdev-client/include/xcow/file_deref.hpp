@@ -2,6 +2,7 @@
 
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <vector>
 #include "xcow/deref.hpp"
 #include "util.hpp"
 
@@ -9,15 +10,39 @@ namespace xcow {
 
 class FileDeref : public xcow::Deref {
 public:
-    explicit FileDeref(int fd, int prot = PROT_READ | PROT_WRITE);
+    // with MAP_PRIVATE, changes only reach the file when they're written back explicitly, see MetaLog
+    explicit FileDeref(int fd, int prot = PROT_READ | PROT_WRITE, int flags = MAP_SHARED);
+    inline int fd() const {
+        return _fd;
+    }
     constexpr std::span<uint8_t> deref(uint64_t off, size_t nbytes) override {
         return _p.subspan(off, nbytes);
     }
     void commit(uint64_t off, size_t nbytes) override;
     void prefetch(uint64_t off, size_t nbytes) override;
+    void dirty(const void *p, size_t nbytes) override;
+
+    // starts recording the pages passed to dirty()
+    void track_dirty();
+    // offsets of the pages modified since the last call, in the order they were first modified
+    std::vector<uint64_t> take_dirty();
+    inline bool has_dirty() const {
+        return !_dirty.empty();
+    }
+    // dirty() calls so far, to tell what tracking costs
+    inline uint64_t dirty_marks() const {
+        return _marks;
+    }
+    inline size_t tracked_pages() const {
+        return _dirty.size();
+    }
 
 private:
+    int _fd;
     std::span<uint8_t> _p;
+    uint64_t _marks = 0;
+    std::vector<bool> _dirty_bits;
+    std::vector<uint64_t> _dirty;
 };
 
 static cleanup file_lock(int fd, short type = F_WRLCK, short whence = SEEK_SET, off_t start = 0, off_t len = 0) {
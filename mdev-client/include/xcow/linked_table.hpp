@@ -78,6 +78,11 @@ public:
         return _entries;
     }
 
+    // push_back() and pop_back() change the header along with the entry
+    constexpr const LinkedTableMeta &meta() const {
+        return *_meta;
+    }
+
     constexpr const RefType &next_ref() const {
         return _meta->ref;
     }
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+#include <sys/types.h>
+
+#include "nvme_core.hpp"
+#include "xcow/file_deref.hpp"
+
+namespace xcow {
+
+// Write-ahead log of the metadata pages of a privately mapped map file.
+// The pages modified since the last record are gathered into one record and appended to an O_DIRECT | O_DSYNC log
+// file, so that a whole batch of metadata updates costs a single sequential write. The map file itself is only
+// written by checkpoints, which log whatever is still pending, copy the logged pages back and empty the log, so that
+// a checkpoint cut short is finished by the replay. Opening the log replays the records of the last run into the
+// map file, up to the last batch that made it to disk entirely.
+class MetaLog {
+public:
+    static constexpr uint64_t magic = 0x474f4c4d574f4358;        // "XCOWMLOG"
+    static constexpr uint64_t record_magic = 0x4443524d574f4358; // "XCOWMRCD"
+    static constexpr uint32_t version = 1;
+    static constexpr size_t block_size = NVME_PAGE_SIZE;
+    static constexpr uint64_t default_capacity = 64ull << 20;
+
+    // creates and preallocates the log if needed, then replays it into the map file and empties it
+    // the map file must not be mapped yet
+    MetaLog(const char *path, int mapfd, uint64_t capacity = default_capacity);
+    MetaLog(const MetaLog &) = delete;
+    MetaLog &operator=(const MetaLog &) = delete;
+    MetaLog(MetaLog &&) = delete;
+    MetaLog &operator=(MetaLog &&) = delete;
+    ~MetaLog();
+
+    // changes to the metadata are tracked through the private mapping of the map file
+    inline void attach(FileDeref *deref) {
+        _deref = deref;
+        _deref->track_dirty();
+    }
+    inline int fd() const {
+        return _fd;
+    }
+    // number of records replayed when the log was opened
+    inline size_t replayed() const {
+        return _replayed;
+    }
+
+    // some metadata changed since the last record
+    inline bool pending() const {
+        return _deref->has_dirty();
+    }
+    // takes the pages modified since the last record into the next one and returns its size, 0 if there are none
+    // only one record can be prepared at a time
+    size_t prepare();
+    // whether the prepared record fits in the log, the log needs a checkpoint otherwise
+    bool fits() const;
+    // writes the prepared record into buf, which must be block aligned, returns where it goes in the log
+    off_t fill(std::span<uint8_t> buf);
+    // the prepared record is on disk
+    void committed();
+    // the prepared record couldn't be written, its pages go into the next one
+    void aborted();
+    // prepares, writes and commits a record synchronously, returns false if the log needs a checkpoint first
+    bool commit();
+
+    // logs the pages not logged yet, then writes every page changed since the last checkpoint back to the map file
+    // and empties the log
+    // the data the metadata refers to must already be durable
+    void checkpoint();
+    // for tests: the write back of a checkpoint fails after this many pages, as if the host went down
+    inline void limit_checkpoint_writes(size_t npages) {
+        _checkpoint_limit = npages;
+    }
+    // the log is more than half full
+    inline bool checkpoint_due() const {
+        return _tail > _capacity / 2;
+    }
+
+private:
+    struct superblock {
+        uint64_t magic;
+        uint32_t version;
+        // bumped whenever the log is emptied, records of earlier epochs are stale
+        uint32_t epoch;
+        uint64_t capacity;
+    };
+    // One block in front of the record, followed by the offsets of its pages padded to a block, then the pages.
+    struct record {
+        uint64_t magic;
+        uint64_t seq;
+        uint32_t epoch;
+        uint32_t npages;
+        // log space taken by the record, header included
+        uint64_t len;
+        // of the whole record with this field set to 0
+        uint64_t checksum;
+        uint32_t flags;
+        uint32_t reserved;
+    };
+    // the batch goes on in the next record and is replayed only once all of it is in the log
+    static constexpr uint32_t record_continued = 1;
+    struct block_deleter {
+        void operator()(unsigned char *p) const;
+    };
+    using block_ptr = std::unique_ptr<unsigned char, block_deleter>;
+    static block_ptr alloc_blocks(size_t nbytes);
+    static uint64_t checksum(std::span<const uint8_t> s);
+
+    static constexpr size_t record_len(size_t npages) {
+        return block_size + round_up(npages * sizeof(uint64_t), block_size) + npages * block_size;
+    }
+    // largest record a checkpoint writes, bigger batches are split
+    size_t max_record_pages() const;
+    // writes the valid records of the log into mapfd, up to the last whole batch, returns how many there were
+    size_t apply(int mapfd);
+    void fill_record(std::span<uint8_t> buf, std::span<const uint64_t> pages, uint32_t flags);
+    // writes pages into the log synchronously, in as many records as needed, returns false if they don't fit
+    bool log_batch(std::span<const uint64_t> pages);
+    // empties the log by moving to the next epoch
+    void reset();
+
+    int _fd = -1;
+    int _mapfd;
+    uint64_t _capacity;
+    uint32_t _epoch = 0;
+    uint64_t _seq = 0;
+    // where the next record goes
+    uint64_t _tail = block_size;
+    size_t _replayed = 0;
+    FileDeref *_deref = nullptr;
+    block_ptr _sbbuf;
+
+    // pages of the prepared record
+    std::vector<uint64_t> _prepared;
+    // pages logged since the last checkpoint
+    std::vector<uint64_t> _logged;
+    size_t _checkpoint_limit = SIZE_MAX;
+};
+
+}; // namespace xcow
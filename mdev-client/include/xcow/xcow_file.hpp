@@ -1,10 +1,16 @@
 #pragma once
 
+#include <bit>
 #include <cassert>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
 #include <span>
 #include <memory>
 #include <utility>
 #include <exception>
+#include <vector>
 #include <sys/uio.h>
 #include "xcow/xcowfmt.hpp"
 #include "xcow/linked_table.hpp"
@@ -22,20 +28,44 @@ static constexpr SnapListRef encode_snap_ref(uint64_t off) {
 static constexpr SnapListEntry encode_snap_entry(uint64_t off, uint64_t disk_hwm) {
     return SnapListEntry(off | valid, disk_hwm);
 }
+// snapshots being deleted keep their entry until their clusters are handed over, then only a tombstone is left
+static constexpr uint64_t snap_deleting = 0x4000'0000'0000'0000ull;
 static constexpr uint64_t decode_snap_entry(SnapListEntry t) {
     assert(t.val & valid);
-    return t.val & decode_mask;
+    return t.val & decode_mask & ~snap_deleting;
+}
+static constexpr bool snap_entry_deleting(SnapListEntry t) {
+    return !!(t.val & snap_deleting);
+}
+// tombstones have no root
+static constexpr bool snap_entry_dead(SnapListEntry t) {
+    return snap_entry_deleting(t) && !decode_snap_entry(t);
 }
 
 static constexpr FreeListRef encode_free_ref(uint64_t off) {
     return FreeListRef(off | valid);
 }
-static constexpr FreeListEntry encode_free_entry(uint64_t off) {
-    return FreeListEntry(off | valid);
+
+// free list entries are extents of clusters, either in the metadata file or in the data file
+static constexpr uint64_t free_meta = 0x4000'0000'0000'0000ull;
+static constexpr size_t free_count_shift = 40;
+static constexpr uint64_t free_start_mask = (1ull << free_count_shift) - 1;
+static constexpr uint64_t free_max_count = (free_meta >> free_count_shift) - 1;
+
+static constexpr FreeListEntry encode_free_entry(bool meta, uint64_t start, uint64_t count) {
+    assert(start <= free_start_mask && count && count <= free_max_count);
+    return FreeListEntry(valid | (meta ? free_meta : 0) | (count << free_count_shift) | start);
 }
+// first cluster of the extent
 static constexpr uint64_t decode_free_entry(FreeListEntry t) {
     assert(t & valid);
-    return t & decode_mask;
+    return t & free_start_mask;
+}
+static constexpr uint64_t free_entry_count(FreeListEntry t) {
+    return (t & ~(valid | free_meta)) >> free_count_shift;
+}
+static constexpr bool free_entry_meta(FreeListEntry t) {
+    return !!(t & free_meta);
 }
 }; // namespace FileBits
 
@@ -65,6 +95,17 @@ using SnapList = LinkedTable<SnapListRef, SnapListEntry>;
 
 struct hwm_exception : public std::exception {};
 
+// what XcowFile::warmup_plan() reads in ahead of use
+enum class WarmupOrder {
+    none,
+    // the root of the writable snapshot
+    roots,
+    // the root, then the l0 tables written since the last snapshot and then the others, newest first
+    recent,
+    // the root, then the l0 tables in guest address order
+    address,
+};
+
 class XcowFile {
 public:
     explicit XcowFile(Deref *deref);
@@ -74,7 +115,16 @@ public:
     XcowFile &operator=(XcowFile &&) = default;
     ~XcowFile() = default;
 
-    static XcowFile format(Deref *deref, size_t fsize, uint32_t cbits, uint32_t hwm_limit, uint64_t disk_hwm_limit);
+    // subclusters must be at least 4K so that they can be accessed with direct I/O
+    static constexpr uint32_t min_extended_l2_bits = 17;
+
+    static XcowFile format(
+        Deref *deref,
+        size_t fsize,
+        uint32_t cbits,
+        uint32_t hwm_limit,
+        uint64_t disk_hwm_limit,
+        bool extended_l2 = false);
 
     constexpr size_t cluster_bits() const {
         return _hdr->cluster_bits;
@@ -84,10 +134,28 @@ public:
         return 1 << _hdr->cluster_bits;
     }
 
+    constexpr bool extended_l2() const {
+        return _hdr->features & XCOW_FEATURE_EXTENDED_L2;
+    }
+
+    constexpr size_t subcluster_bits() const {
+        return extended_l2() ? cluster_bits() - std::countr_zero(XlateBits::subcluster_count) : cluster_bits();
+    }
+
     constexpr size_t fsize() const {
         return _hdr->fsize;
     }
 
+    // the most data clusters the file may ever have, whatever the snapshots share
+    constexpr uint64_t disk_hwm_limit() const {
+        return _hdr->disk_hwm_limit;
+    }
+
+    // nullptr if the file has no backing image
+    const XcowBacking *backing() const;
+    // bases a freshly formatted file on an image
+    void set_backing(const XcowBacking &backing);
+
     constexpr SnapList::iterator snaps() {
         return SnapList::iterator(_deref_meta, _snaps);
     }
@@ -97,23 +165,77 @@ public:
     XcowSnap open_read(int snapi);
     XcowSnap open_write();
     XcowSnap snap_create(XcowSnap &source);
+    // drops the writable snapshot and frees the clusters it owns, along with the snapshots below it that are being
+    // deleted
     void peel(XcowSnap &&source);
+    // marks a snapshot other than the writable one for deletion, merge_step() then does the actual work
+    // indices are the same as open_read()
+    void snap_delete(int snapi);
+    // hands over the clusters of one l0 table of a deleted snapshot to the remaining snapshots, or frees them
+    // busy(addr, nbytes) tells if the writable snapshot is in use in that range, tables it would change are put off
+    // each step leaves a valid file behind, returns false once no deletion is pending
+    bool merge_step(const std::function<bool(uint64_t, uint64_t)> &busy = {});
+    // converts the file to extended l2, returns the number of l0 tables moved; their old clusters are freed
+    size_t upgrade_extended_l2();
+    // clusters a snapshot maps to data, zero leaves and what's left to the backing image aside; indices are the same as
+    // open_read()
+    // the writable snapshot is counted once, which reads all of its l0 tables, and kept up to date from then on
+    uint64_t used_clusters(int snapi = 0);
+    // counts the next ntables l0 tables of the writable snapshot, returns false once all of them are
+    // changes to the tables counted so far are kept track of, so this can go along with I/O
+    bool count_step(size_t ntables);
+    // used_clusters() of the writable snapshot if it's been counted already
+    constexpr std::optional<uint64_t> counted_clusters() const {
+        return _used;
+    }
+    // metadata ranges (offset, bytes) of the writable snapshot to prefetch, most wanted first
+    // only reads the root, the ranges can be prefetched later on while the file is in use
+    std::vector<std::pair<uint64_t, size_t>> warmup_plan(WarmupOrder order);
+
+    // clusters that are no longer referenced by any snapshot, off is a byte offset
+    void free_meta_clusters(uint64_t off, size_t count);
+    void free_data_clusters(uint64_t off, size_t count);
+    // allocated data clusters that nothing refers to yet, e.g. a pool of pre-zeroed clusters, go back on the free list
+    // on disk but stay out of the allocator, so that they're simply free again after a crash
+    void park_data_clusters(uint64_t off, size_t count);
+    // takes parked clusters back, they're allocated again
+    void unpark_data_clusters(uint64_t off, size_t count);
+    // both load the free list if it isn't yet
+    inline uint64_t free_meta_count() {
+        need_free_list();
+        return _free_meta.total;
+    }
+    inline uint64_t free_data_count() {
+        need_free_list();
+        return _free_data.total;
+    }
+    // called with the byte range of data clusters once they're freed, e.g. to punch holes in the data file
+    inline void set_discard(std::function<void(uint64_t, uint64_t)> fn) {
+        _discard = std::move(fn);
+    }
+
+    // guest bytes covered by one l0 table
+    constexpr size_t l0_cover_bits() const {
+        return cluster_bits() * 2 - 3;
+    }
+    constexpr size_t l0_cover_size() const {
+        return size_t{1} << l0_cover_bits();
+    }
 
 #if XCOW_TRANSPARENT
 public:
 #else
 private:
 #endif
-    explicit constexpr XcowFile(Deref *deref_meta, XcowHeader *hdr, SnapList snaps, FreeList flist)
+    explicit XcowFile(Deref *deref_meta, XcowHeader *hdr, SnapList snaps, FreeList flist)
         : _deref_meta(deref_meta), _hdr(hdr), _snaps(snaps), _flist(flist) {
+        _deref_meta->pin(_hdr, sizeof(XcowHeader));
+        pin_table(_snaps);
     }
 
-    constexpr size_t l0_cover_bits() const {
-        return cluster_bits() * 2 - 3;
-    }
-
-    constexpr size_t l0_cover_size() const {
-        return 1 << l0_cover_bits();
+    // the leaves of an l0 table are followed by their XlateExt with extended l2
+    constexpr size_t l0_clusters() const {
+        return extended_l2() ? 1 + sizeof(XlateExt) / sizeof(XlateLeaf) : 1;
     }
 
     constexpr size_t l1_clusters() const {
@@ -121,21 +243,135 @@ private:
         return (l0count * sizeof(XlateRef) + cluster_size() - 1) >> cluster_bits();
     }
 
+    // every change to the metadata is reported to the deref, which may have to log it
+    template <typename T>
+    inline void dirty(const T &t) {
+        _deref_meta->dirty(&t, sizeof(T));
+    }
+    template <typename T>
+    inline void dirty_span(std::span<T> s) {
+        _deref_meta->dirty(s.data(), s.size_bytes());
+    }
+    // the header, the snapshot roots and the tables of the linked lists are used across calls
+    template <typename T>
+    inline void pin_span(std::span<T> s) {
+        _deref_meta->pin(s.data(), s.size_bytes());
+    }
+    template <typename T>
+    inline void unpin_span(std::span<T> s) {
+        _deref_meta->unpin(s.data(), s.size_bytes());
+    }
+    template <typename T>
+    inline void pin_table(const T &table) {
+        _deref_meta->pin(&table.meta(), cluster_size());
+    }
+    template <typename T>
+    inline void unpin_table(const T &table) {
+        _deref_meta->unpin(&table.meta(), cluster_size());
+    }
+    // the header and the entry of a linked table after push_back() or pop_back()
+    template <typename T, typename E>
+    inline void dirty_entry(const T &table, const E &e) {
+        dirty(table.meta());
+        dirty(e);
+    }
+
     std::pair<uint64_t, size_t> alloc_meta_clusters(size_t count) {
+        if (auto start = alloc_free(true, count))
+            return std::make_pair(*start << cluster_bits(), count << cluster_bits());
         if (_hdr->hwm + count > _hdr->hwm_limit)
             throw hwm_exception{};
-        auto ret = std::make_pair(_hdr->hwm << cluster_bits(), count << cluster_bits());
+        auto ret = std::make_pair(static_cast<uint64_t>(_hdr->hwm) << cluster_bits(), count << cluster_bits());
         _hdr->hwm += count;
+        dirty(_hdr->hwm);
         return ret;
     }
     inline std::pair<uint64_t, size_t> alloc_meta_cluster() {
         return alloc_meta_clusters(1);
     }
 
+    // Free extents of one of the files, indexed over the free list entries.
+    struct FreeIndex {
+        // first cluster -> free list entry
+        std::map<uint64_t, FreeListEntry *> by_start;
+        // (count, first cluster) for best fit lookups
+        std::set<std::pair<uint64_t, uint64_t>> by_size;
+        uint64_t total = 0;
+    };
+
+    // a leaf of the writable snapshot was replaced
+    inline void account(uint64_t addr_in, XlateLeaf before, XlateLeaf after) {
+        if (XlateBits::is_empty(before) == XlateBits::is_empty(after))
+            return;
+        // tables count_step() hasn't got to yet are counted as they are then
+        auto &count = _used ? *_used : _count_partial;
+        if (!_used && addr_in >> l0_cover_bits() >= _count_cursor)
+            return;
+        if (XlateBits::is_empty(after))
+            count--;
+        else
+            count++;
+    }
+    uint64_t count_table(XlateRef ref);
+
+    // entries of the snapshot list from the oldest one, tombstones included
+    std::vector<SnapListEntry *> snap_entries();
+    // pops the last entry of the snapshot list and frees what it owns
+    void drop_top();
+    // returns false if the table must wait for busy
+    bool merge_table(
+        XlateTable &root,
+        size_t l1_off,
+        std::span<XlateTable> others,
+        const std::function<bool(uint64_t, uint64_t)> &busy);
+
+    constexpr FreeIndex &free_index(bool meta) {
+        return meta ? _free_meta : _free_data;
+    }
+    void load_free_list();
+    // the free list is only read once something is allocated or freed, so that opening a file stays quick
+    inline void need_free_list() {
+        if (!_free_loaded)
+            load_free_list();
+    }
+    void index_insert(FreeListEntry *fe);
+    void index_erase(FreeListEntry fe);
+    FreeListEntry *list_push(FreeListEntry e);
+    void list_remove(FreeListEntry *fe);
+    // first cluster of a free extent of count clusters, empty if there's none
+    std::optional<uint64_t> alloc_free(bool meta, size_t count);
+    // data clusters [start, start + count) if they're all free
+    std::optional<uint64_t> alloc_free_at(uint64_t start, size_t count);
+    void free_extent(bool meta, uint64_t start, uint64_t count);
+    // drops free data clusters at or above limit, they're above the disk hwm again
+    void trim_free_data(uint64_t limit);
+
     Deref *_deref_meta;
     XcowHeader *_hdr;
     SnapList _snaps;
+    // head of the free list, the newest table
     FreeList _flist;
+    // tables of the free list from the oldest one, those before _fcur are full and those after it are empty
+    // tables are kept once allocated, the list rarely shrinks for long
+    std::vector<FreeList> _ftables;
+    size_t _fcur = 0;
+    bool _free_loaded = false;
+    FreeIndex _free_meta;
+    FreeIndex _free_data;
+    // parked data extents, first cluster -> free list entry; not part of _free_data
+    std::map<uint64_t, FreeListEntry *> _parked;
+    // data allocations continue from here if a free extent starts there, so that runs stay contiguous
+    uint64_t _data_next = 0;
+    std::function<void(uint64_t, uint64_t)> _discard;
+    // merge_step() goes around the root of the snapshot being deleted from here, so that put off tables don't hold up
+    // the others
+    uint64_t _merge_root = 0;
+    size_t _merge_cursor = 0;
+    // used_clusters() of the writable snapshot, once it's been counted
+    std::optional<uint64_t> _used;
+    // count_step() is done with the tables below this one, which have that many clusters
+    size_t _count_cursor = 0;
+    uint64_t _count_partial = 0;
 };
 
 } // namespace xcow
@@ -11,7 +11,9 @@ namespace xcow {
 namespace XlateBits {
 static constexpr uint64_t valid = 0x8000'0000'0000'0000ull;
 static constexpr uint64_t writable = 0x2;
-static constexpr uint64_t decode_mask = ~(valid | writable);
+// the cluster reads as zeroes and has no data cluster, only with XCOW_FEATURE_ZERO_LEAVES
+static constexpr uint64_t zero = 0x4;
+static constexpr uint64_t decode_mask = ~(valid | writable | zero);
 
 static constexpr XlateRef encode_ref(uint64_t off, bool is_writable) {
     return XlateRef(off | valid | (is_writable ? writable : 0));
@@ -20,24 +22,28 @@ static constexpr XlateLeaf encode_leaf(uint64_t off, bool is_writable) {
     return XlateLeaf(off | valid | (is_writable ? writable : 0));
 }
 static constexpr uint64_t decode_leaf(XlateLeaf off) {
-    assert(off & valid);
+    assert((off & valid) && !(off & zero));
     return off & decode_mask;
 }
 static constexpr uint64_t decode_leaf_unsafe(XlateLeaf off) {
     return off & decode_mask;
 }
 
-#if XCOW_ZEROPAGE
-static constexpr XlateLeaf empty_leaf = XlateLeaf(valid | 0);
+static constexpr XlateLeaf empty_leaf = XlateLeaf();
+// unlike an empty leaf, which is merely unallocated, a zero leaf is written explicitly
+static constexpr XlateLeaf zero_leaf = XlateLeaf(valid | zero);
 
-static constexpr bool is_empty(XlateLeaf tl) {
-    return !(tl & valid) || tl == empty_leaf;
+static constexpr bool is_unallocated(XlateLeaf tl) {
+    return !(tl & valid);
 }
-#else
-static constexpr XlateLeaf empty_leaf = XlateLeaf();
 
+static constexpr bool is_zero(XlateLeaf tl) {
+    return (tl & valid) && (tl & zero);
+}
+
+// no data cluster behind the leaf, it reads as zeroes
 static constexpr bool is_empty(XlateLeaf tl) {
-    return !(tl & valid);
+    return is_unallocated(tl) || is_zero(tl);
 }
 
 static constexpr bool needs_cow(XlateLeaf prev) {
@@ -47,7 +53,19 @@ static constexpr bool needs_cow(XlateLeaf prev) {
 static constexpr bool needs_alloc(XlateLeaf tl) {
     return is_empty(tl) || needs_cow(tl);
 }
-#endif
+
+static constexpr size_t subcluster_count = 32;
+static constexpr uint32_t all_subclusters = 0xffff'ffff;
+// state of clusters without subcluster tracking
+static constexpr XlateExt full_ext = XlateExt{.alloc = all_subclusters, .zero = 0, .base = XlateLeaf()};
+
+static constexpr bool is_full(const XlateExt &ext) {
+    return ext.alloc == all_subclusters;
+}
+// subclusters [first, last]
+static constexpr uint32_t subcluster_mask(size_t first, size_t last) {
+    return static_cast<uint32_t>(((2ull << last) - 1) & ~((1ull << first) - 1));
+}
 }; // namespace XlateBits
 
 template <>
@@ -70,15 +88,28 @@ class XcowSnap {
 public:
     XcowSnap(const XcowSnap &) = delete;
     XcowSnap &operator=(const XcowSnap &) = delete;
-    XcowSnap(XcowSnap &&) = default;
-    XcowSnap &operator=(XcowSnap &&) = default;
-    ~XcowSnap() = default;
+    XcowSnap(XcowSnap &&other) noexcept;
+    XcowSnap &operator=(XcowSnap &&other) noexcept;
+    // releases the pin on the root
+    ~XcowSnap();
 
-    XlateLeaf translate_read(uint64_t addr_in) const;
+    // ext receives the subcluster state, full_ext for files without extended l2
+    XlateLeaf translate_read(uint64_t addr_in, XlateExt *ext = nullptr) const;
     XlateLeaf translate_write(uint64_t addr_in, XlateLeaf *prev = nullptr);
+    // frees the cluster if it's ours, and the l0 table once it's empty
+    // pointers returned by tx_write_prep into that table must not be in use anymore
     void erase(uint64_t addr_in);
-    XlateLeaf *tx_write_prep(uint64_t addr_in);
-    XlateLeaf tx_write_commit(XlateLeaf &ref, XlateLeaf tl, XlateLeaf *prev);
+    // makes the given subclusters of a cluster read as zeroes, only for files with extended l2
+    void erase_subclusters(uint64_t addr_in, uint32_t mask);
+    // replaces the cluster with a zero leaf, freeing it if it's ours
+    // pointers returned by tx_write_prep into that table must not be in use anymore
+    void zero(uint64_t addr_in);
+    // ext receives the subcluster state of the entry, nullptr for files without extended l2
+    XlateLeaf *tx_write_prep(uint64_t addr_in, XlateExt **ext = nullptr);
+    // addr_in is the one given to tx_write_prep
+    XlateLeaf tx_write_commit(uint64_t addr_in, XlateLeaf &ref, XlateLeaf tl, XlateLeaf *prev);
+    // unconditionally replaces the entry and its subcluster state
+    void tx_write_commit(uint64_t addr_in, XlateLeaf &ref, XlateExt *ext, XlateLeaf tl, const XlateExt &newext);
 
     constexpr const XcowFile &file() {
         return *_f;
@@ -88,7 +119,8 @@ public:
         return *_disk_hwm;
     }
 
-    std::pair<uint64_t, size_t> alloc_data_clusters(size_t count);
+    // hint is where the caller would like the clusters to start, e.g. right after the clusters it wrote last
+    std::pair<uint64_t, size_t> alloc_data_clusters(size_t count, uint64_t hint = UINT64_MAX);
     inline std::pair<uint64_t, size_t> alloc_data_cluster() {
         return alloc_data_clusters(1);
     }
@@ -96,10 +128,14 @@ public:
     friend class XcowFile;
 
 private:
-    explicit XcowSnap(XcowFile *f, XlateTable root, uint64_t *disk_hwm)
-        : _f(f), _root(std::move(root)), _disk_hwm(disk_hwm) {
-    }
+    // the root stays pinned as long as the snapshot is open
+    explicit XcowSnap(XcowFile *f, XlateTable root, uint64_t *disk_hwm);
+
+    // l0 table covering addr_in, allocated or unshared from older snapshots as needed
+    XlateTable::next_type l0_write(uint64_t addr_in);
+    std::span<XlateExt> l0_ext(size_t l1_off) const;
 
+    // nullptr once moved from
     XcowFile *_f;
     XlateTable _root;
     uint64_t *_disk_hwm;
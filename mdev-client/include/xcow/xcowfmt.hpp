@@ -14,11 +14,21 @@ STRONG_TYPEDEF_I(uint64_t, XlateLeaf, 0);     // NOLINT
 
 static constexpr uint64_t XCOW_MAGIC = 0x306f7274654d564e;
 
+// incompatible format features, files using features we don't know about are refused
+// every l0 table is followed by the XlateExt of its clusters
+static constexpr uint32_t XCOW_FEATURE_EXTENDED_L2 = 0x1;
+// leaves may be zero leaves, set once the first one is written
+static constexpr uint32_t XCOW_FEATURE_ZERO_LEAVES = 0x2;
+// unallocated clusters read from the backing image described by the XcowBacking after the header
+static constexpr uint32_t XCOW_FEATURE_BACKING = 0x4;
+static constexpr uint32_t XCOW_FEATURES_SUPPORTED =
+    XCOW_FEATURE_EXTENDED_L2 | XCOW_FEATURE_ZERO_LEAVES | XCOW_FEATURE_BACKING;
+
 struct XcowHeader {
     uint64_t magic;
     uint64_t fsize;
     uint32_t cluster_bits;
-    uint32_t _rsvd;
+    uint32_t features;
     uint32_t hwm_limit;
     uint32_t hwm;
     uint64_t disk_hwm_limit;
@@ -26,6 +36,35 @@ struct XcowHeader {
     FreeListRef freelist;
 };
 
+// Read-only image that a file is based on, kept in the header cluster at XCOW_BACKING_OFFSET.
+// A raw image is used as is, an xcow image through one of its snapshots and then its own backing image if it has one.
+// The image must not change as long as files are based on it.
+struct XcowBacking {
+    static constexpr uint32_t raw = 0;
+    static constexpr uint32_t xcow = 1;
+    static constexpr size_t path_max = 1024;
+
+    uint32_t kind;
+    // open_read() index of the snapshot of an xcow image
+    uint32_t snap;
+    // raw image or data file of an xcow image, nul-terminated
+    char path[path_max];
+    // map file of an xcow image, nul-terminated
+    char map_path[path_max];
+};
+static constexpr uint64_t XCOW_BACKING_OFFSET = 512;
+static_assert(sizeof(XcowHeader) <= XCOW_BACKING_OFFSET && XCOW_BACKING_OFFSET + sizeof(XcowBacking) <= 4096);
+
+// Extended l2 state of a cluster, split into 32 subclusters.
+// A subcluster is read from the cluster itself if its alloc bit is set, as zeroes if its zero bit is set, and from the
+// same subcluster of base otherwise (zeroes if base is not valid). alloc and zero are never both set.
+struct XlateExt {
+    uint32_t alloc;
+    uint32_t zero;
+    XlateLeaf base;
+};
+static_assert(sizeof(XlateExt) == 2 * sizeof(XlateLeaf));
+
 struct SnapListEntry {
     static constexpr bool strong_typedef = true;
     using backing_type = uint64_t;
@@ -40,7 +40,7 @@ void nvme_encryptor_aio::submit_write_async([[maybe_unused]] size_t sq, const nv
         }
     }
 
-    _ring.queue_write(ticket, ticket->mem.get(), lit.cmd_nbytes(), -1, true, 0, lit.cmd_slba() << lit.cmd_lba_shift());
+    _merger.queue_write(_ring, ticket, ticket->mem.get(), lit.cmd_nbytes(), true, 0, lit.cmd_slba() << lit.cmd_lba_shift());
 }
 
 void nvme_encryptor_aio::submit_write_zeroes_async([[maybe_unused]] size_t sq, const nvme_command &cmd, uint32_t tag) {
@@ -59,7 +59,9 @@ void nvme_encryptor_aio::submit_write_zeroes_async([[maybe_unused]] size_t sq, c
         }
     }
 
+    _merger.flush(_ring);
     _ring.queue_write(ticket, ticket->mem.get(), nbytes, -1, true, 0, slba << lbas);
+    _merger.submitted();
 }
 
 void nvme_encryptor_aio::submit_flush_async(
@@ -67,7 +69,9 @@ void nvme_encryptor_aio::submit_flush_async(
     [[maybe_unused]] const nvme_command &cmd,
     uint32_t tag) {
     auto ticket = new sq_ticket(tag);
+    _merger.flush(_ring);
     _ring.queue_fsync(ticket, true, 0, IORING_FSYNC_DATASYNC);
+    _merger.submitted();
 }
 
 bool nvme_encryptor_aio::submit_async(
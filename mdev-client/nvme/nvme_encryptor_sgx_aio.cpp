@@ -1,14 +1,17 @@
+#include <algorithm>
 #include <exception>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <unistd.h>
 #include <cstring>
+#include <numeric>
 #include <vector>
 #include <system_error>
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/uio.h>
 #include <liburing/io_uring.h>
 
@@ -104,6 +107,240 @@ bool nvme_encryptor_sgx_aio::submit_async(
     return false;
 }
 
+size_t nvme_encryptor_sgx_aio::submit_burst_async(
+    std::span<const nvme_command> cmds,
+    std::span<const uint32_t> tags,
+    std::span<bool> outasync,
+    std::span<__u16> outstatus) {
+    size_t nasync = 0;
+    _burst_cmds.clear();
+    _burst_descs.clear();
+    _burst_items.clear();
+
+    for (size_t i = 0; i < cmds.size(); i++) {
+        const auto &cmd = cmds[i];
+        auto [qi, ucid] = unmake_tag(tags[i]);
+        bool is_read = cmd.common.opcode == nvme_cmd_read;
+        bool is_write = cmd.common.opcode == nvme_cmd_write && !(cmd.common.flags & NVME_CMD_SGL_ALL);
+        if (!is_read && !is_write) {
+            outasync[i] = submit_async(qi, cmd, tags[i], outstatus[i]);
+            nasync += outasync[i];
+            continue;
+        }
+
+        burst_item item{.index = i};
+        try {
+            int lbas = ns_lba_shift(cmd.rw.nsid);
+            item.nbytes = ns_cmd_check_nbytes(static_cast<size_t>(cmd.rw.length) + 1, lbas);
+            item.offset = static_cast<off_t>(cmd.rw.slba << lbas);
+        } catch (const nvme_exception &e) {
+            outasync[i] = false;
+            outstatus[i] = e.code();
+            continue;
+        }
+        crypt_desc desc{};
+        if (is_write) {
+            item.ticket = std::make_unique<mem_ticket<sq_ticket>>(tags[i], item.nbytes);
+            desc.outbuf = item.ticket->mem.get();
+            desc.outbuf_size = item.nbytes;
+            desc.decrypt = 0;
+        } else {
+            desc.decrypt = 1;
+        }
+        _burst_cmds.push_back(cmd);
+        _burst_descs.push_back(desc);
+        _burst_items.push_back(std::move(item));
+    }
+
+    if (_burst_cmds.empty()) {
+        return nasync;
+    }
+    _e.crypt_commands(std::span(_burst_cmds), std::span(_burst_descs));
+
+    for (size_t j = 0; j < _burst_items.size(); j++) {
+        auto &item = _burst_items[j];
+        bool ok = _burst_descs[j].result == static_cast<long>(item.nbytes);
+        if (item.ticket && ok) {
+            auto ticket = item.ticket.release();
+            _ring.queue_write(ticket, ticket->mem.get(), item.nbytes, -1, true, 0, item.offset);
+            outasync[item.index] = true;
+            nasync++;
+        } else {
+            outasync[item.index] = false;
+            outstatus[item.index] = ok ? NVME_SC_SUCCESS : (NVME_SC_DNR | NVME_SC_INTERNAL);
+        }
+    }
+    _burst_items.clear();
+    return nasync;
+}
+
+sgx_ring_state::sgx_ring_state(size_t nr_slots, size_t slot_size) {
+    if (!nr_slots || nr_slots >= CRYPT_RING_SLOT_COUNT) {
+        throw std::invalid_argument("bad enclave ring slot count");
+    }
+    constexpr size_t cq_size = CRYPT_RING_CQ_COUNT * sizeof(crypt_completion);
+    constexpr size_t slots_size = CRYPT_RING_SLOT_COUNT * sizeof(uint32_t);
+    // cq | control page | free slot ring | staging
+    mem_size = cq_size + NVME_PAGE_SIZE + slots_size + nr_slots * slot_size;
+    void *p = mmap(nullptr, mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (p == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "cannot map enclave ring");
+    }
+    mem = unique_handle<unsigned char>(static_cast<unsigned char *>(p), [size = mem_size](unsigned char *m) {
+        munmap(m, size);
+    });
+
+    auto base = mem.get();
+    auto cq_buf = reinterpret_cast<crypt_completion *>(base);
+    // keep each index on its own cacheline
+    auto ctl = reinterpret_cast<volatile int *>(base + cq_size);
+    volatile int *cq_head = &ctl[0], *cq_tail = &ctl[16];
+    volatile int *slots_head = &ctl[32], *slots_tail = &ctl[48];
+    auto slots_buf = reinterpret_cast<uint32_t *>(base + cq_size + NVME_PAGE_SIZE);
+
+    desc.cq = cq_buf;
+    desc.cq_head = cq_head;
+    desc.cq_tail = cq_tail;
+    desc.slots = slots_buf;
+    desc.slots_head = slots_head;
+    desc.slots_tail = slots_tail;
+    desc.staging = base + cq_size + NVME_PAGE_SIZE + slots_size;
+    desc.slot_size = slot_size;
+    desc.nr_slots = nr_slots;
+
+    cq = std::make_unique<crypt_cqbuf_t<cmdbuf_en_direction::consumer>>(cq_buf, cq_head, cq_tail);
+    slots = std::make_unique<crypt_slotbuf_t<cmdbuf_en_direction::producer>>(slots_buf, slots_head, slots_tail);
+
+    std::vector<uint32_t> free_slots(nr_slots);
+    std::iota(free_slots.begin(), free_slots.end(), 0);
+    slots->produce(std::span<const uint32_t>(free_slots));
+}
+
+sgx_ring_state::~sgx_ring_state() {
+    __atomic_store_n(&desc.stop, 1, __ATOMIC_RELEASE);
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+void nvme_encryptor_sgx_aio::ring_start(std::span<nsqbuf_t> sqs) {
+    if (_rs) {
+        throw std::logic_error("enclave ring already started");
+    }
+    if (sqs.size() > CRYPT_RING_MAX_SQ) {
+        throw std::invalid_argument("too many queues for enclave ring");
+    }
+    // a staging slot holds the largest transfer we accept, mdts == 0 means there's no limit so we pick one
+    auto mdts = id_vctrl()->mdts;
+    size_t slot_size = mdts ? std::min(size_t{1} << mdts << NVME_PAGE_SHIFT, ring_max_slot_size) : ring_max_slot_size;
+    auto rs = std::make_unique<sgx_ring_state>(ring_nr_slots, slot_size);
+
+    rs->desc.pvm = _e.pvm();
+    rs->desc.pvm_size = _e.pvm_size();
+    rs->desc.nr_sq = sqs.size();
+    for (size_t i = 0; i < sqs.size(); i++) {
+        rs->desc.sq[i] = crypt_ring_sq{
+            .cmdbuf = sqs[i].data(),
+            .head = sqs[i].head(),
+            .tail = sqs[i].tail(),
+        };
+    }
+
+    auto state = rs.get();
+    rs->worker = std::thread([this, state] {
+        long ret = 0;
+        try {
+            ret = _e.crypt_ring_run(&state->desc);
+        } catch (const std::system_error &e) {
+            ret = -EIO;
+        }
+        if (ret < 0) {
+            state->error = ret;
+            state->failed.store(true, std::memory_order_release);
+        }
+    });
+    pthread_setname_np(rs->worker.native_handle(), "enclave-ring");
+    _rs = std::move(rs);
+}
+
+void nvme_encryptor_sgx_aio::ring_stop() {
+    _rs.reset();
+}
+
+bool nvme_encryptor_sgx_aio::ring_complete_one(const crypt_completion &c, __u16 &outstatus) {
+    auto tag = make_tag(c.qi, c.cmd.common.command_id);
+    if (c.cmd.common.opcode != nvme_cmd_read && c.slot == CRYPT_RING_NO_SLOT) {
+        // not touched by the enclave
+        return submit_async(c.qi, c.cmd, tag, outstatus);
+    }
+
+    std::unique_ptr<slot_ticket> ticket;
+    if (c.slot != CRYPT_RING_NO_SLOT) {
+        if (c.slot >= _rs->desc.nr_slots) {
+            outstatus = NVME_SC_DNR | NVME_SC_INTERNAL;
+            return false;
+        }
+        // gives the slot back on every failure path
+        ticket = std::make_unique<slot_ticket>(tag, _rs->slots.get(), c.slot);
+    }
+
+    size_t nbytes = 0;
+    int lbas = 0;
+    try {
+        lbas = ns_lba_shift(c.cmd.rw.nsid);
+        nbytes = ns_cmd_check_nbytes(static_cast<size_t>(c.cmd.rw.length) + 1, lbas);
+    } catch (const nvme_exception &e) {
+        outstatus = e.code();
+        return false;
+    }
+    if (ticket && nbytes > _rs->desc.slot_size) {
+        // the enclave doesn't stage these, but the slot must never be written past its end
+        outstatus = NVME_SC_DNR | NVME_SC_INVALID_FIELD;
+        return false;
+    }
+    if (c.result != static_cast<int64_t>(nbytes)) {
+        outstatus = NVME_SC_DNR | NVME_SC_INTERNAL;
+        return false;
+    }
+    if (!ticket) {
+        outstatus = NVME_SC_SUCCESS;
+        return false;
+    }
+
+    auto buf = _rs->desc.staging + c.slot * _rs->desc.slot_size;
+    _ring.queue_write(ticket.release(), buf, nbytes, -1, true, 0, c.cmd.rw.slba << lbas);
+    return true;
+}
+
+size_t nvme_encryptor_sgx_aio::ring_poll(
+    std::span<uint32_t> outtags,
+    std::span<__u16> outstatus,
+    bool &submitted_async) {
+    if (!_rs) {
+        return 0;
+    }
+    if (_rs->failed.load(std::memory_order_acquire)) {
+        throw std::system_error(static_cast<int>(-_rs->error), std::generic_category(), "enclave ring worker failed");
+    }
+
+    std::array<crypt_completion, 32> cbuf{};
+    auto max = std::min({cbuf.size(), outtags.size(), outstatus.size()});
+    auto ncpl = _rs->cq->consume(std::span(cbuf.data(), max));
+
+    size_t nimm = 0;
+    for (int i = 0; i < ncpl; i++) {
+        __u16 status = 0;
+        if (ring_complete_one(cbuf[i], status)) {
+            submitted_async = true;
+        } else {
+            outtags[nimm] = make_tag(cbuf[i].qi, cbuf[i].cmd.common.command_id);
+            outstatus[nimm] = status;
+            nimm++;
+        }
+    }
+    return nimm;
+}
+
 cq_window nvme_encryptor_sgx_aio::get_pending_completions(std::span<io_uring_cqe *> cqebuf) {
     return _ring.cq_get_ready(cqebuf);
 }
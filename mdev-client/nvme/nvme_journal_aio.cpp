@@ -0,0 +1,161 @@
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "nvme_core.hpp"
+#include "nvme_journal_aio.hpp"
+#include "util.hpp"
+#include "prp.hpp"
+#include "vm.hpp"
+
+nvme_journal_aio::nvme_journal_aio(
+    const std::shared_ptr<mapping> &vm,
+    int nfd,
+    std::shared_ptr<replica_journal> journal)
+    : nvme(vm, nfd), _journal(std::move(journal)), _jfd{{_journal->fd()}}, _ring(2048, 0, std::span(_jfd)) {
+}
+
+journal_ticket *nvme_journal_aio::make_record(
+    uint32_t tag,
+    journal_record::kind k,
+    off_t offset,
+    size_t nbytes,
+    std::span<const iovec> data) {
+    size_t ndata = 0;
+    for (auto &v : data) {
+        ndata += v.iov_len;
+    }
+    if (ndata > _journal->max_data()) {
+        throw nvme_exception(NVME_SC_DNR | NVME_SC_INVALID_FIELD);
+    }
+    uint64_t seq = 0;
+    off_t file_offset = 0;
+    uint64_t len = 0;
+    if (!_journal->reserve(ndata, seq, file_offset, len)) {
+        return nullptr;
+    }
+
+    auto ticket = new journal_ticket(tag, seq, file_offset, len);
+    auto payload = ticket->record.get() + replica_journal::block_size;
+    size_t copied = 0;
+    for (auto &v : data) {
+        memcpy(payload + copied, v.iov_base, v.iov_len);
+        copied += v.iov_len;
+    }
+    // records are whole blocks so that the next header stays aligned
+    memset(payload + ndata, 0, len - replica_journal::block_size - ndata);
+
+    journal_record rec{
+        .magic = replica_journal::record_magic,
+        .seq = seq,
+        .epoch = _journal->epoch(),
+        .k = k,
+        .offset = static_cast<uint64_t>(offset),
+        .nbytes = nbytes,
+        .len = len,
+        .checksum = replica_journal::checksum(std::span<const unsigned char>(payload, ndata)),
+    };
+    memset(ticket->record.get(), 0, replica_journal::block_size);
+    memcpy(ticket->record.get(), &rec, sizeof(rec));
+    ticket->iovecs.push_back(iovec{ticket->record.get(), len});
+    _unacked.emplace(seq, tag);
+    return ticket;
+}
+
+__u16 nvme_journal_aio::submit_write_async(const nvme_command &cmd, uint32_t tag) {
+    auto slba = cmd.rw.slba;
+    size_t nblocks = static_cast<size_t>(cmd.rw.length) + 1;
+    int lbas = ns_lba_shift(cmd.rw.nsid);
+    size_t nbytes = ns_cmd_check_nbytes(nblocks, lbas);
+
+    std::vector<iovec> data;
+    prp_list cmd_prpl{reinterpret_cast<prp_list::const_pointer>(&cmd.rw.dptr.prp1), 2};
+    for (prp_chain_iter prp_it(vm(), cmd_prpl, 0, nbytes); !prp_it.at_end(); prp_it++) {
+        iovec_append(data, vm()->get_span(*prp_it, prp_it.this_nbytes()));
+    }
+    auto ticket = make_record(tag, journal_record::kind::write, slba << lbas, nbytes, std::span(data));
+    if (!ticket) {
+        return busy_status;
+    }
+    _ring.queue_writev(ticket, ticket->iovecs, true, 0, ticket->offset);
+    return NVME_SC_SUCCESS;
+}
+
+__u16 nvme_journal_aio::submit_write_zeroes_async(const nvme_command &cmd, uint32_t tag) {
+    auto slba = cmd.rw.slba;
+    size_t nblocks = static_cast<size_t>(cmd.rw.length) + 1;
+    int lbas = ns_lba_shift(cmd.rw.nsid);
+
+    auto ticket = make_record(tag, journal_record::kind::write_zeroes, slba << lbas, nblocks << lbas, {});
+    if (!ticket) {
+        return busy_status;
+    }
+    _ring.queue_writev(ticket, ticket->iovecs, true, 0, ticket->offset);
+    return NVME_SC_SUCCESS;
+}
+
+__u16 nvme_journal_aio::try_submit(const nvme_command &cmd, uint32_t tag) {
+    try {
+        if (cmd.common.opcode == nvme_cmd_write) {
+            if (!(cmd.common.flags & NVME_CMD_SGL_ALL)) {
+                return submit_write_async(cmd, tag);
+            }
+        } else if (cmd.common.opcode == nvme_cmd_write_zeroes) {
+            return submit_write_zeroes_async(cmd, tag);
+        } else if (cmd.common.opcode == nvme_cmd_flush) {
+            // the journal is written with O_DSYNC, every completed write is already durable
+            _ready.push_back(tag);
+            return NVME_SC_SUCCESS;
+        }
+    } catch (const nvme_exception &e) {
+        return e.code();
+    }
+    return NVME_SC_DNR | NVME_SC_INVALID_OPCODE;
+}
+
+__u16 nvme_journal_aio::submit_async([[maybe_unused]] size_t sq, const nvme_command &cmd, uint32_t tag) {
+    DBG_PRINTF("sq %zu opcode %#hhx cid %hu\n", sq, cmd.common.opcode, cmd.common.command_id);
+    // keep the submission order once something had to wait
+    auto status = _deferred.empty() ? try_submit(cmd, tag) : busy_status;
+    if (status == busy_status) {
+        _deferred.push_back(deferred_cmd{cmd, tag});
+        return NVME_SC_SUCCESS;
+    }
+    return status;
+}
+
+cq_window nvme_journal_aio::get_pending_completions(std::span<io_uring_cqe *> cqebuf) {
+    return _ring.cq_get_ready(cqebuf);
+}
+
+void nvme_journal_aio::complete(io_uring_cqe *cqe) {
+    auto t = static_cast<journal_ticket *>(cqe_get_data(cqe));
+    auto res = cqe->res;
+    _ring.cq_commit(cqe);
+
+    size_t expected = 0;
+    for (auto &v : t->iovecs) {
+        expected += v.iov_len;
+    }
+    if (res < 0 || static_cast<size_t>(res) != expected) {
+        // later records cannot become durable before this one, so there is no way to fail it alone
+        if (++t->tries >= 3) {
+            throw std::system_error(res < 0 ? -res : EIO, std::generic_category(), "cannot write journal");
+        }
+        _ring.queue_writev(t, t->iovecs, true, 0, t->offset);
+        return;
+    }
+    _journal->written(t->seq);
+    delete t;
+}
+
+void nvme_journal_aio::print_stats(FILE *f, const char *prefix) const {
+    fprintf(f, "%s: %zu waiting for journal, %zu held back\n", prefix, _unacked.size(), _deferred.size());
+    _journal->print_stats(f, prefix);
+}
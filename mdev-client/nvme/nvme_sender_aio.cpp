@@ -1,9 +1,13 @@
 #include <memory>
 #include <vector>
 #include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
 #include <liburing/io_uring.h>
 
@@ -13,6 +17,71 @@
 #include "prp.hpp"
 #include "vm.hpp"
 
+nvme_sender_aio::nvme_sender_aio(
+    const std::shared_ptr<mapping> &vm,
+    int nfd,
+    std::span<const int> bfds,
+    unsigned int quorum,
+    unsigned int merge_window_us,
+    std::shared_ptr<dirty_bitmap> bitmap)
+    : nvme(vm, nfd), _bfd(bfds.begin(), bfds.end()), _quorum(quorum), _remotes(make_remotes(_bfd)),
+      _fixed_bufs(remote_buffers(std::span(_remotes))), _ring(2048, 0, std::span(_bfd), std::span(_fixed_bufs)),
+      _stats(_bfd.size()), _order(_bfd.size()), _bitmap(std::move(bitmap)) {
+    if (_bfd.empty() || !_quorum || _quorum > _bfd.size()) {
+        throw std::invalid_argument("bad replica quorum");
+    }
+    if (_bfd.size() > dirty_bitmap::max_replicas) {
+        throw std::invalid_argument("too many replicas");
+    }
+    _mergers.reserve(_bfd.size());
+    for (size_t i = 0; i < _bfd.size(); i++) {
+        _mergers.emplace_back(merge_window_us);
+    }
+}
+
+std::vector<std::unique_ptr<remote_client>> nvme_sender_aio::make_remotes(std::span<const int> bfds) {
+    std::vector<std::unique_ptr<remote_client>> remotes;
+    for (int r = 0; r < static_cast<int>(bfds.size()); r++) {
+        struct stat st {};
+        if (fstat(bfds[r], &st) < 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot stat backend");
+        }
+        remotes.push_back(S_ISSOCK(st.st_mode) ? std::make_unique<remote_client>(r) : nullptr);
+    }
+    return remotes;
+}
+
+std::vector<iovec> nvme_sender_aio::remote_buffers(std::span<std::unique_ptr<remote_client>> remotes) {
+    std::vector<iovec> bufs;
+    for (auto &rc : remotes) {
+        if (rc) {
+            rc->set_buf_base(static_cast<int>(bufs.size()));
+            bufs.insert(bufs.end(), rc->buffers().begin(), rc->buffers().end());
+        }
+    }
+    return bufs;
+}
+
+void nvme_sender_aio::mark_stale(replica_stats &st, const replica_op &op) {
+    if (op.k == replica_op::kind::flush) {
+        // nothing is known to be durable on this replica anymore
+        st.stale.insert_all();
+    } else {
+        st.stale.insert(op.offset, op.nbytes);
+    }
+}
+
+void nvme_sender_aio::settle(const replica_op &op) {
+    if (op.k == replica_op::kind::flush) {
+        if (op.failed) {
+            // a failed flush may have lost any earlier write, even ones that were acked
+            _sync_wanted = std::max(_sync_wanted, _bitmap->mark_all(op.failed));
+        }
+    } else {
+        _bitmap->write_end(op.offset, op.nbytes, op.failed);
+    }
+}
+
 void nvme_sender_aio::submit_write_async([[maybe_unused]] size_t sq, const nvme_command &cmd, uint32_t tag) {
     auto slba = cmd.rw.slba;
     size_t nblocks = static_cast<size_t>(cmd.rw.length) + 1;
@@ -21,14 +90,75 @@ void nvme_sender_aio::submit_write_async([[maybe_unused]] size_t sq, const nvme_
     prp_list cmd_prpl{reinterpret_cast<prp_list::const_pointer>(&cmd.rw.dptr.prp1), 2};
     prp_chain_iter prp_begin(vm(), cmd_prpl, 0, nbytes);
 
-    auto ticket = new iovec_ticket<sq_ticket>(tag);
+    auto op = std::make_unique<replica_op>(tag, replica_op::kind::write, _bfd.size(), slba << lbas, nbytes);
+    auto tickets = make_tickets(op.get());
+    auto &first = tickets.front();
     for (auto &prp_it = prp_begin; !prp_it.at_end(); prp_it++) {
         DBG_PRINTF("page %#lx size %zu\n", *prp_it, prp_it.this_nbytes());
         // lba index inside current page
-        iovec_append(ticket->iovecs, vm()->get_span(*prp_it, prp_it.this_nbytes()));
+        iovec_append(first->iovecs, vm()->get_span(*prp_it, prp_it.this_nbytes()));
+    }
+
+    // any replica may be one of the late ones, and the guest reuses its pages as soon as the quorum is reached
+    // remote replicas copy the payload into their frames when queued, so only local ones need the copy
+    auto guest_iovecs = first->iovecs;
+    if (_quorum < _bfd.size() && std::any_of(_remotes.begin(), _remotes.end(), [](auto &rc) { return !rc; })) {
+        op->bounce.reset(static_cast<unsigned char *>(mi_malloc_aligned(nbytes, NVME_PAGE_SIZE)));
+        if (!op->bounce) {
+            throw std::bad_alloc();
+        }
+        size_t copied = 0;
+        for (auto &v : guest_iovecs) {
+            memcpy(op->bounce.get() + copied, v.iov_base, v.iov_len);
+            copied += v.iov_len;
+        }
+    }
+    for (unsigned int r = 0; r < _bfd.size(); r++) {
+        if (op->bounce && !_remotes[r]) {
+            tickets[r]->iovecs.assign(1, iovec{op->bounce.get(), nbytes});
+        } else if (r) {
+            tickets[r]->iovecs = guest_iovecs;
+        }
+    }
+
+    int flags = (cmd.rw.control & NVME_RW_FUA) ? RWF_DSYNC : 0;
+    queue_op(std::move(op), tickets, flags);
+}
+
+std::vector<std::unique_ptr<replica_ticket>> nvme_sender_aio::make_tickets(replica_op *op) const {
+    std::vector<std::unique_ptr<replica_ticket>> tickets;
+    tickets.reserve(_bfd.size());
+    for (unsigned int r = 0; r < _bfd.size(); r++) {
+        tickets.push_back(std::make_unique<replica_ticket>(op, r));
     }
+    return tickets;
+}
 
-    _ring.queue_writev(ticket, ticket->iovecs, true, 0, slba << lbas, (cmd.rw.control & NVME_RW_FUA) ? RWF_DSYNC : 0);
+void nvme_sender_aio::queue_op(
+    std::unique_ptr<replica_op> op,
+    std::span<std::unique_ptr<replica_ticket>> tickets,
+    int flags) {
+    // everything the op needs is allocated, nothing can leave a mark set with no write to clear it
+    uint64_t mark = 0;
+    if (_bitmap) {
+        mark = _bitmap->write_begin(op->offset, op->nbytes);
+    }
+    op.release();
+    auto seq = _next_seq++;
+    for (auto &t : tickets) {
+        t->seq = seq;
+        _order[t->replica].inflight.insert(seq);
+        queue_marked(t.release(), flags, mark);
+    }
+}
+
+void nvme_sender_aio::queue_replica_write(replica_ticket *ticket, int flags) {
+    auto r = ticket->replica;
+    if (_remotes[r]) {
+        _remotes[r]->queue_write(ticket, ticket->op->offset, ticket->iovecs, flags & RWF_DSYNC);
+    } else {
+        _mergers[r].queue_writev(_ring, ticket, true, static_cast<int>(r), ticket->op->offset, flags);
+    }
 }
 
 void nvme_sender_aio::submit_write_zeroes_async([[maybe_unused]] size_t sq, const nvme_command &cmd, uint32_t tag) {
@@ -36,16 +166,88 @@ void nvme_sender_aio::submit_write_zeroes_async([[maybe_unused]] size_t sq, cons
     size_t nblocks = static_cast<size_t>(cmd.rw.length) + 1;
     int lbas = ns_lba_shift(cmd.rw.nsid);
 
-    auto ticket = new sq_ticket(tag);
-    _ring.queue_fallocate(ticket, true, 0, FALLOC_FL_ZERO_RANGE, slba << lbas, nblocks << lbas);
+    auto op = std::make_unique<replica_op>(
+        tag,
+        replica_op::kind::write_zeroes,
+        _bfd.size(),
+        slba << lbas,
+        nblocks << lbas);
+    auto tickets = make_tickets(op.get());
+    queue_op(std::move(op), tickets, 0);
+}
+
+void nvme_sender_aio::queue_replica_write_zeroes(replica_ticket *ticket) {
+    auto r = ticket->replica;
+    if (_remotes[r]) {
+        _remotes[r]->queue_write_zeroes(ticket, ticket->op->offset, ticket->op->nbytes);
+        return;
+    }
+    _mergers[r].flush(_ring);
+    _ring.queue_fallocate(ticket, true, r, FALLOC_FL_ZERO_RANGE, ticket->op->offset, ticket->op->nbytes);
+    _mergers[r].submitted();
+}
+
+void nvme_sender_aio::queue_marked(replica_ticket *ticket, int flags, uint64_t mark) {
+    if (_bitmap && !_bitmap->durable(mark)) {
+        _held.push_back(held_write{mark, ticket, flags});
+    } else if (ticket->op->k == replica_op::kind::write_zeroes) {
+        queue_replica_write_zeroes(ticket);
+    } else {
+        queue_replica_write(ticket, flags);
+    }
+}
+
+void nvme_sender_aio::release_held() {
+    // another worker's sync may have covered them as well
+    auto waiting = std::stable_partition(_held.begin(), _held.end(), [this](const held_write &h) {
+        return _bitmap->durable(h.mark);
+    });
+    std::vector<held_write> ready(_held.begin(), waiting);
+    _held.erase(_held.begin(), waiting);
+    for (auto &h : ready) {
+        queue_marked(h.ticket, h.flags, h.mark);
+    }
+    if ((!_held.empty() || !_bitmap->durable(_sync_wanted)) && !_bitmap_syncing) {
+        // one datasync for every mark so far, it completes on the ring like any other I/O
+        auto ticket = new bitmap_sync_ticket(_bitmap->sync_target());
+        _ring.queue_fsync(ticket, false, _bitmap->fd(), IORING_FSYNC_DATASYNC);
+        _bitmap_syncing = true;
+    }
 }
 
 void nvme_sender_aio::submit_flush_async(
     [[maybe_unused]] size_t sq,
     [[maybe_unused]] const nvme_command &cmd,
     uint32_t tag) {
-    auto ticket = new sq_ticket(tag);
-    _ring.queue_fsync(ticket, true, 0, IORING_FSYNC_DATASYNC);
+    auto op = new replica_op(tag, replica_op::kind::flush, _bfd.size(), 0, 0);
+    for (unsigned int r = 0; r < _bfd.size(); r++) {
+        auto ticket = new replica_ticket(op, r);
+        // covers every write submitted so far
+        ticket->seq = _next_seq;
+        queue_replica_flush(ticket);
+    }
+}
+
+void nvme_sender_aio::queue_replica_flush(replica_ticket *ticket) {
+    auto r = ticket->replica;
+    if (_remotes[r]) {
+        _remotes[r]->queue_flush(ticket);
+        return;
+    }
+    _mergers[r].flush(_ring);
+    _ring.queue_fsync(ticket, true, static_cast<int>(r), IORING_FSYNC_DATASYNC);
+    _mergers[r].submitted();
+}
+
+void nvme_sender_aio::reissue_flushes(unsigned int replica) {
+    auto &ord = _order[replica];
+    auto oldest = ord.inflight.empty() ? _next_seq : *ord.inflight.begin();
+    auto ready = std::partition(ord.parked.begin(), ord.parked.end(), [&](auto t) { return t->seq > oldest; });
+    std::vector<replica_ticket *> reissue(ready, ord.parked.end());
+    ord.parked.erase(ready, ord.parked.end());
+    for (auto t : reissue) {
+        queue_replica_flush(t);
+    }
 }
 
 __u16 nvme_sender_aio::submit_async([[maybe_unused]] size_t sq, const nvme_command &cmd, uint32_t tag) {
@@ -82,3 +284,9 @@ __u16 nvme_sender_aio::submit_async([[maybe_unused]] size_t sq, const nvme_comma
 cq_window nvme_sender_aio::get_pending_completions(std::span<io_uring_cqe *> cqebuf) {
     return _ring.cq_get_ready(cqebuf);
 }
+
+void nvme_sender_aio::print_stats(FILE *f, const char *prefix) const {
+    for (unsigned int r = 0; r < _stats.size(); r++) {
+        print_replica_stats(f, prefix, r, _stats[r]);
+    }
+}
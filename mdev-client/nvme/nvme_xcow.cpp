@@ -1,5 +1,7 @@
 #include <algorithm>
 #include <array>
+#include <bit>
+#include <climits>
 #include <exception>
 #include <memory>
 #include <cstring>
@@ -7,8 +9,10 @@
 #include <vector>
 #include <cassert>
 #include <system_error>
+#include <utility>
 
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/uio.h>
 #include <sys/ioctl.h>
@@ -17,6 +21,7 @@
 #include "nvme_xcow.hpp"
 #include "util.hpp"
 #include "util/mdev.hpp"
+#include "util/time.hpp"
 #include "prp.hpp"
 #include "vm.hpp"
 #include "xcow/deref.hpp"
@@ -25,32 +30,100 @@
 
 using namespace xcow;
 
+// backing image files are registered after the data file, fid i of the image is fixed file i + 1
+static std::vector<int> &append_backing(std::vector<int> &fds, xcow::BackingImage *backing) {
+    if (backing)
+        fds.insert(fds.end(), backing->fds().begin(), backing->fds().end());
+    return fds;
+}
+
+// a part of a command split by cluster is done, the command completes with the first failure once all of them are
+static nm_outcome part_done(xcow_ticket *ticket, __s32 us) {
+    if (us < 0 && !ticket->failed)
+        ticket->failed = us;
+    if (--ticket->count)
+        return std::monostate{};
+    nm_reply reply(ticket->tag, translate_uring_status(ticket->failed));
+    delete ticket;
+    return reply;
+}
+
 nvme_xcow::nvme_xcow(
     const std::shared_ptr<mapping> &vm,
     int nfd,
     int bfd,
     xcow::XcowFile *file,
-    std::vector<bool> *clock,
-    workqueue_type *wq)
-    : nvme(vm, nfd), _bfd{{bfd}}, _file(file), _snap(_file->open_write()), _ring(8192, 0, std::span(_bfd), {}),
-      _clock(clock), _wq(wq) {
+    xcow_locks *locks,
+    xcow::FileDeref *deref,
+    xcow::MetaLog *log,
+    xcow::BackingImage *backing,
+    xcow_shards *shards,
+    xcow::CachedDeref *cache)
+    : nvme(vm, nfd), _bfd{bfd}, _file(file), _snap(_file->open_write()),
+      _ring(8192, 0, std::span(append_backing(_bfd, backing)), {}), _copy(std::make_unique<CopyOffload>(bfd)),
+      _locks(locks), _deref(deref), _log(log), _backing(backing), _shards(shards), _cache(cache) {
     auto fsize = _snap.file().fsize();
     auto &idns = id_vns(1);
-    idns->nsze = idns->ncap = fsize >> lba_shift(*idns);
-    idns->nuse = 0;
-    std::fill(std::begin(idns->nvmcap), std::end(idns->nvmcap), 0);
+    // thin: the data file may have room for less than the whole namespace
+    uint64_t capacity = fsize;
+    if (_file->disk_hwm_limit() < fsize >> cluster_bits())
+        capacity = _file->disk_hwm_limit() << cluster_bits();
+    idns->nsze = fsize >> lba_shift(*idns);
+    idns->ncap = capacity >> lba_shift(*idns);
+    // counted by report_usage() while I/O goes on, reading every l0 table here would hold up the start
+    idns->nuse = _file->counted_clusters().value_or(0) << (cluster_bits() - lba_shift(*idns));
+    for (size_t i = 0; i < std::size(idns->nvmcap); i++)
+        idns->nvmcap[i] = i < sizeof(capacity) ? static_cast<__u8>(capacity >> (8 * i)) : 0;
     idns->noiob = _snap.file().cluster_size() / (1 << lba_shift(*idns));
-    // since we don't track NUSE, we can't report THINP
+    idns->nsfeat |= NVME_NS_FEAT_THIN;
     idns->nsfeat |= (1 << 4); // optperf
     idns->npwg = idns->npwa = idns->nows = idns->noiob - 1;
+    set_id_vns(*idns);
+
+    // deallocates are served here, whatever the host controller supports
+    auto &id = id_vctrl();
+    if (!(id->oncs & NVME_CTRL_ONCS_DSM)) {
+        id->oncs |= NVME_CTRL_ONCS_DSM;
+        nvme_mdev_id_vctrl new_id{};
+        memcpy(&new_id.data[0], id.get(), std::size(new_id.data));
+        if (ioctl(nfd, NVME_MDEV_NOTIFYFD_SET_ID_VCTRL, &new_id) < 0)
+            throw std::system_error(errno, std::generic_category(), "cannot set controller id data");
+    }
+
+    _locks->resize(fsize >> _snap.file().cluster_bits());
+    _file->set_discard([bfd](uint64_t off, uint64_t nbytes) { punch_hole(bfd, static_cast<off_t>(off), nbytes); });
+
+    // source for the unwritten parts of fresh subclusters and for write zeroes that need a write
+    _zeroes.reset(static_cast<unsigned char *>(mi_new_aligned(cluster_size(), NVME_PAGE_SIZE)));
+    std::fill(_zeroes.get(), _zeroes.get() + cluster_size(), 0);
+}
 
+void nvme_xcow::set_id_vns(const nvme_id_ns &idns) {
     nvme_mdev_id_vns new_idns{};
     new_idns.nsid = 1;
-    memcpy(&new_idns.data[0], idns.get(), std::size(new_idns.data));
-    if (ioctl(nfd, NVME_MDEV_NOTIFYFD_SET_ID_VNS, &new_idns) < 0)
+    memcpy(&new_idns.data[0], &idns, std::size(new_idns.data));
+    if (ioctl(nfd(), NVME_MDEV_NOTIFYFD_SET_ID_VNS, &new_idns) < 0)
         throw std::system_error(errno, std::generic_category(), "cannot set ns1 id data");
+}
 
-    _clock->resize(fsize >> _snap.file().cluster_bits());
+bool nvme_xcow::report_usage() {
+    if (_file->count_step(count_tables_per_step))
+        return true;
+    auto &idns = id_vns(1);
+    auto nuse = *_file->counted_clusters() << (cluster_bits() - lba_shift(*idns));
+    if (nuse != idns->nuse) {
+        idns->nuse = nuse;
+        set_id_vns(*idns);
+    }
+    return false;
+}
+
+io_uring_sqe *nvme_xcow::queue_copy(xcow_ticket *ticket, off_t inoff, off_t outoff, size_t nbytes) {
+    auto &done = ticket->copies.emplace_back(_copy->copy_async(inoff, outoff, nbytes));
+    ticket->count++;
+    auto sqe = _ring.queue_read(ticket, &_copy_done, sizeof(_copy_done), -1, false, done, 0);
+    sqe->flags |= IOSQE_IO_LINK;
+    return sqe;
 }
 
 std::pair<nvme_xcow::cow_ticket_type *, io_uring_sqe *> nvme_xcow::do_cow(
@@ -58,6 +131,13 @@ std::pair<nvme_xcow::cow_ticket_type *, io_uring_sqe *> nvme_xcow::do_cow(
     off_t inoff,
     off_t outoff,
     size_t nbytes) {
+    if (_copy->method() != CopyMethod::none) {
+        // the nop stands in for the write so that callers can still link to it, and fails with the copy
+        auto ticket = new cow_ticket_type(tag, 0);
+        queue_copy(ticket, inoff, outoff, nbytes);
+        ticket->count++;
+        return std::make_pair(ticket, _ring.queue_nop(ticket));
+    }
     auto ticket = new cow_ticket_type(tag, nbytes);
     ticket->count += 2;
     auto rqe = _ring.queue_read(ticket, ticket->mem.get(), nbytes, -1, true, 0, inoff);
@@ -74,15 +154,234 @@ nm_outcome nvme_xcow::do_snapshot([[maybe_unused]] size_t sq, const nvme_command
         cmd.common.cdw14 || cmd.common.cdw15)
         return nm_reply(tag, NVME_SC_DNR | NVME_SC_INVALID_FIELD);
     _snap = _file->snap_create(_snap);
+    if (_shards)
+        _snap_epoch = ++_shards->snap_epoch;
+    if (_log)
+        _sync_tags.insert(tag);
     return nm_reply(tag, NVME_SC_SUCCESS);
 }
 
+nm_outcome nvme_xcow::do_snapshot_delete(
+    [[maybe_unused]] size_t sq,
+    const nvme_command &cmd,
+    [[maybe_unused]] uint32_t tag) {
+    if (!id_vns(cmd.common.nsid))
+        return nm_reply(tag, NVME_SC_DNR | NVME_SC_INVALID_NS);
+    if (cmd.common.cdw2[0] || cmd.common.cdw2[1] || cmd.common.metadata || cmd.common.dptr.prp1 ||
+        cmd.common.dptr.prp2 || cmd.common.cdw11 || cmd.common.cdw12 || cmd.common.cdw13 || cmd.common.cdw14 ||
+        cmd.common.cdw15)
+        return nm_reply(tag, NVME_SC_DNR | NVME_SC_INVALID_FIELD);
+    // cdw10: snapshot index, 0 being the one we're writing to which can't be deleted
+    auto snapi = cmd.common.cdw10;
+    if (!snapi || snapi > INT_MAX)
+        return nm_reply(tag, NVME_SC_DNR | NVME_SC_INVALID_FIELD);
+    try {
+        _file->snap_delete(static_cast<int>(snapi));
+    } catch (const std::invalid_argument &) {
+        return nm_reply(tag, NVME_SC_DNR | NVME_SC_INVALID_FIELD);
+    }
+    if (_log)
+        _sync_tags.insert(tag);
+    return nm_reply(tag, NVME_SC_SUCCESS);
+}
+
+bool nvme_xcow::clusters_busy(uint64_t addr, uint64_t nbytes) {
+    auto first = addr >> cluster_bits(), last = (addr + nbytes + cluster_size() - 1) >> cluster_bits();
+    if (!_shards)
+        return _locks->busy(first, last);
+    // the range may belong to other workers as well
+    return std::any_of(_shards->locks.begin(), _shards->locks.end(), [=](const xcow_locks &locks) {
+        return locks.busy(first, last);
+    });
+}
+
+size_t nvme_xcow::route(const nvme_command &cmd) {
+    if (!_shards || _shards->count == 1)
+        return xcow_shards::any;
+    switch (cmd.common.opcode) {
+    case nvme_cmd_write:
+    case nvme_cmd_write_zeroes: {
+        // the layout of write zeroes matches that of reads and writes as far as we're concerned
+        int lbas;
+        try {
+            lbas = ns_lba_shift(cmd.rw.nsid);
+        } catch (const nvme_exception &) {
+            // whoever runs it fails it
+            return xcow_shards::any;
+        }
+        auto clus_lba_shift = cluster_bits() - lbas;
+        auto first = cmd.rw.slba >> clus_lba_shift, last = (cmd.rw.slba + cmd.rw.length) >> clus_lba_shift;
+        auto owner = _shards->owner(first);
+        auto last_stripe = last >> xcow_shards::stripe_bits;
+        for (auto stripe = (first >> xcow_shards::stripe_bits) + 1; stripe <= last_stripe; stripe++)
+            if (_shards->owner(stripe << xcow_shards::stripe_bits) != owner)
+                return xcow_shards::exclusive;
+        return owner;
+    }
+    case 0x81:
+    case 0x82:
+        // snapshots must not see a transaction halfway
+        return xcow_shards::exclusive;
+    case nvme_cmd_dsm:
+        // the ranges may be anywhere
+        return (cmd.dsm.attributes & NVME_DSMGMT_AD) ? xcow_shards::exclusive : xcow_shards::any;
+    default:
+        // reads don't take cluster locks, the rest doesn't care about clusters
+        return xcow_shards::any;
+    }
+}
+
+std::optional<XlateLeaf> nvme_xcow::contiguous_leaf(uint64_t addr, uint64_t nbytes, bool write) {
+    std::optional<XlateLeaf> first;
+    auto start = addr & ~(uint64_t{cluster_size()} - 1);
+    for (auto pos = start; pos < addr + nbytes; pos += cluster_size()) {
+        XlateExt ext;
+        auto tl = _snap.translate_read(pos, &ext);
+        if (XlateBits::is_empty(tl) || !XlateBits::is_full(ext) || (write && !(tl & XlateBits::writable)))
+            return std::nullopt;
+        if (!first)
+            first = tl;
+        else if (tl.val != first->val + (pos - start))
+            return std::nullopt;
+    }
+    return first;
+}
+
+uint64_t nvme_xcow::alloc_cluster(uint64_t vblk) {
+    auto hint = UINT64_MAX;
+    if (vblk > 0 && vblk - 1 == _last_vblk) {
+        // the previous cluster may not be committed yet
+        hint = _last_outoff + cluster_size();
+    } else if (vblk > 0) {
+        auto prev = _snap.translate_read((vblk - 1) << cluster_bits());
+        if (!XlateBits::is_empty(prev) && (prev & XlateBits::writable))
+            hint = XlateBits::decode_leaf(prev) + cluster_size();
+    }
+    uint64_t outoff;
+    try {
+        outoff = _snap.alloc_data_clusters(1, hint).first;
+    } catch (const disk_hwm_exception &) {
+        // what the pool holds is as good as any other cluster
+        if (_zero_pool.empty())
+            throw;
+        outoff = _zero_pool.front();
+        _file->unpark_data_clusters(outoff, 1);
+        _zero_pool.pop_front();
+    }
+    _last_vblk = vblk;
+    _last_outoff = outoff;
+    return outoff;
+}
+
+std::optional<uint64_t> nvme_xcow::take_zeroed_cluster(uint64_t vblk) {
+    if (_zero_pool.empty()) {
+        _stats.zero_pool_misses++;
+        return std::nullopt;
+    }
+    auto outoff = _zero_pool.front();
+    _file->unpark_data_clusters(outoff, 1);
+    _zero_pool.pop_front();
+    _zero_taken++;
+    _stats.zero_pool_hits++;
+    // refills are contiguous, so sequential writers still get their clusters back to back
+    _last_vblk = vblk;
+    _last_outoff = outoff;
+    return outoff;
+}
+
+void nvme_xcow::refresh_snap() {
+    if (_shards && _snap_epoch != _shards->snap_epoch) {
+        // another worker took a snapshot, ours is read-only now
+        _snap = _file->open_write();
+        _snap_epoch = _shards->snap_epoch;
+    }
+}
+
+bool nvme_xcow::refill_zero_pool() {
+    // allocating from a stale snapshot would move the disk hwm of a read-only one
+    refresh_snap();
+    // grow right away when the pool runs low, shrink slowly when it isn't used
+    _zero_target = std::clamp(std::max(_zero_taken * 4, _zero_target * 3 / 4), zero_pool_min, zero_pool_max);
+    _zero_taken = 0;
+    auto have = _zero_pool.size() + _zero_pending;
+    if (have >= _zero_target)
+        return false;
+
+    auto count = _zero_target - have;
+    uint64_t outoff;
+    try {
+        outoff = _snap.alloc_data_clusters(count).first;
+    } catch (const disk_hwm_exception &) {
+        // whatever space is left goes to the guest
+        return false;
+    }
+    try {
+        _file->park_data_clusters(outoff, count);
+    } catch (const hwm_exception &) {
+        // no room to grow the free list, the clusters couldn't be reclaimed after a crash
+        _file->free_data_clusters(outoff, count);
+        return false;
+    }
+    auto ticket = new xcow_ticket(noop_tag);
+    _zero_pending += count;
+    ticket->undo = cleanup([this, outoff, count] {
+        _zero_pending -= count;
+        _file->unpark_data_clusters(outoff, count);
+        _file->free_data_clusters(outoff, count);
+    });
+    ticket->last = cleanup([this, outoff, count] {
+        _zero_pending -= count;
+        for (size_t i = 0; i < count; i++)
+            _zero_pool.push_back(outoff + (i << cluster_bits()));
+    });
+    ticket->count++;
+    _ring.queue_fallocate(ticket, true, 0, FALLOC_FL_ZERO_RANGE, outoff, count << cluster_bits());
+    return true;
+}
+
+bool nvme_xcow::complete(io_uring_cqe *cqe, const std::function<bool(const nm_outcome &)> &outcome) {
+    auto t = static_cast<xcow_ticket *>(cqe_get_data(cqe));
+    // what follows a failure in a chain is only cancelled, the ticket goes with the first one
+    if (cqe->res < 0 && !t->failed)
+        t->failed = cqe->res;
+    if (--t->count)
+        return false;
+
+    auto res = t->failed;
+    if (res < 0)
+        printf("unhappy %p %#x %d\n", t, t->tag, res);
+    nm_reply reply(t->tag, translate_uring_status(res), t->aux);
+    auto vblk = t->locked_cluster;
+    // refuse to commit a failed transaction and give back what it allocated
+    if (res < 0)
+        t->last.neutralize();
+    else
+        t->undo.neutralize();
+    // trigger ticket->last before draining cluster locking work queue
+    delete t;
+    // the transaction is committed by now, so a deferred reply waits for its metadata as well
+    auto submitted = outcome(reply);
+    if (vblk != UINT64_MAX)
+        // stops as soon as a continuation takes the lock again, the rest waits for it
+        _locks->unlock(vblk, res, [&](const nm_outcome &next) { submitted |= outcome(next); });
+    return submitted;
+}
+
+bool nvme_xcow::merge_step() {
+    return _file->merge_step([this](uint64_t addr, uint64_t nbytes) { return clusters_busy(addr, nbytes); });
+}
+
 nm_outcome nvme_xcow::do_read([[maybe_unused]] size_t sq, const nvme_command &cmd, uint32_t tag) {
     int lbas = ns_lba_shift(cmd.rw.nsid);
     auto clus_lba_shift = cluster_bits() - lbas;
     __u64 vblk = cmd.rw.slba >> clus_lba_shift;
     if (vblk != (cmd.rw.slba + cmd.rw.length) >> clus_lba_shift) {
-        printf("multiblock command %zu %#x: %#llx+%#hx\n", sq, tag, cmd.rw.slba, cmd.rw.length);
+        auto nbytes = (static_cast<uint64_t>(cmd.rw.length) + 1) << lbas;
+        if (auto tl = contiguous_leaf(cmd.rw.slba << lbas, nbytes, false)) {
+            _stats.multi_forwarded++;
+            return nm_reply(tag, NVME_SC_SUCCESS, *tl, AUXCMD_FORWARD);
+        }
+        _stats.multi_split++;
         blk_iter bi(cmd.rw.slba, static_cast<size_t>(cmd.rw.length) + 1, clus_lba_shift);
         nvme_cmd_lba_iter lit(*this, cmd);
         auto ticket = new iovecs_ticket<xcow_ticket>(tag);
@@ -94,15 +393,20 @@ nm_outcome nvme_xcow::do_read([[maybe_unused]] size_t sq, const nvme_command &cm
             sqe->flags |= IOSQE_IO_LINK;
         }
         for (; !bi.at_end(); bi++) {
-            auto tl = _snap.translate_read(*bi << lbas);
+            XlateExt ext;
+            auto tl = _snap.translate_read(*bi << lbas, &ext);
             auto off = *bi % (1 << clus_lba_shift);
-            if (XlateBits::is_empty(tl)) {
+            if (from_backing(tl)) {
+                do_read_backing(ticket, *bi << lbas, bi.size() << lbas, lit);
+            } else if (XlateBits::is_empty(tl)) {
                 for (auto i = bi.size(); i > 0; i--) {
                     assert(!lit.at_end());
                     auto dt = *lit;
                     std::fill(dt.begin(), dt.end(), uint8_t(0));
                     lit++;
                 }
+            } else if (!XlateBits::is_full(ext)) {
+                do_read_sub(ticket, tl, ext, off << lbas, bi.size() << lbas, lit);
             } else {
                 auto &iovecs = ticket->iovecss.emplace_back();
                 iovecs.reserve(cluster_size() / NVME_PAGE_SIZE + 1);
@@ -126,19 +430,158 @@ nm_outcome nvme_xcow::do_read([[maybe_unused]] size_t sq, const nvme_command &cm
     } else {
         // do_alloc_one_tx will not commit its xlate entry before the allocation/cow is done
         // therefore it's safe to read from an entry snapshot even during a lock period
-        auto tl = _snap.translate_read(cmd.rw.slba << lbas);
-        if (XlateBits::is_empty(tl)) {
+        XlateExt ext;
+        auto tl = _snap.translate_read(cmd.rw.slba << lbas, &ext);
+        if (XlateBits::is_empty(tl) && !from_backing(tl)) {
             for (nvme_cmd_page_iter pit(*this, cmd); !pit.at_end(); pit++) {
                 auto dt = *pit;
                 std::fill(dt.begin(), dt.end(), uint8_t(0));
             }
             return nm_reply(tag, NVME_SC_SUCCESS, 0, AUXBITS_VALID);
+        } else if (!XlateBits::is_full(ext)) {
+            // the cluster doesn't map to a single location, or to one outside of the data file
+            // we have to serve it ourselves and can't let it be cached
+            nvme_cmd_lba_iter lit(*this, cmd);
+            auto ticket = new iovecs_ticket<xcow_ticket>(tag);
+            if (cmd.rw.control & NVME_RW_FUA) {
+                ticket->count++;
+                auto sqe = _ring.queue_fsync(ticket, true, 0, IORING_FSYNC_DATASYNC);
+                sqe->flags |= IOSQE_IO_LINK;
+            }
+            auto off = cmd.rw.slba % (1 << clus_lba_shift);
+            auto nbytes = (static_cast<size_t>(cmd.rw.length) + 1) << lbas;
+            if (from_backing(tl))
+                do_read_backing(ticket, cmd.rw.slba << lbas, nbytes, lit);
+            else
+                do_read_sub(ticket, tl, ext, off << lbas, nbytes, lit);
+            if (ticket->count > 0) {
+                ticket->aux[0] = AUXCMD_KEEP;
+                return ticket;
+            } else {
+                delete ticket;
+                return nm_reply(tag, NVME_SC_SUCCESS, UINT64_MAX, AUXCMD_KEEP);
+            }
         } else {
             return nm_reply(tag, NVME_SC_SUCCESS, tl, AUXCMD_FORWARD);
         }
     }
 }
 
+void nvme_xcow::do_read_backing(
+    iovecs_ticket<xcow_ticket> *ticket,
+    uint64_t addr,
+    size_t nbytes,
+    nvme_cmd_lba_iter &lit) {
+    while (nbytes) {
+        auto ext = _backing->locate(addr, nbytes);
+        if (ext.fid < 0) {
+            for (size_t done = 0; done < ext.nbytes; lit++) {
+                assert(!lit.at_end());
+                auto dt = *lit;
+                std::fill(dt.begin(), dt.end(), uint8_t(0));
+                done += dt.size();
+            }
+        } else {
+            auto &iovecs = ticket->iovecss.emplace_back();
+            iovecs.reserve(ext.nbytes / NVME_PAGE_SIZE + 1);
+            for (size_t done = 0; done < ext.nbytes; lit++) {
+                assert(!lit.at_end());
+                auto dt = *lit;
+                iovec_append(iovecs, dt);
+                done += dt.size();
+            }
+            ticket->count++;
+            _ring.queue_readv(ticket, iovecs, true, ext.fid + 1, ext.off, 0);
+        }
+        addr += ext.nbytes;
+        nbytes -= ext.nbytes;
+    }
+}
+
+nvme_xcow::cow_ticket_type *nvme_xcow::do_copy_up(uint32_t tag, uint64_t addr, uint64_t outoff) {
+    auto ticket = new cow_ticket_type(tag, cluster_size());
+    auto mem = ticket->mem.get();
+    for (size_t pos = 0; pos < cluster_size();) {
+        auto ext = _backing->locate(addr + pos, cluster_size() - pos);
+        if (ext.fid < 0) {
+            std::fill(mem + pos, mem + pos + ext.nbytes, 0);
+        } else {
+            ticket->count++;
+            auto sqe = _ring.queue_read(ticket, mem + pos, ext.nbytes, -1, true, ext.fid + 1, ext.off);
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        pos += ext.nbytes;
+    }
+    ticket->count++;
+    _ring.queue_write(ticket, mem, cluster_size(), -1, true, 0, outoff);
+    return ticket;
+}
+
+uint64_t nvme_xcow::subcluster_source(XlateLeaf tl, const XlateExt &ext, size_t i) {
+    auto bit = 1u << i;
+    if (ext.zero & bit)
+        return UINT64_MAX;
+    else if (ext.alloc & bit)
+        return XlateBits::decode_leaf(tl) + (i << subcluster_bits());
+    else if (!XlateBits::is_empty(ext.base))
+        return XlateBits::decode_leaf(ext.base) + (i << subcluster_bits());
+    else
+        return UINT64_MAX;
+}
+
+void nvme_xcow::do_read_sub(
+    iovecs_ticket<xcow_ticket> *ticket,
+    XlateLeaf tl,
+    const XlateExt &ext,
+    size_t off,
+    size_t nbytes,
+    nvme_cmd_lba_iter &lit) {
+    // runs of subclusters that are contiguous on disk are read together
+    std::vector<iovec> run;
+    uint64_t run_start = UINT64_MAX, run_end = UINT64_MAX;
+    auto flush_run = [&] {
+        if (run.empty())
+            return;
+        auto &iovecs = ticket->iovecss.emplace_back(std::move(run));
+        run = {};
+        run_end = UINT64_MAX;
+        ticket->count++;
+        _ring.queue_readv(ticket, iovecs, true, 0, run_start, 0);
+    };
+
+    auto end = off + nbytes;
+    while (off < end) {
+        auto i = off >> subcluster_bits();
+        auto sub_end = std::min(end, (i + 1) << subcluster_bits());
+        auto src = subcluster_source(tl, ext, i);
+        if (src == UINT64_MAX) {
+            flush_run();
+            for (; off < sub_end; off += (*lit).size()) {
+                assert(!lit.at_end());
+                auto dt = *lit;
+                std::fill(dt.begin(), dt.end(), uint8_t(0));
+                lit++;
+            }
+            continue;
+        }
+        src += off & (subcluster_size() - 1);
+        if (src != run_end) {
+            flush_run();
+            run.reserve(subcluster_size() / NVME_PAGE_SIZE + 1);
+            run_start = src;
+        }
+        for (; off < sub_end; lit++) {
+            assert(!lit.at_end());
+            auto dt = *lit;
+            iovec_append(run, dt);
+            off += dt.size();
+            src += dt.size();
+        }
+        run_end = src;
+    }
+    flush_run();
+}
+
 /*
  * metadata and block allocation/cow operations need to be synchronized wrt each other
  * otherwise we'd have a race condition as follows (for 2 requests on the same cluster):
@@ -157,8 +600,21 @@ nm_outcome nvme_xcow::do_write([[maybe_unused]] size_t sq, const nvme_command &c
     int lbas = ns_lba_shift(cmd.rw.nsid);
     auto clus_lba_shift = cluster_bits() - lbas;
     auto vblk = cmd.rw.slba >> clus_lba_shift;
+    auto flags = (cmd.rw.control & NVME_RW_FUA) ? RWF_DSYNC : 0;
+    // the data is only durable once the clusters it went to are
+    if (_log && flags)
+        _sync_tags.insert(tag);
     if (vblk != (cmd.rw.slba + cmd.rw.length) >> clus_lba_shift) {
-        printf("multiblock command %zu %#x: %#llx+%#hx\n", sq, tag, cmd.rw.slba, cmd.rw.length);
+        auto addr = cmd.rw.slba << lbas;
+        auto nbytes = (static_cast<uint64_t>(cmd.rw.length) + 1) << lbas;
+        // clusters that are ours already, and not being replaced by a transaction
+        if (!clusters_busy(addr, nbytes)) {
+            if (auto tl = contiguous_leaf(addr, nbytes, true)) {
+                _stats.multi_forwarded++;
+                return nm_reply(tag, NVME_SC_SUCCESS, *tl, AUXCMD_FORWARD);
+            }
+        }
+        _stats.multi_split++;
         blk_iter bi(cmd.rw.slba, static_cast<size_t>(cmd.rw.length) + 1, clus_lba_shift);
         nvme_cmd_lba_iter lit(*this, cmd);
         // ticket iovecs must be alive until submission
@@ -172,79 +628,325 @@ nm_outcome nvme_xcow::do_write([[maybe_unused]] size_t sq, const nvme_command &c
                 iovec_append(iovecs, *lit);
                 lit++;
             }
-
-            auto entry = _snap.tx_write_prep(*bi << lbas);
-            vblk = *bi >> clus_lba_shift;
-            auto off = *bi % (1 << clus_lba_shift);
-
-            if (XlateBits::needs_alloc(*entry) && !(*_clock)[vblk]) {
-                do_alloc_one_tx(noop_tag, vblk, entry);
-                (*_clock)[vblk] = true;
-            }
-            auto flags = (cmd.rw.control & NVME_RW_FUA) ? RWF_DSYNC : 0;
-
-            // do_write_one does not increment the ticket
+            // do_write_part does not increment the ticket
             // plus the work might be queued so we have to do it now
             ticket->count++;
-            if ((*_clock)[vblk])
-                _wq->emplace(vblk, [=, this, &iovecs](__s32 us) -> nm_outcome {
-                    // TODO: we leak the allocated blocks on cows
-                    if (us < 0) {
-                        if (!--ticket->count)
-                            delete ticket;
-                        // flush?
-                        return nm_reply(tag, translate_uring_status(us));
-                    } else {
-                        return do_write_one(ticket, iovecs, entry, off, flags);
-                    }
-                });
-            else
-                do_write_one(ticket, iovecs, entry, off, flags);
+            do_write_part(ticket, iovecs, *bi << lbas, bi.size() << lbas, flags);
         }
         return ticket;
     } else {
-        auto entry = _snap.tx_write_prep(cmd.rw.slba << lbas);
-        if (XlateBits::needs_alloc(*entry) && !(*_clock)[vblk]) {
-            auto [ticket, inoff, outoff] = do_alloc_one_tx(tag, vblk, entry);
-            (*_clock)[vblk] = true;
-            set_aux(ticket->aux, outoff, AUXBITS_VALID | AUXBITS_WRITABLE | AUXCMD_FORWARD);
-            return ticket;
-        } else if ((*_clock)[vblk]) {
-            _wq->emplace(vblk, [=](__s32 us) -> nm_outcome {
-                return nm_reply(tag, translate_uring_status(us), *entry, AUXCMD_FORWARD);
-            });
+        XlateExt *ext;
+        auto entry = _snap.tx_write_prep(cmd.rw.slba << lbas, &ext);
+        auto nblocks = static_cast<size_t>(cmd.rw.length) + 1;
+        if (_locks->held(vblk)) {
+            // look at the cluster again once it's unlocked, it might not be in the same state anymore
+            _locks->wait(vblk, [=, this](__s32) -> nm_outcome { return do_write(sq, cmd, tag); });
             return std::monostate{};
+        } else if (XlateBits::needs_alloc(*entry) && nblocks == (size_t{1} << clus_lba_shift)) {
+            // the cluster is overwritten entirely, so there's nothing to zero or copy beforehand
+            // write the guest data ourselves instead of forwarding, the entry can only be committed once it landed
+            auto ticket = new iovec_ticket<xcow_ticket>(tag);
+            for (nvme_cmd_page_iter pit(*this, cmd); !pit.at_end(); pit++)
+                iovec_append(ticket->iovecs, *pit);
+            auto outoff = do_alloc_full_tx(ticket, vblk, entry, ext);
+            _locks->lock(vblk);
+            ticket->count++;
+            _ring.queue_writev(ticket, ticket->iovecs, true, 0, outoff, flags);
+            return ticket;
+        } else if (XlateBits::needs_alloc(*entry) || !XlateBits::is_full(ext ? *ext : XlateBits::full_ext)) {
+            // partial overwrite of a cluster that isn't ours entirely yet
+            std::vector<iovec> iovecs;
+            iovecs.reserve(cluster_size() / NVME_PAGE_SIZE + 1);
+            for (nvme_cmd_page_iter pit(*this, cmd); !pit.at_end(); pit++)
+                iovec_append(iovecs, *pit);
+            auto off = (cmd.rw.slba % (1 << clus_lba_shift)) << lbas;
+            xcow_ticket *ticket;
+            if (ext && !from_backing(*entry)) {
+                // only the subclusters being written are allocated
+                ticket = do_write_sub(tag, vblk, entry, ext, off, iovecs, flags);
+            } else if (XlateBits::needs_cow(*entry)) {
+                // copy only what the guest doesn't overwrite
+                ticket = do_merged_cow(tag, vblk, entry, off, iovecs, flags);
+            } else {
+                // the whole cluster is copied up from the backing image, or zeroed
+                uint64_t outoff;
+                std::tie(ticket, std::ignore, outoff) = do_alloc_one_tx(tag, vblk, entry, ext);
+                set_aux(ticket->aux, outoff, AUXBITS_VALID | AUXBITS_WRITABLE | AUXCMD_FORWARD);
+            }
+            _locks->lock(vblk);
+            return ticket;
         } else {
             return nm_reply(tag, NVME_SC_SUCCESS, *entry, AUXCMD_FORWARD);
         }
     }
 }
 
+nm_outcome nvme_xcow::do_write_part(
+    iovecs_ticket<xcow_ticket> *ticket,
+    const std::vector<iovec> &iovecs,
+    uint64_t addr,
+    size_t nbytes,
+    int flags) {
+    auto vblk = addr >> cluster_bits();
+    auto off = addr & (cluster_size() - 1);
+    XlateExt *ext;
+    auto entry = _snap.tx_write_prep(addr, &ext);
+
+    if (_locks->held(vblk)) {
+        _locks->wait(vblk, [=, this, &iovecs](__s32) -> nm_outcome {
+            return do_write_part(ticket, iovecs, addr, nbytes, flags);
+        });
+        return std::monostate{};
+    } else if (!XlateBits::needs_alloc(*entry) && XlateBits::is_full(ext ? *ext : XlateBits::full_ext)) {
+        return do_write_one(ticket, iovecs, entry, off, flags);
+    } else if (((!ext && XlateBits::is_empty(*entry)) || from_backing(*entry)) && nbytes < cluster_size()) {
+        // zero or copy up the new cluster first, then write into it like into any other cluster
+        auto [alloc_ticket, inoff, outoff] = do_alloc_one_tx(noop_tag, vblk, entry, ext);
+        _locks->lock(vblk);
+        _locks->then(vblk, [=, this, &iovecs](__s32 us) -> nm_outcome {
+            if (us < 0)
+                return part_done(ticket, us);
+            return do_write_part(ticket, iovecs, addr, nbytes, flags);
+        });
+        return alloc_ticket;
+    }
+
+    // the guest data goes straight into the cluster, either alone or merged with the data around it
+    // the cluster ticket holds the lock and commits the entry, we only wait for it to unlock
+    xcow_ticket *cluster_ticket;
+    if (XlateBits::needs_alloc(*entry) && nbytes == cluster_size()) {
+        cluster_ticket = new xcow_ticket(noop_tag);
+        auto outoff = do_alloc_full_tx(cluster_ticket, vblk, entry, ext);
+        cluster_ticket->count++;
+        _ring.queue_writev(cluster_ticket, iovecs, true, 0, outoff, flags);
+    } else if (ext) {
+        cluster_ticket = do_write_sub(noop_tag, vblk, entry, ext, off, iovecs, flags);
+    } else {
+        cluster_ticket = do_merged_cow(noop_tag, vblk, entry, off, iovecs, flags);
+    }
+    _locks->lock(vblk);
+    _locks->then(vblk, [=](__s32 us) -> nm_outcome { return part_done(ticket, us); });
+    return cluster_ticket;
+}
+
 std::tuple<xcow_ticket *, uint64_t, uint64_t> nvme_xcow::do_alloc_one_tx(
     uint32_t tag,
     uint64_t vblk,
-    XlateLeaf *entry) {
+    XlateLeaf *entry,
+    XlateExt *ext) {
     xcow_ticket *ticket;
-    uint64_t inoff, outoff;
-    size_t tmp;
+    uint64_t inoff;
     assert(XlateBits::needs_alloc(*entry));
-    std::tie(outoff, tmp) = _snap.alloc_data_cluster();
-    if (XlateBits::is_empty(*entry)) {
+    std::optional<uint64_t> zeroed;
+    if (XlateBits::is_empty(*entry) && !from_backing(*entry))
+        zeroed = take_zeroed_cluster(vblk);
+    auto outoff = zeroed ? *zeroed : alloc_cluster(vblk);
+    if (from_backing(*entry)) {
+        inoff = UINT64_MAX;
+        ticket = do_copy_up(tag, vblk << cluster_bits(), outoff);
+    } else if (XlateBits::is_empty(*entry)) {
         inoff = UINT64_MAX;
         ticket = new xcow_ticket(tag);
         ticket->count++;
-        _ring.queue_fallocate(ticket, true, 0, FALLOC_FL_ZERO_RANGE, outoff, cluster_size());
+        if (zeroed)
+            // nothing left to do, the nop only keeps the cluster locked until the transaction commits
+            _ring.queue_nop(ticket);
+        else
+            _ring.queue_fallocate(ticket, true, 0, FALLOC_FL_ZERO_RANGE, outoff, cluster_size());
     } else { // XlateBits::needs_cow(*entry)
         inoff = XlateBits::decode_leaf(*entry);
         io_uring_sqe *cow_wqe;
         std::tie(ticket, cow_wqe) = do_cow(tag, inoff, outoff, cluster_size());
     }
-    ticket->locked_cluster = vblk;
-    ticket->last =
-        cleanup([&, entry, outoff] { _snap.tx_write_commit(*entry, XlateBits::encode_leaf(outoff, true), nullptr); });
+    do_lock_tx(ticket, vblk, entry, ext, outoff);
     return std::make_tuple(ticket, inoff, outoff);
 }
 
+void nvme_xcow::do_lock_tx(
+    xcow_ticket *ticket,
+    uint64_t vblk,
+    XlateLeaf *entry,
+    XlateExt *ext,
+    uint64_t outoff,
+    const XlateExt &newext) {
+    ticket->locked_cluster = vblk;
+    if (XlateBits::needs_alloc(*entry))
+        // nothing refers to the new cluster yet
+        ticket->undo = cleanup([&, outoff] { _file->free_data_clusters(outoff, 1); });
+    ticket->last = cleanup([&, vblk, entry, ext, outoff, newext] {
+        auto addr = vblk << cluster_bits();
+        if (ext)
+            _snap.tx_write_commit(addr, *entry, ext, XlateBits::encode_leaf(outoff, true), newext);
+        else
+            _snap.tx_write_commit(addr, *entry, XlateBits::encode_leaf(outoff, true), nullptr);
+    });
+}
+
+uint64_t nvme_xcow::do_alloc_full_tx(xcow_ticket *ticket, uint64_t vblk, XlateLeaf *entry, XlateExt *ext) {
+    assert(XlateBits::needs_alloc(*entry));
+    auto outoff = alloc_cluster(vblk);
+    do_lock_tx(ticket, vblk, entry, ext, outoff);
+    return outoff;
+}
+
+xcow_ticket *nvme_xcow::do_write_sub(
+    uint32_t tag,
+    uint64_t vblk,
+    XlateLeaf *entry,
+    XlateExt *ext,
+    size_t off,
+    std::span<const iovec> data,
+    int flags) {
+    size_t nbytes = 0;
+    for (const auto &v : data)
+        nbytes += v.iov_len;
+    assert(nbytes && off + nbytes <= cluster_size());
+    auto end = off + nbytes;
+    auto first = off >> subcluster_bits(), last = (end - 1) >> subcluster_bits();
+    auto written = XlateBits::subcluster_mask(first, last);
+
+    // the current view of the cluster, sources for the parts of the first and last subclusters that aren't written
+    auto cur_leaf = *entry;
+    auto cur = *ext;
+    uint64_t outoff;
+    XlateExt newext{};
+    // subclusters of the current cluster to carry over into a new one
+    uint32_t carried = 0;
+    if (XlateBits::needs_alloc(cur_leaf)) {
+        outoff = alloc_cluster(vblk);
+        if (XlateBits::is_empty(cur_leaf)) {
+            newext.base = XlateLeaf();
+        } else if (XlateBits::is_full(cur)) {
+            // the old cluster becomes the base of the new one, nothing needs to be copied
+            newext.base = XlateLeaf(cur_leaf & ~XlateBits::writable);
+        } else {
+            // keep the old base, we can only refer to one other cluster
+            newext.base = cur.base;
+            carried = cur.alloc & ~written;
+        }
+        newext.alloc = written | carried;
+        newext.zero = cur.zero & ~written;
+    } else {
+        outoff = XlateBits::decode_leaf(cur_leaf);
+        newext.base = cur.base;
+        newext.alloc = cur.alloc | written;
+        newext.zero = cur.zero & ~written;
+    }
+    if (XlateBits::is_full(newext))
+        newext.base = XlateLeaf();
+
+    // fill the rest of the first and last subclusters unless they're already in place
+    auto in_place = XlateBits::needs_alloc(cur_leaf) ? 0 : cur.alloc;
+    auto sub_mask = subcluster_size() - 1;
+    size_t head = (in_place & (1u << first)) ? 0 : off & sub_mask;
+    size_t tail = (in_place & (1u << last)) ? 0 : (subcluster_size() - (end & sub_mask)) & sub_mask;
+    auto head_src = head ? subcluster_source(cur_leaf, cur, first) : UINT64_MAX;
+    auto tail_src = tail ? subcluster_source(cur_leaf, cur, last) : UINT64_MAX;
+    if (tail_src != UINT64_MAX)
+        tail_src += end & sub_mask;
+    size_t bounce = (head_src != UINT64_MAX ? head : 0) + (tail_src != UINT64_MAX ? tail : 0) +
+                    (static_cast<size_t>(std::popcount(carried)) << subcluster_bits());
+
+    auto ticket = new merged_cow_ticket_type(tag, bounce);
+    auto mem = ticket->mem.get();
+    auto queue_fill = [&](uint64_t src, size_t len) {
+        if (src == UINT64_MAX) {
+            ticket->iovecs.push_back(iovec{_zeroes.get(), len});
+        } else {
+            ticket->count++;
+            auto sqe = _ring.queue_read(ticket, mem, len, -1, true, 0, src);
+            sqe->flags |= IOSQE_IO_LINK;
+            ticket->iovecs.push_back(iovec{mem, len});
+            mem += len;
+        }
+    };
+
+    ticket->iovecs.reserve(data.size() + 2);
+    if (head)
+        queue_fill(head_src, head);
+    ticket->iovecs.insert(ticket->iovecs.end(), data.begin(), data.end());
+    if (tail)
+        queue_fill(tail_src, tail);
+
+    // carried over subclusters are copied run by run before the guest write
+    for (size_t i = 0; i < XlateBits::subcluster_count;) {
+        if (!(carried & (1u << i))) {
+            i++;
+            continue;
+        }
+        auto j = i;
+        while (j < XlateBits::subcluster_count && (carried & (1u << j)))
+            j++;
+        auto run_off = i << subcluster_bits(), run_len = (j - i) << subcluster_bits();
+        auto inoff = XlateBits::decode_leaf(cur_leaf) + run_off;
+        if (_copy->method() != CopyMethod::none) {
+            queue_copy(ticket, inoff, outoff + run_off, run_len);
+        } else {
+            ticket->count += 2;
+            auto rqe = _ring.queue_read(ticket, mem, run_len, -1, true, 0, inoff);
+            rqe->flags |= IOSQE_IO_LINK;
+            auto wqe = _ring.queue_write(ticket, mem, run_len, -1, true, 0, outoff + run_off);
+            wqe->flags |= IOSQE_IO_LINK;
+            mem += run_len;
+        }
+        i = j;
+    }
+
+    ticket->count++;
+    _ring.queue_writev(ticket, ticket->iovecs, true, 0, outoff + off - head, flags);
+    do_lock_tx(ticket, vblk, entry, ext, outoff, newext);
+    return ticket;
+}
+
+xcow_ticket *nvme_xcow::do_merged_cow(
+    uint32_t tag,
+    uint64_t vblk,
+    XlateLeaf *entry,
+    size_t off,
+    std::span<const iovec> data,
+    int flags) {
+    assert(XlateBits::needs_cow(*entry));
+    size_t nbytes = 0;
+    for (const auto &v : data)
+        nbytes += v.iov_len;
+    assert(off + nbytes <= cluster_size());
+    auto tail = cluster_size() - off - nbytes;
+    auto inoff = XlateBits::decode_leaf(*entry);
+    auto outoff = alloc_cluster(vblk);
+
+    if (_copy->method() != CopyMethod::none) {
+        // the filesystem copies or shares the old cluster, only the guest data is left to write after it
+        auto ticket = new iovec_ticket<xcow_ticket>(tag);
+        ticket->iovecs.assign(data.begin(), data.end());
+        queue_copy(ticket, inoff, outoff, cluster_size());
+        ticket->count++;
+        _ring.queue_writev(ticket, ticket->iovecs, true, 0, outoff + off, flags);
+        do_lock_tx(ticket, vblk, entry, nullptr, outoff);
+        return ticket;
+    }
+
+    auto ticket = new merged_cow_ticket_type(tag, off + tail);
+    // old data before the guest write goes to mem[0, off), old data after it to mem[off, off + tail)
+    ticket->iovecs.reserve(data.size() + 2);
+    if (off) {
+        ticket->count++;
+        auto sqe = _ring.queue_read(ticket, ticket->mem.get(), off, -1, true, 0, inoff);
+        sqe->flags |= IOSQE_IO_LINK;
+        ticket->iovecs.push_back(iovec{ticket->mem.get(), off});
+    }
+    ticket->iovecs.insert(ticket->iovecs.end(), data.begin(), data.end());
+    if (tail) {
+        ticket->count++;
+        auto sqe = _ring.queue_read(ticket, ticket->mem.get() + off, tail, -1, true, 0, inoff + off + nbytes);
+        sqe->flags |= IOSQE_IO_LINK;
+        ticket->iovecs.push_back(iovec{ticket->mem.get() + off, tail});
+    }
+    ticket->count++;
+    _ring.queue_writev(ticket, ticket->iovecs, true, 0, outoff, flags);
+    do_lock_tx(ticket, vblk, entry, nullptr, outoff);
+    return ticket;
+}
+
 nm_outcome nvme_xcow::do_write_one(
     xcow_ticket *ticket,
     const std::vector<iovec> &iovecs,
@@ -258,77 +960,406 @@ nm_outcome nvme_xcow::do_write_one(
 }
 
 nm_outcome nvme_xcow::do_write_zeroes([[maybe_unused]] size_t sq, const nvme_command &cmd, uint32_t tag) {
-    int lbas = ns_lba_shift(cmd.rw.nsid);
+    int lbas = ns_lba_shift(cmd.write_zeroes.nsid);
     auto clus_lba_shift = cluster_bits() - lbas;
-    __u64 vblk = cmd.rw.slba >> clus_lba_shift;
-    if (vblk != (cmd.rw.slba + cmd.rw.length) >> clus_lba_shift) {
-        blk_iter bi(cmd.rw.slba, static_cast<size_t>(cmd.rw.length) + 1, clus_lba_shift);
-        auto ticket = new xcow_ticket(tag);
-        for (; !bi.at_end(); bi++) {
-            auto old = _snap.translate_read(*bi << lbas);
-            auto off = *bi % (1 << clus_lba_shift);
-            if (XlateBits::is_empty(old)) {
-                continue;
-            } else if (bi.size() == (1 << clus_lba_shift)) {
-                _snap.erase(*bi << lbas);
-                continue;
-            } else if (old & XlateBits::writable) {
-                ticket->count++;
-                _ring.queue_fallocate(
-                    ticket,
-                    true,
-                    0,
-                    FALLOC_FL_ZERO_RANGE,
-                    XlateBits::decode_leaf(old) + (off << lbas),
-                    bi.size() << lbas);
-            } else {
-                XlateLeaf prev{};
-                auto tl = _snap.translate_write(*bi << lbas, &prev);
-                loff_t inoff = XlateBits::decode_leaf(prev), outoff = XlateBits::decode_leaf(tl);
-                auto [cow_ticket, cow_wqe] = do_cow(noop_tag, inoff, outoff, cluster_size());
-                cow_wqe->flags |= IOSQE_IO_LINK;
-                ticket->count++;
-                _ring.queue_fallocate(ticket, true, 0, FALLOC_FL_ZERO_RANGE, outoff + (off << lbas), bi.size() << lbas);
-            }
+    bool deallocate = cmd.write_zeroes.control & NVME_WZ_DEAC;
+    if (_log && (cmd.write_zeroes.control & NVME_RW_FUA))
+        _sync_tags.insert(tag);
+    blk_iter bi(cmd.write_zeroes.slba, static_cast<size_t>(cmd.write_zeroes.length) + 1, clus_lba_shift);
+    auto ticket = new xcow_ticket(tag);
+    // most clusters only need their metadata changed and are done right away
+    // hold the ticket until all of them have been looked at
+    ticket->count++;
+    for (; !bi.at_end(); bi++) {
+        ticket->count++;
+        do_write_zeroes_part(ticket, *bi << lbas, bi.size() << lbas, deallocate);
+    }
+    if (auto outcome = part_done(ticket, 0); std::holds_alternative<nm_reply>(outcome))
+        return outcome;
+    return ticket;
+}
+
+nm_outcome nvme_xcow::do_write_zeroes_part(xcow_ticket *ticket, uint64_t addr, size_t nbytes, bool deallocate) {
+    auto vblk = addr >> cluster_bits();
+    auto off = addr & (cluster_size() - 1);
+    if (_locks->held(vblk)) {
+        _locks->wait(vblk, [=, this](__s32) -> nm_outcome {
+            return do_write_zeroes_part(ticket, addr, nbytes, deallocate);
+        });
+        return std::monostate{};
+    }
+    auto done = [ticket]() -> nm_outcome { return part_done(ticket, 0); };
+    // erasing may free the l0 table, which the entries of locked clusters point into
+    // with a backing image, erased clusters would read from the image again
+    auto table = addr & ~(uint64_t{_file->l0_cover_size()} - 1);
+    auto may_erase = !_backing && !clusters_busy(table, _file->l0_cover_size());
+
+    XlateExt cur;
+    auto tl = _snap.translate_read(addr, &cur);
+    if (nbytes == cluster_size()) {
+        if (deallocate && may_erase)
+            _snap.erase(addr);
+        else if (!XlateBits::is_zero(tl))
+            _snap.zero(addr);
+        return done();
+    } else if (XlateBits::is_empty(tl) && !from_backing(tl)) {
+        return done();
+    }
+
+    XlateExt *ext;
+    auto entry = _snap.tx_write_prep(addr, &ext);
+    if (from_backing(*entry)) {
+        // copy up the cluster, then zero the range like in any other cluster
+        auto [alloc_ticket, inoff, outoff] = do_alloc_one_tx(noop_tag, vblk, entry, ext);
+        _locks->lock(vblk);
+        _locks->then(vblk, [=, this](__s32 us) -> nm_outcome {
+            if (us < 0)
+                return part_done(ticket, us);
+            return do_write_zeroes_part(ticket, addr, nbytes, deallocate);
+        });
+        return alloc_ticket;
+    }
+    auto sub_mask = subcluster_size() - 1;
+    iovec zeroes{_zeroes.get(), nbytes};
+    xcow_ticket *cluster_ticket;
+    if (ext && !(off & sub_mask) && !(nbytes & sub_mask)) {
+        auto mask = XlateBits::subcluster_mask(off >> subcluster_bits(), (off + nbytes - 1) >> subcluster_bits());
+        if ((ext->zero | mask) != XlateBits::all_subclusters)
+            _snap.erase_subclusters(addr, mask);
+        else if (deallocate && may_erase)
+            _snap.erase(addr);
+        else
+            _snap.zero(addr);
+        return done();
+    } else if (ext) {
+        // the subclusters at both ends are only partly zeroed, write zeroes over the range like guest data
+        cluster_ticket = do_write_sub(noop_tag, vblk, entry, ext, off, std::span(&zeroes, 1), 0);
+    } else if (XlateBits::needs_cow(*entry)) {
+        cluster_ticket = do_merged_cow(noop_tag, vblk, entry, off, std::span(&zeroes, 1), 0);
+    } else {
+        // the cluster is ours, the filesystem zeroes the range in place
+        cluster_ticket = new xcow_ticket(noop_tag);
+        cluster_ticket->locked_cluster = vblk;
+        cluster_ticket->count++;
+        _ring.queue_fallocate(
+            cluster_ticket,
+            true,
+            0,
+            FALLOC_FL_ZERO_RANGE,
+            XlateBits::decode_leaf(*entry) + off,
+            nbytes);
+    }
+    _locks->lock(vblk);
+    _locks->then(vblk, [=](__s32 us) -> nm_outcome { return part_done(ticket, us); });
+    return cluster_ticket;
+}
+
+nm_outcome nvme_xcow::do_dsm([[maybe_unused]] size_t sq, const nvme_command &cmd, uint32_t tag) {
+    auto &idns = id_vns(cmd.dsm.nsid);
+    int lbas = lba_shift(*idns);
+    // the other attributes are access hints, which we have no use for
+    if (!(cmd.dsm.attributes & NVME_DSMGMT_AD))
+        return nm_reply(tag, NVME_SC_SUCCESS);
+
+    std::array<nvme_dsm_range, NVME_DSM_MAX_RANGES> ranges;
+    auto nr = static_cast<size_t>(cmd.dsm.nr & 0xff) + 1;
+    prp_list cmd_prpl{reinterpret_cast<prp_list::const_pointer>(&cmd.dsm.dptr.prp1), 2};
+    try {
+        auto dst = reinterpret_cast<unsigned char *>(ranges.data());
+        for (prp_chain_iter pit(vm(), cmd_prpl, 0, nr * sizeof(nvme_dsm_range)); !pit.at_end(); pit++) {
+            auto src = vm()->get_span(*pit, pit.this_nbytes());
+            dst = std::copy(src.begin(), src.end(), dst);
         }
-        if (ticket->count > 0) {
-            return ticket;
-        } else {
-            // all blocks are absent or already erased, no need to do anything
-            delete ticket;
-            return nm_reply(tag, NVME_SC_SUCCESS);
+    } catch (const std::out_of_range &) {
+        return nm_reply(tag, NVME_SC_DNR | NVME_SC_DATA_XFER_ERROR);
+    }
+    // nothing changes unless every range is good
+    for (size_t i = 0; i < nr; i++)
+        if (ranges[i].slba > idns->nsze || ranges[i].nlb > idns->nsze - ranges[i].slba)
+            return nm_reply(tag, NVME_SC_DNR | NVME_SC_LBA_RANGE);
+    for (size_t i = 0; i < nr; i++)
+        do_deallocate(ranges[i].slba << lbas, static_cast<uint64_t>(ranges[i].nlb) << lbas);
+    return nm_reply(tag, NVME_SC_SUCCESS);
+}
+
+void nvme_xcow::do_deallocate(uint64_t addr, uint64_t nbytes) {
+    auto end = addr + nbytes;
+    auto table_mask = uint64_t{_file->l0_cover_size()} - 1;
+    auto sub_mask = subcluster_size() - 1;
+    uint64_t table = UINT64_MAX;
+    bool may_erase = false;
+    for (auto pos = addr; pos < end;) {
+        auto next = std::min<uint64_t>((pos | (cluster_size() - 1)) + 1, end);
+        auto off = pos & (cluster_size() - 1), len = next - pos;
+        auto cur = pos;
+        pos = next;
+        if ((cur & ~table_mask) != table) {
+            // same as write zeroes: erasing may free the table, and would bring back the backing image
+            table = cur & ~table_mask;
+            may_erase = !_backing && !clusters_busy(table, _file->l0_cover_size());
         }
-    } else {
-        auto old = _snap.translate_read(cmd.rw.slba << lbas);
-        auto nblocks = static_cast<size_t>(cmd.rw.length) + 1;
-        if (XlateBits::is_empty(old)) {
-            // already zero, no need to write anything
-            return nm_reply(tag, NVME_SC_SUCCESS);
-        } else if (nblocks == (1 << clus_lba_shift)) {
-            _snap.erase(cmd.rw.slba << lbas);
-            return nm_reply(tag, NVME_SC_SUCCESS);
-        } else if (!(old & XlateBits::writable)) {
-            XlateLeaf prev{};
-            auto tl = _snap.translate_write(cmd.rw.slba << lbas, &prev);
-            loff_t inoff = XlateBits::decode_leaf(prev), outoff = XlateBits::decode_leaf(tl);
-            auto [cow_ticket, cow_wqe] = do_cow(noop_tag, inoff, outoff, cluster_size());
-            set_aux(cow_ticket->aux, tl, AUXCMD_FORWARD);
-            return cow_ticket;
-        } else {
-            return nm_reply(tag, NVME_SC_SUCCESS, old, AUXCMD_FORWARD);
+
+        XlateExt ext;
+        auto tl = _snap.translate_read(cur, &ext);
+        if (XlateBits::is_empty(tl))
+            continue;
+        if (clusters_busy(cur, len)) {
+            _stats.dealloc_skipped++;
+            continue;
+        }
+        if (len == cluster_size()) {
+            if (may_erase)
+                _snap.erase(cur);
+            else
+                _snap.zero(cur);
+            _stats.deallocated++;
+            continue;
         }
+        // only the subclusters within the range
+        auto first = (off + sub_mask) >> subcluster_bits(), last = (off + len) >> subcluster_bits();
+        if (!_file->extended_l2() || first >= last) {
+            _stats.dealloc_skipped++;
+            continue;
+        }
+        auto mask = XlateBits::subcluster_mask(first, last - 1);
+        if ((ext.zero | mask) != XlateBits::all_subclusters)
+            _snap.erase_subclusters(cur, mask);
+        else if (may_erase)
+            _snap.erase(cur);
+        else
+            _snap.zero(cur);
+        _stats.deallocated++;
     }
 }
 
 nm_outcome nvme_xcow::do_flush([[maybe_unused]] size_t sq, [[maybe_unused]] const nvme_command &cmd, uint32_t tag) {
     auto ticket = new xcow_ticket(tag);
-    ticket->count++;
-    _ring.queue_fsync(ticket, true, 0, IORING_FSYNC_DATASYNC);
     ticket->aux[0] = AUXCMD_KEEP | AUXCMD_FORWARD;
+    timespec start{};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ticket->last = cleanup([this, start] {
+        timespec now{};
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        _stats.flush_latency.record(now - start);
+    });
+    _stats.flushes++;
+    if (_log) {
+        log_wait(ticket);
+        return ticket;
+    }
+    ticket->count++;
+    auto sqe = _ring.queue_fsync(ticket, true, 0, IORING_FSYNC_DATASYNC);
+    if (_deref && _deref->has_dirty()) {
+        sqe->flags |= IOSQE_IO_LINK;
+        do_flush_meta(ticket);
+    } else if (_cache && _cache->has_dirty()) {
+        sqe->flags |= IOSQE_IO_LINK;
+        do_flush_cache(ticket);
+    }
     return ticket;
 }
 
+void nvme_xcow::do_flush_meta(xcow_ticket *ticket) {
+    // past this many ranges, a plain fdatasync writes back the same pages with fewer sqes
+    static constexpr size_t max_ranges = 256;
+
+    auto pages = _deref->take_dirty();
+    std::sort(pages.begin(), pages.end());
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    for (auto off : pages) {
+        if (!ranges.empty() && ranges.back().second == off)
+            ranges.back().second += NVME_PAGE_SIZE;
+        else
+            ranges.emplace_back(off, off + NVME_PAGE_SIZE);
+    }
+    _stats.meta_pages += pages.size();
+    _stats.meta_ranges += ranges.size();
+
+    // start writing back every range at once, then wait for all of them and the device cache with one fdatasync
+    // a failure anywhere cancels the rest of the chain and fails the flush
+    if (ranges.size() <= max_ranges) {
+        for (auto [first, last] : ranges) {
+            ticket->count++;
+            auto sqe = _ring.queue_sync_file_range(
+                ticket,
+                false,
+                _deref->fd(),
+                static_cast<off_t>(first),
+                static_cast<unsigned int>(last - first),
+                SYNC_FILE_RANGE_WRITE);
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+    }
+    ticket->count++;
+    _ring.queue_fsync(ticket, false, _deref->fd(), IORING_FSYNC_DATASYNC);
+}
+
+void nvme_xcow::do_flush_cache(xcow_ticket *ticket) {
+    static constexpr size_t max_ranges = 256;
+    static constexpr uint64_t max_write = 1 << 20;
+
+    auto units = _cache->take_dirty();
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    for (auto off : units) {
+        auto end = std::min<uint64_t>(off + _cache->unit_size(), _cache->size());
+        if (!ranges.empty() && ranges.back().second == off && end - ranges.back().first <= max_write)
+            ranges.back().second = end;
+        else
+            ranges.emplace_back(off, end);
+    }
+    for (auto [first, last] : ranges)
+        _stats.meta_pages += (last - first) / NVME_PAGE_SIZE;
+    _stats.meta_ranges += ranges.size();
+
+    if (ranges.size() <= max_ranges) {
+        // the units count as clean already, those that fail are dirty again
+        for (auto [first, last] : ranges) {
+            ticket->count++;
+            auto sqe = _ring.queue_write(
+                ticket,
+                _cache->deref(first, last - first).data(),
+                static_cast<unsigned int>(last - first),
+                -1,
+                false,
+                _cache->fd(),
+                static_cast<off_t>(first));
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        ticket->undo = cleanup([this, units] { _cache->redirty(units); });
+    } else {
+        // more than the ring should take for one flush, write them back right here instead
+        _cache->redirty(units);
+        _cache->commit(0, _cache->size());
+    }
+    ticket->count++;
+    _ring.queue_fsync(ticket, false, _cache->fd(), IORING_FSYNC_DATASYNC);
+}
+
+void nvme_xcow::log_wait(xcow_ticket *ticket) {
+    ticket->count++;
+    _log_waiters.push_back(ticket);
+    log_kick();
+}
+
+void nvme_xcow::log_kick() {
+    if (_log_busy || _log_waiters.empty())
+        return;
+
+    auto len = _log->prepare();
+    if (len && !_log->fits()) {
+        // no room left for the record, the checkpoint logs it in chunks before writing anything back
+        if (fdatasync(_bfd[0]) < 0)
+            throw std::system_error(errno, std::generic_category(), "cannot sync data");
+        _log->checkpoint();
+        len = 0;
+    }
+
+    // fsync -> record -> waiters: the metadata can't be durable before the data it refers to
+    using log_ticket_type = mem_ticket<xcow_ticket, MetaLog::block_size>;
+    auto record = new log_ticket_type(noop_tag, len);
+    record->count++;
+    auto sqe = _ring.queue_fsync(record, true, 0, IORING_FSYNC_DATASYNC);
+    sqe->flags |= IOSQE_IO_LINK;
+    if (len) {
+        auto off = _log->fill(std::span<uint8_t>(record->mem.get(), len));
+        record->count++;
+        sqe = _ring.queue_write(record, record->mem.get(), static_cast<unsigned int>(len), -1, false, _log->fd(), off);
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+    record->last = cleanup([this, len] {
+        if (len)
+            _log->committed();
+        _log_busy = false;
+        log_kick();
+    });
+    record->undo = cleanup([this] {
+        _log->aborted();
+        _log_busy = false;
+        log_kick();
+    });
+
+    auto waiters = std::exchange(_log_waiters, {});
+    for (auto ticket : waiters) {
+        sqe = _ring.queue_nop(ticket);
+        if (ticket != waiters.back())
+            sqe->flags |= IOSQE_IO_LINK;
+    }
+    _log_busy = true;
+    _ring.sq_kick();
+}
+
+bool nvme_xcow::defer_reply(const nm_reply &reply) {
+    if (!_log || !_sync_tags.erase(reply.tag) || reply.status != NVME_SC_SUCCESS)
+        return false;
+    // nothing to wait for if every change is already in the log
+    if (!_log_busy && !_log->pending())
+        return false;
+    auto ticket = new xcow_ticket(reply.tag);
+    ticket->aux = reply.aux;
+    log_wait(ticket);
+    return true;
+}
+
+void nvme_xcow::print_stats(FILE *f, const char *prefix) {
+    fprintf(
+        f,
+        "%s: flushes %lu p50 %luus p99 %luus p999 %luus, metadata written back %lu pages %lu ranges, "
+        "multi-cluster commands forwarded %lu split %lu, zeroed clusters pooled %zu hits %lu misses %lu, "
+        "deallocated clusters %lu skipped %lu",
+        prefix,
+        _stats.flushes,
+        _stats.flush_latency.percentile_us(500),
+        _stats.flush_latency.percentile_us(990),
+        _stats.flush_latency.percentile_us(999),
+        _stats.meta_pages,
+        _stats.meta_ranges,
+        _stats.multi_forwarded,
+        _stats.multi_split,
+        _zero_pool.size(),
+        _stats.zero_pool_hits,
+        _stats.zero_pool_misses,
+        _stats.deallocated,
+        _stats.dealloc_skipped);
+    if (_deref)
+        fprintf(f, ", dirty marks %lu pages pending %zu", _deref->dirty_marks(), _deref->tracked_pages());
+    if (_cache) {
+        auto cs = _cache->stats();
+        fprintf(
+            f,
+            ", metadata cache hits %lu misses %lu units read %lu evicted %lu written %lu resident %zu/%zu pinned %zu "
+            "dirty %zu",
+            cs.hits,
+            cs.misses,
+            cs.units_read,
+            cs.evictions,
+            cs.units_written,
+            cs.resident,
+            _cache->budget() / _cache->unit_size(),
+            cs.pinned,
+            cs.dirty);
+    }
+    auto &ls = _locks->stats();
+    fprintf(
+        f,
+        ", cluster locks %lu contended %lu max queue %lu wait p50 %luus p99 %luus",
+        ls.locked,
+        ls.contended,
+        ls.max_queue,
+        ls.wait_latency.percentile_us(500),
+        ls.wait_latency.percentile_us(990));
+    fprintf(f, "\n");
+}
+
+void nvme_xcow::log_checkpoint() {
+    if (!_log || _log_busy || !_log->checkpoint_due())
+        return;
+    if (fdatasync(_bfd[0]) < 0)
+        throw std::system_error(errno, std::generic_category(), "cannot sync data");
+    _log->checkpoint();
+}
+
 nm_outcome nvme_xcow::submit_async(size_t sq, const nvme_command &cmd, uint32_t tag) {
+    refresh_snap();
     try {
         if (sq == 0) {
             return nm_reply(tag, NVME_SC_DNR | NVME_SC_INVALID_OPCODE);
@@ -336,12 +1367,16 @@ nm_outcome nvme_xcow::submit_async(size_t sq, const nvme_command &cmd, uint32_t
             return do_read(sq, cmd, tag);
         } else if (cmd.common.opcode == nvme_cmd_write) {
             return do_write(sq, cmd, tag);
-            //} else if (cmd.common.opcode == nvme_cmd_write_zeroes) {
-            // return do_write_zeroes(sq, cmd, tag);
+        } else if (cmd.common.opcode == nvme_cmd_write_zeroes) {
+            return do_write_zeroes(sq, cmd, tag);
         } else if (cmd.common.opcode == nvme_cmd_flush) {
             return do_flush(sq, cmd, tag);
+        } else if (cmd.common.opcode == nvme_cmd_dsm) {
+            return do_dsm(sq, cmd, tag);
         } else if (cmd.common.opcode == 0x81) {
             return do_snapshot(sq, cmd, tag);
+        } else if (cmd.common.opcode == 0x82) {
+            return do_snapshot_delete(sq, cmd, tag);
         } else {
             DBG_PRINTF("sq %zu unknown opcode %#hhx cid %hu\n", sq, cmd.common.opcode, cmd.common.command_id);
         }
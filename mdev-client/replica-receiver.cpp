@@ -0,0 +1,74 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "util/remote.hpp"
+
+// serves one replicator connection, each replicator worker opens its own
+static void connection_func(int sock, const char *arg_blkdev) {
+    auto hsock = cleanup([=] { close(sock); });
+    int bfd = open(arg_blkdev, O_RDWR | O_DIRECT);
+    if (bfd < 0) {
+        perror("cannot open blkdev file");
+        return;
+    }
+    auto hbfd = cleanup([=] { close(bfd); });
+    try {
+        remote_receiver receiver(sock, bfd);
+        receiver.run();
+    } catch (const std::exception &e) {
+        fprintf(stderr, "connection failed: %s\n", e.what());
+    }
+}
+
+int main(int argc, char **argv) { // NOLINT
+    setbuf(stdout, NULL);
+
+    const char *arg_blkdev = nullptr;
+    const char *arg_listen = nullptr;
+    int o = 0;
+
+    while ((o = getopt(argc, argv, "b:l:")) != -1) {
+        switch (o) {
+        case 'b':
+            arg_blkdev = optarg;
+            break;
+        case 'l':
+            arg_listen = optarg;
+            break;
+        default:
+            printf("unknown flag %d\n", o);
+            return 1;
+        }
+    }
+
+    if (!arg_blkdev || !arg_listen || !is_remote_spec(arg_listen)) {
+        fprintf(stderr, "bad usage\n");
+        return 1;
+    }
+    // a replicator going away must only end its own connections
+    signal(SIGPIPE, SIG_IGN);
+
+    int lfd = remote_listen(arg_listen);
+    auto hlfd = cleanup([=] { close(lfd); });
+    while (true) {
+        int sock = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "cannot accept connection");
+        }
+        std::thread(connection_func, sock, arg_blkdev).detach();
+    }
+
+    return 0;
+}
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <array>
+#include <csignal>
 #include <bit>
 #include <cstring>
 #include <cstdio>
@@ -9,6 +11,7 @@
 #include <functional>
 #include <sstream>
 #include <span>
+#include <type_traits>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -17,8 +20,13 @@
 
 #include "util.hpp"
 #include "cmdbuf.hpp"
+#include "nvme_journal_aio.hpp"
 #include "nvme_sender_aio.hpp"
+#include "util/dirty_bitmap.hpp"
+#include "util/journal.hpp"
 #include "util/mdev.hpp"
+#include "util/remote.hpp"
+#include "util/resync.hpp"
 #include "util/time.hpp"
 #include "util/uring.hpp"
 
@@ -29,22 +37,17 @@ constexpr int sleeppoll_ms = 100;
 constexpr long busypoll_ms = 500;
 constexpr unsigned int busypoll_loops = 20;
 
-static void worker_func(
-    std::vector<size_t> sqids,
-    std::vector<int> sqfds,
-    const char *arg_blkdev,
-    unsigned char *pvm,
-    off_t pvm_size) {
-    if (!pvm || !pvm_size || sqids.empty() || sqids.size() != sqfds.size()) {
-        return;
-    }
-    auto vm = std::make_shared<mapping>(pvm, pvm_size);
-    int bfd = open(arg_blkdev, O_RDWR | O_DIRECT);
-    if (bfd < 0) {
-        throw std::system_error(errno, std::generic_category(), "cannot open blkdev file");
-    }
-
-    nvme_sender_aio controller(vm, sqfds.front(), bfd);
+template <typename Controller>
+static void run_queues(
+    Controller &controller,
+    const std::vector<size_t> &sqids,
+    const std::vector<int> &sqfds,
+    size_t tid,
+    unsigned int arg_stats_interval_s) {
+    std::ostringstream stats_prefix;
+    stats_prefix << "worker" << tid;
+    timespec last_stats{};
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &last_stats);
 
     std::vector<nsqbuf_t> nsqbuf;
     std::vector<ncqbuf_t> ncqbuf;
@@ -60,6 +63,14 @@ static void worker_func(
         ncqbuf.emplace_back(sqfd, NMNTFY_CQ_DATA_OFFSET);
         pollfds.push_back(pollfd{.fd = sqfd, .events = POLLIN});
     }
+    auto respond = [&](uint32_t tag, __u16 status) {
+        auto [qi, ucid] = unmake_tag(tag);
+        nmntfy_response resp{
+            .ucid = ucid,
+            .status = status,
+        };
+        cq_produce_one(ncqbuf[qi], resp);
+    };
 
     while (true) {
         bool succeeded = false;
@@ -74,11 +85,7 @@ static void worker_func(
                         auto tag = make_tag(qi, cmds[j].common.command_id);
                         auto submit_status = controller.submit_async(sqids[qi], cmds[j], tag);
                         if (submit_status != NVME_SC_SUCCESS) {
-                            nmntfy_response resp{
-                                .ucid = cmds[j].common.command_id,
-                                .status = submit_status,
-                            };
-                            cq_produce_one(ncqbuf[qi], resp);
+                            respond(tag, submit_status);
                         }
                     }
                 }
@@ -88,17 +95,27 @@ static void worker_func(
 
         auto wnd = controller.get_pending_completions(std::span(cqebuf));
         for (auto cqe : wnd.cqes) {
-            auto t = static_cast<sq_ticket *>(controller.cqe_get_data(cqe));
-            auto [qi, ucid] = unmake_tag(t->tag);
-            delete t;
-
-            auto status = cqe->res < 0 ? (NVME_SC_DNR | NVME_SC_INTERNAL) : NVME_SC_SUCCESS;
-            nmntfy_response resp{
-                .ucid = ucid,
-                .status = static_cast<__u16>(status),
-            };
-            cq_produce_one(ncqbuf[qi], resp);
-            controller.commit_completion(cqe);
+            if constexpr (std::is_same_v<Controller, nvme_journal_aio>) {
+                controller.complete(cqe);
+            } else {
+                controller.complete(cqe, respond);
+            }
+        }
+        controller.poll(respond);
+        if constexpr (std::is_same_v<Controller, nvme_journal_aio>) {
+            // held back commands and records of other workers do not wake up the queues
+            if (controller.busy()) {
+                succeeded = true;
+            }
+        }
+
+        if (arg_stats_interval_s) {
+            timespec now{};
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+            if (now - last_stats > 1000000000l * arg_stats_interval_s) {
+                controller.print_stats(stdout, stats_prefix.str().c_str());
+                last_stats = now;
+            }
         }
 
         if (succeeded) {
@@ -108,6 +125,12 @@ static void worker_func(
             clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
             if (now - last > 1000000l * busypoll_ms) {
                 // timeout
+                if constexpr (std::is_same_v<Controller, nvme_sender_aio>) {
+                    if (controller.merge_pending()) {
+                        // nothing kicks the mergers while we sleep
+                        controller.flush_merges();
+                    }
+                }
                 for (auto &pfd : pollfds) {
                     pfd.events = POLLIN;
                 }
@@ -119,18 +142,70 @@ static void worker_func(
     }
 }
 
+static void worker_func(
+    std::vector<size_t> sqids,
+    std::vector<int> sqfds,
+    std::vector<const char *> arg_blkdevs,
+    unsigned int arg_quorum,
+    unsigned int arg_merge_window_us,
+    unsigned int arg_stats_interval_s,
+    std::shared_ptr<dirty_bitmap> bitmap,
+    std::shared_ptr<replica_journal> journal,
+    size_t tid,
+    unsigned char *pvm,
+    off_t pvm_size) {
+    if (!pvm || !pvm_size || sqids.empty() || sqids.size() != sqfds.size()) {
+        return;
+    }
+    auto vm = std::make_shared<mapping>(pvm, pvm_size);
+    if (journal) {
+        // the journal's shipper owns the replica descriptors
+        nvme_journal_aio controller(vm, sqfds.front(), journal);
+        run_queues(controller, sqids, sqfds, tid, arg_stats_interval_s);
+        return;
+    }
+
+    std::vector<int> bfds;
+    for (auto blkdev : arg_blkdevs) {
+        if (is_remote_spec(blkdev)) {
+            // one connection per worker, the receiver serves each on its own
+            bfds.push_back(remote_connect(blkdev));
+            continue;
+        }
+        int bfd = open(blkdev, O_RDWR | O_DIRECT);
+        if (bfd < 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot open blkdev file");
+        }
+        bfds.push_back(bfd);
+    }
+
+    nvme_sender_aio controller(vm, sqfds.front(), std::span(bfds), arg_quorum, arg_merge_window_us, bitmap);
+    run_queues(controller, sqids, sqfds, tid, arg_stats_interval_s);
+}
+
 int main(int argc, char **argv) { // NOLINT
     setbuf(stdout, NULL);
 
     const char *arg_iommu_group = nullptr;
     const char *arg_mdev_uuid = nullptr;
     const char *arg_memfile = nullptr;
-    const char *arg_blkdev = nullptr;
+    // one per replica
+    std::vector<const char *> arg_blkdevs;
+    unsigned int arg_quorum = 0;
+    unsigned int arg_stats_interval_s = 0;
     size_t nthreads = 0;
     size_t arg_below_4g_mem_size = 2ull << 30;
+    unsigned int arg_merge_window_us = 0;
+    const char *arg_bitmap = nullptr;
+    unsigned int arg_region_shift = 22;
+    uint64_t arg_resync_mbps = 100;
+    const char *arg_journal = nullptr;
+    uint64_t arg_journal_mb = 1024;
+    uint64_t arg_max_lag_mb = 0;
+    unsigned int arg_max_lag_ms = 0;
     int o = 0;
 
-    while ((o = getopt(argc, argv, "g:d:m:b:e:B:k:j:il:")) != -1) {
+    while ((o = getopt(argc, argv, "g:d:m:b:e:B:k:j:il:w:q:s:D:G:r:J:C:L:T:")) != -1) {
         switch (o) {
         case 'g':
             arg_iommu_group = optarg;
@@ -142,7 +217,7 @@ int main(int argc, char **argv) { // NOLINT
             arg_memfile = optarg;
             break;
         case 'b':
-            arg_blkdev = optarg;
+            arg_blkdevs.push_back(optarg);
             break;
         case 'j':
             nthreads = static_cast<size_t>(atoi(optarg));
@@ -150,16 +225,106 @@ int main(int argc, char **argv) { // NOLINT
         case 'l':
             arg_below_4g_mem_size = strtoull(optarg, NULL, 0);
             break;
+        case 'w':
+            arg_merge_window_us = static_cast<unsigned int>(strtoul(optarg, NULL, 0));
+            break;
+        case 'q':
+            arg_quorum = static_cast<unsigned int>(strtoul(optarg, NULL, 0));
+            break;
+        case 's':
+            arg_stats_interval_s = static_cast<unsigned int>(strtoul(optarg, NULL, 0));
+            break;
+        case 'D':
+            arg_bitmap = optarg;
+            break;
+        case 'G':
+            arg_region_shift = static_cast<unsigned int>(strtoul(optarg, NULL, 0));
+            break;
+        case 'r':
+            arg_resync_mbps = strtoull(optarg, NULL, 0);
+            break;
+        case 'J':
+            arg_journal = optarg;
+            break;
+        case 'C':
+            arg_journal_mb = strtoull(optarg, NULL, 0);
+            break;
+        case 'L':
+            arg_max_lag_mb = strtoull(optarg, NULL, 0);
+            break;
+        case 'T':
+            arg_max_lag_ms = static_cast<unsigned int>(strtoul(optarg, NULL, 0));
+            break;
         default:
             printf("unknown flag %d\n", o);
             return 1;
         }
     }
 
-    if (!arg_iommu_group || !arg_mdev_uuid || !arg_memfile || !arg_blkdev) {
+    if (!arg_iommu_group || !arg_mdev_uuid || !arg_memfile || arg_blkdevs.empty()) {
         fprintf(stderr, "bad usage\n");
         return 1;
     }
+    if (!arg_quorum) {
+        // fully synchronous mirror by default
+        arg_quorum = static_cast<unsigned int>(arg_blkdevs.size());
+    }
+    if (arg_quorum > arg_blkdevs.size()) {
+        fprintf(stderr, "quorum larger than replica count\n");
+        return 1;
+    }
+
+    bool has_remote = std::any_of(arg_blkdevs.begin(), arg_blkdevs.end(), is_remote_spec);
+    if (has_remote && (arg_journal || arg_bitmap)) {
+        // both copy data with plain file I/O
+        fprintf(stderr, "remote replicas cannot be used with a journal or dirty bitmap\n");
+        return 1;
+    }
+    // a replica connection going down must fail its requests, not the whole process
+    signal(SIGPIPE, SIG_IGN);
+    if (arg_journal && arg_bitmap) {
+        // in async mode the journal already covers everything the targets have not seen
+        fprintf(stderr, "journal and dirty bitmap cannot be combined\n");
+        return 1;
+    }
+    if (arg_journal && arg_merge_window_us) {
+        // journal records are written one per command, there is nothing to merge
+        fprintf(stderr, "journal and write merging cannot be combined\n");
+        return 1;
+    }
+    std::shared_ptr<replica_journal> journal;
+    if (arg_journal) {
+        journal = std::make_shared<replica_journal>(
+            arg_journal,
+            arg_journal_mb << 20,
+            std::span(arg_blkdevs),
+            arg_max_lag_mb ? arg_max_lag_mb << 20 : arg_journal_mb << 20,
+            arg_max_lag_ms);
+    }
+
+    std::shared_ptr<dirty_bitmap> bitmap;
+    std::unique_ptr<resync_engine> resync;
+    if (arg_bitmap) {
+        int fd = open(arg_blkdevs.front(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot open blkdev file");
+        }
+        auto dev_size = lseek(fd, 0, SEEK_END);
+        close(fd);
+        if (dev_size <= 0) {
+            fprintf(stderr, "cannot get blkdev size\n");
+            return 1;
+        }
+        bitmap = std::make_shared<dirty_bitmap>(
+            arg_bitmap,
+            static_cast<uint64_t>(dev_size),
+            arg_region_shift,
+            static_cast<unsigned int>(arg_blkdevs.size()));
+        if (auto n = bitmap->count_sticky()) {
+            printf("resyncing %zu dirty regions\n", n);
+        }
+        resync = std::make_unique<resync_engine>(bitmap, std::span(arg_blkdevs), arg_resync_mbps << 20);
+    }
 
     std::vector<int> sqfds(MAX_VIRTUAL_QUEUES);
     if (mdev_open(arg_iommu_group, arg_mdev_uuid, sqfds) < 0) {
@@ -197,7 +362,13 @@ int main(int argc, char **argv) { // NOLINT
             worker_func,
             worker_sqids[tid],
             worker_sqfds[tid],
-            arg_blkdev,
+            arg_blkdevs,
+            arg_quorum,
+            arg_merge_window_us,
+            arg_stats_interval_s,
+            bitmap,
+            journal,
+            tid,
             static_cast<unsigned char *>(pvm),
             pvm_size);
 
@@ -1,11 +1,14 @@
 #include "enclave.hpp"
 
+#include <algorithm>
 #include <map>
 #include <sstream>
+#include <thread>
 #include <utility>
 
 #include "sgx_error.h"
 #include "sgx_urts.h"
+#include "sgx/Enclave_u.h"
 
 static const std::map<sgx_status_t, std::string> sgx_error_codes = {
     {SGX_SUCCESS, "Success"},
@@ -108,11 +111,13 @@ static const std::map<sgx_status_t, std::string> sgx_error_codes = {
     {SGX_INTERNAL_ERROR_ENCLAVE_CREATE_INTERRUPTED, "The ioctl for enclave_create unexpectedly failed with EINTR."},
 };
 
-sgx_enclave::sgx_enclave(const std::string &filename, bool debug) {
+sgx_enclave::sgx_enclave(const std::string &filename, bool debug, unsigned int nthreads) {
+    nthreads = std::max(nthreads, 1u);
     _exfeat_switchless = {
-        .switchless_calls_pool_size_qwords = 1,
+        // one pool slot per bit
+        .switchless_calls_pool_size_qwords = (nthreads + 63) / 64,
         .num_uworkers = 1,
-        .num_tworkers = 1,
+        .num_tworkers = nthreads,
         .retries_before_fallback = 20000,
         .retries_before_sleep = 20000,
         .callback_func = {0},
@@ -163,3 +168,8 @@ std::string sgx_category::message(int condition) const {
         return ef.str();
     }
 }
+
+// ocall used by an idle crypt_ring_run
+void crypt_ring_wait(unsigned int usec) {
+    std::this_thread::sleep_for(std::chrono::microseconds(usec));
+}
@@ -6,6 +6,9 @@ static void clear_cache() {
     std::fill(cache_tag.begin(), cache_tag.end(), 0);
     std::fill(cache_plba.begin(), cache_plba.end(), 0);
     std::fill(cache_meta.begin(), cache_meta.end(), 0);
+    std::fill(cache_epoch.begin(), cache_epoch.end(), 0);
+    snap_epoch[0] = 0;
+    valid_epoch[0] = 0;
 }
 
 static void print_cache() {
@@ -152,6 +155,231 @@ TEST_CASE("lbacache tests") {
         REQUIRE(ctx.cmd.rw.slba == 1280 * CLUSTER_LBAS + 559 % CLUSTER_LBAS);
     }
 
+    SECTION("wz") {
+        clear_cache();
+
+        bpf_io_ctx ctx{};
+        ctx.cmd.common.opcode = nvme_cmd_write;
+        ctx.cmd.rw.slba = 555;
+        ctx.cmd.rw.length = 3;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+
+        ctx.aux[0] = AUXBITS_VALID | AUXBITS_WRITABLE | AUXCMD_FORWARD;
+        ctx.aux[1] = 1280 * CLUSTER_SIZE;
+        ctx.aux[2] = 0;
+        ctx.current_hook = NMBPF_HOOK_NFD_WRITE;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+
+        // a read of another cluster sent before the write zeroes
+        bpf_io_ctx rd{};
+        rd.cmd.common.opcode = nvme_cmd_read;
+        rd.cmd.rw.slba = 555 + 4 * CLUSTER_LBAS;
+        rd.cmd.rw.length = 3;
+        rd.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&rd) & NMBPF_SEND_FD);
+
+        // even with a writable translation cached, the whole range goes to the server
+        ctx.cmd.common.opcode = nvme_cmd_write_zeroes;
+        ctx.cmd.write_zeroes.slba = 500;
+        ctx.cmd.write_zeroes.length = 2 * CLUSTER_LBAS;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+        REQUIRE(ctx.cmd.write_zeroes.slba == 500);
+
+        ctx.cmd.common.opcode = nvme_cmd_read;
+        ctx.cmd.rw.slba = 559;
+        ctx.cmd.rw.length = 3;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+
+        // the cluster it names may have been freed by the write zeroes and reused
+        rd.aux[0] = AUXBITS_VALID | AUXCMD_FORWARD;
+        rd.aux[1] = 1290 * CLUSTER_SIZE;
+        rd.aux[2] = 0;
+        rd.current_hook = NMBPF_HOOK_NFD_WRITE;
+        REQUIRE(nvme_run_bpf(&rd) & NMBPF_SEND_HQ);
+        rd.cmd.rw.slba = 555 + 4 * CLUSTER_LBAS;
+        rd.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&rd) & NMBPF_SEND_FD);
+    }
+
+    SECTION("multi") {
+        clear_cache();
+
+        bpf_io_ctx ctx{};
+        ctx.cmd.common.opcode = nvme_cmd_read;
+        ctx.cmd.rw.slba = 555;
+        ctx.cmd.rw.length = CLUSTER_LBAS;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+
+        // the server found both clusters back to back
+        ctx.aux[0] = AUXBITS_VALID | AUXCMD_FORWARD;
+        ctx.aux[1] = 768 * CLUSTER_SIZE;
+        ctx.aux[2] = 0;
+        ctx.current_hook = NMBPF_HOOK_NFD_WRITE;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+        REQUIRE(ctx.cmd.rw.slba == 768 * CLUSTER_LBAS + 555 % CLUSTER_LBAS);
+
+        ctx.cmd.rw.slba = 555 + CLUSTER_LBAS;
+        ctx.cmd.rw.length = 3;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+        REQUIRE(ctx.cmd.rw.slba == 769 * CLUSTER_LBAS + 555 % CLUSTER_LBAS);
+
+        ctx.cmd.rw.slba = 560;
+        ctx.cmd.rw.length = CLUSTER_LBAS;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+        REQUIRE(ctx.cmd.rw.slba == 768 * CLUSTER_LBAS + 560 % CLUSTER_LBAS);
+
+        // not writable, and every cluster of the write is dropped
+        ctx.cmd.common.opcode = nvme_cmd_write;
+        ctx.cmd.rw.slba = 555;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+
+        ctx.cmd.common.opcode = nvme_cmd_read;
+        ctx.cmd.rw.slba = 555 + CLUSTER_LBAS;
+        ctx.cmd.rw.length = 3;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+
+        ctx.aux[0] = AUXBITS_VALID | AUXCMD_FORWARD;
+        ctx.aux[1] = 900 * CLUSTER_SIZE;
+        ctx.current_hook = NMBPF_HOOK_NFD_WRITE;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+
+        ctx.cmd.rw.slba = 555;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+        ctx.aux[1] = 768 * CLUSTER_SIZE;
+        ctx.current_hook = NMBPF_HOOK_NFD_WRITE;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+
+        // both clusters are cached, but not back to back
+        ctx.cmd.rw.slba = 555;
+        ctx.cmd.rw.length = CLUSTER_LBAS;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+    }
+
+    SECTION("snapshot") {
+        clear_cache();
+
+        bpf_io_ctx ctx{};
+        ctx.cmd.common.opcode = nvme_cmd_write;
+        ctx.cmd.rw.slba = 555;
+        ctx.cmd.rw.length = 3;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+
+        ctx.aux[0] = AUXBITS_VALID | AUXBITS_WRITABLE | AUXCMD_FORWARD;
+        ctx.aux[1] = 1280 * CLUSTER_SIZE;
+        ctx.aux[2] = 0;
+        ctx.current_hook = NMBPF_HOOK_NFD_WRITE;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+        // the device never sees the epoch
+        REQUIRE(ctx.cmd.rw.rsvd2 == 0);
+
+        bpf_io_ctx snap{};
+        snap.cmd.common.opcode = 0x81;
+        snap.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&snap) & NMBPF_SEND_FD);
+
+        // still there for reads, but writes go to the server
+        ctx.cmd.common.opcode = nvme_cmd_read;
+        ctx.cmd.rw.slba = 559;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+        REQUIRE(ctx.cmd.rw.slba == 1280 * CLUSTER_LBAS + 559 % CLUSTER_LBAS);
+
+        ctx.cmd.common.opcode = nvme_cmd_write;
+        ctx.cmd.rw.slba = 559;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+
+        // a write sent before the next snapshot, but answered after it
+        ctx.cmd.common.opcode = nvme_cmd_write;
+        ctx.cmd.rw.slba = 555 + CLUSTER_LBAS;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+        REQUIRE(nvme_run_bpf(&snap) & NMBPF_SEND_FD);
+        ctx.aux[1] = 1400 * CLUSTER_SIZE;
+        ctx.current_hook = NMBPF_HOOK_NFD_WRITE;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+        REQUIRE(ctx.cmd.rw.slba == 1400 * CLUSTER_LBAS + 555 % CLUSTER_LBAS);
+
+        ctx.cmd.rw.slba = 555 + CLUSTER_LBAS;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+
+        // answered in the current epoch
+        ctx.aux[1] = 1500 * CLUSTER_SIZE;
+        ctx.current_hook = NMBPF_HOOK_NFD_WRITE;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+
+        ctx.cmd.rw.slba = 555 + CLUSTER_LBAS;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+        REQUIRE(ctx.cmd.rw.slba == 1500 * CLUSTER_LBAS + 555 % CLUSTER_LBAS);
+    }
+
+    SECTION("deallocate") {
+        clear_cache();
+
+        bpf_io_ctx ctx{};
+        ctx.cmd.common.opcode = nvme_cmd_read;
+        ctx.cmd.rw.slba = 555;
+        ctx.cmd.rw.length = 3;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+        ctx.aux[0] = AUXBITS_VALID | AUXCMD_FORWARD;
+        ctx.aux[1] = 1280 * CLUSTER_SIZE;
+        ctx.aux[2] = 0;
+        ctx.current_hook = NMBPF_HOOK_NFD_WRITE;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+
+        // hints alone keep the cache
+        bpf_io_ctx dsm{};
+        dsm.cmd.common.opcode = nvme_cmd_dsm;
+        dsm.cmd.dsm.attributes = NVME_DSMGMT_IDR;
+        dsm.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&dsm) & NMBPF_SEND_FD);
+        ctx.cmd.rw.slba = 559;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+
+        // a read sent before the deallocate, but answered after it
+        ctx.cmd.rw.slba = 555 + CLUSTER_LBAS;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+        dsm.cmd.dsm.attributes = NVME_DSMGMT_AD;
+        REQUIRE(nvme_run_bpf(&dsm) & NMBPF_SEND_FD);
+        ctx.aux[1] = 1400 * CLUSTER_SIZE;
+        ctx.current_hook = NMBPF_HOOK_NFD_WRITE;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+        REQUIRE(ctx.cmd.rw.slba == 1400 * CLUSTER_LBAS + 555 % CLUSTER_LBAS);
+
+        // neither translation is used anymore
+        ctx.cmd.rw.slba = 559;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+        ctx.cmd.rw.slba = 555 + CLUSTER_LBAS;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_FD);
+
+        // answered after the deallocate
+        ctx.aux[1] = 1500 * CLUSTER_SIZE;
+        ctx.current_hook = NMBPF_HOOK_NFD_WRITE;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+        ctx.cmd.rw.slba = 555 + CLUSTER_LBAS;
+        ctx.current_hook = NMBPF_HOOK_VSQ;
+        REQUIRE(nvme_run_bpf(&ctx) & NMBPF_SEND_HQ);
+        REQUIRE(ctx.cmd.rw.slba == 1500 * CLUSTER_LBAS + 555 % CLUSTER_LBAS);
+    }
+
     SECTION("r4") {
         clear_cache();
 
@@ -0,0 +1,275 @@
+#include <array>
+#include <cstdarg>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <catch_amalgamated.hpp>
+#include "nvme_sender_aio.hpp"
+#include "util/remote.hpp"
+
+static constexpr size_t block = 4096;
+static constexpr size_t nwrites = 4096;
+// larger than a frame, goes out in its own heap frame
+static constexpr size_t big_write = 3 << 20;
+static constexpr size_t dev_size = nwrites * block + big_write;
+
+static unsigned char pattern(size_t offset) {
+    return static_cast<unsigned char>(offset / block * 7 + offset % 251);
+}
+
+// runs the client until every ticket has been answered, results are indexed by tag
+static void run_client(uring &ring, remote_client &client, std::vector<int> &results, size_t count) {
+    std::array<io_uring_cqe *, 64> cqebuf{};
+    size_t done = 0;
+    client.kick(ring);
+    while (done < count) {
+        ring.sq_kick_wait(1);
+        auto wnd = ring.cq_get_ready(std::span(cqebuf));
+        for (auto cqe : wnd.cqes) {
+            auto io = static_cast<remote_io_ticket *>(io_uring_cqe_get_data(cqe));
+            REQUIRE(io->tag == remote_tag);
+            client.complete(ring, io, cqe->res, [&](sq_ticket *t, int res) {
+                results[t->tag] = res;
+                done++;
+            });
+        }
+        ring.cq_commit(wnd);
+    }
+}
+
+TEST_CASE("remote replica over loopback") {
+    // writes to a dead connection must fail, not kill the test
+    signal(SIGPIPE, SIG_IGN);
+    char path[] = "test-remote.XXXXXX";
+    int bfd = mkstemp(path);
+    REQUIRE(bfd >= 0);
+    unlink(path);
+    REQUIRE(ftruncate(bfd, dev_size) == 0);
+
+    int lfd = remote_listen("tcp:127.0.0.1:0");
+    sockaddr_in sa{};
+    socklen_t salen = sizeof(sa);
+    REQUIRE(getsockname(lfd, reinterpret_cast<sockaddr *>(&sa), &salen) == 0);
+    std::thread server([=] {
+        int s = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (s >= 0) {
+            remote_receiver receiver(s, bfd);
+            receiver.run();
+            close(s);
+        }
+    });
+
+    auto spec = "tcp:127.0.0.1:" + std::to_string(ntohs(sa.sin_port));
+    int sock = remote_connect(spec.c_str());
+    std::array<int, 1> files{{sock}};
+    remote_client client(0);
+    std::vector<iovec> bufs(client.buffers().begin(), client.buffers().end());
+    client.set_buf_base(0);
+    uring ring(256, 0, std::span(files), std::span(bufs));
+
+    std::vector<unsigned char> data(dev_size);
+    for (size_t i = 0; i < dev_size; i++) {
+        data[i] = pattern(i);
+    }
+    std::vector<std::unique_ptr<sq_ticket>> tickets;
+    auto ticket = [&] { return tickets.emplace_back(std::make_unique<sq_ticket>(tickets.size())).get(); };
+
+    SECTION("pipelined writes and flush") {
+        // many small writes, batched into frames, with more outstanding than there are registered frames
+        for (size_t i = 0; i < nwrites; i++) {
+            iovec v{data.data() + i * block, block};
+            client.queue_write(ticket(), static_cast<off_t>(i * block), std::span(&v, 1), false);
+        }
+        iovec big{data.data() + nwrites * block, big_write};
+        client.queue_write(ticket(), static_cast<off_t>(nwrites * block), std::span(&big, 1), true);
+        client.queue_flush(ticket());
+
+        std::vector<int> results(tickets.size(), 1);
+        run_client(ring, client, results, tickets.size());
+        for (auto r : results) {
+            REQUIRE(r == 0);
+        }
+
+        std::vector<unsigned char> readback(dev_size);
+        REQUIRE(pread(bfd, readback.data(), dev_size, 0) == static_cast<ssize_t>(dev_size));
+        REQUIRE(readback == data);
+    }
+
+    SECTION("write zeroes") {
+        iovec v{data.data(), 4 * block};
+        client.queue_write(ticket(), 0, std::span(&v, 1), false);
+        client.queue_flush(ticket());
+        std::vector<int> results(tickets.size(), 1);
+        run_client(ring, client, results, tickets.size());
+
+        client.queue_write_zeroes(ticket(), block, 2 * block);
+        client.queue_flush(ticket());
+        results.assign(tickets.size(), 1);
+        run_client(ring, client, results, 2);
+        REQUIRE(results[2] == 0);
+        REQUIRE(results[3] == 0);
+
+        std::vector<unsigned char> readback(4 * block);
+        REQUIRE(pread(bfd, readback.data(), readback.size(), 0) == static_cast<ssize_t>(readback.size()));
+        for (size_t i = 0; i < readback.size(); i++) {
+            REQUIRE(readback[i] == ((i >= block && i < 3 * block) ? 0 : pattern(i)));
+        }
+    }
+
+    SECTION("connection loss fails outstanding requests") {
+        shutdown(sock, SHUT_RDWR);
+        iovec v{data.data(), block};
+        client.queue_write(ticket(), 0, std::span(&v, 1), false);
+        std::vector<int> results(tickets.size(), 1);
+        run_client(ring, client, results, tickets.size());
+        REQUIRE(results[0] < 0);
+        REQUIRE(client.dead());
+    }
+
+    shutdown(sock, SHUT_RDWR);
+    server.join();
+    close(sock);
+    close(lfd);
+    close(bfd);
+}
+
+// the identify data the controller under test reads through its notify fd, there's no mdev behind it
+static int fake_nfd = -1;
+static nvme_id_ctrl fake_id_ctrl;
+static nvme_id_ns fake_id_ns;
+
+extern "C" int ioctl(int fd, unsigned long request, ...) noexcept {
+    va_list ap;
+    va_start(ap, request);
+    auto arg = va_arg(ap, void *);
+    va_end(ap);
+    if (fd != fake_nfd || fd < 0) {
+        return static_cast<int>(syscall(SYS_ioctl, fd, request, arg));
+    }
+    switch (request) {
+    case NVME_MDEV_NOTIFYFD_ID_VCTRL:
+        memcpy(static_cast<nvme_mdev_id_vctrl *>(arg)->data, &fake_id_ctrl, sizeof(fake_id_ctrl));
+        return 0;
+    case NVME_MDEV_NOTIFYFD_ID_VNS:
+        memcpy(static_cast<nvme_mdev_id_vns *>(arg)->data, &fake_id_ns, sizeof(fake_id_ns));
+        return 0;
+    }
+    errno = ENOTTY;
+    return -1;
+}
+
+TEST_CASE("guest commands to a remote replica") {
+    static constexpr int lba_shift = 9;
+    static constexpr size_t npages = 64;
+    signal(SIGPIPE, SIG_IGN);
+    char path[] = "test-remote.XXXXXX";
+    int bfd = mkstemp(path);
+    REQUIRE(bfd >= 0);
+    unlink(path);
+    REQUIRE(ftruncate(bfd, npages * block) == 0);
+
+    int lfd = remote_listen("tcp:127.0.0.1:0");
+    sockaddr_in sa{};
+    socklen_t salen = sizeof(sa);
+    REQUIRE(getsockname(lfd, reinterpret_cast<sockaddr *>(&sa), &salen) == 0);
+    std::thread server([=] {
+        int s = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (s >= 0) {
+            remote_receiver receiver(s, bfd);
+            receiver.run();
+            close(s);
+        }
+    });
+    auto spec = "tcp:127.0.0.1:" + std::to_string(ntohs(sa.sin_port));
+    int sock = remote_connect(spec.c_str());
+
+    fake_nfd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    REQUIRE(fake_nfd >= 0);
+    fake_id_ctrl = nvme_id_ctrl{};
+    fake_id_ctrl.mdts = 5;
+    fake_id_ns = nvme_id_ns{};
+    fake_id_ns.lbaf[0].ds = lba_shift;
+
+    // one guest page per write
+    auto guest = mmap(nullptr, npages * block, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    REQUIRE(guest != MAP_FAILED); // NOLINT
+    auto vm = std::make_shared<mapping>(static_cast<unsigned char *>(guest), npages * block);
+    auto gdata = vm->get_span(0, npages * block);
+    for (size_t i = 0; i < gdata.size(); i++) {
+        gdata[i] = pattern(i);
+    }
+
+    {
+        nvme_sender_aio sender(vm, fake_nfd, std::span<const int>(&sock, 1), 1);
+        std::vector<__u16> replies(npages + 2, 0xffff);
+        size_t nreplies = 0;
+        auto respond = [&](uint32_t tag, __u16 status) {
+            replies.at(tag) = status;
+            nreplies++;
+        };
+        auto run = [&](size_t count) {
+            std::array<io_uring_cqe *, 64> cqebuf{};
+            while (nreplies < count) {
+                sender.sq_kick();
+                auto wnd = sender.get_pending_completions(std::span(cqebuf));
+                for (auto cqe : wnd.cqes) {
+                    sender.complete(cqe, respond);
+                }
+                sender.poll(respond);
+            }
+        };
+
+        for (size_t i = 0; i < npages; i++) {
+            nvme_command cmd{};
+            cmd.rw.opcode = nvme_cmd_write;
+            cmd.rw.nsid = 1;
+            cmd.rw.slba = i * block >> lba_shift;
+            cmd.rw.length = (block >> lba_shift) - 1;
+            cmd.rw.dptr.prp1 = i * block;
+            REQUIRE(sender.submit_async(0, cmd, static_cast<uint32_t>(i)) == NVME_SC_SUCCESS);
+        }
+        // overlapping commands may run in any order, the zeroes wait for the writes
+        run(npages);
+        nvme_command zeroes{};
+        zeroes.write_zeroes.opcode = nvme_cmd_write_zeroes;
+        zeroes.write_zeroes.nsid = 1;
+        zeroes.write_zeroes.slba = block >> lba_shift;
+        zeroes.write_zeroes.length = (2 * block >> lba_shift) - 1;
+        REQUIRE(sender.submit_async(0, zeroes, npages) == NVME_SC_SUCCESS);
+        nvme_command flush{};
+        flush.common.opcode = nvme_cmd_flush;
+        flush.common.nsid = 1;
+        REQUIRE(sender.submit_async(0, flush, npages + 1) == NVME_SC_SUCCESS);
+        run(replies.size());
+
+        for (auto status : replies) {
+            REQUIRE(status == NVME_SC_SUCCESS);
+        }
+        REQUIRE(sender.stats(0).failed == 0);
+    }
+
+    std::vector<unsigned char> readback(npages * block);
+    REQUIRE(pread(bfd, readback.data(), readback.size(), 0) == static_cast<ssize_t>(readback.size()));
+    for (size_t i = 0; i < readback.size(); i++) {
+        REQUIRE(readback[i] == ((i >= block && i < 3 * block) ? 0 : pattern(i)));
+    }
+
+    shutdown(sock, SHUT_RDWR);
+    server.join();
+    munmap(guest, npages * block);
+    close(fake_nfd);
+    fake_nfd = -1;
+    close(sock);
+    close(lfd);
+    close(bfd);
+}
@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <catch_amalgamated.hpp>
+#include "sgx/prp_en.hpp"
+#include "sgx/crypt_ring.hpp"
+
+// build the enclave with SGX_MODE=SIM to run this without SGX hardware
+static const std::string esopath = "../encryptor-sgx/enclave.signed.so";
+static constexpr int lba_shift = 9;
+static constexpr size_t nthreads = 8;
+static constexpr size_t niters = 2000;
+// 4 pages per thread: plaintext, ciphertext, in-place scratch, unused
+static constexpr size_t thread_area = 4 * NVME_PAGE_SIZE;
+static constexpr size_t memsize = nthreads * thread_area;
+
+// one page worth of blocks, single PRP entry
+static nvme_command make_cmd(uint64_t slba, uint64_t gpa) {
+    nvme_command cmd{};
+    cmd.rw.opcode = nvme_cmd_write;
+    cmd.rw.nsid = 1;
+    cmd.rw.slba = slba;
+    cmd.rw.length = (NVME_PAGE_SIZE >> lba_shift) - 1;
+    cmd.rw.dptr.prp1 = gpa;
+    return cmd;
+}
+
+// host side of an enclave ring fed from one fake SQ, the way sgx_ring_state lays it out
+struct test_ring {
+    static constexpr size_t sq_count = (NMNTFY_SQ_DATA_NR_PAGES << NVME_PAGE_SHIFT) / sizeof(nvme_command);
+    static constexpr size_t nr_slots = 4;
+    static constexpr size_t slot_size = NVME_PAGE_SIZE;
+
+    explicit test_ring(const prp_en &e) {
+        desc.pvm = e.pvm();
+        desc.pvm_size = e.pvm_size();
+        desc.nr_sq = 1;
+        desc.sq[0] = crypt_ring_sq{.cmdbuf = sqbuf.data(), .head = &idx.sq_head, .tail = &idx.sq_tail};
+        desc.cq = cqbuf.data();
+        desc.cq_head = &idx.cq_head;
+        desc.cq_tail = &idx.cq_tail;
+        desc.slots = slotbuf.data();
+        desc.slots_head = &idx.slots_head;
+        desc.slots_tail = &idx.slots_tail;
+        desc.staging = staging.data();
+        desc.slot_size = slot_size;
+        desc.nr_slots = nr_slots;
+        std::array<uint32_t, nr_slots> free_slots{};
+        std::iota(free_slots.begin(), free_slots.end(), 0);
+        REQUIRE(slots.produce(std::span<const uint32_t>(free_slots)) == static_cast<int>(nr_slots));
+    }
+
+    std::vector<nvme_command> sqbuf = std::vector<nvme_command>(sq_count);
+    std::vector<crypt_completion> cqbuf = std::vector<crypt_completion>(CRYPT_RING_CQ_COUNT);
+    std::vector<uint32_t> slotbuf = std::vector<uint32_t>(CRYPT_RING_SLOT_COUNT);
+    std::vector<unsigned char> staging = std::vector<unsigned char>(nr_slots * slot_size);
+    struct {
+        alignas(64) volatile int sq_head = 0;
+        alignas(64) volatile int sq_tail = 0;
+        alignas(64) volatile int cq_head = 0;
+        alignas(64) volatile int cq_tail = 0;
+        alignas(64) volatile int slots_head = 0;
+        alignas(64) volatile int slots_tail = 0;
+    } idx;
+    crypt_ring desc{};
+    cmdbuf_en<nvme_command, sq_count, cmdbuf_en_direction::producer> sq{sqbuf.data(), &idx.sq_head, &idx.sq_tail};
+    crypt_cqbuf_t<cmdbuf_en_direction::consumer> cq{cqbuf.data(), &idx.cq_head, &idx.cq_tail};
+    crypt_slotbuf_t<cmdbuf_en_direction::producer> slots{slotbuf.data(), &idx.slots_head, &idx.slots_tail};
+};
+
+TEST_CASE("sgx enclave tests") {
+    auto mem = mmap(nullptr, memsize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) // NOLINT
+        throw std::system_error(errno, std::generic_category(), "mmap");
+    auto pvm = static_cast<unsigned char *>(mem);
+
+    std::array<unsigned char, 32> key{};
+    std::iota(key.begin(), key.end(), 1);
+    prp_en_pool pool(esopath, true, key, lba_shift, nthreads);
+
+    // reference ciphertext of each thread's plaintext page, computed single-threaded
+    std::vector<std::array<unsigned char, NVME_PAGE_SIZE>> expected(nthreads);
+    {
+        auto e = pool.get(pvm, memsize);
+        for (size_t t = 0; t < nthreads; t++) {
+            auto area = pvm + t * thread_area;
+            std::fill(area, area + NVME_PAGE_SIZE, static_cast<unsigned char>(t + 1));
+            auto cmd = make_cmd(t * 1000, t * thread_area);
+            REQUIRE(e.crypt_command(&cmd, expected[t].data(), expected[t].size(), 0) == NVME_PAGE_SIZE);
+        }
+    }
+
+    SECTION("batched results match single calls") {
+        auto e = pool.get(pvm, memsize);
+        std::vector<nvme_command> cmds;
+        std::vector<crypt_desc> descs(nthreads);
+        std::vector<std::array<unsigned char, NVME_PAGE_SIZE>> out(nthreads);
+        for (size_t t = 0; t < nthreads; t++) {
+            cmds.push_back(make_cmd(t * 1000, t * thread_area));
+            descs[t] = crypt_desc{.outbuf = out[t].data(), .outbuf_size = out[t].size(), .decrypt = 0, .result = 0};
+        }
+        REQUIRE(e.crypt_commands(std::span(cmds), std::span(descs)) == static_cast<long>(nthreads));
+        for (size_t t = 0; t < nthreads; t++) {
+            REQUIRE(descs[t].result == NVME_PAGE_SIZE);
+            REQUIRE(out[t] == expected[t]);
+        }
+    }
+
+    SECTION("concurrent workers") {
+        std::atomic<size_t> failures = 0;
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < nthreads; t++) {
+            workers.emplace_back([&, t] {
+                auto e = pool.get(pvm, memsize);
+                auto area = pvm + t * thread_area;
+                auto cipher = area + NVME_PAGE_SIZE;
+                auto scratch = area + 2 * NVME_PAGE_SIZE;
+                auto cmd = make_cmd(t * 1000, t * thread_area);
+                auto scratch_cmd = make_cmd(t * 1000, t * thread_area + 2 * NVME_PAGE_SIZE);
+                for (size_t i = 0; i < niters; i++) {
+                    if (e.crypt_command(&cmd, cipher, NVME_PAGE_SIZE, 0) != NVME_PAGE_SIZE ||
+                        memcmp(cipher, expected[t].data(), NVME_PAGE_SIZE)) {
+                        failures++;
+                    }
+                    // the decrypted ciphertext must give back the plaintext pattern
+                    memcpy(scratch, cipher, NVME_PAGE_SIZE);
+                    if (e.crypt_command_inplace(&scratch_cmd, 1) != NVME_PAGE_SIZE ||
+                        !std::all_of(scratch, scratch + NVME_PAGE_SIZE, [t](unsigned char c) { return c == t + 1; })) {
+                        failures++;
+                    }
+                }
+            });
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+        REQUIRE(failures == 0);
+    }
+
+    SECTION("ring mode") {
+        auto e = pool.get(pvm, memsize);
+        test_ring ring(e);
+
+        // thread 1's scratch page holds its ciphertext, which a read decrypts in place
+        auto scratch = pvm + thread_area + 2 * NVME_PAGE_SIZE;
+        memcpy(scratch, expected[1].data(), NVME_PAGE_SIZE);
+        std::vector<nvme_command> cmds{
+            make_cmd(0, 0),
+            make_cmd(1000, thread_area + 2 * NVME_PAGE_SIZE),
+            make_cmd(2000, 2 * thread_area),
+            make_cmd(0, 0),
+            nvme_command{},
+        };
+        cmds[1].rw.opcode = nvme_cmd_read;
+        // larger than a staging slot
+        cmds[3].rw.length = static_cast<__u16>((2 * NVME_PAGE_SIZE >> lba_shift) - 1);
+        cmds[4].common.opcode = nvme_cmd_flush;
+        for (size_t i = 0; i < cmds.size(); i++) {
+            cmds[i].common.command_id = static_cast<__u16>(i);
+        }
+        REQUIRE(ring.sq.produce(std::span<const nvme_command>(cmds)) == static_cast<int>(cmds.size()));
+
+        long ret = 0;
+        std::thread worker([&] { ret = e.crypt_ring_run(&ring.desc); });
+        std::vector<crypt_completion> done;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (done.size() < cmds.size() && std::chrono::steady_clock::now() < deadline) {
+            crypt_completion c{};
+            if (ring.cq.consume(std::span(&c, 1))) {
+                done.push_back(c);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        __atomic_store_n(&ring.desc.stop, 1, __ATOMIC_RELEASE);
+        worker.join();
+        REQUIRE(ret == static_cast<long>(cmds.size()));
+        REQUIRE(done.size() == cmds.size());
+
+        for (size_t i = 0; i < done.size(); i++) {
+            REQUIRE(done[i].qi == 0);
+            REQUIRE(done[i].cmd.common.command_id == i);
+        }
+        // writes are encrypted into the slots in the order they were handed out
+        REQUIRE(done[0].result == NVME_PAGE_SIZE);
+        REQUIRE(done[0].slot == 0);
+        REQUIRE(std::equal(expected[0].begin(), expected[0].end(), ring.staging.begin()));
+        REQUIRE(done[2].result == NVME_PAGE_SIZE);
+        REQUIRE(done[2].slot == 1);
+        REQUIRE(std::equal(expected[2].begin(), expected[2].end(), ring.staging.begin() + test_ring::slot_size));
+        // the plaintext of a write is left alone
+        REQUIRE(std::all_of(pvm, pvm + NVME_PAGE_SIZE, [](unsigned char c) { return c == 1; }));
+
+        REQUIRE(done[1].result == NVME_PAGE_SIZE);
+        REQUIRE(done[1].slot == CRYPT_RING_NO_SLOT);
+        REQUIRE(std::all_of(scratch, scratch + NVME_PAGE_SIZE, [](unsigned char c) { return c == 2; }));
+
+        // the slot comes back with the completion so the host can give it back
+        REQUIRE(done[3].result == -EINVAL);
+        REQUIRE(done[3].slot == 2);
+        REQUIRE(done[4].result == 0);
+        REQUIRE(done[4].slot == CRYPT_RING_NO_SLOT);
+    }
+
+    munmap(mem, memsize);
+}
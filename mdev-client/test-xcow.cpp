@@ -1,11 +1,36 @@
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
 #include <system_error>
+#include <vector>
+#include <cstdarg>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
 #include <catch_amalgamated.hpp>
+#include "util.hpp"
+#include "xcow/cached_deref.hpp"
+#include "xcow/copy_offload.hpp"
+#include "xcow/file_deref.hpp"
+#include "xcow/meta_log.hpp"
+
+#define XCOW_TRANSPARENT 1
 #include "xcow/xcow_file.hpp"
 #include "xcow/xcow_snap.hpp"
+#include "xcow/backing_image.hpp"
 #include "xcow/blk_iter.hpp"
+#include "util/cluster_locks.hpp"
+#include "nvme_xcow.hpp"
 
 using namespace xcow;
 using namespace xcow::XlateBits;
@@ -99,6 +124,1011 @@ TEST_CASE("metadata tests") {
         REQUIRE(f.fsize() == 50ull << 30);
         REQUIRE(f.cluster_bits() == 16);
     }
+
+    SECTION("warmup plan") {
+        XcowFile f(&deref);
+        auto s1 = f.open_write();
+        // one l0 table each
+        report_write(s1, 0);
+        report_write(s1, 1 << 20);
+        auto s2 = f.snap_create(s1);
+        report_write(s2, 2 << 20);
+
+        REQUIRE(f.warmup_plan(WarmupOrder::none).empty());
+        auto roots = f.warmup_plan(WarmupOrder::roots);
+        REQUIRE(roots.size() == 1);
+        REQUIRE(roots[0].first == FileBits::decode_snap_entry(f._snaps.active_entries().back()));
+        auto address = f.warmup_plan(WarmupOrder::address);
+        REQUIRE(address.size() == 4);
+        REQUIRE(address[0] == roots[0]);
+        REQUIRE(address[1].second == f.cluster_size());
+        REQUIRE(address[1].first < address[2].first);
+        // the table written since the snapshot goes first
+        auto recent = f.warmup_plan(WarmupOrder::recent);
+        REQUIRE(recent == decltype(recent){roots[0], address[3], address[2], address[1]});
+    }
+}
+
+TEST_CASE("extended l2 tests") {
+    auto mem = mmap(nullptr, memsize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) // NOLINT
+        throw std::system_error(errno, std::generic_category(), "mmap");
+
+    MemDeref deref(std::span<uint8_t>(static_cast<uint8_t *>(mem), memsize));
+    static constexpr uint64_t addr = 0x12340000ull << 9;
+
+    SECTION("too small clusters") {
+        REQUIRE_THROWS_AS(
+            XcowFile::format(&deref, 50ull << 30, 16, UINT32_MAX, UINT64_MAX, true),
+            std::invalid_argument);
+    }
+
+    SECTION("subcluster state") {
+        auto f = XcowFile::format(&deref, 50ull << 30, 20, 512, UINT64_MAX, true);
+        REQUIRE(f.extended_l2());
+        REQUIRE(f.subcluster_bits() == 15);
+        auto s1 = f.open_write();
+
+        XlateExt ext;
+        REQUIRE(is_empty(s1.translate_read(addr, &ext)));
+        REQUIRE(ext.alloc == 0);
+
+        XlateExt *pext;
+        auto entry = s1.tx_write_prep(addr, &pext);
+        REQUIRE(pext);
+        REQUIRE(pext->alloc == 0);
+        auto [off, nbytes] = s1.alloc_data_cluster();
+        s1.tx_write_commit(addr, *entry, pext, encode_leaf(off, true), XlateExt{.alloc = 0x3, .zero = 0, .base = {}});
+
+        auto tl = s1.translate_read(addr, &ext);
+        REQUIRE(decode_leaf(tl) == off);
+        REQUIRE(ext.alloc == 0x3);
+        REQUIRE(!is_full(ext));
+
+        s1.erase_subclusters(addr, 0x2);
+        s1.translate_read(addr, &ext);
+        REQUIRE(ext.alloc == 0x1);
+        REQUIRE(ext.zero == 0x2);
+
+        SECTION("snapshot keeps subcluster state") {
+            auto s2 = f.snap_create(s1);
+            auto prev = s2.tx_write_prep(addr, &pext);
+            REQUIRE(needs_cow(*prev));
+            REQUIRE(pext->alloc == 0x1);
+            REQUIRE(pext->zero == 0x2);
+            pext->alloc = 0;
+            // the older snapshot's table wasn't touched
+            auto s1r = f.open_read(1);
+            s1r.translate_read(addr, &ext);
+            REQUIRE(ext.alloc == 0x1);
+        }
+
+        SECTION("erase") {
+            s1.erase(addr);
+            REQUIRE(is_empty(s1.translate_read(addr, &ext)));
+            REQUIRE(ext.alloc == 0);
+            REQUIRE(ext.zero == 0);
+        }
+    }
+
+    SECTION("upgrade") {
+        auto f = XcowFile::format(&deref, 50ull << 30, 17, 512, UINT64_MAX);
+        REQUIRE(f.subcluster_bits() == 17);
+        auto s1 = f.open_write();
+        auto a = report_write(s1, addr >> 9);
+        auto s2 = f.snap_create(s1);
+        auto b = report_write(s2, (addr >> 9) + 0x1000);
+
+        // s2 unshared the table when writing to it, so each snapshot has its own
+        REQUIRE(f.upgrade_extended_l2() == 2);
+        REQUIRE(f.extended_l2());
+        REQUIRE(f.upgrade_extended_l2() == 0);
+
+        XlateExt ext;
+        REQUIRE(s2.translate_read(addr, &ext) == XlateLeaf(a & ~writable));
+        REQUIRE(is_full(ext));
+        REQUIRE(s2.translate_read(addr + (0x1000 << 9), &ext) == b);
+        REQUIRE(is_full(ext));
+        REQUIRE(is_empty(s2.translate_read(addr + (1 << 17), &ext)));
+        REQUIRE(ext.alloc == 0);
+        auto s1r = f.open_read(1);
+        REQUIRE(s1r.translate_read(addr, &ext) == a);
+        REQUIRE(is_full(ext));
+    }
+}
+
+TEST_CASE("free list tests") {
+    auto mem = mmap(nullptr, memsize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) // NOLINT
+        throw std::system_error(errno, std::generic_category(), "mmap");
+
+    MemDeref deref(std::span<uint8_t>(static_cast<uint8_t *>(mem), memsize));
+    auto f = XcowFile::format(&deref, 50ull << 30, 16, UINT32_MAX, UINT64_MAX);
+    std::vector<std::pair<uint64_t, uint64_t>> discarded;
+    f.set_discard([&](uint64_t off, uint64_t nbytes) { discarded.emplace_back(off, nbytes); });
+    auto s1 = f.open_write();
+
+    SECTION("erase reuses clusters") {
+        auto a = report_write(s1, 0x12349876);
+        report_write(s1, 0x12359876);
+        s1.erase(0x12349876ull << 9);
+        REQUIRE(f.free_data_count() == 1);
+        REQUIRE(discarded.size() == 1);
+        REQUIRE(discarded[0] == std::make_pair(decode_leaf(a), uint64_t{1} << 16));
+        REQUIRE(report_write(s1, 0x12369876) == a);
+        REQUIRE(f.free_data_count() == 0);
+    }
+
+    SECTION("empty tables are freed") {
+        auto hwm = f._hdr->hwm;
+        report_write(s1, 0x12349876);
+        s1.erase(0x12349876ull << 9);
+        REQUIRE(f.free_meta_count() == 1);
+        report_write(s1, 0x22349876);
+        REQUIRE(f.free_meta_count() == 0);
+        REQUIRE(f._hdr->hwm == hwm + 1);
+    }
+
+    SECTION("shared clusters are kept") {
+        auto a = report_write(s1, 0x12349876);
+        auto s2 = f.snap_create(s1);
+        s2.erase(0x12349876ull << 9);
+        REQUIRE(f.free_data_count() == 0);
+        REQUIRE(discarded.empty());
+        REQUIRE(is_empty(report_read(s2, 0x12349876)));
+        auto s1r = f.open_read(1);
+        REQUIRE(report_read(s1r, 0x12349876) == a);
+    }
+
+    SECTION("extents merge") {
+        std::vector<XlateLeaf> leaves;
+        for (uint64_t i = 0; i < 3; i++)
+            leaves.push_back(report_write(s1, 0x12340000 + (i << 7)));
+        s1.erase(0x12340000ull << 9);
+        s1.erase((0x12340000ull + (2 << 7)) << 9);
+        s1.erase((0x12340000ull + (1 << 7)) << 9);
+        REQUIRE(f.free_data_count() == 3);
+        REQUIRE_THROWS_AS(f.free_data_clusters(decode_leaf(leaves[1]), 1), std::logic_error);
+        auto [off, nbytes] = s1.alloc_data_clusters(3);
+        REQUIRE(off == decode_leaf(leaves[0]));
+        REQUIRE(f.free_data_count() == 0);
+    }
+
+    SECTION("hinted allocation") {
+        std::vector<XlateLeaf> leaves;
+        for (uint64_t i = 0; i < 5; i++)
+            leaves.push_back(report_write(s1, 0x12340000 + (i << 7)));
+        for (uint64_t i = 1; i < 4; i++)
+            s1.erase((0x12340000ull + (i << 7)) << 9);
+        REQUIRE(f.free_data_count() == 3);
+        // from the middle of a free extent, the rest stays free
+        auto [off, nbytes] = s1.alloc_data_clusters(1, decode_leaf(leaves[2]));
+        REQUIRE(off == decode_leaf(leaves[2]));
+        REQUIRE(f.free_data_count() == 2);
+        // right after the last cluster even with free clusters left
+        auto disk_hwm = s1.disk_hwm();
+        std::tie(off, nbytes) = s1.alloc_data_clusters(1, disk_hwm << 16);
+        REQUIRE(off == disk_hwm << 16);
+        // taken already, falls back to the free list
+        std::tie(off, nbytes) = s1.alloc_data_clusters(1, decode_leaf(leaves[4]));
+        REQUIRE(f.free_data_count() == 1);
+        REQUIRE((off == decode_leaf(leaves[1]) || off == decode_leaf(leaves[3])));
+        auto [off2, nbytes2] = s1.alloc_data_clusters(1, decode_leaf(leaves[1]));
+        REQUIRE(off2 != off);
+        REQUIRE(f.free_data_count() == 0);
+    }
+
+    SECTION("peel") {
+        auto a = report_write(s1, 0x12349876);
+        report_write(s1, 0x12359876);
+        s1.erase(0x12359876ull << 9);
+        auto meta_hwm = f._hdr->hwm;
+        auto s2 = f.snap_create(s1);
+        auto disk_hwm = s2.disk_hwm();
+        // takes the free cluster, then allocates above the disk hwm
+        report_write(s2, 0x12369876);
+        report_write(s2, 0x12349876);
+        REQUIRE(s2.disk_hwm() == disk_hwm + 1);
+        f.peel(std::move(s2));
+
+        REQUIRE(f.free_data_count() == 1);
+        REQUIRE(f.free_meta_count() == f._hdr->hwm - meta_hwm);
+        auto s1w = f.open_write();
+        REQUIRE(s1w.disk_hwm() == disk_hwm);
+        REQUIRE(report_read(s1w, 0x12349876) == a);
+        REQUIRE(discarded.back() == std::make_pair(disk_hwm << 16, uint64_t{1} << 16));
+    }
+
+    SECTION("parked clusters") {
+        auto [off, nbytes] = s1.alloc_data_clusters(4);
+        f.park_data_clusters(off, 4);
+        // out of the allocator, but free for whoever opens the file next
+        REQUIRE(f.free_data_count() == 0);
+        REQUIRE(XcowFile(&deref).free_data_count() == 4);
+        REQUIRE(s1.alloc_data_clusters(1).first == off + nbytes);
+
+        f.unpark_data_clusters(off, 1);
+        f.unpark_data_clusters(off + (2 << 16), 1);
+        REQUIRE_THROWS_AS(f.unpark_data_clusters(off, 1), std::logic_error);
+        REQUIRE(XcowFile(&deref).free_data_count() == 2);
+        // a whole extent leaves the list, the entry moved into its place stays parked
+        f.unpark_data_clusters(off + (1 << 16), 1);
+        f.unpark_data_clusters(off + (3 << 16), 1);
+        REQUIRE(XcowFile(&deref).free_data_count() == 0);
+        REQUIRE(f._parked.empty());
+        f.free_data_clusters(off, 4);
+        REQUIRE(f.free_data_count() == 4);
+    }
+
+    SECTION("reload") {
+        // enough free extents for several list tables
+        for (uint64_t i = 0; i < 20000; i++)
+            report_write(s1, i << 7);
+        for (uint64_t i = 0; i < 20000; i += 2)
+            s1.erase(i << 16);
+        REQUIRE(f.free_data_count() == 10000);
+        {
+            XcowFile g(&deref);
+            // nothing was allocated yet
+            REQUIRE(!g._free_loaded);
+            REQUIRE(g.free_data_count() == 10000);
+            REQUIRE(g.free_meta_count() == f.free_meta_count());
+        }
+        for (uint64_t i = 0; i < 10000; i++)
+            report_write(s1, (i + 100000) << 7);
+        REQUIRE(f.free_data_count() == 0);
+        XcowFile g(&deref);
+        REQUIRE(g.free_data_count() == 0);
+    }
+}
+
+TEST_CASE("zero leaf tests") {
+    auto mem = mmap(nullptr, memsize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) // NOLINT
+        throw std::system_error(errno, std::generic_category(), "mmap");
+
+    MemDeref deref(std::span<uint8_t>(static_cast<uint8_t *>(mem), memsize));
+    auto f = XcowFile::format(&deref, 50ull << 30, 16, UINT32_MAX, UINT64_MAX);
+    auto s1 = f.open_write();
+
+    SECTION("encoding") {
+        REQUIRE(is_zero(zero_leaf));
+        REQUIRE(is_empty(zero_leaf));
+        REQUIRE(!is_unallocated(zero_leaf));
+        REQUIRE(needs_alloc(zero_leaf));
+        REQUIRE(!needs_cow(zero_leaf));
+        // cluster 0 is a regular cluster
+        REQUIRE(!is_empty(encode_leaf(0, false)));
+        REQUIRE(needs_cow(encode_leaf(0, false)));
+    }
+
+    SECTION("zero frees the cluster and keeps the table") {
+        report_write(s1, 0x12349876);
+        REQUIRE(!(f._hdr->features & XCOW_FEATURE_ZERO_LEAVES));
+        s1.zero(0x12349876ull << 9);
+        REQUIRE(f._hdr->features & XCOW_FEATURE_ZERO_LEAVES);
+        REQUIRE(is_zero(report_read(s1, 0x12349876)));
+        REQUIRE(f.free_data_count() == 1);
+        REQUIRE(f.free_meta_count() == 0);
+        s1.erase(0x12349876ull << 9);
+        REQUIRE(is_unallocated(report_read(s1, 0x12349876)));
+        REQUIRE(f.free_meta_count() == 1);
+    }
+
+    SECTION("shared clusters are kept") {
+        auto a = report_write(s1, 0x12349876);
+        auto s2 = f.snap_create(s1);
+        s2.zero(0x12349876ull << 9);
+        REQUIRE(f.free_data_count() == 0);
+        REQUIRE(is_zero(report_read(s2, 0x12349876)));
+        auto s1r = f.open_read(1);
+        REQUIRE(report_read(s1r, 0x12349876) == a);
+    }
+
+    SECTION("writes allocate") {
+        s1.zero(0x12349876ull << 9);
+        XlateLeaf prev;
+        auto a = report_write(s1, 0x12349876, &prev);
+        REQUIRE(prev == zero_leaf);
+        REQUIRE((a & writable));
+        REQUIRE(!is_empty(a));
+    }
+
+    SECTION("reopen") {
+        s1.zero(0x12349876ull << 9);
+        XcowFile g(&deref);
+        auto s = g.open_read(0);
+        REQUIRE(is_zero(report_read(s, 0x12349876)));
+    }
+}
+
+TEST_CASE("usage tests") {
+    auto mem = mmap(nullptr, memsize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) // NOLINT
+        throw std::system_error(errno, std::generic_category(), "mmap");
+
+    MemDeref deref(std::span<uint8_t>(static_cast<uint8_t *>(mem), memsize));
+    auto f = XcowFile::format(&deref, 50ull << 30, 16, UINT32_MAX, UINT64_MAX);
+    auto s1 = f.open_write();
+    REQUIRE(f.used_clusters() == 0);
+    report_write(s1, 0x12349876);
+    report_write(s1, 0x12349876);
+    report_write(s1, 0x2349876);
+    REQUIRE(f.used_clusters() == 2);
+
+    SECTION("zero leaves don't count") {
+        s1.zero(0x12349876ull << 9);
+        REQUIRE(f.used_clusters() == 1);
+        s1.erase(0x12349876ull << 9);
+        s1.erase(0x2349876ull << 9);
+        REQUIRE(f.used_clusters() == 0);
+    }
+
+    SECTION("transactions") {
+        auto entry = s1.tx_write_prep(0x3349876ull << 9);
+        auto [off, nbytes] = s1.alloc_data_cluster();
+        s1.tx_write_commit(0x3349876ull << 9, *entry, encode_leaf(off, true), nullptr);
+        REQUIRE(f.used_clusters() == 3);
+        s1.tx_write_commit(0x3349876ull << 9, *entry, nullptr, zero_leaf, XlateExt{});
+        REQUIRE(f.used_clusters() == 2);
+    }
+
+    SECTION("snapshots") {
+        auto s2 = f.snap_create(s1);
+        REQUIRE(f.used_clusters() == 2);
+        report_write(s2, 0x12349876);
+        s2.erase(0x2349876ull << 9);
+        REQUIRE(f.used_clusters() == 1);
+        REQUIRE(f.used_clusters(1) == 2);
+        f.peel(std::move(s2));
+        REQUIRE(f.used_clusters() == 2);
+    }
+
+    SECTION("counted on first use") {
+        XcowFile g(&deref);
+        REQUIRE(!g._used);
+        REQUIRE(g.used_clusters() == 2);
+        REQUIRE(g._used == 2);
+    }
+
+    SECTION("counted in steps") {
+        XcowFile g(&deref);
+        auto s = g.open_write();
+        REQUIRE(g.count_step(((0x2349876ull << 9) >> g.l0_cover_bits()) + 1));
+        REQUIRE(!g.counted_clusters());
+        // one change in a table counted already, one in a table that isn't yet
+        s.erase(0x2349876ull << 9);
+        report_write(s, 0x12359876);
+        while (g.count_step(16)) {
+        }
+        REQUIRE(g.counted_clusters() == 2);
+        report_write(s, 0x2349876);
+        REQUIRE(g.counted_clusters() == 3);
+        XcowFile h(&deref);
+        REQUIRE(h.used_clusters() == 3);
+    }
+}
+
+static size_t count_snaps(XcowFile &f) {
+    size_t count = 0;
+    for (auto it = f.snaps(); !it.at_end(); it++)
+        count += !FileBits::snap_entry_dead(*it);
+    return count;
+}
+
+TEST_CASE("snapshot deletion tests") {
+    auto mem = mmap(nullptr, memsize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) // NOLINT
+        throw std::system_error(errno, std::generic_category(), "mmap");
+
+    MemDeref deref(std::span<uint8_t>(static_cast<uint8_t *>(mem), memsize));
+    auto f = XcowFile::format(&deref, 50ull << 30, 16, UINT32_MAX, UINT64_MAX);
+    auto s1 = f.open_write();
+    auto a = report_write(s1, 0x12349876);
+    auto s2 = f.snap_create(s1);
+
+    SECTION("bad indices") {
+        REQUIRE_THROWS_AS(f.snap_delete(0), std::invalid_argument);
+        REQUIRE_THROWS_AS(f.snap_delete(2), std::invalid_argument);
+        REQUIRE(!f.merge_step());
+    }
+
+    SECTION("shared tables go to the next snapshot") {
+        auto b = report_write(s2, 0x12359876);
+        auto s3 = f.snap_create(s2);
+        f.snap_delete(1);
+        REQUIRE_THROWS_AS(f.open_read(1), std::invalid_argument);
+        while (f.merge_step()) {
+        }
+        REQUIRE(count_snaps(f) == 2);
+        REQUIRE(f.free_data_count() == 0);
+        REQUIRE(report_read(s3, 0x12359876) == b);
+        REQUIRE(!(report_read(s3, 0x12349876) & writable));
+        auto s1r = f.open_read(1);
+        REQUIRE(report_read(s1r, 0x12349876) == a);
+        REQUIRE(is_empty(report_read(s1r, 0x12359876)));
+    }
+
+    SECTION("unshared clusters are freed") {
+        auto b = report_write(s2, 0x12349876);
+        auto s3 = f.snap_create(s2);
+        auto c = report_write(s3, 0x12349876);
+        auto free_meta = f.free_meta_count();
+        f.snap_delete(1);
+        while (f.merge_step()) {
+        }
+        REQUIRE(f.free_data_count() == 1);
+        REQUIRE(f._free_data.by_start.contains(decode_leaf(b) >> 16));
+        REQUIRE(f.free_meta_count() == free_meta + f.l1_clusters() + f.l0_clusters());
+        REQUIRE(report_read(s3, 0x12349876) == c);
+        auto s1r = f.open_read(1);
+        REQUIRE(report_read(s1r, 0x12349876) == a);
+    }
+
+    SECTION("clusters go to the oldest snapshot using them") {
+        auto b = report_write(s2, 0x12349876);
+        report_write(s2, 0x12359876);
+        auto s3 = f.snap_create(s2);
+        report_write(s3, 0x12359876);
+        f.snap_delete(1);
+        while (f.merge_step()) {
+        }
+        REQUIRE(f.free_data_count() == 1);
+        REQUIRE(report_read(s3, 0x12349876) == b);
+    }
+
+    SECTION("busy ranges are put off") {
+        auto b = report_write(s2, 0x12359876);
+        auto s3 = f.snap_create(s2);
+        f.snap_delete(1);
+        bool busy = true;
+        for (int i = 0; i < 3; i++)
+            REQUIRE(f.merge_step([&](uint64_t, uint64_t) { return busy; }));
+        REQUIRE(!(report_read(s3, 0x12359876) & writable));
+        busy = false;
+        while (f.merge_step([&](uint64_t, uint64_t) { return busy; })) {
+        }
+        REQUIRE(report_read(s3, 0x12359876) == b);
+    }
+
+    SECTION("peel drops deleted snapshots below") {
+        report_write(s2, 0x12359876);
+        auto s3 = f.snap_create(s2);
+        f.snap_delete(1);
+        f.peel(std::move(s3));
+        REQUIRE(count_snaps(f) == 1);
+        REQUIRE(!f.merge_step());
+        auto s1w = f.open_write();
+        REQUIRE(report_read(s1w, 0x12349876) == a);
+        REQUIRE(is_empty(report_read(s1w, 0x12359876)));
+        REQUIRE_THROWS_AS(f.peel(std::move(s1w)), std::logic_error);
+    }
+
+    SECTION("reopen") {
+        auto b = report_write(s2, 0x12359876);
+        auto s3 = f.snap_create(s2);
+        f.snap_delete(1);
+        XcowFile g(&deref);
+        while (g.merge_step()) {
+        }
+        REQUIRE(count_snaps(g) == 2);
+        REQUIRE(report_read(s3, 0x12359876) == b);
+    }
+}
+
+// filesystems that share extents on FICLONERANGE
+static bool can_reflink(int fd) {
+    struct statfs sfs {};
+    if (fstatfs(fd, &sfs) < 0)
+        throw std::system_error(errno, std::generic_category(), "fstatfs");
+    return sfs.f_type == XFS_SUPER_MAGIC || sfs.f_type == BTRFS_SUPER_MAGIC;
+}
+
+static bool extent_shared(int fd, off_t off) {
+    // room for a single extent
+    alignas(struct fiemap) uint8_t buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)]{};
+    auto fm = reinterpret_cast<struct fiemap *>(buf);
+    fm->fm_start = static_cast<__u64>(off);
+    fm->fm_length = 1;
+    fm->fm_flags = FIEMAP_FLAG_SYNC;
+    fm->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0)
+        throw std::system_error(errno, std::generic_category(), "FS_IOC_FIEMAP");
+    return fm->fm_mapped_extents && (fm->fm_extents[0].fe_flags & FIEMAP_EXTENT_SHARED);
+}
+
+// copies the first cluster of a scratch file to the second one and checks the result
+// the file is created in the working directory, which unlike /tmp is usually on a filesystem that can reflink
+// set XCOW_TEST_DIR to put it elsewhere
+static CopyMethod check_copy(CopyMethod max, bool async = false) {
+    static constexpr size_t clus = 1 << 16;
+    auto dir = getenv("XCOW_TEST_DIR");
+    auto path = std::string(dir ? dir : ".") + "/test-xcow.XXXXXX";
+    int fd = mkstemp(path.data());
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "mkstemp");
+    auto hfd = cleanup([&] {
+        close(fd);
+        unlink(path.c_str());
+    });
+
+    std::vector<uint8_t> data(clus), out(clus);
+    for (size_t i = 0; i < clus; i++)
+        data[i] = static_cast<uint8_t>(i % 251);
+    REQUIRE(pwrite(fd, data.data(), clus, 0) == static_cast<ssize_t>(clus));
+    REQUIRE(ftruncate(fd, 2 * clus) == 0);
+
+    CopyOffload copy(fd, max);
+    bool done;
+    if (async) {
+        auto sock = copy.copy_async(0, clus, clus);
+        char c;
+        done = read(sock, &c, 1) == 1;
+        // the helper falls back to copying the data itself
+        REQUIRE(done);
+    } else {
+        done = copy.copy(0, clus, clus);
+    }
+    if (done) {
+        REQUIRE(pread(fd, out.data(), clus, clus) == static_cast<ssize_t>(clus));
+        REQUIRE(out == data);
+    }
+    if (max == CopyMethod::reflink && can_reflink(fd)) {
+        REQUIRE(copy.method() == CopyMethod::reflink);
+        REQUIRE(extent_shared(fd, clus));
+    }
+    if (!async)
+        REQUIRE(done == (copy.method() != CopyMethod::none));
+    return copy.method();
+}
+
+TEST_CASE("copy offload tests") {
+    SECTION("reflink") {
+        // a filesystem that can't reflink refuses it for good and copy_file_range takes over
+        auto method = check_copy(CopyMethod::reflink);
+        UNSCOPED_INFO("copy method " << static_cast<int>(method));
+        REQUIRE(method != CopyMethod::none);
+    }
+
+    SECTION("copy_file_range") {
+        REQUIRE(check_copy(CopyMethod::copy_range) == CopyMethod::copy_range);
+    }
+
+    SECTION("fallback") {
+        REQUIRE(check_copy(CopyMethod::none) == CopyMethod::none);
+    }
+
+    SECTION("async") {
+        REQUIRE(check_copy(CopyMethod::reflink, true) != CopyMethod::none);
+        REQUIRE(check_copy(CopyMethod::none, true) == CopyMethod::none);
+    }
+
+    SECTION("not a regular file") {
+        int p[2];
+        REQUIRE(pipe(p) == 0);
+        CopyOffload copy(p[0]);
+        REQUIRE(copy.method() == CopyMethod::none);
+        REQUIRE(!copy.copy(0, 1 << 16, 1 << 16));
+        // the helper can't read it either, the socket is closed without a byte
+        auto sock = copy.copy_async(0, 1 << 16, 1 << 16);
+        char c;
+        REQUIRE(read(sock, &c, 1) == 0);
+        close(p[0]);
+        close(p[1]);
+    }
+}
+
+static std::vector<uint8_t> read_all(int fd, size_t nbytes) {
+    std::vector<uint8_t> ret(nbytes);
+    REQUIRE(pread(fd, ret.data(), nbytes, 0) == static_cast<ssize_t>(nbytes));
+    return ret;
+}
+
+TEST_CASE("metadata log tests") {
+    static constexpr size_t mapsize = 64 << 20;
+    static constexpr uint64_t logsize = 4 << 20;
+    auto dir = getenv("XCOW_TEST_DIR");
+    auto mappath = std::string(dir ? dir : "/tmp") + "/test-xcow.XXXXXX";
+    int mapfd = mkstemp(mappath.data());
+    if (mapfd < 0)
+        throw std::system_error(errno, std::generic_category(), "mkstemp");
+    auto logpath = mappath + ".log";
+    auto hfd = cleanup([&] {
+        close(mapfd);
+        unlink(mappath.c_str());
+        unlink(logpath.c_str());
+    });
+    REQUIRE(ftruncate(mapfd, mapsize) == 0);
+
+    std::vector<uint8_t> committed;
+    XlateLeaf a, b;
+    {
+        MetaLog log(logpath.c_str(), mapfd, logsize);
+        REQUIRE(log.replayed() == 0);
+        FileDeref deref(mapfd, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+        log.attach(&deref);
+        auto f = XcowFile::format(&deref, 1ull << 30, 16, mapsize >> 16, UINT64_MAX);
+        auto s1 = f.open_write();
+        a = report_write(s1, 0x123456);
+        auto s2 = f.snap_create(s1);
+        b = report_write(s2, 0x123456);
+        auto s3 = f.snap_create(s2);
+        report_write(s3, 0x1234567);
+        f.snap_delete(1);
+        while (f.merge_step()) {
+        }
+        REQUIRE(log.commit());
+        REQUIRE(!log.pending());
+        // nothing reaches the map file without the log
+        REQUIRE(read_all(mapfd, mapsize) == std::vector<uint8_t>(mapsize));
+        auto mem = deref.deref(0, mapsize);
+        committed.assign(mem.begin(), mem.end());
+
+        SECTION("replay") {
+            report_write(s3, 0x234567);
+            REQUIRE(log.pending());
+        }
+
+        SECTION("checkpoint") {
+            log.checkpoint();
+            REQUIRE(read_all(mapfd, mapsize) == committed);
+            report_write(s3, 0x234567);
+        }
+
+        SECTION("torn record") {
+            report_write(s3, 0x234567);
+            REQUIRE(log.commit());
+            // damage the last page of the second record
+            int lfd = open(logpath.c_str(), O_RDWR);
+            REQUIRE(lfd >= 0);
+            auto logdata = read_all(lfd, logsize);
+            for (size_t pos = MetaLog::block_size; pos < logsize; pos += MetaLog::block_size) {
+                uint64_t hdr[4];
+                memcpy(hdr, &logdata[pos], sizeof(hdr));
+                if (hdr[0] == MetaLog::record_magic && hdr[1] == 1) {
+                    uint8_t garbage = 0xff;
+                    REQUIRE(pwrite(lfd, &garbage, 1, static_cast<off_t>(pos + hdr[3] - 1)) == 1);
+                    break;
+                }
+            }
+            close(lfd);
+        }
+    }
+
+    MetaLog log(logpath.c_str(), mapfd, logsize);
+    REQUIRE(read_all(mapfd, mapsize) == committed);
+    FileDeref deref(mapfd);
+    XcowFile f(&deref);
+    auto s = f.open_write();
+    REQUIRE(report_read(s, 0x123456) == b);
+    REQUIRE(is_empty(report_read(s, 0x234567)));
+    auto s1r = f.open_read(1);
+    REQUIRE(report_read(s1r, 0x123456) == a);
+
+    // the log starts over empty
+    MetaLog again(logpath.c_str(), mapfd, logsize);
+    REQUIRE(again.replayed() == 0);
+}
+
+TEST_CASE("interrupted checkpoint") {
+    static constexpr size_t mapsize = 4 << 20;
+    static constexpr uint64_t logsize = 64 * MetaLog::block_size;
+    auto dir = getenv("XCOW_TEST_DIR");
+    auto mappath = std::string(dir ? dir : "/tmp") + "/test-xcow.XXXXXX";
+    int mapfd = mkstemp(mappath.data());
+    if (mapfd < 0)
+        throw std::system_error(errno, std::generic_category(), "mkstemp");
+    auto logpath = mappath + ".log";
+    auto hfd = cleanup([&] {
+        close(mapfd);
+        unlink(mappath.c_str());
+        unlink(logpath.c_str());
+    });
+    REQUIRE(ftruncate(mapfd, mapsize) == 0);
+
+    auto scribble = [](FileDeref &deref, size_t first, size_t npages, uint8_t value) {
+        for (size_t i = first; i < first + npages; i++) {
+            auto page = deref.deref(i * MetaLog::block_size, MetaLog::block_size);
+            memset(page.data(), value, page.size());
+            deref.dirty(page.data(), page.size());
+        }
+    };
+
+    std::vector<uint8_t> expected;
+    size_t records;
+    {
+        MetaLog log(logpath.c_str(), mapfd, logsize);
+        FileDeref deref(mapfd, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+        log.attach(&deref);
+        scribble(deref, 0, 20, 1);
+        REQUIRE(log.commit());
+
+        SECTION("write back") {
+            // logged behind the first record
+            scribble(deref, 4, 8, 2);
+            records = 2;
+        }
+
+        SECTION("chunked") {
+            // doesn't fit behind the first record, the log is applied and emptied, then takes it in 3 records
+            scribble(deref, 10, 40, 3);
+            records = 3;
+        }
+
+        log.limit_checkpoint_writes(3);
+        REQUIRE_THROWS_AS(log.checkpoint(), std::runtime_error);
+        auto mem = deref.deref(0, mapsize);
+        expected.assign(mem.begin(), mem.end());
+    }
+
+    // the write back was cut short, the replay finishes it
+    MetaLog log(logpath.c_str(), mapfd, logsize);
+    REQUIRE(log.replayed() == records);
+    REQUIRE(read_all(mapfd, mapsize) == expected);
+}
+
+TEST_CASE("metadata cache tests") {
+    static constexpr size_t mapsize = 16 << 20;
+    static constexpr size_t unit = CachedDeref::default_unit_size;
+    auto dir = getenv("XCOW_TEST_DIR");
+    auto mappath = std::string(dir ? dir : "/tmp") + "/test-xcow.XXXXXX";
+    int mapfd = mkstemp(mappath.data());
+    if (mapfd < 0)
+        throw std::system_error(errno, std::generic_category(), "mkstemp");
+    auto hfd = cleanup([&] {
+        close(mapfd);
+        unlink(mappath.c_str());
+    });
+    REQUIRE(ftruncate(mapfd, mapsize) == 0);
+
+    REQUIRE_THROWS_AS(CachedDeref(mapfd, unit - 1), std::invalid_argument);
+    REQUIRE_THROWS_AS(CachedDeref(mapfd, unit, 1000), std::invalid_argument);
+
+    // one l0 table per write
+    std::vector<XlateLeaf> leaves;
+    XlateLeaf last;
+    {
+        CachedDeref cache(mapfd, 8 * unit);
+        auto f = XcowFile::format(&cache, 64ull << 30, 16, mapsize >> 16, UINT64_MAX);
+        auto s = f.open_write();
+        for (uint64_t i = 0; i < 16; i++)
+            leaves.push_back(report_write(s, i << 20));
+        REQUIRE_THROWS_AS(cache.deref(mapsize - 8, 16), std::out_of_range);
+
+        // the header, the lists and the root stay
+        auto st = cache.stats();
+        REQUIRE(st.pinned == 4);
+        REQUIRE(st.resident == 20);
+        REQUIRE(st.dirty == 20);
+        // dirty units stay until they're written back
+        REQUIRE(cache.trim() == 0);
+        cache.commit(0, mapsize);
+        REQUIRE(!cache.has_dirty());
+        REQUIRE(cache.trim() == 12);
+        REQUIRE(cache.stats().resident == 8);
+
+        // evicted tables are read back from the file
+        for (uint64_t i = 0; i < 16; i++)
+            REQUIRE(report_read(s, i << 20) == leaves[i]);
+        REQUIRE(cache.stats().misses > st.misses);
+
+        last = report_write(s, 16 << 20);
+        auto units = cache.take_dirty();
+        REQUIRE(std::is_sorted(units.begin(), units.end()));
+        REQUIRE(!cache.has_dirty());
+        // a failed write back
+        cache.redirty(units);
+        REQUIRE(cache.stats().dirty == units.size());
+
+        // the root of a snapshot is released along with the last XcowSnap holding it
+        {
+            auto ro = f.open_read(0);
+            REQUIRE(cache.stats().pinned == 4);
+            s = f.snap_create(s);
+            REQUIRE(cache.stats().pinned == 5);
+        }
+        REQUIRE(cache.stats().pinned == 4);
+        s = f.open_write();
+        REQUIRE(cache.stats().pinned == 4);
+        f.snap_delete(1);
+        while (f.merge_step())
+            ;
+        REQUIRE(cache.stats().pinned == 4);
+        REQUIRE(report_read(s, 16 << 20) == last);
+    }
+
+    // what's left is written back when the cache goes away
+    FileDeref deref(mapfd);
+    XcowFile f(&deref);
+    auto s = f.open_write();
+    for (uint64_t i = 0; i < 16; i++)
+        REQUIRE(report_read(s, i << 20) == leaves[i]);
+    REQUIRE(report_read(s, 16 << 20) == last);
+}
+
+TEST_CASE("backing image tests") {
+    static constexpr size_t mapsize = 16 << 20;
+    static constexpr size_t rawsize = 2 << 20;
+    auto dir = getenv("XCOW_TEST_DIR");
+    auto mappath = std::string(dir ? dir : "/tmp") + "/test-xcow.XXXXXX";
+    auto datapath = mappath;
+    auto rawpath = mappath;
+    int mapfd = mkstemp(mappath.data());
+    int datafd = mkstemp(datapath.data());
+    int rawfd = mkstemp(rawpath.data());
+    auto hfd = cleanup([&] {
+        for (auto [fd, path] : {std::make_pair(mapfd, &mappath), {datafd, &datapath}, {rawfd, &rawpath}}) {
+            if (fd >= 0) {
+                close(fd);
+                unlink(path->c_str());
+            }
+        }
+    });
+    if (mapfd < 0 || datafd < 0 || rawfd < 0)
+        throw std::system_error(errno, std::generic_category(), "mkstemp");
+    REQUIRE(ftruncate(mapfd, mapsize) == 0);
+    REQUIRE(ftruncate(rawfd, rawsize) == 0);
+
+    XcowBacking raw{};
+    raw.kind = XcowBacking::raw;
+    strcpy(raw.path, rawpath.c_str());
+    FileDeref deref(mapfd);
+    auto f = XcowFile::format(&deref, 1ull << 30, 16, mapsize >> 16, UINT64_MAX);
+    REQUIRE(!f.backing());
+    f.set_backing(raw);
+    REQUIRE(f.backing());
+    REQUIRE(f._hdr->features & XCOW_FEATURE_BACKING);
+
+    auto s = f.open_write();
+    auto tl = report_write(s, 0x800);
+    s.zero(0x1000 * 512);
+    // clusters written so far would hide the new image
+    REQUIRE_THROWS_AS(f.set_backing(raw), std::logic_error);
+
+    SECTION("raw") {
+        BackingImage img(raw);
+        REQUIRE(img.fds().size() == 1);
+        auto ext = img.locate(0x1234, 0x100000);
+        REQUIRE(ext.fid == 0);
+        REQUIRE(ext.off == 0x1234);
+        REQUIRE(ext.nbytes == 0x100000);
+        // past the end of the image
+        ext = img.locate(rawsize - 0x1000, 0x2000);
+        REQUIRE(ext.nbytes == 0x1000);
+        ext = img.locate(rawsize, 0x1000);
+        REQUIRE(ext.fid == -1);
+        REQUIRE(ext.nbytes == 0x1000);
+    }
+
+    SECTION("xcow") {
+        XcowBacking base{};
+        base.kind = XcowBacking::xcow;
+        strcpy(base.path, datapath.c_str());
+        strcpy(base.map_path, mappath.c_str());
+        BackingImage img(base);
+        REQUIRE(img.fds().size() == 2);
+        // written clusters come from the data file of the image
+        auto ext = img.locate(0x100010, 0x20000);
+        REQUIRE(ext.fid == 0);
+        REQUIRE(ext.off == decode_leaf(tl) + 0x10);
+        REQUIRE(ext.nbytes == 0x10000 - 0x10);
+        // zero leaves hide the image below
+        ext = img.locate(0x200000, 0x1000);
+        REQUIRE(ext.fid == -1);
+        // the rest falls through to the raw image
+        ext = img.locate(0x1000, 0x20000);
+        REQUIRE(ext.fid == 1);
+        REQUIRE(ext.off == 0x1000);
+        REQUIRE(ext.nbytes == 0x10000 - 0x1000);
+        ext = img.locate(rawsize + 0x20000, 0x1000);
+        REQUIRE(ext.fid == -1);
+    }
+}
+
+TEST_CASE("dirty tracking tests") {
+    static constexpr size_t mapsize = 16 << 20;
+    auto dir = getenv("XCOW_TEST_DIR");
+    auto mappath = std::string(dir ? dir : "/tmp") + "/test-xcow.XXXXXX";
+    int mapfd = mkstemp(mappath.data());
+    if (mapfd < 0)
+        throw std::system_error(errno, std::generic_category(), "mkstemp");
+    auto hfd = cleanup([&] {
+        close(mapfd);
+        unlink(mappath.c_str());
+    });
+    REQUIRE(ftruncate(mapfd, mapsize) == 0);
+
+    FileDeref deref(mapfd);
+    auto f = XcowFile::format(&deref, 1ull << 30, 16, mapsize >> 16, UINT64_MAX);
+    auto s1 = f.open_write();
+    // nothing is recorded until asked to
+    REQUIRE(!deref.has_dirty());
+    REQUIRE(deref.dirty_marks() == 0);
+
+    deref.track_dirty();
+    report_write(s1, 0x123456);
+    REQUIRE(deref.has_dirty());
+    auto pages = deref.take_dirty();
+    REQUIRE(!deref.has_dirty());
+    REQUIRE(deref.dirty_marks() > 0);
+    for (auto off : pages)
+        REQUIRE(off % NVME_PAGE_SIZE == 0);
+
+    // the same pages again
+    report_write(s1, 0x123457);
+    REQUIRE(deref.take_dirty().size() <= pages.size());
+    // reading doesn't dirty anything
+    report_read(s1, 0x234567);
+    REQUIRE(!deref.has_dirty());
+}
+
+TEST_CASE("cluster lock tests") {
+    cluster_locks<int(int)> locks;
+    locks.resize(1000);
+    std::vector<int> ran;
+    auto sink = [&](int r) { ran.push_back(r); };
+
+    SECTION("busy ranges") {
+        locks.lock(70);
+        REQUIRE(locks.held(70));
+        REQUIRE(!locks.held(71));
+        REQUIRE(locks.busy(0, 1000));
+        REQUIRE(locks.busy(70, 71));
+        REQUIRE(!locks.busy(0, 70));
+        REQUIRE(!locks.busy(71, 1000));
+        REQUIRE(locks.busy(64, 128));
+        REQUIRE(!locks.busy(5000, 6000));
+        locks.unlock(70, 0, sink);
+        REQUIRE(!locks.busy(0, 1000));
+        REQUIRE(ran.empty());
+    }
+
+    SECTION("fifo") {
+        locks.lock(3);
+        for (int i = 0; i < 5; i++)
+            locks.wait(3, [i](int us) { return us + i; });
+        locks.unlock(3, 10, sink);
+        REQUIRE(ran == std::vector<int>{10, 11, 12, 13, 14});
+        REQUIRE(locks.stats().contended == 5);
+        REQUIRE(locks.stats().max_queue == 5);
+    }
+
+    SECTION("relock stops the drain") {
+        locks.lock(3);
+        locks.wait(3, [&](int) {
+            locks.lock(3);
+            locks.then(3, [](int) { return 2; });
+            return 1;
+        });
+        locks.wait(3, [](int) { return 3; });
+        locks.unlock(3, 0, sink);
+        REQUIRE(ran == std::vector<int>{1});
+        REQUIRE(locks.held(3));
+        // the transaction's own continuation went behind the one that waited already
+        locks.unlock(3, 0, sink);
+        REQUIRE(ran == std::vector<int>{1, 3, 2});
+        REQUIRE(!locks.held(3));
+    }
+
+    SECTION("many queues") {
+        std::vector<int> payload(4, 7);
+        for (uint64_t vblk = 0; vblk < 1000; vblk++) {
+            locks.lock(vblk);
+            locks.wait(vblk, [vblk, payload](int) { return static_cast<int>(vblk) + payload[0]; });
+        }
+        // releasing in another order than locking shuffles the queue table around
+        for (uint64_t vblk = 0; vblk < 1000; vblk += 2)
+            locks.unlock(vblk, 0, sink);
+        for (uint64_t vblk = 1; vblk < 1000; vblk += 2)
+            locks.unlock(vblk, 0, sink);
+        std::vector<int> expected;
+        for (int vblk = 0; vblk < 1000; vblk += 2)
+            expected.push_back(vblk + 7);
+        for (int vblk = 1; vblk < 1000; vblk += 2)
+            expected.push_back(vblk + 7);
+        REQUIRE(ran == expected);
+        REQUIRE(!locks.busy(0, 1000));
+    }
 }
 
 TEST_CASE("blk_iter tests") {
@@ -183,3 +1213,138 @@ TEST_CASE("blk_iter tests") {
         REQUIRE(bi.size() == 0);
     }
 }
+
+// the identify data the controller under test reads and sets through its notify fd, there's no mdev behind it
+static int fake_nfd = -1;
+static nvme_id_ctrl fake_id_ctrl;
+static nvme_id_ns fake_id_ns;
+
+extern "C" int ioctl(int fd, unsigned long request, ...) noexcept {
+    va_list ap;
+    va_start(ap, request);
+    auto arg = va_arg(ap, void *);
+    va_end(ap);
+    if (fd != fake_nfd || fd < 0)
+        return static_cast<int>(syscall(SYS_ioctl, fd, request, arg));
+    switch (request) {
+    case NVME_MDEV_NOTIFYFD_ID_VCTRL:
+        memcpy(static_cast<nvme_mdev_id_vctrl *>(arg)->data, &fake_id_ctrl, sizeof(fake_id_ctrl));
+        return 0;
+    case NVME_MDEV_NOTIFYFD_SET_ID_VCTRL:
+        memcpy(&fake_id_ctrl, static_cast<nvme_mdev_id_vctrl *>(arg)->data, sizeof(fake_id_ctrl));
+        return 0;
+    case NVME_MDEV_NOTIFYFD_ID_VNS:
+        memcpy(static_cast<nvme_mdev_id_vns *>(arg)->data, &fake_id_ns, sizeof(fake_id_ns));
+        return 0;
+    case NVME_MDEV_NOTIFYFD_SET_ID_VNS:
+        memcpy(&fake_id_ns, static_cast<nvme_mdev_id_vns *>(arg)->data, sizeof(fake_id_ns));
+        return 0;
+    }
+    errno = ENOTTY;
+    return -1;
+}
+
+TEST_CASE("controller writes") {
+    static constexpr size_t guest_size = 1 << 20;
+    static constexpr uint64_t cbits = 16, csize = uint64_t{1} << cbits;
+    auto mem = mmap(nullptr, memsize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) // NOLINT
+        throw std::system_error(errno, std::generic_category(), "mmap");
+    MemDeref deref(std::span<uint8_t>(static_cast<uint8_t *>(mem), memsize));
+    auto f = XcowFile::format(&deref, 1ull << 30, cbits, UINT32_MAX, UINT64_MAX);
+
+    auto dir = getenv("XCOW_TEST_DIR");
+    auto path = std::string(dir ? dir : "/tmp") + "/test-xcow.XXXXXX";
+    int bfd = mkstemp(path.data());
+    if (bfd < 0)
+        throw std::system_error(errno, std::generic_category(), "mkstemp");
+    fake_nfd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    auto hfd = cleanup([&] {
+        close(bfd);
+        unlink(path.c_str());
+        close(fake_nfd);
+        fake_nfd = -1;
+    });
+    fake_id_ctrl = nvme_id_ctrl{};
+    fake_id_ctrl.mdts = 5;
+    fake_id_ns = nvme_id_ns{};
+    fake_id_ns.lbaf[0].ds = 9;
+
+    // the guest data, then the PRP list of its pages
+    auto guest = mmap(nullptr, guest_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (guest == MAP_FAILED) // NOLINT
+        throw std::system_error(errno, std::generic_category(), "mmap");
+    auto vm = std::make_shared<mapping>(static_cast<unsigned char *>(guest), guest_size);
+    auto data = vm->get_span(0, 2 * csize);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<unsigned char>(i / NVME_PAGE_SIZE * 13 + i % 241);
+    auto prps = vm->get_page(2 * csize);
+    for (size_t i = 1; i < 2 * csize / NVME_PAGE_SIZE; i++)
+        prps[i - 1] = i * NVME_PAGE_SIZE;
+
+    auto write_cmd = [](uint64_t vblk, size_t nclusters) {
+        nvme_command cmd{};
+        cmd.rw.opcode = nvme_cmd_write;
+        cmd.rw.nsid = 1;
+        cmd.rw.slba = vblk << (cbits - 9);
+        cmd.rw.length = static_cast<__u16>((nclusters << (cbits - 9)) - 1);
+        cmd.rw.dptr.prp1 = 0;
+        cmd.rw.dptr.prp2 = 2 * csize;
+        return cmd;
+    };
+    // runs the ring until nothing is left in flight, replies are gathered by tag
+    auto run = [](nvme_xcow &ctrl, nm_outcome outcome, std::vector<nm_reply> &replies) {
+        auto take = [&](const nm_outcome &o) {
+            // the tickets of the clusters a command is split into don't reply
+            if (std::holds_alternative<nm_reply>(o) && std::get<nm_reply>(o).tag != noop_tag)
+                replies.push_back(std::get<nm_reply>(o));
+            return std::holds_alternative<xcow_ticket *>(o);
+        };
+        take(outcome);
+        std::array<io_uring_cqe *, 64> cqebuf{};
+        while (xcow_ticket::live_count) {
+            ctrl.sq_kick();
+            auto wnd = ctrl.get_pending_completions(std::span(cqebuf));
+            for (auto cqe : wnd.cqes)
+                ctrl.complete(cqe, take);
+            ctrl.commit_completions(wnd);
+        }
+    };
+
+    xcow_locks locks;
+    std::vector<nm_reply> replies;
+
+    SECTION("full cluster") {
+        nvme_xcow ctrl(vm, fake_nfd, bfd, &f, &locks);
+        run(ctrl, ctrl.submit_async(1, write_cmd(3, 1), 7), replies);
+        REQUIRE(replies.size() == 1);
+        REQUIRE(replies[0].tag == 7);
+        REQUIRE(replies[0].status == NVME_SC_SUCCESS);
+
+        // the guest data went to a cluster of our own, which the leaf points to now
+        auto s = f.open_write();
+        auto tl = s.translate_read(3 * csize);
+        REQUIRE(!is_empty(tl));
+        REQUIRE((tl & writable));
+        std::vector<unsigned char> written(csize);
+        REQUIRE(pread(bfd, written.data(), csize, static_cast<off_t>(decode_leaf(tl))) == csize);
+        REQUIRE(std::equal(written.begin(), written.end(), data.begin()));
+    }
+
+    SECTION("failed parts reply once") {
+        // both clusters fail to be written
+        int rofd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        REQUIRE(rofd >= 0);
+        {
+            nvme_xcow ctrl(vm, fake_nfd, rofd, &f, &locks);
+            run(ctrl, ctrl.submit_async(1, write_cmd(5, 2), 9), replies);
+        }
+        close(rofd);
+        REQUIRE(replies.size() == 1);
+        REQUIRE(replies[0].tag == 9);
+        REQUIRE(replies[0].status != NVME_SC_SUCCESS);
+        auto s = f.open_write();
+        REQUIRE(is_empty(s.translate_read(5 * csize)));
+        REQUIRE(is_empty(s.translate_read(6 * csize)));
+    }
+}
@@ -0,0 +1,270 @@
+#include <bit>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nvme_core.hpp"
+#include "util.hpp"
+#include "util/dirty_bitmap.hpp"
+
+dirty_bitmap::dirty_bitmap(const char *path, uint64_t dev_size, unsigned int region_shift, unsigned int nreplicas)
+    : _region_shift(region_shift), _dev_size(dev_size) {
+    if (region_shift < NVME_PAGE_SHIFT || region_shift >= 48 || !nreplicas || nreplicas > max_replicas) {
+        throw std::invalid_argument("bad dirty bitmap parameters");
+    }
+    _nr_regions = (dev_size + region_size() - 1) >> region_shift;
+    _map_size = NVME_PAGE_SIZE + round_up((_nr_regions + 63) / 64 * sizeof(uint64_t), NVME_PAGE_SIZE);
+
+    _fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot open dirty bitmap");
+    }
+    struct stat st {};
+    if (fstat(_fd, &st) < 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot stat dirty bitmap");
+    }
+    bool fresh = st.st_size == 0;
+    if (fresh && ftruncate(_fd, static_cast<off_t>(_map_size)) < 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot size dirty bitmap");
+    } else if (!fresh && static_cast<size_t>(st.st_size) != _map_size) {
+        throw std::runtime_error("dirty bitmap size mismatch");
+    }
+
+    auto m = mmap(nullptr, _map_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (m == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "cannot map dirty bitmap");
+    }
+    _map = static_cast<unsigned char *>(m);
+    _hdr = reinterpret_cast<header *>(_map);
+    _bits = reinterpret_cast<uint64_t *>(_map + NVME_PAGE_SIZE);
+
+    if (fresh) {
+        *_hdr = header{
+            .magic = magic,
+            .version = version,
+            .region_shift = region_shift,
+            .dev_size = dev_size,
+            .nr_regions = _nr_regions,
+            .nreplicas = nreplicas,
+            .degraded = 0,
+        };
+        sync_header();
+    } else if (
+        _hdr->magic != magic || _hdr->version != version || _hdr->region_shift != region_shift ||
+        _hdr->dev_size != dev_size || _hdr->nreplicas != nreplicas) {
+        throw std::runtime_error("dirty bitmap does not match this volume");
+    }
+
+    size_t nwords = (_nr_regions + 63) / 64;
+    _sticky = std::make_unique<std::atomic<uint64_t>[]>(nwords);
+    _inflight = std::make_unique<std::atomic<uint16_t>[]>(_nr_regions);
+    _gen = std::make_unique<std::atomic<uint32_t>[]>(_nr_regions);
+    _clean_gen = std::make_unique<uint32_t[]>(_nr_regions);
+    _page_mark = std::make_unique<std::atomic<uint64_t>[]>((_nr_regions + bits_per_page - 1) / bits_per_page);
+    // whatever was dirty when we went down may differ between replicas
+    for (size_t i = 0; i < nwords; i++) {
+        _sticky[i].store(_bits[i], std::memory_order_relaxed);
+    }
+}
+
+dirty_bitmap::~dirty_bitmap() {
+    msync(_map, _map_size, MS_SYNC);
+    munmap(_map, _map_size);
+    close(_fd);
+}
+
+void dirty_bitmap::sync_bits(uint64_t region) {
+    auto p = reinterpret_cast<uintptr_t>(&_bits[region / 64]) & ~(NVME_PAGE_SIZE - 1);
+    if (msync(reinterpret_cast<void *>(p), NVME_PAGE_SIZE, MS_SYNC) < 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot sync dirty bitmap");
+    }
+}
+
+void dirty_bitmap::sync_header() {
+    if (msync(_map, NVME_PAGE_SIZE, MS_SYNC) < 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot sync dirty bitmap");
+    }
+}
+
+uint64_t dirty_bitmap::mark(uint64_t region) {
+    auto &page_mark = _page_mark[region / bits_per_page];
+    if (__atomic_load_n(&_bits[region / 64], __ATOMIC_SEQ_CST) & bit(region)) {
+        // set by an earlier write, whose sync may still be in flight
+        return page_mark.load(std::memory_order_seq_cst);
+    }
+    std::lock_guard lk(_mark_lock);
+    auto m = _marked.load(std::memory_order_relaxed) + 1;
+    // before the bit, for writes that find it set
+    page_mark.store(m, std::memory_order_seq_cst);
+    __atomic_fetch_or(&_bits[region / 64], bit(region), __ATOMIC_SEQ_CST);
+    // after the bit, so that a sync issued for this mark covers it
+    _marked.store(m, std::memory_order_seq_cst);
+    return m;
+}
+
+uint64_t dirty_bitmap::write_begin(off_t offset, size_t nbytes) {
+    auto last = std::min(last_region(offset, nbytes), _nr_regions - 1);
+    uint64_t m = 0;
+    for (auto r = first_region(offset); r <= last; r++) {
+        // inflight must be visible before the bit, see clean()
+        _inflight[r].fetch_add(1, std::memory_order_seq_cst);
+        _gen[r].fetch_add(1, std::memory_order_relaxed);
+        m = std::max(m, mark(r));
+    }
+    return m;
+}
+
+void dirty_bitmap::synced(uint64_t target) {
+    auto cur = _durable.load(std::memory_order_seq_cst);
+    while (cur < target && !_durable.compare_exchange_weak(cur, target, std::memory_order_seq_cst)) {
+    }
+}
+
+void dirty_bitmap::write_end(off_t offset, size_t nbytes, unsigned int nfailed) {
+    auto last = std::min(last_region(offset, nbytes), _nr_regions - 1);
+    for (auto r = first_region(offset); r <= last; r++) {
+        if (nfailed) {
+            _sticky[r / 64].fetch_or(bit(r), std::memory_order_seq_cst);
+        }
+        _inflight[r].fetch_sub(1, std::memory_order_seq_cst);
+    }
+    _unsettled.fetch_sub(nfailed, std::memory_order_seq_cst);
+}
+
+uint64_t dirty_bitmap::replica_failed(unsigned int replica) {
+    _unsettled.fetch_add(1, std::memory_order_seq_cst);
+    auto flag = uint32_t{1} << replica;
+    if (__atomic_load_n(&_hdr->degraded, __ATOMIC_SEQ_CST) & flag) {
+        // set by an earlier failure, whose sync may still be in flight
+        return _header_mark.load(std::memory_order_seq_cst);
+    }
+    std::lock_guard lk(_mark_lock);
+    auto m = _marked.load(std::memory_order_relaxed) + 1;
+    _header_mark.store(m, std::memory_order_seq_cst);
+    __atomic_fetch_or(&_hdr->degraded, flag, __ATOMIC_SEQ_CST);
+    _marked.store(m, std::memory_order_seq_cst);
+    return m;
+}
+
+uint64_t dirty_bitmap::mark_all(unsigned int nfailed) {
+    size_t nwords = (_nr_regions + 63) / 64;
+    size_t npages = (_nr_regions + bits_per_page - 1) / bits_per_page;
+    uint64_t m = 0;
+    {
+        std::lock_guard lk(_mark_lock);
+        m = _marked.load(std::memory_order_relaxed) + 1;
+        // writes finding their bit set from here on wait for this mark
+        for (size_t p = 0; p < npages; p++) {
+            _page_mark[p].store(m, std::memory_order_seq_cst);
+        }
+        for (size_t i = 0; i < nwords; i++) {
+            auto mask = i + 1 < nwords || !(_nr_regions % 64) ? ~uint64_t{0} : bit(_nr_regions) - 1;
+            _sticky[i].fetch_or(mask, std::memory_order_seq_cst);
+            __atomic_fetch_or(&_bits[i], mask, __ATOMIC_SEQ_CST);
+        }
+        _marked.store(m, std::memory_order_seq_cst);
+    }
+    // the regions are sticky in memory already, which keeps try_clear_degraded away
+    _unsettled.fetch_sub(nfailed, std::memory_order_seq_cst);
+    return m;
+}
+
+uint32_t dirty_bitmap::degraded_mask() const {
+    return __atomic_load_n(&_hdr->degraded, __ATOMIC_ACQUIRE);
+}
+
+bool dirty_bitmap::try_clear_degraded(uint32_t mask) {
+    if (_unsettled.load(std::memory_order_seq_cst) || count_sticky()) {
+        return false;
+    }
+    __atomic_fetch_and(&_hdr->degraded, ~mask, __ATOMIC_SEQ_CST);
+    // a failure may have been reported meanwhile, in which case its replica must stay degraded
+    if (_unsettled.load(std::memory_order_seq_cst) || count_sticky()) {
+        __atomic_fetch_or(&_hdr->degraded, mask, __ATOMIC_SEQ_CST);
+        return false;
+    }
+    sync_header();
+    return true;
+}
+
+bool dirty_bitmap::next_sticky(uint64_t &region) const {
+    size_t nwords = (_nr_regions + 63) / 64;
+    for (auto i = region / 64; i < nwords; i++) {
+        auto w = _sticky[i].load(std::memory_order_acquire);
+        if (i == region / 64) {
+            w &= ~(bit(region) - 1);
+        }
+        if (w) {
+            region = i * 64 + static_cast<uint64_t>(std::countr_zero(w));
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t dirty_bitmap::count_sticky() const {
+    size_t nwords = (_nr_regions + 63) / 64;
+    size_t n = 0;
+    for (size_t i = 0; i < nwords; i++) {
+        n += static_cast<size_t>(std::popcount(_sticky[i].load(std::memory_order_relaxed)));
+    }
+    return n;
+}
+
+bool dirty_bitmap::resync_begin(uint64_t region, uint32_t &gen) const {
+    gen = _gen[region].load(std::memory_order_seq_cst);
+    return _inflight[region].load(std::memory_order_seq_cst) == 0;
+}
+
+bool dirty_bitmap::resync_end(uint64_t region, uint32_t gen) {
+    if (_inflight[region].load(std::memory_order_seq_cst) || _gen[region].load(std::memory_order_seq_cst) != gen) {
+        return false;
+    }
+    _sticky[region / 64].fetch_and(~bit(region), std::memory_order_seq_cst);
+    // a write may have started after the check above
+    if (_gen[region].load(std::memory_order_seq_cst) != gen) {
+        _sticky[region / 64].fetch_or(bit(region), std::memory_order_seq_cst);
+        return false;
+    }
+    return true;
+}
+
+size_t dirty_bitmap::clean() {
+    size_t nwords = (_nr_regions + 63) / 64;
+    constexpr size_t words_per_page = NVME_PAGE_SIZE / sizeof(uint64_t);
+    size_t cleared = 0;
+    bool page_changed = false;
+    for (size_t i = 0; i < nwords; i++) {
+        auto w = __atomic_load_n(&_bits[i], __ATOMIC_ACQUIRE) & ~_sticky[i].load(std::memory_order_acquire);
+        while (w) {
+            auto r = i * 64 + static_cast<uint64_t>(std::countr_zero(w));
+            w &= w - 1;
+            auto gen = _gen[r].load(std::memory_order_seq_cst);
+            if (_inflight[r].load(std::memory_order_seq_cst) || gen != _clean_gen[r]) {
+                _clean_gen[r] = gen;
+                continue;
+            }
+            __atomic_fetch_and(&_bits[i], ~bit(r), __ATOMIC_SEQ_CST);
+            // write_begin bumps inflight before setting the bit; if one slipped in, put the bit back on disk
+            if (_inflight[r].load(std::memory_order_seq_cst) ||
+                (_sticky[i].load(std::memory_order_seq_cst) & bit(r))) {
+                __atomic_fetch_or(&_bits[i], bit(r), __ATOMIC_SEQ_CST);
+                sync_bits(r);
+            } else {
+                page_changed = true;
+                cleared++;
+            }
+        }
+        if (page_changed && (i + 1 == nwords || (i + 1) % words_per_page == 0)) {
+            // clears only need to reach the disk eventually, write them back once per page
+            msync(&_bits[i - i % words_per_page], NVME_PAGE_SIZE, MS_ASYNC);
+            page_changed = false;
+        }
+    }
+    return cleared;
+}
@@ -0,0 +1,405 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <mimalloc.h>
+
+#include "util.hpp"
+#include "util/journal.hpp"
+#include "util/time.hpp"
+
+void replica_journal::block_deleter::operator()(unsigned char *p) const {
+    mi_free(p);
+}
+
+replica_journal::block_ptr replica_journal::alloc_blocks(size_t nbytes) {
+    auto p = static_cast<unsigned char *>(mi_new_aligned(nbytes, block_size));
+    memset(p, 0, nbytes);
+    return block_ptr(p);
+}
+
+uint64_t replica_journal::checksum(std::span<const unsigned char> data) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, data.data() + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static bool pread_full(int fd, unsigned char *buf, size_t nbytes, off_t offset) {
+    while (nbytes) {
+        auto ret = pread(fd, buf, nbytes, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        nbytes -= static_cast<size_t>(ret);
+        offset += ret;
+    }
+    return true;
+}
+
+replica_journal::replica_journal(
+    const char *path,
+    uint64_t capacity,
+    std::span<const char *const> targets,
+    uint64_t max_lag_bytes,
+    unsigned int max_lag_ms,
+    size_t batch_bytes)
+    : _max_lag_ms(max_lag_ms), _batch_bytes(batch_bytes), _sbbuf(alloc_blocks(block_size)),
+      _buf(alloc_blocks(batch_bytes)), _buf_size(batch_bytes) {
+    capacity = capacity / block_size * block_size;
+    if (capacity < 3 * block_size || batch_bytes < block_size) {
+        throw std::invalid_argument("journal too small");
+    }
+    _ring_size = capacity - block_size;
+    _max_lag_bytes = std::min(max_lag_bytes, _ring_size);
+
+    auto hfds = cleanup([&] {
+        for (auto fd : {_fd, _rfd}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        for (auto fd : _targets) {
+            close(fd);
+        }
+    });
+
+    _fd = open(path, O_RDWR | O_CREAT | O_DIRECT | O_DSYNC | O_CLOEXEC, 0600);
+    if (_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot open journal");
+    }
+    _rfd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (_rfd < 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot open journal");
+    }
+    for (auto target : targets) {
+        int fd = open(target, O_RDWR | O_DIRECT | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot open journal target");
+        }
+        _targets.push_back(fd);
+    }
+
+    struct stat st {};
+    if (fstat(_fd, &st) < 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot stat journal");
+    }
+    if (st.st_size == 0) {
+        if (fallocate(_fd, 0, 0, static_cast<off_t>(capacity)) < 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot preallocate journal");
+        }
+        _epoch = 1;
+        write_superblock(0, 0);
+    } else {
+        if (!pread_full(_fd, _sbbuf.get(), block_size, 0)) {
+            throw std::runtime_error("cannot read journal superblock");
+        }
+        superblock sb{};
+        memcpy(&sb, _sbbuf.get(), sizeof(sb));
+        if (sb.magic != magic || sb.version != version || sb.capacity != capacity ||
+            static_cast<uint64_t>(st.st_size) != capacity) {
+            throw std::runtime_error("journal does not match");
+        }
+        _epoch = sb.epoch + 1;
+        recover(sb);
+        write_superblock(_head, _entries.empty() ? _next_seq : _entries.front().seq);
+    }
+    hfds.neutralize();
+
+    _thread = std::thread(&replica_journal::run, this);
+    pthread_setname_np(_thread.native_handle(), "shipper");
+}
+
+replica_journal::~replica_journal() {
+    _stop.store(true, std::memory_order_relaxed);
+    _thread.join();
+    close(_fd);
+    close(_rfd);
+    for (auto fd : _targets) {
+        close(fd);
+    }
+}
+
+void replica_journal::write_superblock(uint64_t head_pos, uint64_t head_seq) {
+    superblock sb{
+        .magic = magic,
+        .version = version,
+        .epoch = _epoch,
+        .capacity = _ring_size + block_size,
+        .head_pos = head_pos,
+        .head_seq = head_seq,
+    };
+    memcpy(_sbbuf.get(), &sb, sizeof(sb));
+    if (pwrite(_fd, _sbbuf.get(), block_size, 0) != static_cast<ssize_t>(block_size)) {
+        throw std::system_error(errno, std::generic_category(), "cannot write journal superblock");
+    }
+}
+
+bool replica_journal::read_records(uint64_t pos, uint64_t len) {
+    if (len > _buf_size) {
+        _buf = alloc_blocks(len);
+        _buf_size = len;
+    }
+    return pread_full(_rfd, _buf.get(), len, file_offset(pos));
+}
+
+void replica_journal::recover(const superblock &sb) {
+    auto pos = sb.head_pos;
+    auto seq = sb.head_seq;
+    uint32_t epoch = 0;
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    auto valid_at = [&](uint64_t p, journal_record &rec) {
+        if (!read_records(p, block_size)) {
+            return false;
+        }
+        memcpy(&rec, _buf.get(), sizeof(rec));
+        if (rec.magic != record_magic || rec.seq != seq || rec.epoch < epoch || rec.epoch >= _epoch ||
+            rec.len < block_size || rec.len % block_size || p % _ring_size + rec.len > _ring_size ||
+            rec.ndata() > rec.len - block_size) {
+            return false;
+        }
+        // a torn record has a valid header but not all of its data
+        return read_records(p, rec.len) &&
+            rec.checksum == checksum(std::span<const unsigned char>(_buf.get() + block_size, rec.ndata()));
+    };
+    while (true) {
+        journal_record rec{};
+        if (!valid_at(pos, rec)) {
+            // the writer skips to the start of the ring when a record does not fit before its end
+            auto next_lap = pos + (_ring_size - pos % _ring_size);
+            if (pos % _ring_size == 0 || next_lap - sb.head_pos >= _ring_size || !valid_at(next_lap, rec)) {
+                break;
+            }
+            pos = next_lap;
+        }
+        _entries.push_back(entry{.seq = seq, .pos = pos, .len = rec.len, .time = now, .written = true});
+        epoch = rec.epoch;
+        pos += rec.len;
+        seq++;
+        if (pos - sb.head_pos >= _ring_size) {
+            break;
+        }
+    }
+    _head = sb.head_pos;
+    _tail = pos;
+    _next_seq = seq;
+    _durable_seq.store(seq, std::memory_order_release);
+    if (!_entries.empty()) {
+        printf("journal: replaying %zu records (%lu bytes)\n", _entries.size(), _tail - _head);
+    }
+}
+
+bool replica_journal::reserve(size_t nbytes, uint64_t &seq, off_t &offset, uint64_t &len) {
+    if (nbytes > max_data()) {
+        throw std::invalid_argument("journal record too large");
+    }
+    len = block_size + round_up(static_cast<uint64_t>(nbytes), uint64_t{block_size});
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    std::lock_guard lock(_lock);
+    auto skip = _tail % _ring_size + len > _ring_size ? _ring_size - _tail % _ring_size : 0;
+    if (_tail + skip + len - _head > _ring_size) {
+        return false;
+    }
+    if (_tail != _head) {
+        if (_tail + skip + len - _head > _max_lag_bytes) {
+            return false;
+        }
+        if (_max_lag_ms && !_entries.empty() && now - _entries.front().time > 1000000l * _max_lag_ms) {
+            return false;
+        }
+    }
+    auto pos = _tail + skip;
+    _tail = pos + len;
+    seq = _next_seq++;
+    _entries.push_back(entry{.seq = seq, .pos = pos, .len = len, .time = now, .written = false});
+    offset = file_offset(pos);
+    return true;
+}
+
+void replica_journal::written(uint64_t seq) {
+    std::lock_guard lock(_lock);
+    // only durable records are ever shipped, so seq is still queued
+    auto first = _entries.front().seq;
+    _entries[seq - first].written = true;
+    auto d = _durable_seq.load(std::memory_order_relaxed);
+    while (d - first < _entries.size() && _entries[d - first].written) {
+        d++;
+    }
+    _durable_seq.store(d, std::memory_order_release);
+}
+
+bool replica_journal::write_targets(std::span<const iovec> iov, uint64_t offset) {
+    size_t total = 0;
+    for (auto &v : iov) {
+        total += v.iov_len;
+    }
+    for (auto fd : _targets) {
+        if (pwritev(fd, iov.data(), static_cast<int>(iov.size()), static_cast<off_t>(offset)) !=
+            static_cast<ssize_t>(total)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool replica_journal::zero_targets(uint64_t offset, uint64_t nbytes) {
+    for (auto fd : _targets) {
+        if (fallocate(fd, FALLOC_FL_ZERO_RANGE, static_cast<off_t>(offset), static_cast<off_t>(nbytes)) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool replica_journal::ship(std::span<const entry> batch) {
+    std::vector<iovec> iov;
+    uint64_t iov_offset = 0;
+    uint64_t iov_end = 0;
+    auto flush_iov = [&] {
+        bool ok = iov.empty() || write_targets(iov, iov_offset);
+        iov.clear();
+        return ok;
+    };
+
+    for (size_t i = 0; i < batch.size();) {
+        // a run of records that are contiguous in the file
+        size_t n = 1;
+        auto run_len = batch[i].len;
+        while (i + n < batch.size() && batch[i + n].pos == batch[i + n - 1].pos + batch[i + n - 1].len &&
+               batch[i + n].pos % _ring_size && run_len + batch[i + n].len <= _buf_size) {
+            run_len += batch[i + n].len;
+            n++;
+        }
+        if (!read_records(batch[i].pos, run_len)) {
+            fprintf(stderr, "journal: cannot read record %lu\n", batch[i].seq);
+            return false;
+        }
+
+        auto p = _buf.get();
+        for (size_t j = i; j < i + n; j++) {
+            journal_record rec{};
+            memcpy(&rec, p, sizeof(rec));
+            if (rec.magic != record_magic || rec.seq != batch[j].seq || rec.len != batch[j].len ||
+                rec.ndata() > rec.len - block_size ||
+                rec.checksum != checksum(std::span<const unsigned char>(p + block_size, rec.ndata()))) {
+                fprintf(stderr, "journal: record %lu is corrupted\n", batch[j].seq);
+                return false;
+            }
+            if (rec.k == journal_record::kind::write) {
+                // coalesce writes that are contiguous on the volume as well
+                if (!iov.empty() && (rec.offset != iov_end || iov.size() >= IOV_MAX)) {
+                    if (!flush_iov()) {
+                        return false;
+                    }
+                }
+                if (iov.empty()) {
+                    iov_offset = rec.offset;
+                }
+                iov.push_back(iovec{p + block_size, rec.nbytes});
+                iov_end = rec.offset + rec.nbytes;
+            } else if (rec.k == journal_record::kind::write_zeroes) {
+                if (!flush_iov() || !zero_targets(rec.offset, rec.nbytes)) {
+                    return false;
+                }
+            }
+            p += rec.len;
+        }
+        // the buffer is reused by the next run
+        if (!flush_iov()) {
+            return false;
+        }
+        i += n;
+    }
+
+    for (auto fd : _targets) {
+        if (fdatasync(fd) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void replica_journal::run() {
+    constexpr auto idle_wait = std::chrono::milliseconds(1);
+    constexpr auto error_wait = std::chrono::seconds(1);
+    std::vector<entry> batch;
+
+    while (!_stop.load(std::memory_order_relaxed)) {
+        batch.clear();
+        {
+            std::lock_guard lock(_lock);
+            auto durable = _durable_seq.load(std::memory_order_acquire);
+            uint64_t nbytes = 0;
+            for (auto &e : _entries) {
+                if (e.seq >= durable || (!batch.empty() && nbytes + e.len > _batch_bytes)) {
+                    break;
+                }
+                batch.push_back(e);
+                nbytes += e.len;
+            }
+        }
+        if (batch.empty()) {
+            std::this_thread::sleep_for(idle_wait);
+            continue;
+        }
+
+        if (!ship(batch)) {
+            fprintf(stderr, "journal: cannot ship records %lu-%lu, retrying\n", batch.front().seq, batch.back().seq);
+            std::this_thread::sleep_for(error_wait);
+            continue;
+        }
+
+        uint64_t head = batch.back().pos + batch.back().len;
+        uint64_t shipped = 0;
+        {
+            std::lock_guard lock(_lock);
+            _entries.erase(_entries.begin(), _entries.begin() + static_cast<ptrdiff_t>(batch.size()));
+            if (!_entries.empty()) {
+                head = _entries.front().pos;
+            }
+        }
+        for (auto &e : batch) {
+            shipped += e.len;
+        }
+        // the space can only be reused once the new head is on disk
+        write_superblock(head, batch.back().seq + 1);
+        {
+            std::lock_guard lock(_lock);
+            _head = head;
+        }
+        _shipped_bytes.fetch_add(shipped, std::memory_order_relaxed);
+    }
+}
+
+void replica_journal::print_stats(FILE *f, const char *prefix) {
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    std::lock_guard lock(_lock);
+    long lag_ms = _entries.empty() ? 0 : (now - _entries.front().time) / 1000000;
+    fprintf(
+        f,
+        "%s: journal lag %lu bytes %zu records %ld ms, shipped %lu bytes\n",
+        prefix,
+        _tail - _head,
+        _entries.size(),
+        lag_ms,
+        _shipped_bytes.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,499 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <mimalloc.h>
+
+#include "util/remote.hpp"
+
+bool is_remote_spec(const char *spec) {
+    return !strncmp(spec, "unix:", 5) || !strncmp(spec, "tcp:", 4);
+}
+
+static sockaddr_un unix_addr(const char *path) {
+    sockaddr_un sa{};
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        throw std::invalid_argument("socket path too long");
+    }
+    strcpy(sa.sun_path, path);
+    return sa;
+}
+
+// calls fn(addrinfo) for each address of "host:port" until it returns a descriptor
+template <typename F>
+static int with_tcp_addr(const char *hostport, bool passive, F &&fn) {
+    std::string s(hostport);
+    auto colon = s.rfind(':');
+    if (colon == std::string::npos) {
+        throw std::invalid_argument("bad tcp address");
+    }
+    auto host = s.substr(0, colon);
+    auto port = s.substr(colon + 1);
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo *res = nullptr;
+    auto ret = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+    if (ret) {
+        throw std::runtime_error(std::string("cannot resolve address: ") + gai_strerror(ret));
+    }
+    auto hres = cleanup([=] { freeaddrinfo(res); });
+    int err = EADDRNOTAVAIL;
+    for (auto ai = res; ai; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+        if (fn(fd, ai) == 0) {
+            return fd;
+        }
+        err = errno;
+        close(fd);
+    }
+    throw std::system_error(err, std::generic_category(), "cannot set up tcp socket");
+}
+
+int remote_connect(const char *spec) {
+    if (!strncmp(spec, "unix:", 5)) {
+        auto sa = unix_addr(spec + 5);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot create socket");
+        }
+        if (connect(fd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa)) < 0) {
+            auto err = errno;
+            close(fd);
+            throw std::system_error(err, std::generic_category(), "cannot connect to replica");
+        }
+        return fd;
+    } else if (!strncmp(spec, "tcp:", 4)) {
+        return with_tcp_addr(spec + 4, false, [](int fd, addrinfo *ai) {
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+                return -1;
+            }
+            // frames are already batched, do not hold back the tail of a frame
+            int one = 1;
+            return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        });
+    }
+    throw std::invalid_argument("bad replica address");
+}
+
+int remote_listen(const char *spec) {
+    if (!strncmp(spec, "unix:", 5)) {
+        auto sa = unix_addr(spec + 5);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot create socket");
+        }
+        unlink(sa.sun_path);
+        if (bind(fd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa)) < 0 || listen(fd, SOMAXCONN) < 0) {
+            auto err = errno;
+            close(fd);
+            throw std::system_error(err, std::generic_category(), "cannot listen");
+        }
+        return fd;
+    } else if (!strncmp(spec, "tcp:", 4)) {
+        return with_tcp_addr(spec + 4, true, [](int fd, addrinfo *ai) {
+            int one = 1;
+            if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+                bind(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+                return -1;
+            }
+            return listen(fd, SOMAXCONN);
+        });
+    }
+    throw std::invalid_argument("bad listen address");
+}
+
+static unsigned char *map_buffers(size_t size) {
+    auto m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (m == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "cannot allocate replica buffers");
+    }
+    return static_cast<unsigned char *>(m);
+}
+
+remote_client::remote_client(int fid)
+    : _fid(fid), _mem_size(nr_frames * frame_size + recv_size), _send_ticket(this), _recv_ticket(this) {
+    _mem = map_buffers(_mem_size);
+    for (size_t i = 0; i < nr_frames; i++) {
+        _iovecs.push_back(iovec{_mem + i * frame_size, frame_size});
+        _free_frames.push_back(static_cast<int>(nr_frames - 1 - i));
+    }
+    _iovecs.push_back(iovec{_mem + nr_frames * frame_size, recv_size});
+}
+
+remote_client::~remote_client() {
+    munmap(_mem, _mem_size);
+}
+
+void remote_client::append(sq_ticket *t, remote_request req, std::span<const iovec> data) {
+    if (_dead) {
+        _done.emplace_back(t, -EPIPE);
+        return;
+    }
+    req.magic = remote_request_magic;
+    req.seq = _next_seq++;
+    size_t need = sizeof(req);
+    for (auto &v : data) {
+        need += v.iov_len;
+    }
+
+    if (_frames.empty() || _frames.back().submitted || _frames.back().used + need > _frames.back().size) {
+        if (!_free_frames.empty() && need <= frame_size) {
+            auto index = _free_frames.back();
+            _free_frames.pop_back();
+            _frames.push_back(frame{
+                .mem = _mem + static_cast<size_t>(index) * frame_size,
+                .size = frame_size,
+                .index = index,
+            });
+        } else {
+            // the wire is slower than the guest, or the request is larger than a frame
+            auto size = std::max(frame_size, need);
+            auto heap = std::make_unique<unsigned char[]>(size);
+            auto mem = heap.get();
+            _frames.push_back(frame{.mem = mem, .size = size, .index = -1, .heap = std::move(heap)});
+        }
+    }
+
+    auto &f = _frames.back();
+    memcpy(f.mem + f.used, &req, sizeof(req));
+    f.used += sizeof(req);
+    for (auto &v : data) {
+        memcpy(f.mem + f.used, v.iov_base, v.iov_len);
+        f.used += v.iov_len;
+    }
+    _inflight.emplace(req.seq, t);
+}
+
+void remote_client::queue_write(sq_ticket *t, off_t offset, std::span<const iovec> data, bool fua) {
+    size_t nbytes = 0;
+    for (auto &v : data) {
+        nbytes += v.iov_len;
+    }
+    append(
+        t,
+        remote_request{
+            .op = remote_op::write,
+            .flags = fua ? remote_flag_fua : uint16_t{0},
+            .offset = static_cast<uint64_t>(offset),
+            .nbytes = nbytes,
+        },
+        data);
+}
+
+void remote_client::queue_write_zeroes(sq_ticket *t, off_t offset, size_t nbytes) {
+    append(
+        t,
+        remote_request{.op = remote_op::write_zeroes, .offset = static_cast<uint64_t>(offset), .nbytes = nbytes},
+        {});
+}
+
+void remote_client::queue_flush(sq_ticket *t) {
+    append(t, remote_request{.op = remote_op::flush}, {});
+}
+
+void remote_client::kick(uring &ring) {
+    if (_dead) {
+        return;
+    }
+    if (!_sending && !_frames.empty()) {
+        auto &f = _frames.front();
+        // a send from the registered frame, see remote_client
+        ring.queue_write(
+            &_send_ticket,
+            f.mem + f.sent,
+            static_cast<unsigned int>(f.used - f.sent),
+            f.index >= 0 ? _buf_base + f.index : -1,
+            true,
+            _fid,
+            0);
+        f.submitted = true;
+        _sending = true;
+    }
+    if (!_receiving) {
+        ring.queue_read(
+            &_recv_ticket,
+            _mem + nr_frames * frame_size + _recv_used,
+            static_cast<unsigned int>(recv_size - _recv_used),
+            _buf_base + static_cast<int>(nr_frames),
+            true,
+            _fid,
+            0);
+        _receiving = true;
+    }
+}
+
+void remote_client::on_send(int res) {
+    _sending = false;
+    if (_dead) {
+        // nothing will be sent anymore
+        for (auto &f : _frames) {
+            if (f.index >= 0) {
+                _free_frames.push_back(f.index);
+            }
+        }
+        _frames.clear();
+        return;
+    }
+    if (res <= 0) {
+        fail_all(res < 0 ? res : -EPIPE);
+        return;
+    }
+    auto &f = _frames.front();
+    f.sent += static_cast<size_t>(res);
+    if (f.sent == f.used) {
+        if (f.index >= 0) {
+            _free_frames.push_back(f.index);
+        }
+        _frames.pop_front();
+    }
+}
+
+void remote_client::on_recv(int res) {
+    _receiving = false;
+    if (_dead) {
+        return;
+    }
+    if (res <= 0) {
+        fail_all(res < 0 ? res : -ECONNRESET);
+        return;
+    }
+    _recv_used += static_cast<size_t>(res);
+    auto buf = _mem + nr_frames * frame_size;
+    size_t pos = 0;
+    for (; pos + sizeof(remote_response) <= _recv_used; pos += sizeof(remote_response)) {
+        remote_response resp{};
+        memcpy(&resp, buf + pos, sizeof(resp));
+        auto it = _inflight.find(resp.seq);
+        if (resp.magic != remote_response_magic || it == _inflight.end()) {
+            fail_all(-EPROTO);
+            return;
+        }
+        _done.emplace_back(it->second, resp.status);
+        _inflight.erase(it);
+    }
+    memmove(buf, buf + pos, _recv_used - pos);
+    _recv_used -= pos;
+}
+
+void remote_client::fail_all(int err) {
+    _dead = true;
+    for (auto [seq, t] : _inflight) {
+        _done.emplace_back(t, err);
+    }
+    _inflight.clear();
+    if (!_sending) {
+        on_send(0);
+    }
+}
+
+struct remote_receiver::request_ticket final : public sq_ticket {
+    struct deleter {
+        void operator()(unsigned char *p) {
+            mi_free(p);
+        }
+    };
+
+    request_ticket(uint64_t _seq, remote_op _op) : sq_ticket(0), seq(_seq), op(_op) {
+    }
+    uint64_t seq;
+    remote_op op;
+    uint64_t ordinal = 0;
+    size_t nbytes = 0;
+    std::unique_ptr<unsigned char[], deleter> buf;
+    iovec iov{};
+};
+
+remote_receiver::remote_receiver(int sock, int bfd)
+    : _fds{{sock, bfd}}, _mem_size(recv_size + send_size), _mem(map_buffers(_mem_size)),
+      _iovecs{{{_mem, recv_size}, {_mem + recv_size, send_size}}}, _ring(2 * max_inflight, 0, std::span(_fds), _iovecs),
+      _recv_ticket(0), _send_ticket(0) {
+}
+
+remote_receiver::~remote_receiver() {
+    munmap(_mem, _mem_size);
+}
+
+void remote_receiver::respond(uint64_t seq, int status) {
+    remote_response resp{.magic = remote_response_magic, .status = status, .seq = seq};
+    // parse() never lets the responses outgrow the send buffer
+    memcpy(_mem + recv_size + _send_used, &resp, sizeof(resp));
+    _send_used += sizeof(resp);
+}
+
+void remote_receiver::parse() {
+    constexpr int fid_backend = 1;
+    while (_recv_start + sizeof(remote_request) <= _recv_used &&
+           _inflight + _send_used / sizeof(remote_response) < max_inflight) {
+        remote_request req{};
+        memcpy(&req, _mem + _recv_start, sizeof(req));
+        if (req.magic != remote_request_magic ||
+            (req.op == remote_op::write && req.nbytes > recv_size - sizeof(req))) {
+            fprintf(stderr, "receiver: bad request, closing\n");
+            _closed = true;
+            _broken = true;
+            // wakes up the pending receive
+            shutdown(_fds[0], SHUT_RDWR);
+            return;
+        }
+        size_t need = sizeof(req) + (req.op == remote_op::write ? req.nbytes : 0);
+        if (_recv_start + need > _recv_used) {
+            break;
+        }
+
+        auto t = new request_ticket(req.seq, req.op);
+        _inflight++;
+        switch (req.op) {
+        case remote_op::write:
+            t->ordinal = _next_write++;
+            _writes.insert(t->ordinal);
+            t->nbytes = req.nbytes;
+            // the payload is not aligned for O_DIRECT where it sits in the stream
+            t->buf.reset(
+                static_cast<unsigned char *>(mi_new_aligned(std::max(req.nbytes, uint64_t{1}), NVME_PAGE_SIZE)));
+            memcpy(t->buf.get(), _mem + _recv_start + sizeof(req), req.nbytes);
+            t->iov = iovec{t->buf.get(), req.nbytes};
+            _ring.queue_writev(
+                t,
+                std::span(&t->iov, 1),
+                true,
+                fid_backend,
+                static_cast<off_t>(req.offset),
+                (req.flags & remote_flag_fua) ? RWF_DSYNC : 0);
+            break;
+        case remote_op::write_zeroes:
+            t->ordinal = _next_write++;
+            _writes.insert(t->ordinal);
+            _ring.queue_fallocate(
+                t,
+                true,
+                fid_backend,
+                FALLOC_FL_ZERO_RANGE,
+                static_cast<off_t>(req.offset),
+                static_cast<off_t>(req.nbytes));
+            break;
+        case remote_op::flush:
+            _flushes.emplace_back(_next_write, t);
+            break;
+        default:
+            respond(req.seq, -EOPNOTSUPP);
+            _inflight--;
+            delete t;
+            break;
+        }
+        _recv_start += need;
+    }
+}
+
+void remote_receiver::issue_flushes() {
+    constexpr int fid_backend = 1;
+    while (!_flushes.empty() && (_writes.empty() || *_writes.begin() >= _flushes.front().first)) {
+        _ring.queue_fsync(_flushes.front().second, true, fid_backend, IORING_FSYNC_DATASYNC);
+        _flushes.pop_front();
+    }
+}
+
+void remote_receiver::kick() {
+    constexpr int fid_sock = 0;
+    if (!_send_inflight && _send_used && !_broken) {
+        _send_inflight = _send_used;
+        _ring.queue_write(
+            &_send_ticket,
+            _mem + recv_size,
+            static_cast<unsigned int>(_send_inflight),
+            1,
+            true,
+            fid_sock,
+            0);
+    }
+    if (!_receiving && !_closed) {
+        // compact only while no receive is writing into the buffer
+        if (_recv_start) {
+            memmove(_mem, _mem + _recv_start, _recv_used - _recv_start);
+            _recv_used -= _recv_start;
+            _recv_start = 0;
+        }
+        if (_recv_used < recv_size) {
+            _ring.queue_read(
+                &_recv_ticket,
+                _mem + _recv_used,
+                static_cast<unsigned int>(recv_size - _recv_used),
+                0,
+                true,
+                fid_sock,
+                0);
+            _receiving = true;
+        }
+    }
+}
+
+void remote_receiver::run() {
+    std::array<io_uring_cqe *, 64> cqebuf{};
+    kick();
+    while (!_closed || _inflight || _receiving || _send_inflight || (_send_used && !_broken)) {
+        _ring.sq_kick_wait(1);
+        auto wnd = _ring.cq_get_ready(std::span(cqebuf));
+        for (auto cqe : wnd.cqes) {
+            auto t = static_cast<sq_ticket *>(io_uring_cqe_get_data(cqe));
+            auto res = cqe->res;
+            if (t == &_recv_ticket) {
+                _receiving = false;
+                if (res <= 0) {
+                    _closed = true;
+                } else {
+                    _recv_used += static_cast<size_t>(res);
+                }
+            } else if (t == &_send_ticket) {
+                if (res <= 0) {
+                    // the peer is gone, nobody is left to answer
+                    _closed = true;
+                    _broken = true;
+                    _send_used = 0;
+                    shutdown(_fds[0], SHUT_RDWR);
+                } else {
+                    memmove(_mem + recv_size, _mem + recv_size + res, _send_used - static_cast<size_t>(res));
+                    _send_used -= static_cast<size_t>(res);
+                }
+                _send_inflight = 0;
+            } else {
+                auto rt = static_cast<request_ticket *>(t);
+                int status = res < 0 ? res : 0;
+                if (rt->op == remote_op::write && res >= 0 && static_cast<size_t>(res) != rt->nbytes) {
+                    status = -EIO;
+                }
+                if (rt->op != remote_op::flush) {
+                    _writes.erase(rt->ordinal);
+                }
+                if (!_broken) {
+                    respond(rt->seq, status);
+                }
+                _inflight--;
+                delete rt;
+            }
+        }
+        _ring.cq_commit(wnd);
+        if (!_closed) {
+            parse();
+        }
+        issue_flushes();
+        kick();
+    }
+}
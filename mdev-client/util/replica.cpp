@@ -0,0 +1,60 @@
+#include <algorithm>
+#include <iterator>
+
+#include "util/replica.hpp"
+
+uint64_t latency_histogram::percentile_us(unsigned int permille) const {
+    if (!count) {
+        return 0;
+    }
+    uint64_t target = (count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= target) {
+            return uint64_t{1} << i;
+        }
+    }
+    return uint64_t{1} << (nr_buckets - 1);
+}
+
+void extent_set::insert(off_t offset, size_t nbytes) {
+    if (_all || !nbytes) {
+        return;
+    }
+    off_t end = offset + static_cast<off_t>(nbytes);
+    // first extent that may touch [offset, end)
+    auto it = _extents.upper_bound(offset);
+    if (it != _extents.begin() && std::prev(it)->second >= offset) {
+        it = std::prev(it);
+    }
+    while (it != _extents.end() && it->first <= end) {
+        offset = std::min(offset, it->first);
+        end = std::max(end, it->second);
+        it = _extents.erase(it);
+    }
+    _extents.emplace(offset, end);
+}
+
+void print_replica_stats(FILE *f, const char *prefix, unsigned int replica, const replica_stats &st) {
+    fprintf(
+        f,
+        "%s replica %u: completed %lu failed %lu late %lu stale %s%zu p50 %luus p99 %luus p999 %luus\n",
+        prefix,
+        replica,
+        st.completed,
+        st.failed,
+        st.late,
+        st.stale.all() ? "all " : "",
+        st.stale.count(),
+        st.latency.percentile_us(500),
+        st.latency.percentile_us(990),
+        st.latency.percentile_us(999));
+    fprintf(f, "%s replica %u histogram (us):", prefix, replica);
+    for (size_t i = 0; i < st.latency.buckets.size(); i++) {
+        if (st.latency.buckets[i]) {
+            fprintf(f, " <%lu:%lu", uint64_t{1} << i, st.latency.buckets[i]);
+        }
+    }
+    fprintf(f, "\n");
+}
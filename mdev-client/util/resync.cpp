@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <system_error>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <mimalloc.h>
+
+#include "nvme_core.hpp"
+#include "util/resync.hpp"
+#include "util/time.hpp"
+
+void resync_engine::buffer_deleter::operator()(unsigned char *p) const {
+    mi_free(p);
+}
+
+resync_engine::resync_engine(
+    std::shared_ptr<dirty_bitmap> bitmap,
+    std::span<const char *const> paths,
+    uint64_t bytes_per_sec,
+    unsigned int clean_interval_ms)
+    : _bitmap(std::move(bitmap)), _bytes_per_sec(bytes_per_sec), _clean_interval_ms(clean_interval_ms),
+      _buf(static_cast<unsigned char *>(mi_new_aligned(_bitmap->region_size(), NVME_PAGE_SIZE))) {
+    for (auto path : paths) {
+        int fd = open(path, O_RDWR | O_DIRECT | O_CLOEXEC);
+        if (fd < 0) {
+            auto err = errno;
+            for (auto f : _fds) {
+                close(f);
+            }
+            throw std::system_error(err, std::generic_category(), "cannot open replica for resync");
+        }
+        _fds.push_back(fd);
+    }
+    _thread = std::thread(&resync_engine::run, this);
+    pthread_setname_np(_thread.native_handle(), "resync");
+}
+
+resync_engine::~resync_engine() {
+    _stop.store(true, std::memory_order_relaxed);
+    _thread.join();
+    for (auto fd : _fds) {
+        close(fd);
+    }
+}
+
+static bool pread_full(int fd, unsigned char *buf, size_t nbytes, off_t offset) {
+    while (nbytes) {
+        auto ret = pread(fd, buf, nbytes, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        nbytes -= static_cast<size_t>(ret);
+        offset += ret;
+    }
+    return true;
+}
+
+static bool pwrite_full(int fd, const unsigned char *buf, size_t nbytes, off_t offset) {
+    while (nbytes) {
+        auto ret = pwrite(fd, buf, nbytes, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        nbytes -= static_cast<size_t>(ret);
+        offset += ret;
+    }
+    return true;
+}
+
+bool resync_engine::copy_region(uint64_t region, unsigned int source) {
+    auto offset = region * _bitmap->region_size();
+    auto nbytes = static_cast<size_t>(std::min(_bitmap->region_size(), _bitmap->dev_size() - offset));
+    if (!pread_full(_fds[source], _buf.get(), nbytes, static_cast<off_t>(offset))) {
+        fprintf(stderr, "resync: cannot read region %lu from replica %u\n", region, source);
+        return false;
+    }
+    bool ok = true;
+    for (unsigned int r = 0; r < _fds.size(); r++) {
+        if (r == source) {
+            continue;
+        }
+        if (!pwrite_full(_fds[r], _buf.get(), nbytes, static_cast<off_t>(offset)) || fdatasync(_fds[r]) < 0) {
+            fprintf(stderr, "resync: cannot write region %lu to replica %u\n", region, r);
+            ok = false;
+        }
+    }
+    throttle(nbytes);
+    _copied.fetch_add(nbytes, std::memory_order_relaxed);
+    return ok;
+}
+
+void resync_engine::throttle(size_t nbytes) {
+    if (!_bytes_per_sec) {
+        return;
+    }
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // restart the window every second so that idle time does not accumulate into a burst
+    if (now - _window_start > 1000000000l) {
+        _window_start = now;
+        _window_bytes = 0;
+    }
+    _window_bytes += nbytes;
+    auto due_ns = static_cast<long>(_window_bytes * 1000000000ull / _bytes_per_sec);
+    auto ahead_ns = due_ns - (now - _window_start);
+    if (ahead_ns > 0) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(ahead_ns));
+    }
+}
+
+void resync_engine::run() {
+    constexpr auto idle_wait = std::chrono::milliseconds(100);
+    constexpr auto error_wait = std::chrono::seconds(1);
+    uint64_t cursor = 0;
+    bool progressed = false;
+    timespec last_clean{};
+    clock_gettime(CLOCK_MONOTONIC, &last_clean);
+    clock_gettime(CLOCK_MONOTONIC, &_window_start);
+
+    while (!_stop.load(std::memory_order_relaxed)) {
+        timespec now{};
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now - last_clean > 1000000l * _clean_interval_ms) {
+            _bitmap->clean();
+            last_clean = now;
+        }
+
+        auto degraded = _bitmap->degraded_mask();
+        auto healthy = ~degraded & ((uint64_t{1} << _fds.size()) - 1);
+        if (!healthy) {
+            // nothing to copy from, an operator has to pick a replica
+            fprintf(stderr, "resync: all replicas are degraded\n");
+            std::this_thread::sleep_for(error_wait);
+            continue;
+        }
+        auto source = static_cast<unsigned int>(std::countr_zero(healthy));
+
+        auto region = cursor;
+        if (!_bitmap->next_sticky(region)) {
+            if (cursor) {
+                // wrap around for regions that were busy or became sticky behind the cursor
+                cursor = 0;
+                if (!progressed) {
+                    std::this_thread::sleep_for(idle_wait);
+                }
+                progressed = false;
+            } else {
+                if (degraded && _bitmap->try_clear_degraded(degraded)) {
+                    printf("resync: replicas %#x are in sync\n", degraded);
+                }
+                std::this_thread::sleep_for(idle_wait);
+            }
+            continue;
+        }
+        cursor = region + 1;
+
+        uint32_t gen = 0;
+        if (!_bitmap->resync_begin(region, gen)) {
+            // guest writes in flight, revisit on the next pass
+            continue;
+        }
+        if (!copy_region(region, source)) {
+            std::this_thread::sleep_for(error_wait);
+            continue;
+        }
+        progressed |= _bitmap->resync_end(region, gen);
+    }
+}
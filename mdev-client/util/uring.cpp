@@ -134,6 +134,27 @@ io_uring_sqe *uring::queue_fsync(sq_ticket *ticket, bool fixed, int fid, unsigne
     return sqe;
 }
 
+io_uring_sqe *uring::queue_sync_file_range(
+    sq_ticket *ticket,
+    bool fixed,
+    int fid,
+    off_t offset,
+    unsigned int nbytes,
+    int flags) {
+    auto sqe = get_sqe();
+    io_uring_prep_sync_file_range(sqe, fid, nbytes, offset, flags);
+    io_uring_sqe_set_flags(sqe, IOSQE_ASYNC | (fixed ? IOSQE_FIXED_FILE : 0));
+    io_uring_sqe_set_data(sqe, ticket);
+    return sqe;
+}
+
+io_uring_sqe *uring::queue_nop(sq_ticket *ticket) {
+    auto sqe = get_sqe();
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, ticket);
+    return sqe;
+}
+
 cq_window uring::cq_get_ready(const std::span<io_uring_cqe *> &cqebuf) {
     auto rdy = io_uring_peek_batch_cqe(_ring.get(), cqebuf.data(), cqebuf.size());
     return cq_window(cqebuf.subspan(0, rdy));
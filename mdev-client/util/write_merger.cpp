@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <utility>
+
+#include "util.hpp"
+#include "util/time.hpp"
+#include "util/write_merger.hpp"
+
+write_merger::~write_merger() {
+    for (auto m : _run.members) {
+        delete m;
+    }
+}
+
+bool write_merger::try_append(bool fixed, int fid, off_t offset, size_t nbytes, size_t niovecs, int flags) const {
+    return pending() && fixed == _run.fixed && fid == _run.fid && flags == _run.flags &&
+           offset == _run.offset + static_cast<off_t>(_run.nbytes) && _run.nbytes + nbytes <= max_merge_bytes &&
+           _run.iovecs.size() + niovecs <= max_merge_iovecs;
+}
+
+void write_merger::start(bool fixed, int fid, off_t offset, int flags) {
+    _run.fixed = fixed;
+    _run.fid = fid;
+    _run.flags = flags;
+    _run.offset = offset;
+    _run.nbytes = 0;
+    _run.first_iovecs = {};
+    clock_gettime(CLOCK_MONOTONIC, &_run.start);
+}
+
+void write_merger::queue_writev(
+    uring &ring,
+    iovec_ticket<sq_ticket> *ticket,
+    bool fixed,
+    int fid,
+    off_t offset,
+    int flags) {
+    if (!enabled()) {
+        ring.queue_writev(ticket, ticket->iovecs, fixed, fid, offset, flags);
+        submitted();
+        return;
+    }
+
+    size_t nbytes = 0;
+    for (const auto &v : ticket->iovecs) {
+        nbytes += v.iov_len;
+    }
+    if (!try_append(fixed, fid, offset, nbytes, ticket->iovecs.size(), flags)) {
+        flush(ring);
+        start(fixed, fid, offset, flags);
+        _run.first_iovecs = ticket->iovecs;
+    }
+    _run.members.push_back(ticket);
+    for (const auto &v : ticket->iovecs) {
+        iovec_append(_run.iovecs, static_cast<uint8_t *>(v.iov_base), v.iov_len);
+    }
+    _run.nbytes += nbytes;
+}
+
+void write_merger::queue_write(
+    uring &ring,
+    sq_ticket *ticket,
+    const void *buf,
+    size_t nbytes,
+    bool fixed,
+    int fid,
+    off_t offset) {
+    if (!enabled()) {
+        ring.queue_write(ticket, buf, nbytes, -1, fixed, fid, offset);
+        submitted();
+        return;
+    }
+
+    if (!try_append(fixed, fid, offset, nbytes, 1, 0)) {
+        flush(ring);
+        start(fixed, fid, offset, 0);
+    }
+    _run.members.push_back(ticket);
+    iovec_append(_run.iovecs, static_cast<uint8_t *>(const_cast<void *>(buf)), nbytes);
+    _run.nbytes += nbytes;
+}
+
+void write_merger::flush(uring &ring) {
+    if (!pending()) {
+        return;
+    }
+
+    if (_run.members.size() == 1) {
+        auto ticket = _run.members.front();
+        if (!_run.first_iovecs.empty()) {
+            ring.queue_writev(ticket, _run.first_iovecs, _run.fixed, _run.fid, _run.offset, _run.flags);
+        } else {
+            ring.queue_write(
+                ticket,
+                _run.iovecs.front().iov_base,
+                _run.nbytes,
+                -1,
+                _run.fixed,
+                _run.fid,
+                _run.offset);
+        }
+    } else {
+        DBG_PRINTF("merged %zu writes offset %#lx size %zu\n", _run.members.size(), _run.offset, _run.nbytes);
+        auto ticket = new merged_ticket();
+        ticket->members = std::move(_run.members);
+        ticket->iovecs = std::move(_run.iovecs);
+        ring.queue_writev(ticket, ticket->iovecs, _run.fixed, _run.fid, _run.offset, _run.flags);
+    }
+    submitted();
+
+    _run.members.clear();
+    _run.iovecs.clear();
+    _run.first_iovecs = {};
+}
+
+long write_merger::hold_ns() const {
+    // waiting only pays off if the backend is already busy
+    return 1000l * _window_us * static_cast<long>(std::min(_inflight, full_window_depth)) /
+           static_cast<long>(full_window_depth);
+}
+
+void write_merger::tick(uring &ring) {
+    if (!pending()) {
+        return;
+    }
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now - _run.start >= hold_ns()) {
+        flush(ring);
+    }
+}
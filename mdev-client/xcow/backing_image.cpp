@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "xcow/backing_image.hpp"
+
+using namespace xcow::XlateBits;
+
+std::unique_ptr<xcow::BackingImage> xcow::BackingImage::open(const xcow::XcowFile &f) {
+    auto desc = f.backing();
+    if (!desc)
+        return nullptr;
+    return std::make_unique<BackingImage>(*desc);
+}
+
+xcow::BackingImage::BackingImage(const xcow::XcowBacking &desc, size_t depth) {
+    if (depth >= max_depth)
+        throw std::runtime_error("backing image chain too long");
+    _fd = FileDescriptor(desc.path, O_RDONLY | O_CLOEXEC);
+    if (_fd.err())
+        throw std::system_error(_fd.err(), std::generic_category(), "cannot open backing image");
+    _fds.push_back(_fd);
+
+    if (desc.kind == XcowBacking::raw) {
+        auto size = lseek(_fd, 0, SEEK_END);
+        if (size < 0)
+            throw std::system_error(errno, std::generic_category(), "cannot size backing image");
+        _size = static_cast<uint64_t>(size);
+    } else if (desc.kind == XcowBacking::xcow) {
+        _mapfd = FileDescriptor(desc.map_path, O_RDONLY | O_CLOEXEC);
+        if (_mapfd.err())
+            throw std::system_error(_mapfd.err(), std::generic_category(), "cannot open backing map file");
+        _deref = std::make_unique<FileDeref>(_mapfd, PROT_READ, MAP_SHARED);
+        _file = std::make_unique<XcowFile>(_deref.get());
+        _snap.emplace(_file->open_read(static_cast<int>(desc.snap)));
+        _size = _file->fsize();
+        if (auto next = _file->backing()) {
+            _next = std::make_unique<BackingImage>(*next, depth + 1);
+            _fds.insert(_fds.end(), _next->fds().begin(), _next->fds().end());
+        }
+    } else {
+        throw std::runtime_error("unknown backing image kind");
+    }
+}
+
+xcow::BackingImage::Extent xcow::BackingImage::locate(uint64_t addr, size_t nbytes) const {
+    // the image may be smaller than the files based on it
+    if (addr >= _size)
+        return Extent{-1, 0, nbytes};
+    nbytes = std::min<uint64_t>(nbytes, _size - addr);
+    if (!_file)
+        return Extent{0, addr, nbytes};
+    return locate_xcow(addr, nbytes);
+}
+
+xcow::BackingImage::Extent xcow::BackingImage::locate_xcow(uint64_t addr, size_t nbytes) const {
+    auto cmask = _file->cluster_size() - 1;
+    auto smask = (size_t{1} << _file->subcluster_bits()) - 1;
+    // subclusters are the smallest unit with a location of their own
+    nbytes = std::min<uint64_t>(nbytes, (addr | smask) + 1 - addr);
+
+    XlateExt ext;
+    auto tl = _snap->translate_read(addr, &ext);
+    if (is_zero(tl))
+        return Extent{-1, 0, nbytes};
+    else if (is_unallocated(tl))
+        return locate_next(addr, nbytes);
+    else if (is_full(ext))
+        return Extent{0, decode_leaf(tl) + (addr & cmask), nbytes};
+
+    auto bit = 1u << ((addr & cmask) >> _file->subcluster_bits());
+    if (ext.alloc & bit)
+        return Extent{0, decode_leaf(tl) + (addr & cmask), nbytes};
+    else if (!(ext.zero & bit) && !is_empty(ext.base))
+        return Extent{0, decode_leaf(ext.base) + (addr & cmask), nbytes};
+    else
+        return Extent{-1, 0, nbytes};
+}
+
+xcow::BackingImage::Extent xcow::BackingImage::locate_next(uint64_t addr, size_t nbytes) const {
+    if (!_next)
+        return Extent{-1, 0, nbytes};
+    auto ext = _next->locate(addr, nbytes);
+    // our own data file comes first
+    if (ext.fid >= 0)
+        ext.fid++;
+    return ext;
+}
@@ -0,0 +1,300 @@
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "nvme_core.hpp"
+#include "util.hpp"
+#include "xcow/cached_deref.hpp"
+
+static void pread_full(int fd, uint8_t *buf, size_t nbytes, off_t offset) {
+    while (nbytes) {
+        auto ret = pread(fd, buf, nbytes, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        else if (ret < 0)
+            throw std::system_error(errno, std::generic_category(), "cannot read map file");
+        else if (ret == 0)
+            throw std::runtime_error("map file is shorter than it was");
+        buf += ret;
+        nbytes -= static_cast<size_t>(ret);
+        offset += ret;
+    }
+}
+
+static void pwrite_full(int fd, const uint8_t *buf, size_t nbytes, off_t offset) {
+    while (nbytes) {
+        auto ret = pwrite(fd, buf, nbytes, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        else if (ret < 0)
+            throw std::system_error(errno, std::generic_category(), "cannot write map file");
+        buf += ret;
+        nbytes -= static_cast<size_t>(ret);
+        offset += ret;
+    }
+}
+
+xcow::CachedDeref::CachedDeref(int fd, size_t budget, size_t unit_size)
+    : _fd(fd), _unit_bits(static_cast<size_t>(std::countr_zero(unit_size))), _budget(budget >> _unit_bits) {
+    if (!std::has_single_bit(unit_size) || unit_size < NVME_PAGE_SIZE)
+        throw std::invalid_argument("bad cache unit size");
+    if (!_budget)
+        throw std::invalid_argument("cache budget is smaller than a unit");
+    auto flen = lseek(fd, 0, SEEK_END);
+    if (flen < 0)
+        throw std::system_error(errno, std::generic_category(), "lseek");
+    _size = static_cast<size_t>(flen);
+    _nunits = (_size + unit_size - 1) >> _unit_bits;
+
+    // only the units that are read in take memory, the rest of the region stays reserved address space
+    auto region = std::max<size_t>(_nunits << _unit_bits, unit_size);
+    auto m = mmap(nullptr, region, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (m == MAP_FAILED)
+        throw std::system_error(errno, std::generic_category(), "mmap");
+    auto hm = cleanup([=] { munmap(m, region); });
+    if (madvise(m, region, MADV_DONTDUMP) < 0)
+        throw std::system_error(errno, std::generic_category(), "cannot madvise(MADV_DONTDUMP) deref memory");
+    _base = static_cast<uint8_t *>(m);
+    _state = std::make_unique<std::atomic<uint8_t>[]>(_nunits);
+    _pins = std::make_unique<uint32_t[]>(_nunits);
+
+    // direct I/O needs whole blocks, which the end of the file might not be
+    // filesystems without it go through the page cache instead
+    if (_size % NVME_PAGE_SIZE == 0) {
+        auto path = "/proc/self/fd/" + std::to_string(fd);
+        _dfd = open(path.c_str(), O_RDWR | O_DIRECT | O_CLOEXEC);
+    }
+    hm.neutralize();
+}
+
+xcow::CachedDeref::~CachedDeref() {
+    try {
+        if (has_dirty())
+            commit(0, _size);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "cannot write back cached metadata: %s\n", e.what());
+    }
+    munmap(_base, std::max<size_t>(_nunits << _unit_bits, unit_size()));
+    if (_dfd >= 0)
+        close(_dfd);
+}
+
+xcow::CachedDeref::stats_type xcow::CachedDeref::stats() const {
+    return stats_type{
+        .hits = _hits.load(std::memory_order_relaxed),
+        .misses = _misses.load(std::memory_order_relaxed),
+        .units_read = _units_read,
+        .evictions = _evictions,
+        .units_written = _units_written,
+        .resident = _resident,
+        .pinned = _pinned,
+        .dirty = _dirty.size(),
+    };
+}
+
+std::span<uint8_t> xcow::CachedDeref::deref(uint64_t off, size_t nbytes) {
+    if (off > _size || nbytes > _size - off)
+        throw std::out_of_range("deref past the end of the map file");
+    if (nbytes) {
+        auto first = off >> _unit_bits, last = (off + nbytes - 1) >> _unit_bits;
+        bool hit = true;
+        for (auto u = first; u <= last; u++) {
+            // pairs with the release in load(), the contents of the unit are there once it's resident
+            auto st = _state[u].load(std::memory_order_acquire);
+            if (!(st & resident)) {
+                load(u, last);
+                hit = false;
+                break;
+            }
+            // don't write the shared state on every hit
+            if (!(st & referenced))
+                _state[u].fetch_or(referenced, std::memory_order_relaxed);
+        }
+        (hit ? _hits : _misses).fetch_add(1, std::memory_order_relaxed);
+    }
+    return std::span<uint8_t>(_base + off, nbytes);
+}
+
+void xcow::CachedDeref::load(size_t first, size_t last) {
+    std::unique_lock lk(_load_lock);
+    while (true) {
+        // claim runs of missing units, units someone else is reading are waited for
+        std::vector<std::pair<size_t, size_t>> runs;
+        bool waiting = false;
+        for (auto u = first; u <= last; u++) {
+            auto st = _state[u].load(std::memory_order_relaxed);
+            if (st & resident) {
+                _state[u].fetch_or(referenced, std::memory_order_relaxed);
+            } else if (st & loading) {
+                waiting = true;
+            } else {
+                _state[u].fetch_or(loading, std::memory_order_relaxed);
+                if (!runs.empty() && runs.back().second == u)
+                    runs.back().second++;
+                else
+                    runs.emplace_back(u, u + 1);
+            }
+        }
+        if (runs.empty() && !waiting)
+            return;
+        if (runs.empty()) {
+            _loaded.wait(lk);
+            continue;
+        }
+
+        lk.unlock();
+        size_t done = 0;
+        try {
+            for (; done < runs.size(); done++) {
+                auto pos = runs[done].first << _unit_bits;
+                auto len = std::min<size_t>(runs[done].second << _unit_bits, _size) - pos;
+                pread_full(fd(), _base + pos, len, static_cast<off_t>(pos));
+            }
+        } catch (...) {
+            lk.lock();
+            for (auto [ufirst, uend] : runs)
+                for (auto v = ufirst; v < uend; v++)
+                    _state[v].fetch_and(static_cast<uint8_t>(~loading), std::memory_order_relaxed);
+            _loaded.notify_all();
+            throw;
+        }
+        lk.lock();
+        for (auto [ufirst, uend] : runs) {
+            for (auto v = ufirst; v < uend; v++)
+                _state[v].store(resident | referenced, std::memory_order_release);
+            _resident += uend - ufirst;
+            _units_read += uend - ufirst;
+        }
+        _loaded.notify_all();
+    }
+}
+
+void xcow::CachedDeref::commit(uint64_t off, size_t nbytes) {
+    if (!nbytes)
+        return;
+    auto first = off >> _unit_bits, last = (off + nbytes - 1) >> _unit_bits;
+    // whatever was written is off the list even if a later write fails
+    auto hd = cleanup([&] {
+        std::erase_if(_dirty, [&](uint64_t d) {
+            return !(_state[d >> _unit_bits].load(std::memory_order_relaxed) & dirty_unit);
+        });
+    });
+    for (auto d : _dirty) {
+        auto u = d >> _unit_bits;
+        if (u < first || u > last)
+            continue;
+        pwrite_full(fd(), _base + d, std::min<size_t>(d + unit_size(), _size) - d, static_cast<off_t>(d));
+        _state[u].fetch_and(static_cast<uint8_t>(~dirty_unit), std::memory_order_relaxed);
+        _units_written++;
+    }
+    if (fdatasync(fd()) < 0)
+        throw std::system_error(errno, std::generic_category(), "cannot sync map file");
+}
+
+void xcow::CachedDeref::dirty(const void *p, size_t nbytes) {
+    if (!nbytes)
+        return;
+    auto off = static_cast<size_t>(static_cast<const uint8_t *>(p) - _base);
+    for (auto u = off >> _unit_bits; u <= (off + nbytes - 1) >> _unit_bits; u++) {
+        auto old = _state[u].fetch_or(dirty_unit, std::memory_order_relaxed);
+        assert(old & resident);
+        if (!(old & dirty_unit))
+            _dirty.push_back(u << _unit_bits);
+    }
+}
+
+void xcow::CachedDeref::prefetch(uint64_t off, size_t nbytes) {
+    off = std::min<uint64_t>(off, _size);
+    nbytes = std::min<uint64_t>(nbytes, _size - off);
+    if (!nbytes)
+        return;
+    size_t room;
+    {
+        std::lock_guard lk(_load_lock);
+        room = _resident < _budget ? _budget - _resident : 0;
+    }
+    // several prefetches at once can overshoot a little, trim() takes care of it
+    if (!room)
+        return;
+    auto first = off >> _unit_bits, last = (off + nbytes - 1) >> _unit_bits;
+    load(first, std::min(last, first + room - 1));
+}
+
+void xcow::CachedDeref::pin(const void *p, size_t nbytes) {
+    if (!nbytes)
+        return;
+    auto off = static_cast<size_t>(static_cast<const uint8_t *>(p) - _base);
+    // callers may only hold the metadata shared
+    std::lock_guard lk(_load_lock);
+    for (auto u = off >> _unit_bits; u <= (off + nbytes - 1) >> _unit_bits; u++) {
+        assert(_state[u].load(std::memory_order_relaxed) & resident);
+        if (_pins[u]++)
+            continue;
+        _state[u].fetch_or(pinned, std::memory_order_relaxed);
+        _pinned++;
+    }
+}
+
+void xcow::CachedDeref::unpin(const void *p, size_t nbytes) {
+    if (!nbytes)
+        return;
+    auto off = static_cast<size_t>(static_cast<const uint8_t *>(p) - _base);
+    std::lock_guard lk(_load_lock);
+    for (auto u = off >> _unit_bits; u <= (off + nbytes - 1) >> _unit_bits; u++) {
+        assert(_pins[u]);
+        if (--_pins[u])
+            continue;
+        _state[u].fetch_and(static_cast<uint8_t>(~pinned), std::memory_order_relaxed);
+        _pinned--;
+    }
+}
+
+size_t xcow::CachedDeref::trim() {
+    std::lock_guard lk(_load_lock);
+    size_t evicted = 0;
+    // the first time around may only clear the referenced bits
+    for (size_t scanned = 0; _resident > _budget && scanned < 2 * _nunits; scanned++) {
+        auto u = _hand;
+        _hand = (_hand + 1) % _nunits;
+        auto st = _state[u].load(std::memory_order_relaxed);
+        if (!(st & resident) || (st & (pinned | dirty_unit)))
+            continue;
+        if (st & referenced) {
+            _state[u].store(static_cast<uint8_t>(st & ~referenced), std::memory_order_relaxed);
+            continue;
+        }
+        // the pages go back to the kernel, the unit reads as zeroes until it's loaded again
+        if (madvise(_base + (u << _unit_bits), unit_size(), MADV_DONTNEED) < 0)
+            throw std::system_error(errno, std::generic_category(), "madvise(MADV_DONTNEED)");
+        _state[u].store(0, std::memory_order_relaxed);
+        _resident--;
+        evicted++;
+    }
+    _evictions += evicted;
+    return evicted;
+}
+
+std::vector<uint64_t> xcow::CachedDeref::take_dirty() {
+    auto ret = std::exchange(_dirty, {});
+    std::sort(ret.begin(), ret.end());
+    for (auto d : ret)
+        _state[d >> _unit_bits].fetch_and(static_cast<uint8_t>(~dirty_unit), std::memory_order_relaxed);
+    _units_written += ret.size();
+    return ret;
+}
+
+void xcow::CachedDeref::redirty(std::span<const uint64_t> units) {
+    for (auto d : units)
+        if (!(_state[d >> _unit_bits].fetch_or(dirty_unit, std::memory_order_relaxed) & dirty_unit))
+            _dirty.push_back(d);
+}
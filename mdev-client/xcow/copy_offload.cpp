@@ -0,0 +1,160 @@
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <mimalloc.h>
+
+#include "xcow/copy_offload.hpp"
+
+// errors meaning that the file can't do this kind of copy at all, as opposed to this particular copy failing
+// EINVAL only says that this range couldn't be copied, e.g. for being unaligned
+static bool is_unsupported(int err) {
+    return err == EOPNOTSUPP || err == EXDEV;
+}
+
+// the data file is opened with O_DIRECT
+static constexpr size_t bounce_align = 4096;
+
+xcow::CopyOffload::CopyOffload(int fd, CopyMethod max) : _fd(fd), _method(CopyMethod::none) {
+    struct stat st {};
+    if (fstat(fd, &st) < 0)
+        throw std::system_error(errno, std::generic_category(), "fstat");
+    // block devices don't support either method
+    if (S_ISREG(st.st_mode))
+        _method.store(max, std::memory_order_relaxed);
+}
+
+xcow::CopyOffload::~CopyOffload() {
+    if (!_helper.joinable())
+        return;
+    {
+        std::lock_guard lk(_lock);
+        _stop = true;
+    }
+    _cv.notify_one();
+    _helper.join();
+}
+
+bool xcow::CopyOffload::copy(off_t inoff, off_t outoff, size_t nbytes) {
+    if (method() == CopyMethod::reflink) {
+        if (clone(inoff, outoff, nbytes))
+            return true;
+        else if (method() == CopyMethod::reflink)
+            return false;
+    }
+    if (method() == CopyMethod::copy_range)
+        return copy_range(inoff, outoff, nbytes);
+    return false;
+}
+
+FileDescriptor xcow::CopyOffload::copy_async(off_t inoff, off_t outoff, size_t nbytes) {
+    // a socket rather than a pipe, so that a reader that went away doesn't raise SIGPIPE
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        throw std::system_error(errno, std::generic_category(), "cannot create copy completion socket");
+    FileDescriptor ret(sv[0]), done(sv[1]);
+    {
+        std::lock_guard lk(_lock);
+        _jobs.push_back(job{inoff, outoff, nbytes, std::move(done)});
+        if (!_helper.joinable())
+            _helper = std::thread(&CopyOffload::run, this);
+    }
+    _cv.notify_one();
+    return ret;
+}
+
+void xcow::CopyOffload::run() {
+    std::unique_lock lk(_lock);
+    while (true) {
+        _cv.wait(lk, [this] { return _stop || !_jobs.empty(); });
+        if (_stop)
+            return;
+        auto j = std::move(_jobs.front());
+        _jobs.pop_front();
+        lk.unlock();
+        bool ok;
+        try {
+            ok = copy(j.inoff, j.outoff, j.nbytes) || copy_bounce(j.inoff, j.outoff, j.nbytes);
+        } catch (const std::bad_alloc &) {
+            ok = false;
+        }
+        char one = 1;
+        // a reader that went away has nobody left to tell
+        if (ok)
+            (void)send(j.done, &one, sizeof(one), MSG_NOSIGNAL);
+        // closing the socket wakes the reader of a failed copy with a short read
+        j.done = FileDescriptor();
+        lk.lock();
+    }
+}
+
+bool xcow::CopyOffload::clone(off_t inoff, off_t outoff, size_t nbytes) {
+    file_clone_range fcr{
+        .src_fd = _fd,
+        .src_offset = static_cast<__u64>(inoff),
+        .src_length = nbytes,
+        .dest_offset = static_cast<__u64>(outoff),
+    };
+    if (ioctl(_fd, FICLONERANGE, &fcr) == 0)
+        return true;
+    if (is_unsupported(errno))
+        _method.store(CopyMethod::copy_range, std::memory_order_relaxed);
+    return false;
+}
+
+bool xcow::CopyOffload::copy_range(off_t inoff, off_t outoff, size_t nbytes) {
+    while (nbytes) {
+        auto ret = copy_file_range(_fd, &inoff, _fd, &outoff, nbytes, 0);
+        if (ret < 0) {
+            if (is_unsupported(errno))
+                _method.store(CopyMethod::none, std::memory_order_relaxed);
+            return false;
+        } else if (ret == 0) {
+            // source past the end of file, let the caller read it as it sees fit
+            return false;
+        }
+        nbytes -= static_cast<size_t>(ret);
+    }
+    return true;
+}
+
+bool xcow::CopyOffload::copy_bounce(off_t inoff, off_t outoff, size_t nbytes) {
+    auto len = (nbytes + bounce_align - 1) & ~(bounce_align - 1);
+    std::unique_ptr<unsigned char, decltype(&mi_free)> buf(
+        static_cast<unsigned char *>(mi_new_aligned(len, bounce_align)),
+        &mi_free);
+    for (size_t done = 0; done < nbytes;) {
+        auto ret = pread(_fd, buf.get() + done, nbytes - done, inoff + static_cast<off_t>(done));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        else if (ret < 0)
+            return false;
+        else if (ret == 0) {
+            // past the end of file reads as zeroes
+            memset(buf.get() + done, 0, nbytes - done);
+            break;
+        }
+        done += static_cast<size_t>(ret);
+    }
+    for (size_t done = 0; done < nbytes;) {
+        auto ret = pwrite(_fd, buf.get() + done, nbytes - done, outoff + static_cast<off_t>(done));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        else if (ret <= 0)
+            return false;
+        done += static_cast<size_t>(ret);
+    }
+    return true;
+}
+
+bool xcow::punch_hole(int fd, off_t off, size_t nbytes) {
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, static_cast<off_t>(nbytes)) == 0;
+}
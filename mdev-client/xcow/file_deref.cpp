@@ -2,14 +2,15 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <system_error>
+#include <utility>
 #include "nvme_core.hpp"
 #include "xcow/file_deref.hpp"
 
-xcow::FileDeref::FileDeref(int fd, int prot) {
+xcow::FileDeref::FileDeref(int fd, int prot, int flags) : _fd(fd) {
     auto flen = lseek(fd, 0, SEEK_END);
     if (flen < 0)
         throw std::system_error(errno, std::generic_category(), "lseek");
-    auto m = mmap(nullptr, flen, prot, MAP_SHARED, fd, 0);
+    auto m = mmap(nullptr, flen, prot, flags, fd, 0);
     if (m == MAP_FAILED)
         throw std::system_error(errno, std::generic_category(), "mmap");
     if (madvise(m, flen, MADV_DONTDUMP) < 0)
@@ -17,6 +18,10 @@ xcow::FileDeref::FileDeref(int fd, int prot) {
     _p = {static_cast<uint8_t *>(m), static_cast<size_t>(flen)};
 }
 
+void xcow::FileDeref::track_dirty() {
+    _dirty_bits.resize((_p.size() + NVME_PAGE_SIZE - 1) / NVME_PAGE_SIZE);
+}
+
 void xcow::FileDeref::commit(uint64_t off, size_t nbytes) {
     auto poff = off & (NVME_PAGE_SIZE - 1);
     if (poff) {
@@ -33,3 +38,22 @@ void xcow::FileDeref::prefetch(uint64_t off, size_t nbytes) {
     if (madvise(region.data(), region.size(), MADV_WILLNEED) < 0)
         throw std::system_error(errno, std::generic_category(), "madvise(MADV_WILLNEED)");
 }
+
+void xcow::FileDeref::dirty(const void *p, size_t nbytes) {
+    if (!nbytes || _dirty_bits.empty())
+        return;
+    _marks++;
+    auto off = static_cast<size_t>(static_cast<const uint8_t *>(p) - _p.data());
+    for (auto page = off / NVME_PAGE_SIZE; page <= (off + nbytes - 1) / NVME_PAGE_SIZE; page++) {
+        if (!_dirty_bits[page]) {
+            _dirty_bits[page] = true;
+            _dirty.push_back(page * NVME_PAGE_SIZE);
+        }
+    }
+}
+
+std::vector<uint64_t> xcow::FileDeref::take_dirty() {
+    for (auto off : _dirty)
+        _dirty_bits[off / NVME_PAGE_SIZE] = false;
+    return std::exchange(_dirty, {});
+}
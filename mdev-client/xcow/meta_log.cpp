@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <mimalloc.h>
+
+#include "util.hpp"
+#include "xcow/meta_log.hpp"
+
+void xcow::MetaLog::block_deleter::operator()(unsigned char *p) const {
+    mi_free(p);
+}
+
+xcow::MetaLog::block_ptr xcow::MetaLog::alloc_blocks(size_t nbytes) {
+    auto p = static_cast<unsigned char *>(mi_new_aligned(nbytes, block_size));
+    memset(p, 0, nbytes);
+    return block_ptr(p);
+}
+
+uint64_t xcow::MetaLog::checksum(std::span<const uint8_t> s) {
+    // FNV-1a over 64-bit words, records are whole blocks
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i + sizeof(uint64_t) <= s.size(); i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, s.data() + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static bool pread_full(int fd, unsigned char *buf, size_t nbytes, off_t offset) {
+    while (nbytes) {
+        auto ret = pread(fd, buf, nbytes, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        nbytes -= static_cast<size_t>(ret);
+        offset += ret;
+    }
+    return true;
+}
+
+static void pwrite_full(int fd, const unsigned char *buf, size_t nbytes, off_t offset) {
+    while (nbytes) {
+        auto ret = pwrite(fd, buf, nbytes, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        else if (ret < 0)
+            throw std::system_error(errno, std::generic_category(), "pwrite");
+        buf += ret;
+        nbytes -= static_cast<size_t>(ret);
+        offset += ret;
+    }
+}
+
+xcow::MetaLog::MetaLog(const char *path, int mapfd, uint64_t capacity)
+    : _mapfd(mapfd), _capacity(capacity / block_size * block_size), _sbbuf(alloc_blocks(block_size)) {
+    if (_capacity < 4 * block_size)
+        throw std::invalid_argument("metadata log too small");
+
+    _fd = open(path, O_RDWR | O_CREAT | O_DIRECT | O_DSYNC | O_CLOEXEC, 0600);
+    if (_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "cannot open metadata log");
+    auto hfd = cleanup([&] { close(_fd); });
+
+    struct stat st {};
+    if (fstat(_fd, &st) < 0)
+        throw std::system_error(errno, std::generic_category(), "cannot stat metadata log");
+    if (st.st_size == 0) {
+        if (fallocate(_fd, 0, 0, static_cast<off_t>(_capacity)) < 0)
+            throw std::system_error(errno, std::generic_category(), "cannot preallocate metadata log");
+    } else {
+        if (!pread_full(_fd, _sbbuf.get(), block_size, 0))
+            throw std::runtime_error("cannot read metadata log superblock");
+        superblock sb{};
+        memcpy(&sb, _sbbuf.get(), sizeof(sb));
+        if (sb.magic != magic || sb.version != version || sb.capacity != _capacity ||
+            static_cast<uint64_t>(st.st_size) != _capacity)
+            throw std::runtime_error("metadata log does not match");
+        _epoch = sb.epoch;
+        _replayed = apply(mapfd);
+    }
+    reset();
+    hfd.neutralize();
+}
+
+xcow::MetaLog::~MetaLog() {
+    close(_fd);
+}
+
+size_t xcow::MetaLog::apply(int mapfd) {
+    auto buf = alloc_blocks(block_size);
+    // position and length of the records, and how many of them make up whole batches
+    std::vector<std::pair<uint64_t, uint64_t>> records;
+    size_t whole_batches = 0;
+    uint64_t pos = block_size;
+    while (pos + block_size <= _capacity) {
+        if (!pread_full(_fd, buf.get(), block_size, static_cast<off_t>(pos)))
+            break;
+        record rec{};
+        memcpy(&rec, buf.get(), sizeof(rec));
+        if (rec.magic != record_magic || rec.epoch != _epoch || rec.seq != records.size() || !rec.npages ||
+            rec.len != record_len(rec.npages) || pos + rec.len > _capacity)
+            break;
+
+        // a torn record ends the log, so does a record that was never written entirely
+        auto whole = alloc_blocks(rec.len);
+        if (!pread_full(_fd, whole.get(), rec.len, static_cast<off_t>(pos)))
+            break;
+        memset(whole.get() + offsetof(record, checksum), 0, sizeof(rec.checksum));
+        if (checksum(std::span<const uint8_t>(whole.get(), rec.len)) != rec.checksum)
+            break;
+        records.emplace_back(pos, rec.len);
+        if (!(rec.flags & record_continued))
+            whole_batches = records.size();
+        pos += rec.len;
+    }
+
+    for (size_t r = 0; r < whole_batches; r++) {
+        auto [rpos, len] = records[r];
+        auto whole = alloc_blocks(len);
+        if (!pread_full(_fd, whole.get(), len, static_cast<off_t>(rpos)))
+            throw std::runtime_error("cannot read metadata log record");
+        record rec{};
+        memcpy(&rec, whole.get(), sizeof(rec));
+        auto offsets = convert_span<uint64_t>(std::span<uint8_t>(whole.get() + block_size, rec.npages * 8));
+        auto pages = whole.get() + record_len(rec.npages) - rec.npages * block_size;
+        for (size_t i = 0; i < rec.npages; i++)
+            pwrite_full(mapfd, pages + i * block_size, block_size, static_cast<off_t>(offsets[i]));
+    }
+    if (whole_batches && fdatasync(mapfd) < 0)
+        throw std::system_error(errno, std::generic_category(), "cannot sync map file");
+    return whole_batches;
+}
+
+void xcow::MetaLog::reset() {
+    _epoch++;
+    _seq = 0;
+    _tail = block_size;
+    _logged.clear();
+    superblock sb{
+        .magic = magic,
+        .version = version,
+        .epoch = _epoch,
+        .capacity = _capacity,
+    };
+    memcpy(_sbbuf.get(), &sb, sizeof(sb));
+    if (pwrite(_fd, _sbbuf.get(), block_size, 0) != static_cast<ssize_t>(block_size))
+        throw std::system_error(errno, std::generic_category(), "cannot write metadata log superblock");
+}
+
+size_t xcow::MetaLog::prepare() {
+    if (!_prepared.empty())
+        throw std::logic_error("a metadata log record is already prepared");
+    _prepared = _deref->take_dirty();
+    return _prepared.empty() ? 0 : record_len(_prepared.size());
+}
+
+bool xcow::MetaLog::fits() const {
+    return _prepared.empty() || _tail + record_len(_prepared.size()) <= _capacity;
+}
+
+void xcow::MetaLog::fill_record(std::span<uint8_t> buf, std::span<const uint64_t> pages, uint32_t flags) {
+    auto len = record_len(pages.size());
+    if (buf.size() < len)
+        throw std::invalid_argument("metadata log buffer too small");
+    std::fill(buf.begin(), buf.begin() + static_cast<ptrdiff_t>(len), 0);
+    record rec{
+        .magic = record_magic,
+        .seq = _seq,
+        .epoch = _epoch,
+        .npages = static_cast<uint32_t>(pages.size()),
+        .len = len,
+        .checksum = 0,
+        .flags = flags,
+        .reserved = 0,
+    };
+    memcpy(buf.data(), &rec, sizeof(rec));
+    memcpy(buf.data() + block_size, pages.data(), pages.size() * sizeof(uint64_t));
+    auto data = buf.data() + len - pages.size() * block_size;
+    for (size_t i = 0; i < pages.size(); i++) {
+        auto page = _deref->deref(pages[i], block_size);
+        memcpy(data + i * block_size, page.data(), block_size);
+    }
+    rec.checksum = checksum(buf.subspan(0, len));
+    memcpy(buf.data(), &rec, sizeof(rec));
+}
+
+off_t xcow::MetaLog::fill(std::span<uint8_t> buf) {
+    fill_record(buf, _prepared, 0);
+    return static_cast<off_t>(_tail);
+}
+
+void xcow::MetaLog::committed() {
+    _tail += record_len(_prepared.size());
+    _seq++;
+    _logged.insert(_logged.end(), _prepared.begin(), _prepared.end());
+    _prepared.clear();
+}
+
+void xcow::MetaLog::aborted() {
+    // the pages are still modified in memory
+    for (auto off : _prepared)
+        _deref->dirty(_deref->deref(off, block_size).data(), block_size);
+    _prepared.clear();
+}
+
+bool xcow::MetaLog::commit() {
+    auto len = prepare();
+    if (!len)
+        return true;
+    if (!fits()) {
+        aborted();
+        return false;
+    }
+    auto buf = alloc_blocks(len);
+    auto off = fill(std::span<uint8_t>(buf.get(), len));
+    try {
+        pwrite_full(_fd, buf.get(), len, off);
+    } catch (...) {
+        aborted();
+        throw;
+    }
+    committed();
+    return true;
+}
+
+size_t xcow::MetaLog::max_record_pages() const {
+    // a quarter of the log keeps the staging buffer small
+    auto limit = std::max(_capacity / 4, record_len(1));
+    auto n = limit / block_size;
+    while (n > 1 && record_len(n) > limit)
+        n--;
+    return n;
+}
+
+bool xcow::MetaLog::log_batch(std::span<const uint64_t> pages) {
+    auto per_record = max_record_pages();
+    auto nfull = pages.size() / per_record, rest = pages.size() % per_record;
+    if (_tail + nfull * record_len(per_record) + (rest ? record_len(rest) : 0) > _capacity)
+        return false;
+    auto buf = alloc_blocks(record_len(std::min(pages.size(), per_record)));
+    while (!pages.empty()) {
+        auto chunk = pages.subspan(0, std::min(pages.size(), per_record));
+        pages = pages.subspan(chunk.size());
+        auto len = record_len(chunk.size());
+        fill_record(std::span<uint8_t>(buf.get(), len), chunk, pages.empty() ? 0 : record_continued);
+        // the log is O_DSYNC, the record is durable once written
+        pwrite_full(_fd, buf.get(), len, static_cast<off_t>(_tail));
+        _tail += len;
+        _seq++;
+        _logged.insert(_logged.end(), chunk.begin(), chunk.end());
+    }
+    return true;
+}
+
+void xcow::MetaLog::checkpoint() {
+    // nothing is written in place before it's in the log
+    auto pending = std::exchange(_prepared, {});
+    auto dirty = _deref->take_dirty();
+    pending.insert(pending.end(), dirty.begin(), dirty.end());
+    std::sort(pending.begin(), pending.end());
+    pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+    try {
+        if (!log_batch(pending)) {
+            // the logged pages may have changed since, so they're put in place from the log itself
+            apply(_mapfd);
+            reset();
+            if (!log_batch(pending))
+                throw std::runtime_error("metadata changes don't fit in the log");
+        }
+    } catch (...) {
+        for (auto off : pending)
+            _deref->dirty(_deref->deref(off, block_size).data(), block_size);
+        throw;
+    }
+
+    // what's in memory now is what's in the log, a write back cut short is finished by the replay
+    auto pages = _logged;
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+    size_t written = 0;
+    for (auto off : pages) {
+        if (written++ == _checkpoint_limit)
+            throw std::runtime_error("checkpoint write back interrupted");
+        pwrite_full(_mapfd, _deref->deref(off, block_size).data(), block_size, static_cast<off_t>(off));
+    }
+    if (!pages.empty() && fdatasync(_mapfd) < 0)
+        throw std::system_error(errno, std::generic_category(), "cannot sync map file");
+    // the map file has everything now
+    reset();
+}
@@ -1,6 +1,10 @@
 #include <algorithm>
+#include <cstring>
+#include <iterator>
 #include <stdexcept>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include "xcow/xcow_file.hpp"
 #include "xcow/xcowfmt.hpp"
 #include "xcow/xcow_snap.hpp"
@@ -13,6 +17,10 @@ static xcow::XcowHeader *make_hdr(xcow::Deref &deref) {
         throw std::runtime_error("invalid snap magic");
     if (p->cluster_bits < 12 || p->cluster_bits > 24)
         throw std::runtime_error("unsupported cluster size");
+    if (p->features & ~xcow::XCOW_FEATURES_SUPPORTED)
+        throw std::runtime_error("unsupported format features");
+    if ((p->features & xcow::XCOW_FEATURE_EXTENDED_L2) && p->cluster_bits < xcow::XcowFile::min_extended_l2_bits)
+        throw std::runtime_error("cluster size too small for extended l2");
     return p;
 }
 
@@ -21,7 +29,10 @@ xcow::XcowFile::XcowFile(xcow::Deref *deref)
       //_rt(_deref_meta->deref(_hdr->rcl1_offset, _hdr->rcl1_entries * sizeof(RcRef))),
       _snaps(_deref_meta->deref(LTRefImpl<SnapListRef>::decode(_hdr->snaplist), cluster_size())),
       _flist(_deref_meta->deref(LTRefImpl<FreeListRef>::decode(_hdr->freelist), cluster_size())) {
-    _deref_meta->prefetch(0, static_cast<size_t>(_hdr->hwm) << cluster_size());
+    _deref_meta->pin(_hdr, sizeof(XcowHeader));
+    pin_table(_snaps);
+    if (_snaps.active_entries().empty() || !decode_snap_entry(_snaps.active_entries().back()))
+        throw std::runtime_error("no writable snapshot");
 }
 
 xcow::XcowFile xcow::XcowFile::format(
@@ -29,7 +40,10 @@ xcow::XcowFile xcow::XcowFile::format(
     size_t fsize,
     uint32_t cbits,
     uint32_t hwm_limit,
-    uint64_t disk_hwm_limit) {
+    uint64_t disk_hwm_limit,
+    bool extended_l2) {
+    if (extended_l2 && cbits < min_extended_l2_bits)
+        throw std::invalid_argument("cluster size too small for extended l2");
     size_t csize = 1 << cbits;
     uint64_t hwm = 0;
 
@@ -39,44 +53,69 @@ xcow::XcowFile xcow::XcowFile::format(
     hdr->magic = XCOW_MAGIC;
     hdr->fsize = fsize;
     hdr->cluster_bits = cbits;
-    hdr->_rsvd = 0;
+    hdr->features = extended_l2 ? XCOW_FEATURE_EXTENDED_L2 : 0;
     hdr->hwm_limit = hwm_limit;
     hdr->disk_hwm_limit = disk_hwm_limit;
 
     auto snapoff = (hwm++) << cbits;
-    auto snaplist = SnapList::format(deref->deref(snapoff, csize));
+    auto snapbytes = deref->deref(snapoff, csize);
+    auto snaplist = SnapList::format(snapbytes);
     hdr->snaplist = encode_snap_ref(snapoff);
 
     auto freeoff = (hwm++) << cbits;
-    auto freelist = FreeList::format(deref->deref(freeoff, csize));
+    auto freebytes = deref->deref(freeoff, csize);
+    auto freelist = FreeList::format(freebytes);
     hdr->freelist = encode_free_ref(freeoff);
 
     hdr->hwm = hwm;
 
     XcowFile f(deref, hdr, snaplist, freelist);
+    f.dirty_span(hdrbytes);
+    f.dirty_span(snapbytes);
+    f.dirty_span(freebytes);
     auto [l1_off, l1_nbytes] = f.alloc_meta_clusters(f.l1_clusters());
     XlateTable s0(deref->deref(l1_off, l1_nbytes));
     std::fill(s0.entries().begin(), s0.entries().end(), XlateRef{});
+    f.dirty_span(s0.entries());
     // skip the first zero block
     f._snaps.push_back(encode_snap_entry(l1_off, 1));
+    f.dirty_entry(f._snaps, f._snaps.active_entries().back());
 
     return f;
 }
 
+const xcow::XcowBacking *xcow::XcowFile::backing() const {
+    if (!(_hdr->features & XCOW_FEATURE_BACKING))
+        return nullptr;
+    return _deref_meta->deref_as<XcowBacking>(XCOW_BACKING_OFFSET, sizeof(XcowBacking)).data();
+}
+
+void xcow::XcowFile::set_backing(const xcow::XcowBacking &backing) {
+    if (backing.kind != XcowBacking::raw && backing.kind != XcowBacking::xcow)
+        throw std::invalid_argument("unknown backing image kind");
+    if (!memchr(backing.path, 0, sizeof(backing.path)) || !memchr(backing.map_path, 0, sizeof(backing.map_path)))
+        throw std::invalid_argument("backing image path too long");
+    // clusters written so far would hide the image
+    if (_snaps.active_entries().size() != 1 || _snaps.active_entries().back().disk_hwm != 1)
+        throw std::logic_error("file is already in use");
+    auto &dst = _deref_meta->deref_as<XcowBacking>(XCOW_BACKING_OFFSET, sizeof(XcowBacking))[0];
+    dst = backing;
+    dirty(dst);
+    _hdr->features |= XCOW_FEATURE_BACKING;
+    dirty(_hdr->features);
+}
+
 xcow::XcowSnap xcow::XcowFile::open_read(int snapi) {
-    std::optional<SnapList> t = _snaps;
-    auto sei = t->active_entries().rbegin();
-    while (t.has_value() && snapi > 0) {
-        if (sei == t->active_entries().rend()) {
-            t = _snaps.next(*_deref_meta);
-            sei = t->active_entries().rbegin();
+    // newest first, tombstones don't count
+    for (auto it = snaps(); !it.at_end(); it++) {
+        if (snap_entry_dead(*it) || snapi-- > 0)
             continue;
-        }
-        sei++;
-        snapi--;
+        if (snap_entry_deleting(*it))
+            throw std::invalid_argument("snapshot is being deleted");
+        XlateTable root(_deref_meta->deref(decode_snap_entry(*it), cluster_size()));
+        return XcowSnap(this, root, nullptr);
     }
-    XlateTable root(_deref_meta->deref(decode_snap_entry(*sei), cluster_size()));
-    return XcowSnap(this, root, nullptr);
+    throw std::invalid_argument("no such snapshot");
 }
 
 xcow::XcowSnap xcow::XcowFile::open_write() {
@@ -94,17 +133,23 @@ xcow::XcowSnap xcow::XcowFile::snap_create(xcow::XcowSnap &source) {
         *oit = XlateRef(it->val & ~XlateBits::writable);
         oit++;
     }
+    dirty_span(snaproot.entries());
 
     auto last_hwm = _snaps.active_entries().back().disk_hwm;
     auto res = _snaps.push_back(encode_snap_entry(l1_off, last_hwm));
     if (!res) {
         auto [st_off, st_nbytes] = alloc_meta_cluster();
-        SnapList stnext(_deref_meta->deref(st_off, st_nbytes));
+        auto stbytes = _deref_meta->deref(st_off, st_nbytes);
+        auto stnext = SnapList::format(stbytes);
         stnext.next_ref() = _hdr->snaplist;
         _hdr->snaplist = encode_snap_ref(st_off);
+        dirty_span(stbytes);
+        dirty(_hdr->snaplist);
         _snaps = stnext;
+        pin_table(_snaps);
         _snaps.push_back(encode_snap_entry(l1_off, last_hwm));
     }
+    dirty_entry(_snaps, _snaps.active_entries().back());
     source._disk_hwm = nullptr;
     return XcowSnap(this, snaproot, &_snaps.active_entries().back().disk_hwm);
 }
@@ -112,10 +157,595 @@ xcow::XcowSnap xcow::XcowFile::snap_create(xcow::XcowSnap &source) {
 void xcow::XcowFile::peel(xcow::XcowSnap &&source) {
     if (!source._disk_hwm)
         throw std::logic_error("snapshot is not writable, cannot peel");
-    if (_snaps.active_entries().size() == 1 && !(_snaps.next_ref() & FileBits::valid))
+    auto entries = snap_entries();
+    if (std::none_of(entries.begin(), entries.end() - 1, [](auto se) { return !snap_entry_deleting(*se); }))
         throw std::logic_error("cannot peel last snapshot");
-    if (_snaps.pop_back()) {
+    // snapshots being deleted can't become writable, nothing else refers to their clusters once they're on top
+    do
+        drop_top();
+    while (snap_entry_deleting(_snaps.active_entries().back()));
+}
+
+void xcow::XcowFile::drop_top() {
+    auto top = _snaps.active_entries().back();
+    auto root_off = decode_snap_entry(top);
+    auto old_hwm = top.disk_hwm;
+
+    // only the top snapshot can reach a cluster through writable references, those are its own
+    // tombstones have nothing left
+    std::vector<uint64_t> owned;
+    if (root_off) {
+        XlateTable root(_deref_meta->deref(root_off, l1_clusters() << cluster_bits()));
+        for (auto ref : root.entries()) {
+            if (!NTRefImpl<XlateRef>::valid(ref) || !(ref & XlateBits::writable))
+                continue;
+            auto l0_off = NTRefImpl<XlateRef>::decode(ref);
+            for (auto tl : _deref_meta->deref_as<XlateLeaf>(l0_off, cluster_size()))
+                if (!XlateBits::is_empty(tl) && (tl & XlateBits::writable))
+                    owned.push_back(XlateBits::decode_leaf(tl));
+            free_meta_clusters(l0_off, l0_clusters());
+        }
+    }
+
+    auto st_off = LTRefImpl<SnapListRef>::decode(_hdr->snaplist);
+    auto st_empty = _snaps.pop_back();
+    dirty_entry(_snaps, _snaps.entries()[_snaps.active_entries().size()]);
+    if (st_empty) {
         _hdr->snaplist = _snaps.next_ref();
+        dirty(_hdr->snaplist);
+        unpin_table(_snaps);
         _snaps = *_snaps.next(*_deref_meta);
+        pin_table(_snaps);
+    }
+
+    // the snapshot below allocates from its own disk hwm again, which gives back everything allocated above it
+    auto new_hwm = _snaps.active_entries().back().disk_hwm;
+    trim_free_data(new_hwm);
+    for (auto off : owned)
+        if ((off >> cluster_bits()) < new_hwm)
+            free_data_clusters(off, 1);
+    if (_discard && old_hwm > new_hwm)
+        _discard(new_hwm << cluster_bits(), (old_hwm - new_hwm) << cluster_bits());
+
+    if (root_off)
+        free_meta_clusters(root_off, l1_clusters());
+    if (st_empty)
+        free_meta_clusters(st_off, 1);
+    // the snapshot below is the writable one now, its clusters are counted again
+    _used.reset();
+    _count_cursor = 0;
+    _count_partial = 0;
+}
+
+void xcow::XcowFile::snap_delete(int snapi) {
+    if (snapi == 0)
+        throw std::invalid_argument("the writable snapshot can only be peeled");
+    for (auto it = snaps(); !it.at_end(); it++) {
+        if (snap_entry_dead(*it) || snapi-- > 0)
+            continue;
+        it->val |= snap_deleting;
+        dirty(*it);
+        return;
+    }
+    throw std::invalid_argument("no such snapshot");
+}
+
+bool xcow::XcowFile::merge_step(const std::function<bool(uint64_t, uint64_t)> &busy) {
+    // deletions are done one at a time from the oldest snapshot
+    auto entries = snap_entries();
+    auto sit = std::find_if(entries.begin(), entries.end(), [](auto se) {
+        return snap_entry_deleting(*se) && !snap_entry_dead(*se);
+    });
+    if (sit == entries.end())
+        return false;
+
+    auto root_off = decode_snap_entry(**sit);
+    XlateTable root(_deref_meta->deref(root_off, l1_clusters() << cluster_bits()));
+    if (root_off != _merge_root) {
+        _merge_root = root_off;
+        _merge_cursor = 0;
+    }
+    // the other snapshots in list order, those being deleted still hold on to their clusters until their turn
+    // the writable snapshot is the last one
+    std::vector<XlateTable> others;
+    for (auto se : entries)
+        if (se != *sit && !snap_entry_dead(*se))
+            others.emplace_back(_deref_meta->deref(decode_snap_entry(*se), l1_clusters() << cluster_bits()));
+
+    auto nrefs = root.entries().size();
+    bool put_off = false;
+    for (size_t n = 0; n < nrefs; n++) {
+        auto j = (_merge_cursor + n) % nrefs;
+        auto &ref = root[j];
+        if (!NTRefImpl<XlateRef>::valid(ref))
+            continue;
+        // tables we don't own belong to older snapshots, which keep them
+        if (!(ref & XlateBits::writable)) {
+            ref = XlateRef{};
+            dirty(ref);
+            continue;
+        }
+        if (!merge_table(root, j, others, busy)) {
+            put_off = true;
+            continue;
+        }
+        _merge_cursor = j + 1;
+        return true;
+    }
+    if (put_off)
+        return true;
+
+    // the root goes after the entry, a crash in between only leaks it
+    (*sit)->val = valid | snap_deleting;
+    dirty(**sit);
+    free_meta_clusters(root_off, l1_clusters());
+    return true;
+}
+
+bool xcow::XcowFile::merge_table(
+    xcow::XlateTable &root,
+    size_t l1_off,
+    std::span<xcow::XlateTable> others,
+    const std::function<bool(uint64_t, uint64_t)> &busy) {
+    auto t_off = NTRefImpl<XlateRef>::decode(root[l1_off]);
+    auto leaves = _deref_meta->deref_as<XlateLeaf>(t_off, cluster_size());
+
+    // the table goes to the oldest snapshot sharing it
+    std::optional<size_t> heir;
+    std::vector<std::span<XlateLeaf>> other_leaves(others.size());
+    std::vector<std::span<XlateExt>> other_ext(others.size());
+    for (size_t i = 0; i < others.size(); i++) {
+        auto ref = others[i][l1_off];
+        if (!NTRefImpl<XlateRef>::valid(ref))
+            continue;
+        auto off = NTRefImpl<XlateRef>::decode(ref);
+        if (off == t_off && !heir)
+            heir = i;
+        other_leaves[i] = _deref_meta->deref_as<XlateLeaf>(off, cluster_size());
+        if (extended_l2())
+            other_ext[i] = _deref_meta->deref_as<XlateExt>(off + cluster_size(), cluster_size() * 2);
+    }
+
+    // each of our clusters goes to the oldest snapshot using it, which only has to be marked when it has its own table
+    std::vector<std::pair<size_t, size_t>> grants;
+    std::vector<size_t> unused;
+    for (size_t k = 0; k < leaves.size(); k++) {
+        auto tl = leaves[k];
+        if (XlateBits::is_empty(tl) || !(tl & XlateBits::writable))
+            continue;
+        auto off = XlateBits::decode_leaf(tl);
+        auto uses = [off](XlateLeaf other) {
+            return !XlateBits::is_empty(other) && XlateBits::decode_leaf(other) == off;
+        };
+        std::optional<size_t> user;
+        bool base_user = false;
+        for (size_t i = 0; i < others.size(); i++) {
+            if (other_leaves[i].empty())
+                continue;
+            if (uses(other_leaves[i][k])) {
+                user = i;
+                break;
+            }
+            base_user |= !other_ext[i].empty() && uses(other_ext[i][k].base);
+        }
+        if (user && other_leaves[*user].data() != leaves.data())
+            grants.emplace_back(*user, k);
+        else if (!user && !base_user)
+            unused.push_back(k);
+        // clusters that are only left as the base of others are kept, but nothing owns them anymore
+    }
+
+    auto writable_i = others.size() - 1;
+    bool touches_writable = heir == writable_i ||
+        std::any_of(grants.begin(), grants.end(), [&](auto g) { return g.first == writable_i; });
+    if (touches_writable && busy && busy(l1_off << l0_cover_bits(), l0_cover_size()))
+        return false;
+
+    // the new owners are marked before we let go, so that a step redone after a crash finds them again
+    for (auto [i, k] : grants) {
+        other_leaves[i][k] = XlateLeaf(other_leaves[i][k] | XlateBits::writable);
+        leaves[k] = XlateLeaf(leaves[k] & ~XlateBits::writable);
+        dirty(other_leaves[i][k]);
+        dirty(leaves[k]);
+    }
+    if (heir) {
+        others[*heir][l1_off] = XlateRef(others[*heir][l1_off] | XlateBits::writable);
+        root[l1_off] = XlateRef{};
+        dirty(others[*heir][l1_off]);
+        dirty(root[l1_off]);
+        return true;
+    }
+
+    // nobody else has the table
+    std::vector<uint64_t> freed;
+    for (auto k : unused) {
+        freed.push_back(XlateBits::decode_leaf(std::exchange(leaves[k], XlateBits::empty_leaf)));
+        dirty(leaves[k]);
+    }
+    root[l1_off] = XlateRef{};
+    dirty(root[l1_off]);
+    for (auto off : freed)
+        free_data_clusters(off, 1);
+    free_meta_clusters(t_off, l0_clusters());
+    return true;
+}
+
+size_t xcow::XcowFile::upgrade_extended_l2() {
+    if (extended_l2())
+        return 0;
+    if (cluster_bits() < min_extended_l2_bits)
+        throw std::invalid_argument("cluster size too small for extended l2");
+
+    // l0 tables are shared between snapshots, keep sharing them after the move
+    // the leaves stay at the start of the moved tables, so an interrupted upgrade leaves a valid file behind
+    std::unordered_map<uint64_t, uint64_t> moved;
+    // what l0_clusters() will be once the feature is set
+    size_t ext_count = 1 + sizeof(XlateExt) / sizeof(XlateLeaf);
+    for (std::optional<SnapList> sl = _snaps; sl.has_value(); sl = sl->next(*_deref_meta)) {
+        for (auto &se : sl->active_entries()) {
+            if (snap_entry_dead(se))
+                continue;
+            XlateTable root(_deref_meta->deref(decode_snap_entry(se), l1_clusters() << cluster_bits()));
+            for (auto &ref : root.entries()) {
+                if (!NTRefImpl<XlateRef>::valid(ref))
+                    continue;
+                auto old_off = NTRefImpl<XlateRef>::decode(ref);
+                auto it = moved.find(old_off);
+                if (it == moved.end()) {
+                    auto [new_off, new_nbytes] = alloc_meta_clusters(ext_count);
+                    auto old_leaves = _deref_meta->deref_as<XlateLeaf>(old_off, cluster_size());
+                    auto new_leaves = _deref_meta->deref_as<XlateLeaf>(new_off, cluster_size());
+                    auto new_ext =
+                        _deref_meta->deref_as<XlateExt>(new_off + cluster_size(), new_nbytes - cluster_size());
+                    std::copy(old_leaves.begin(), old_leaves.end(), new_leaves.begin());
+                    std::transform(old_leaves.begin(), old_leaves.end(), new_ext.begin(), [](XlateLeaf tl) {
+                        return XlateBits::is_empty(tl) ? XlateExt{} : XlateBits::full_ext;
+                    });
+                    dirty_span(new_leaves);
+                    dirty_span(new_ext);
+                    it = moved.emplace(old_off, new_off).first;
+                }
+                ref = XlateRef(it->second | (ref & ~XlateBits::decode_mask));
+                dirty(ref);
+            }
+        }
+    }
+    _hdr->features |= XCOW_FEATURE_EXTENDED_L2;
+    dirty(_hdr->features);
+    for (auto [old_off, new_off] : moved)
+        free_meta_clusters(old_off, 1);
+    return moved.size();
+}
+
+std::vector<std::pair<uint64_t, size_t>> xcow::XcowFile::warmup_plan(WarmupOrder order) {
+    std::vector<std::pair<uint64_t, size_t>> plan;
+    if (order == WarmupOrder::none)
+        return plan;
+    auto root_off = decode_snap_entry(_snaps.active_entries().back());
+    auto l1_nbytes = l1_clusters() << cluster_bits();
+    plan.emplace_back(root_off, l1_nbytes);
+    if (order == WarmupOrder::roots)
+        return plan;
+
+    // (offset, written since the last snapshot)
+    std::vector<std::pair<uint64_t, bool>> tables;
+    XlateTable root(_deref_meta->deref(root_off, l1_nbytes));
+    for (auto ref : root.entries())
+        if (NTRefImpl<XlateRef>::valid(ref))
+            tables.emplace_back(NTRefImpl<XlateRef>::decode(ref), !!(ref & XlateBits::writable));
+    if (order == WarmupOrder::recent)
+        // the map file has no timestamps, but metadata clusters are mostly handed out in increasing order
+        std::sort(tables.begin(), tables.end(), [](const auto &a, const auto &b) {
+            return a.second != b.second ? a.second : a.first > b.first;
+        });
+    for (const auto &t : tables)
+        plan.emplace_back(t.first, l0_clusters() << cluster_bits());
+    return plan;
+}
+
+uint64_t xcow::XcowFile::used_clusters(int snapi) {
+    if (snapi == 0 && _used)
+        return *_used;
+    auto writable = snapi == 0;
+    for (auto it = snaps(); !it.at_end(); it++) {
+        if (snap_entry_dead(*it) || snapi-- > 0)
+            continue;
+        if (snap_entry_deleting(*it))
+            throw std::invalid_argument("snapshot is being deleted");
+        uint64_t count = 0;
+        XlateTable root(_deref_meta->deref(decode_snap_entry(*it), l1_clusters() << cluster_bits()));
+        for (auto ref : root.entries())
+            count += count_table(ref);
+        if (writable)
+            _used = count;
+        return count;
+    }
+    throw std::invalid_argument("no such snapshot");
+}
+
+bool xcow::XcowFile::count_step(size_t ntables) {
+    if (_used)
+        return false;
+    auto root_off = decode_snap_entry(_snaps.active_entries().back());
+    XlateTable root(_deref_meta->deref(root_off, l1_clusters() << cluster_bits()));
+    auto entries = root.entries();
+    for (; ntables && _count_cursor < entries.size(); ntables--)
+        _count_partial += count_table(entries[_count_cursor++]);
+    if (_count_cursor < entries.size())
+        return true;
+    _used = _count_partial;
+    return false;
+}
+
+uint64_t xcow::XcowFile::count_table(XlateRef ref) {
+    if (!NTRefImpl<XlateRef>::valid(ref))
+        return 0;
+    auto leaves = _deref_meta->deref_as<XlateLeaf>(NTRefImpl<XlateRef>::decode(ref), cluster_size());
+    return static_cast<uint64_t>(
+        std::count_if(leaves.begin(), leaves.end(), [](XlateLeaf tl) { return !XlateBits::is_empty(tl); }));
+}
+
+std::vector<xcow::SnapListEntry *> xcow::XcowFile::snap_entries() {
+    std::vector<SnapListEntry *> ret;
+    for (auto it = snaps(); !it.at_end(); it++)
+        ret.push_back(&*it);
+    std::reverse(ret.begin(), ret.end());
+    return ret;
+}
+
+void xcow::XcowFile::free_meta_clusters(uint64_t off, size_t count) {
+    free_extent(true, off >> cluster_bits(), count);
+}
+
+void xcow::XcowFile::free_data_clusters(uint64_t off, size_t count) {
+    free_extent(false, off >> cluster_bits(), count);
+    if (_discard)
+        _discard(off, count << cluster_bits());
+}
+
+void xcow::XcowFile::park_data_clusters(uint64_t off, size_t count) {
+    need_free_list();
+    auto start = off >> cluster_bits();
+    _parked.emplace(start, list_push(encode_free_entry(false, start, count)));
+}
+
+void xcow::XcowFile::unpark_data_clusters(uint64_t off, size_t count) {
+    auto start = off >> cluster_bits();
+    auto it = _parked.upper_bound(start);
+    if (it == _parked.begin())
+        throw std::logic_error("clusters are not parked");
+    it--;
+    auto [first, fe] = *it;
+    auto end = first + free_entry_count(*fe);
+    if (start + count > end)
+        throw std::logic_error("clusters are not parked");
+
+    _parked.erase(it);
+    if (first < start) {
+        *fe = encode_free_entry(false, first, start - first);
+        dirty(*fe);
+        _parked.emplace(first, fe);
+        if (start + count < end)
+            _parked.emplace(start + count, list_push(encode_free_entry(false, start + count, end - start - count)));
+    } else if (start + count < end) {
+        *fe = encode_free_entry(false, start + count, end - start - count);
+        dirty(*fe);
+        _parked.emplace(start + count, fe);
+    } else {
+        list_remove(fe);
+    }
+}
+
+void xcow::XcowFile::load_free_list() {
+    _free_loaded = true;
+    _ftables.clear();
+    for (std::optional<FreeList> fl = _flist; fl.has_value(); fl = fl->next(*_deref_meta)) {
+        pin_table(*fl);
+        _ftables.push_back(*fl);
+    }
+    std::reverse(_ftables.begin(), _ftables.end());
+    _fcur = 0;
+    for (size_t i = 0; i < _ftables.size(); i++) {
+        if (_ftables[i].active_entries().empty())
+            continue;
+        _fcur = i;
+        for (auto &fe : _ftables[i].active_entries())
+            index_insert(&fe);
+    }
+}
+
+void xcow::XcowFile::index_insert(xcow::FreeListEntry *fe) {
+    auto &idx = free_index(free_entry_meta(*fe));
+    auto start = decode_free_entry(*fe), count = free_entry_count(*fe);
+    idx.by_start.emplace(start, fe);
+    idx.by_size.emplace(count, start);
+    idx.total += count;
+}
+
+void xcow::XcowFile::index_erase(xcow::FreeListEntry fe) {
+    auto &idx = free_index(free_entry_meta(fe));
+    auto start = decode_free_entry(fe), count = free_entry_count(fe);
+    idx.by_start.erase(start);
+    idx.by_size.erase(std::make_pair(count, start));
+    idx.total -= count;
+}
+
+xcow::FreeListEntry *xcow::XcowFile::list_push(xcow::FreeListEntry e) {
+    if (!_ftables[_fcur].push_back(e)) {
+        if (_fcur + 1 == _ftables.size()) {
+            // taking the new table off the free list can make room in the current one, the new table waits then
+            auto [off, nbytes] = alloc_meta_cluster();
+            auto bytes = _deref_meta->deref(off, nbytes);
+            auto table = FreeList::format(bytes);
+            table.next_ref() = _hdr->freelist;
+            _hdr->freelist = encode_free_ref(off);
+            dirty_span(bytes);
+            dirty(_hdr->freelist);
+            _flist = table;
+            pin_table(table);
+            _ftables.push_back(table);
+        }
+        if (!_ftables[_fcur].push_back(e))
+            _ftables[++_fcur].push_back(e);
+    }
+    auto &cur = _ftables[_fcur];
+    dirty_entry(cur, cur.active_entries().back());
+    return &cur.active_entries().back();
+}
+
+void xcow::XcowFile::list_remove(xcow::FreeListEntry *fe) {
+    // the last entry of the list takes the place of the removed one
+    auto &cur = _ftables[_fcur];
+    auto last = &cur.active_entries().back();
+    if (fe != last) {
+        *fe = *last;
+        dirty(*fe);
+        auto start = decode_free_entry(*fe);
+        if (auto it = _parked.find(start); !free_entry_meta(*fe) && it != _parked.end() && it->second == last)
+            it->second = fe;
+        else
+            free_index(free_entry_meta(*fe)).by_start[start] = fe;
+    }
+    cur.pop_back();
+    dirty_entry(cur, *last);
+    if (cur.active_entries().empty() && _fcur > 0)
+        _fcur--;
+}
+
+std::optional<uint64_t> xcow::XcowFile::alloc_free(bool meta, size_t count) {
+    need_free_list();
+    auto &idx = free_index(meta);
+    if (idx.total < count)
+        return {};
+    auto it = idx.by_start.end();
+    if (meta) {
+        // best fit, keeps the larger extents for multi-cluster tables
+        auto sit = idx.by_size.lower_bound(std::make_pair(static_cast<uint64_t>(count), uint64_t{0}));
+        if (sit == idx.by_size.end())
+            return {};
+        it = idx.by_start.find(sit->second);
+    } else {
+        // continue the last allocation if we can, otherwise start over in the largest extent so that the following
+        // allocations can continue there
+        it = idx.by_start.find(_data_next);
+        if (it == idx.by_start.end() || free_entry_count(*it->second) < count) {
+            auto sit = idx.by_size.rbegin();
+            if (sit->first < count)
+                return {};
+            it = idx.by_start.find(sit->second);
+        }
+    }
+
+    auto fe = it->second;
+    auto start = it->first;
+    auto left = free_entry_count(*fe) - count;
+    index_erase(*fe);
+    if (left) {
+        *fe = encode_free_entry(meta, start + count, left);
+        dirty(*fe);
+        index_insert(fe);
+    } else {
+        list_remove(fe);
+    }
+    if (!meta)
+        _data_next = start + count;
+    return start;
+}
+
+std::optional<uint64_t> xcow::XcowFile::alloc_free_at(uint64_t start, size_t count) {
+    need_free_list();
+    auto &idx = _free_data;
+    auto it = idx.by_start.upper_bound(start);
+    if (it == idx.by_start.begin())
+        return {};
+    it--;
+    auto fe = it->second;
+    auto first = it->first, end = first + free_entry_count(*fe);
+    if (start + count > end)
+        return {};
+
+    index_erase(*fe);
+    if (start + count < end) {
+        *fe = encode_free_entry(false, start + count, end - start - count);
+        dirty(*fe);
+        index_insert(fe);
+    } else {
+        list_remove(fe);
+    }
+    // the head of the extent stays free
+    if (first < start)
+        free_extent(false, first, start - first);
+    _data_next = start + count;
+    return start;
+}
+
+void xcow::XcowFile::free_extent(bool meta, uint64_t start, uint64_t count) {
+    need_free_list();
+    auto &idx = free_index(meta);
+    auto next = idx.by_start.lower_bound(start);
+    if (next != idx.by_start.end() && next->first < start + count)
+        throw std::logic_error("freeing free clusters");
+
+    // merge with the extents right before and right after
+    FreeListEntry *prev_fe = nullptr, *next_fe = nullptr;
+    auto merged = count;
+    if (next != idx.by_start.begin()) {
+        auto prev = std::prev(next);
+        auto prev_count = free_entry_count(*prev->second);
+        if (prev->first + prev_count > start)
+            throw std::logic_error("freeing free clusters");
+        if (prev->first + prev_count == start && merged + prev_count <= free_max_count) {
+            prev_fe = prev->second;
+            merged += prev_count;
+        }
+    }
+    if (next != idx.by_start.end() && next->first == start + count &&
+        merged + free_entry_count(*next->second) <= free_max_count)
+        next_fe = next->second;
+
+    if (!prev_fe && !next_fe) {
+        FreeListEntry *fe;
+        try {
+            fe = list_push(encode_free_entry(meta, start, count));
+        } catch (const hwm_exception &) {
+            // the list can't grow without metadata space, rather leak the clusters than fail the caller
+            return;
+        }
+        index_insert(fe);
+        return;
+    }
+
+    auto fe = prev_fe ? prev_fe : next_fe;
+    if (prev_fe) {
+        start = decode_free_entry(*prev_fe);
+        count += free_entry_count(*prev_fe);
+        index_erase(*prev_fe);
+    }
+    if (next_fe) {
+        count += free_entry_count(*next_fe);
+        index_erase(*next_fe);
+    }
+    *fe = encode_free_entry(meta, start, count);
+    dirty(*fe);
+    index_insert(fe);
+    if (prev_fe && next_fe)
+        list_remove(next_fe);
+}
+
+void xcow::XcowFile::trim_free_data(uint64_t limit) {
+    need_free_list();
+    while (!_free_data.by_start.empty()) {
+        auto [start, fe] = *std::prev(_free_data.by_start.end());
+        auto count = free_entry_count(*fe);
+        if (start + count <= limit)
+            break;
+        index_erase(*fe);
+        if (start < limit) {
+            *fe = encode_free_entry(false, start, limit - start);
+            dirty(*fe);
+            index_insert(fe);
+        } else {
+            list_remove(fe);
+        }
     }
 }
@@ -1,34 +1,81 @@
 #include <algorithm>
 #include <span>
 #include <stdexcept>
+#include <utility>
 #include "xcow/xcowfmt.hpp"
 #include "xcow/xcow_snap.hpp"
 #include "xcow/xcow_file.hpp"
 
-xcow::XlateLeaf xcow::XcowSnap::translate_read(uint64_t addr_in) const {
+xcow::XcowSnap::XcowSnap(xcow::XcowFile *f, xcow::XlateTable root, uint64_t *disk_hwm)
+    : _f(f), _root(std::move(root)), _disk_hwm(disk_hwm) {
+    _f->pin_span(_root.entries());
+}
+
+xcow::XcowSnap::XcowSnap(xcow::XcowSnap &&other) noexcept
+    : _f(std::exchange(other._f, nullptr)), _root(std::move(other._root)), _disk_hwm(other._disk_hwm) {
+}
+
+xcow::XcowSnap &xcow::XcowSnap::operator=(xcow::XcowSnap &&other) noexcept {
+    if (this != &other) {
+        // e.g. a worker reopening the writable snapshot, the old root may not be one anymore
+        if (_f)
+            _f->unpin_span(_root.entries());
+        _f = std::exchange(other._f, nullptr);
+        _root = std::move(other._root);
+        _disk_hwm = other._disk_hwm;
+    }
+    return *this;
+}
+
+xcow::XcowSnap::~XcowSnap() {
+    if (_f)
+        _f->unpin_span(_root.entries());
+}
+
+xcow::XlateLeaf xcow::XcowSnap::translate_read(uint64_t addr_in, xcow::XlateExt *ext) const {
     auto l1_off = addr_in >> _f->l0_cover_bits();
     auto l0 = _root.next(*_f->_deref_meta, l1_off, _f->cluster_size());
-    if (!l0.has_value())
+    if (!l0.has_value()) {
+        if (ext)
+            *ext = XlateExt{};
         return XlateBits::empty_leaf;
+    }
     auto l0_off = (addr_in & (_f->l0_cover_size() - 1)) >> _f->cluster_bits();
-    return (*l0)[l0_off];
+    auto tl = (*l0)[l0_off];
+    // clusters of a table we share belong to the table's owner, whatever the leaf says
+    if (!(_root[l1_off] & XlateBits::writable))
+        tl = XlateLeaf(tl & ~XlateBits::writable);
+    if (ext) {
+        if (_f->extended_l2())
+            *ext = l0_ext(l1_off)[l0_off];
+        else
+            *ext = XlateBits::is_empty(tl) ? XlateExt{} : XlateBits::full_ext;
+    }
+    return tl;
 }
 
-xcow::XlateLeaf xcow::XcowSnap::translate_write(uint64_t addr_in, xcow::XlateLeaf *prev) {
+xcow::XlateTable::next_type xcow::XcowSnap::l0_write(uint64_t addr_in) {
     if (!_disk_hwm) {
         throw std::logic_error("snapshot is not writable");
     }
     auto l1_off = addr_in >> _f->l0_cover_bits();
     auto l0 = _root.next(*_f->_deref_meta, l1_off, _f->cluster_size());
     if (!l0.has_value()) {
-        auto [newmeta_off, newmeta_nbytes] = _f->alloc_meta_cluster();
-        l0 = XlateTable::next_type(_f->_deref_meta->deref(newmeta_off, newmeta_nbytes));
+        auto [newmeta_off, newmeta_nbytes] = _f->alloc_meta_clusters(_f->l0_clusters());
+        l0 = XlateTable::next_type(_f->_deref_meta->deref(newmeta_off, _f->cluster_size()));
         std::fill(l0->entries().begin(), l0->entries().end(), XlateBits::empty_leaf);
         auto entry = XlateBits::encode_ref(newmeta_off, true);
         _root[l1_off] = entry;
+        _f->dirty_span(l0->entries());
+        _f->dirty(_root[l1_off]);
+        if (_f->extended_l2()) {
+            auto ext = l0_ext(l1_off);
+            std::fill(ext.begin(), ext.end(), XlateExt{});
+            _f->dirty_span(ext);
+        }
     } else if (!(_root[l1_off] & XlateBits::writable)) {
-        auto [newmeta_off, newmeta_nbytes] = _f->alloc_meta_cluster();
-        auto new_l0 = XlateTable::next_type(_f->_deref_meta->deref(newmeta_off, newmeta_nbytes));
+        auto [newmeta_off, newmeta_nbytes] = _f->alloc_meta_clusters(_f->l0_clusters());
+        auto new_l0 = XlateTable::next_type(_f->_deref_meta->deref(newmeta_off, _f->cluster_size()));
 
         auto oit = new_l0.entries().begin();
         for (auto it = l0->entries().begin(); it != l0->entries().end(); it++) {
@@ -36,81 +83,171 @@ xcow::XlateLeaf xcow::XcowSnap::translate_write(uint64_t addr_in, xcow::XlateLea
             oit++;
         }
 
-        auto entry = XlateBits::encode_ref(newmeta_off, true);
-        _root[l1_off] = entry;
+        if (_f->extended_l2()) {
+            auto old_ext = l0_ext(l1_off);
+            _root[l1_off] = XlateBits::encode_ref(newmeta_off, true);
+            auto new_ext = l0_ext(l1_off);
+            std::copy(old_ext.begin(), old_ext.end(), new_ext.begin());
+            _f->dirty_span(new_ext);
+        } else {
+            _root[l1_off] = XlateBits::encode_ref(newmeta_off, true);
+        }
+        _f->dirty_span(new_l0.entries());
+        _f->dirty(_root[l1_off]);
         l0 = new_l0;
     }
+    return *l0;
+}
+
+std::span<xcow::XlateExt> xcow::XcowSnap::l0_ext(size_t l1_off) const {
+    auto l0_off = NTRefImpl<XlateRef>::decode(_root[l1_off]);
+    return _f->_deref_meta->deref_as<XlateExt>(l0_off + _f->cluster_size(), _f->cluster_size() * 2);
+}
+
+xcow::XlateLeaf xcow::XcowSnap::translate_write(uint64_t addr_in, xcow::XlateLeaf *prev) {
+    auto l0 = l0_write(addr_in);
     auto l0_off = (addr_in & (_f->l0_cover_size() - 1)) >> _f->cluster_bits();
-    auto &cluster_entry = (*l0)[l0_off];
+    auto &cluster_entry = l0[l0_off];
     XlateLeaf _prev = cluster_entry;
     if (!(cluster_entry & XlateBits::valid) || !(cluster_entry & XlateBits::writable)) {
         auto [newdata_off, newdata_nbytes] = alloc_data_cluster();
         _prev = std::exchange(cluster_entry, XlateBits::encode_leaf(newdata_off, true));
+        _f->dirty(cluster_entry);
+        _f->account(addr_in, _prev, cluster_entry);
+        // the caller fills the whole new cluster
+        if (_f->extended_l2()) {
+            auto &ext = l0_ext(addr_in >> _f->l0_cover_bits())[l0_off];
+            ext = XlateBits::full_ext;
+            _f->dirty(ext);
+        }
     }
     if (prev)
         *prev = _prev;
     return cluster_entry;
 }
 
-xcow::XlateLeaf *xcow::XcowSnap::tx_write_prep(uint64_t addr_in) {
-    if (!_disk_hwm) {
-        throw std::logic_error("snapshot is not writable");
-    }
-    auto l1_off = addr_in >> _f->l0_cover_bits();
-    auto l0 = _root.next(*_f->_deref_meta, l1_off, _f->cluster_size());
-    if (!l0.has_value()) {
-        auto [newmeta_off, newmeta_nbytes] = _f->alloc_meta_cluster();
-        l0 = XlateTable::next_type(_f->_deref_meta->deref(newmeta_off, newmeta_nbytes));
-        std::fill(l0->entries().begin(), l0->entries().end(), XlateBits::empty_leaf);
-        auto entry = XlateBits::encode_ref(newmeta_off, true);
-        _root[l1_off] = entry;
-    } else if (!(_root[l1_off] & XlateBits::writable)) {
-        auto [newmeta_off, newmeta_nbytes] = _f->alloc_meta_cluster();
-        auto new_l0 = XlateTable::next_type(_f->_deref_meta->deref(newmeta_off, newmeta_nbytes));
-
-        auto oit = new_l0.entries().begin();
-        for (auto it = l0->entries().begin(); it != l0->entries().end(); it++) {
-            *oit = XlateLeaf((*it) & ~XlateBits::writable);
-            oit++;
-        }
-
-        auto entry = XlateBits::encode_ref(newmeta_off, true);
-        _root[l1_off] = entry;
-        l0 = new_l0;
-    }
+xcow::XlateLeaf *xcow::XcowSnap::tx_write_prep(uint64_t addr_in, xcow::XlateExt **ext) {
+    auto l0 = l0_write(addr_in);
     auto l0_off = (addr_in & (_f->l0_cover_size() - 1)) >> _f->cluster_bits();
-    return &(*l0)[l0_off];
+    if (ext)
+        *ext = _f->extended_l2() ? &l0_ext(addr_in >> _f->l0_cover_bits())[l0_off] : nullptr;
+    return &l0[l0_off];
 }
 
-xcow::XlateLeaf xcow::XcowSnap::tx_write_commit(xcow::XlateLeaf &ref, xcow::XlateLeaf tl, xcow::XlateLeaf *prev) {
+xcow::XlateLeaf xcow::XcowSnap::tx_write_commit(
+    uint64_t addr_in,
+    xcow::XlateLeaf &ref,
+    xcow::XlateLeaf tl,
+    xcow::XlateLeaf *prev) {
     XlateLeaf _prev = ref;
-    if (!(ref & XlateBits::valid) || !(ref & XlateBits::writable))
+    if (!(ref & XlateBits::valid) || !(ref & XlateBits::writable)) {
         ref = tl;
+        _f->dirty(ref);
+        _f->account(addr_in, _prev, ref);
+    }
     if (prev)
         *prev = _prev;
     return ref;
 }
 
+void xcow::XcowSnap::tx_write_commit(
+    uint64_t addr_in,
+    xcow::XlateLeaf &ref,
+    xcow::XlateExt *ext,
+    xcow::XlateLeaf tl,
+    const xcow::XlateExt &newext) {
+    _f->account(addr_in, std::exchange(ref, tl), tl);
+    _f->dirty(ref);
+    if (ext) {
+        *ext = newext;
+        _f->dirty(*ext);
+    }
+}
+
 void xcow::XcowSnap::erase(uint64_t addr_in) {
     auto l1_off = addr_in >> _f->l0_cover_bits();
+    auto l0_off = (addr_in & (_f->l0_cover_size() - 1)) >> _f->cluster_bits();
     auto l0 = _root.next(*_f->_deref_meta, l1_off, _f->cluster_size());
-    if (!l0.has_value())
+    if (!l0.has_value() || XlateBits::is_unallocated((*l0)[l0_off]))
         return;
-    auto l0_off = (addr_in & (_f->l0_cover_size() - 1)) >> _f->cluster_bits();
-    auto &cluster_entry = (*l0)[l0_off];
-    if (!XlateBits::is_empty(cluster_entry)) {
-        // TODO: free disk block
+    // the table may still be shared with older snapshots
+    auto wl0 = l0_write(addr_in);
+    auto &cluster_entry = wl0[l0_off];
+    if (cluster_entry & XlateBits::writable)
+        _f->free_data_clusters(XlateBits::decode_leaf(cluster_entry), 1);
+    _f->account(addr_in, std::exchange(cluster_entry, XlateBits::empty_leaf), XlateBits::empty_leaf);
+    _f->dirty(cluster_entry);
+    if (_f->extended_l2()) {
+        auto &ext = l0_ext(l1_off)[l0_off];
+        ext = XlateExt{};
+        _f->dirty(ext);
+    }
+    // zero leaves keep the table
+    if (std::all_of(wl0.entries().begin(), wl0.entries().end(), XlateBits::is_unallocated)) {
+        _f->free_meta_clusters(NTRefImpl<XlateRef>::decode(_root[l1_off]), _f->l0_clusters());
+        _root[l1_off] = XlateRef{};
+        _f->dirty(_root[l1_off]);
+    }
+}
+
+void xcow::XcowSnap::zero(uint64_t addr_in) {
+    if (!(_f->_hdr->features & XCOW_FEATURE_ZERO_LEAVES)) {
+        _f->_hdr->features |= XCOW_FEATURE_ZERO_LEAVES;
+        _f->dirty(_f->_hdr->features);
     }
-    cluster_entry = XlateBits::empty_leaf;
-    if (std::all_of(l0->entries().begin(), l0->entries().end(), XlateBits::is_empty)) {
-        // TODO: free l0 meta block
+    auto l0 = l0_write(addr_in);
+    auto l0_off = (addr_in & (_f->l0_cover_size() - 1)) >> _f->cluster_bits();
+    auto &cluster_entry = l0[l0_off];
+    if (!XlateBits::is_empty(cluster_entry) && (cluster_entry & XlateBits::writable))
+        _f->free_data_clusters(XlateBits::decode_leaf(cluster_entry), 1);
+    _f->account(addr_in, std::exchange(cluster_entry, XlateBits::zero_leaf), XlateBits::zero_leaf);
+    _f->dirty(cluster_entry);
+    if (_f->extended_l2()) {
+        auto &ext = l0_ext(addr_in >> _f->l0_cover_bits())[l0_off];
+        ext = XlateExt{};
+        _f->dirty(ext);
     }
 }
 
-std::pair<uint64_t, size_t> xcow::XcowSnap::alloc_data_clusters(size_t count) {
+void xcow::XcowSnap::erase_subclusters(uint64_t addr_in, uint32_t mask) {
+    if (!_f->extended_l2())
+        throw std::logic_error("file has no subclusters");
+    if (mask == XlateBits::all_subclusters)
+        return erase(addr_in);
+    auto l1_off = addr_in >> _f->l0_cover_bits();
+    if (!_root.next(*_f->_deref_meta, l1_off, _f->cluster_size()).has_value())
+        return;
+    auto l0 = l0_write(addr_in);
+    auto l0_off = (addr_in & (_f->l0_cover_size() - 1)) >> _f->cluster_bits();
+    if (XlateBits::is_empty(l0[l0_off]))
+        return;
+    auto &ext = l0_ext(l1_off)[l0_off];
+    ext.alloc &= ~mask;
+    ext.zero |= mask;
+    _f->dirty(ext);
+    if (ext.zero == XlateBits::all_subclusters)
+        erase(addr_in);
+}
+
+std::pair<uint64_t, size_t> xcow::XcowSnap::alloc_data_clusters(size_t count, uint64_t hint) {
+    if (hint != UINT64_MAX) {
+        auto want = hint >> _f->cluster_bits();
+        if (want == *_disk_hwm && *_disk_hwm + count <= _f->_hdr->disk_hwm_limit) {
+            *_disk_hwm += count;
+            _f->dirty(*_disk_hwm);
+            _f->_data_next = *_disk_hwm;
+            return std::make_pair(want << _f->cluster_bits(), count << _f->cluster_bits());
+        } else if (auto start = _f->alloc_free_at(want, count)) {
+            return std::make_pair(*start << _f->cluster_bits(), count << _f->cluster_bits());
+        }
+    }
+    if (auto start = _f->alloc_free(false, count))
+        return std::make_pair(*start << _f->cluster_bits(), count << _f->cluster_bits());
     if (*_disk_hwm + count > _f->_hdr->disk_hwm_limit)
         throw disk_hwm_exception{};
     auto ret = std::make_pair(*_disk_hwm << _f->cluster_bits(), count << _f->cluster_bits());
     *_disk_hwm += count;
+    _f->dirty(*_disk_hwm);
+    _f->_data_next = *_disk_hwm;
     return ret;
 }
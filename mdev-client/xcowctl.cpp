@@ -1,4 +1,8 @@
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <system_error>
 #include <fmt/format.h>
@@ -7,6 +11,9 @@
 #include "fildes.hpp"
 #include "xcow/xcow_file.hpp"
 #include "xcow/file_deref.hpp"
+#include "xcow/copy_offload.hpp"
+#include "xcow/meta_log.hpp"
+#include "xcow/backing_image.hpp"
 
 using namespace xcow;
 
@@ -16,14 +23,45 @@ static cxxopts::Options make_options() {
     cxxopts::Options opt{"xcowctl"};
     auto g = opt.add_options();
     g("M,mapfile", "map file", cxxopts::value<std::string>());
+    g("L,logfile", "metadata log, replayed before anything else", cxxopts::value<std::string>());
     g("o,operation", "operation", cxxopts::value<std::string>());
     g("s,snap-index", "snapshot index", cxxopts::value<int>());
     g("b,blkdev", "block data file", cxxopts::value<std::string>());
     g("z,fsize", "new file size", cxxopts::value<size_t>());
     g("C,cluster-bits", "new cluster bits", cxxopts::value<uint32_t>()->default_value("16"));
+    g("X,extended-l2", "track allocation per subcluster", cxxopts::value<bool>()->default_value("false"));
+    g("B,backing", "read-only backing image, or the block data file of an xcow backing image",
+      cxxopts::value<std::string>());
+    g("backing-map", "map file of an xcow backing image, snap-index selects its snapshot",
+      cxxopts::value<std::string>());
     return opt;
 }
 
+// paths are stored resolved, relative ones would depend on where xcowsrv runs
+static void set_backing_path(char (&out)[XcowBacking::path_max], const std::string &path) {
+    std::unique_ptr<char, decltype(&free)> real(realpath(path.c_str(), nullptr), &free);
+    if (!real)
+        throw std::system_error(errno, std::generic_category(), "cannot resolve backing image path");
+    auto len = strlen(real.get());
+    if (len >= XcowBacking::path_max)
+        throw std::invalid_argument("backing image path too long");
+    memcpy(out, real.get(), len + 1);
+}
+
+static XcowBacking make_backing(const cxxopts::ParseResult &argm) {
+    XcowBacking desc{};
+    set_backing_path(desc.path, argm["backing"].as<std::string>());
+    if (argm.count("backing-map")) {
+        desc.kind = XcowBacking::xcow;
+        set_backing_path(desc.map_path, argm["backing-map"].as<std::string>());
+        if (argm.count("snap-index"))
+            desc.snap = static_cast<uint32_t>(argm["snap-index"].as<int>());
+    } else {
+        desc.kind = XcowBacking::raw;
+    }
+    return desc;
+}
+
 int main(int argc, char **argv) {
     auto opts = make_options();
     cxxopts::ParseResult argm;
@@ -40,6 +78,12 @@ int main(int argc, char **argv) {
     if (mapfd.err())
         throw std::system_error(mapfd.err(), std::generic_category(), "cannot open mapfile");
     auto flk = file_lock(mapfd);
+    if (argm.count("logfile")) {
+        // leaves an empty log behind, we write to the map file directly
+        MetaLog log(argm["logfile"].as<std::string>().c_str(), mapfd);
+        if (log.replayed())
+            fmt::print("replayed {} metadata log records\n", log.replayed());
+    }
     FileDeref deref(mapfd);
     std::unique_ptr<XcowFile> f;
 
@@ -63,19 +107,45 @@ int main(int argc, char **argv) {
         if (fallocate(bfd, FALLOC_FL_ZERO_RANGE, 0, 1l << cluster_bits) < 0)
             throw std::system_error(errno, std::generic_category(), "fallocate");
 
-        f = std::make_unique<XcowFile>(
-            XcowFile::format(&deref, fsize, cluster_bits, metasize >> cluster_bits, disksize >> cluster_bits));
-
+        f = std::make_unique<XcowFile>(XcowFile::format(
+            &deref,
+            fsize,
+            cluster_bits,
+            metasize >> cluster_bits,
+            disksize >> cluster_bits,
+            argm["extended-l2"].as<bool>()));
+
+        if (argm.count("backing")) {
+            auto desc = make_backing(argm);
+            // fail now rather than when the image is first served
+            BackingImage check(desc);
+            f->set_backing(desc);
+        }
     } else {
         f = std::make_unique<XcowFile>(&deref);
+        // freed data clusters are punched out of the data file if we have it
+        FileDescriptor bfd;
+        if (argm.count("blkdev")) {
+            auto blkdev = argm["blkdev"].as<std::string>();
+            bfd = FileDescriptor(blkdev.c_str(), O_RDWR);
+            if (bfd.err())
+                throw std::system_error(bfd.err(), std::generic_category(), "cannot open blkdev");
+            f->set_discard([fd = static_cast<int>(bfd)](uint64_t off, uint64_t nbytes) {
+                punch_hole(fd, static_cast<off_t>(off), nbytes);
+            });
+        }
         if (op == "snap-list") {
             size_t count = 0;
-            for (auto it = f->snaps(); !it.at_end(); it++)
+            for (auto it = f->snaps(); !it.at_end(); it++) {
+                if (FileBits::snap_entry_dead(*it))
+                    continue;
                 fmt::print(
-                    "snap {}: {} disk_hwm={}\n",
+                    "snap {}: {} disk_hwm={}{}\n",
                     count++,
                     DECODE(*it, FileBits::decode_snap_entry),
-                    it->disk_hwm);
+                    it->disk_hwm,
+                    FileBits::snap_entry_deleting(*it) ? " (deleting)" : "");
+            }
 
         } else if (op == "snap-create") {
             int idx = 0;
@@ -88,6 +158,22 @@ int main(int argc, char **argv) {
             auto snap = f->open_write();
             f->peel(std::move(snap));
 
+        } else if (op == "snap-delete") {
+            // xcowsrv finishes the deletion in the background, or use snap-merge
+            auto idx = argm["snap-index"].as<int>();
+            if (idx == 0) {
+                auto snap = f->open_write();
+                f->peel(std::move(snap));
+            } else {
+                f->snap_delete(idx);
+            }
+
+        } else if (op == "snap-merge") {
+            size_t steps = 0;
+            while (f->merge_step())
+                steps++;
+            fmt::print("{} merge steps\n", steps);
+
         } else if (op == "snap-recreate") {
             {
                 auto snap = f->open_write();
@@ -102,6 +188,15 @@ int main(int argc, char **argv) {
                 fmt::print("{}\n", new_snap.disk_hwm());
             }
 
+        } else if (op == "upgrade") {
+            // only converts to extended l2 for now
+            if (f->extended_l2()) {
+                fmt::print("already using extended l2\n");
+            } else {
+                auto count = f->upgrade_extended_l2();
+                fmt::print("moved {} l0 tables\n", count);
+            }
+
         } else {
             throw std::runtime_error("unknown operation");
         }
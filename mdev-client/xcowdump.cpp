@@ -36,8 +36,16 @@ int main(int argc, char **argv) {
 
     fmt::print("fsize={}\n", f.fsize());
     fmt::print("cluster_bits={} ({} bytes)\n", f.cluster_bits(), f.cluster_size());
+    fmt::print("features={:#x}{}\n", f._hdr->features, f.extended_l2() ? " (extended l2)" : "");
     fmt::print("hwm_limit={}, disk_hwm_limit={}\n", f._hdr->hwm_limit, f._hdr->disk_hwm_limit);
     fmt::print("hwm={}\n", f._hdr->hwm);
+    fmt::print("free meta={}, free data={}\n", f.free_meta_count(), f.free_data_count());
+    if (auto backing = f.backing()) {
+        if (backing->kind == XcowBacking::xcow)
+            fmt::print("backing={} (xcow, map={}, snap {})\n", backing->path, backing->map_path, backing->snap);
+        else
+            fmt::print("backing={} (raw)\n", backing->path);
+    }
     fmt::print("\n");
 
     std::vector<SnapListEntry> snaps;
@@ -48,10 +56,13 @@ int main(int argc, char **argv) {
         while (sl.has_value()) {
             for (auto se = sl->active_entries().rbegin(); se != sl->active_entries().rend(); se++) {
                 fmt::print(
-                    "snap {}: {} disk_hwm={}\n",
+                    "snap {}: {} disk_hwm={}{}\n",
                     snaps.size(),
                     DECODE(*se, FileBits::decode_snap_entry),
-                    se->disk_hwm);
+                    se->disk_hwm,
+                    FileBits::snap_entry_dead(*se)       ? " (deleted)"
+                    : FileBits::snap_entry_deleting(*se) ? " (deleting)"
+                                                         : "");
                 snaps.push_back(*se);
             }
             sl = sl->next(deref);
@@ -66,7 +77,12 @@ int main(int argc, char **argv) {
         std::optional<FreeList> fl = f._flist;
         while (fl.has_value()) {
             for (auto fe : fl->active_entries()) {
-                fmt::print("free: {}\n", DECODE(fe, FileBits::decode_free_entry));
+                fmt::print(
+                    "free: {:x}->{} {}+{}\n",
+                    fe.val,
+                    FileBits::free_entry_meta(fe) ? "meta" : "data",
+                    FileBits::decode_free_entry(fe),
+                    FileBits::free_entry_count(fe));
             }
             fl = fl->next(deref);
             SEPARATE;
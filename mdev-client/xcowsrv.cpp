@@ -1,5 +1,7 @@
 #include <array>
+#include <atomic>
 #include <bit>
+#include <deque>
 #include <cstring>
 #include <cstdio>
 #include <iostream>
@@ -10,19 +12,25 @@
 #include <optional>
 #include <sstream>
 #include <span>
+#include <mutex>
+#include <shared_mutex>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 
 #include "util.hpp"
 #include "fildes.hpp"
 #include "cmdbuf.hpp"
 #include "nvme_xcow.hpp"
 #include "xcow/file_deref.hpp"
+#include "xcow/cached_deref.hpp"
+#include "xcow/meta_log.hpp"
 #include "util/mdev.hpp"
 #include "util/time.hpp"
 #include "util/uring.hpp"
+#include "util/spsc_ring.hpp"
 
 constexpr size_t MAX_VIRTUAL_QUEUES = 16;
 constexpr size_t NOTIFYFD_BURST = 16;
@@ -30,12 +38,61 @@ constexpr size_t COMPLETION_BURST = 128;
 constexpr int sleeppoll_ms = 100;
 constexpr long busypoll_ms = 500;
 constexpr unsigned int busypoll_loops = 20;
+// pending snapshot deletions make progress one l0 table at a time, at most this often
+constexpr long merge_interval_ms = 10;
+// the pool of pre-zeroed clusters is topped up and the metadata cache trimmed when there are no new commands, at most
+// this often
+constexpr long zero_refill_interval_ms = 10;
+// how often the guest's view of the space in use (NUSE) is brought up to date
+constexpr long usage_interval_ms = 1000;
+
+// metadata is read in ahead of use by this many threads, alongside the workers serving I/O
+constexpr size_t warmup_threads = 4;
+
+// commands handed to the worker owning their clusters, and replies on their way back to the worker owning the queue
+struct handoff {
+    bool is_reply = false;
+    size_t sq = 0;
+    uint32_t tag = 0;
+    uint16_t status = 0;
+    nmntfy_aux aux{};
+    nvme_command cmd{};
+};
+using handoff_ring = spsc_ring<handoff, 1024>;
+
+// the image is opened once and its metadata shared by all workers, see xcow_shards
+struct shared_image {
+    static constexpr size_t no_owner = SIZE_MAX;
+
+    explicit shared_image(size_t nworkers) : shards(nworkers), sleeping(nworkers) {
+    }
+
+    FileDescriptor mapfd;
+    cleanup flk;
+    std::unique_ptr<xcow::MetaLog> log;
+    std::unique_ptr<xcow::FileDeref> deref;
+    // instead of deref, with a memory budget
+    std::unique_ptr<xcow::CachedDeref> cache;
+    std::unique_ptr<xcow::XcowFile> f;
+    std::unique_ptr<xcow::BackingImage> backing;
+    xcow_shards shards;
+
+    // rings[src * count + dst]
+    std::vector<std::unique_ptr<handoff_ring>> rings;
+    std::vector<FileDescriptor> wakefds;
+    std::vector<std::atomic<bool>> sleeping;
+    // the worker running exclusive commands, the others wait for it in paused
+    std::atomic<size_t> barrier_owner = no_owner;
+    std::atomic<size_t> paused = 0;
+};
 
 struct worker_arg {
     std::vector<size_t> sqids;
     std::vector<int> sqfds;
-    const char *mapfile;
+    shared_image *img;
     const char *blkdev;
+    unsigned int stats_interval_s;
+    size_t tid;
     size_t below_4g_mem_size;
     int mfd;
     unsigned char *pvm;
@@ -44,19 +101,28 @@ struct worker_arg {
 };
 
 class worker {
-    std::shared_ptr<mapping> vm;
-    FileDescriptor bfd, mapfd;
-    cleanup flk;
+    // where a worker stands in a barrier for exclusive commands
+    enum class barrier_state {
+        running,
+        // another worker wants to run exclusive commands, we wait for our own commands to finish
+        pausing,
+        paused,
+        // we want to, and wait for everyone else to pause
+        acquiring,
+        exclusive,
+    };
 
-    std::unique_ptr<xcow::FileDeref> deref;
-    std::unique_ptr<xcow::XcowFile> f;
+    std::shared_ptr<mapping> vm;
+    FileDescriptor bfd;
+    shared_image *img;
+    size_t nworkers;
 
-    std::vector<bool> clock;
-    nvme_xcow::workqueue_type wq;
     std::optional<nvme_xcow> controller;
 
     std::vector<size_t> sqids;
     int adm_sqfd;
+    unsigned int stats_interval_s;
+    size_t tid;
 
     std::vector<nsqbuf_t> nsqbufs;
     std::vector<ncqbuf_t> ncqbufs;
@@ -68,7 +134,93 @@ class worker {
     std::array<nvme_command, NOTIFYFD_BURST> cmds{};
     std::array<io_uring_cqe *, COMPLETION_BURST> cqebuf{};
 
-    std::pair<bool, bool> queue_poll_once(size_t qi, size_t sq, nsqbuf_t &nsqbuf, ncqbuf_t &ncqbuf) {
+    barrier_state state = barrier_state::running;
+    // commands spanning the clusters of several workers, they wait for a barrier
+    std::vector<handoff> exclusive_cmds;
+    // commands handed to us while we couldn't run them
+    std::deque<handoff> held_cmds;
+    // handoffs that didn't fit in the ring to each worker
+    std::vector<std::deque<handoff>> backlog;
+
+    // the queue index in a tag tells which worker the queue belongs to
+    uint16_t tag_qi(size_t qi) const {
+        return static_cast<uint16_t>(tid << 8 | qi);
+    }
+
+    std::unique_lock<std::shared_mutex> lock_meta() {
+        if (nworkers == 1)
+            return {};
+        return std::unique_lock(img->shards.meta_lock);
+    }
+
+    std::shared_lock<std::shared_mutex> lock_meta_shared() {
+        if (nworkers == 1)
+            return {};
+        return std::shared_lock(img->shards.meta_lock);
+    }
+
+    void wake(size_t dst) {
+        // pairs with the fence in idle_poll()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (img->sleeping[dst].load(std::memory_order_relaxed)) {
+            uint64_t one = 1;
+            if (write(img->wakefds[dst], &one, sizeof(one)) < 0 && errno != EAGAIN)
+                throw std::system_error(errno, std::generic_category(), "cannot wake worker");
+        }
+    }
+
+    void send(size_t dst, const handoff &h) {
+        // keep the order of what's already waiting
+        if (!backlog[dst].empty() || !img->rings[tid * nworkers + dst]->push(h))
+            backlog[dst].push_back(h);
+        else
+            wake(dst);
+    }
+
+    void flush_backlog() {
+        for (size_t dst = 0; dst < nworkers; dst++) {
+            auto &bl = backlog[dst];
+            if (bl.empty())
+                continue;
+            while (!bl.empty() && img->rings[tid * nworkers + dst]->push(bl.front()))
+                bl.pop_front();
+            wake(dst);
+        }
+    }
+
+    // true if the reply waits for the log
+    bool deliver(const nm_reply &reply) {
+        auto [qi, ucid] = unmake_tag(reply.tag);
+        if (qi == qi_invalid)
+            return false;
+        if (qi != qi_admin && qi >> 8 != tid) {
+            send(qi >> 8, handoff{.is_reply = true, .tag = reply.tag, .status = reply.status, .aux = reply.aux});
+            return false;
+        }
+        if (controller->defer_reply(reply))
+            return true;
+        process_reply(ucid, reply, qi == qi_admin ? *adm_ncqbuf : ncqbufs[qi & 0xff]);
+        return false;
+    }
+
+    // true: async
+    bool execute(size_t sq, const nvme_command &cmd, uint32_t tag) {
+        nm_outcome outcome;
+        if (cmd.common.opcode == nvme_cmd_read) {
+            auto lk = lock_meta_shared();
+            outcome = controller->submit_async(sq, cmd, tag);
+        } else {
+            auto lk = lock_meta();
+            outcome = controller->submit_async(sq, cmd, tag);
+        }
+        if (std::holds_alternative<xcow_ticket *>(outcome))
+            return true;
+        else if (std::holds_alternative<nm_reply>(outcome))
+            return deliver(std::get<nm_reply>(outcome));
+        return false;
+    }
+
+    std::pair<bool, bool> queue_poll_once(size_t qi, size_t sq, nsqbuf_t &nsqbuf) {
         bool succeeded = false, submitted_async = false;
         int new_tail = 0;
         int ncmds = std::min(static_cast<int>(cmds.size()), nsqbuf.peek_items(new_tail));
@@ -76,19 +228,137 @@ class worker {
             succeeded = true;
             nsqbuf.consume_raw(cmds, new_tail, ncmds);
             for (int j = 0; j < ncmds; j++) {
-                auto tag = make_tag(qi, cmds[j].common.command_id);
-                auto outcome = controller->submit_async(sq, cmds[j], tag);
-                if (std::holds_alternative<xcow_ticket *>(outcome)) {
-                    submitted_async = true;
-                } else if (std::holds_alternative<nm_reply>(outcome)) {
-                    const auto &reply = std::get<nm_reply>(outcome);
-                    process_reply(cmds[j].common.command_id, reply, ncqbuf);
+                if (qi == qi_admin) {
+                    submitted_async |= execute(sq, cmds[j], make_tag(qi_admin, cmds[j].common.command_id));
+                    continue;
                 }
+                auto tag = make_tag(tag_qi(qi), cmds[j].common.command_id);
+                auto dst = controller->route(cmds[j]);
+                if (dst == xcow_shards::any || dst == tid)
+                    submitted_async |= execute(sq, cmds[j], tag);
+                else if (dst == xcow_shards::exclusive)
+                    exclusive_cmds.push_back(handoff{.sq = sq, .tag = tag, .cmd = cmds[j]});
+                else
+                    send(dst, handoff{.sq = sq, .tag = tag, .cmd = cmds[j]});
+            }
+        }
+        return std::make_pair(succeeded, submitted_async);
+    }
+
+    std::pair<bool, bool> inbox_poll_once() {
+        bool succeeded = false, submitted_async = false;
+        for (size_t src = 0; src < nworkers; src++) {
+            if (src == tid)
+                continue;
+            auto &ring = *img->rings[src * nworkers + tid];
+            while (auto h = ring.pop()) {
+                succeeded = true;
+                if (h->is_reply)
+                    submitted_async |= deliver(nm_reply(h->tag, h->status, h->aux));
+                else if (state == barrier_state::running)
+                    submitted_async |= execute(h->sq, h->cmd, h->tag);
+                else
+                    held_cmds.push_back(*h);
             }
         }
         return std::make_pair(succeeded, submitted_async);
     }
 
+    // true: async
+    bool barrier_step() {
+        if (nworkers == 1)
+            return false;
+        bool submitted_async = false;
+        auto owner = img->barrier_owner.load(std::memory_order_acquire);
+        switch (state) {
+        case barrier_state::running:
+            if (owner != shared_image::no_owner) {
+                state = barrier_state::pausing;
+            } else if (!exclusive_cmds.empty()) {
+                if (img->barrier_owner.compare_exchange_strong(owner, tid, std::memory_order_acq_rel)) {
+                    state = barrier_state::acquiring;
+                    for (size_t dst = 0; dst < nworkers; dst++)
+                        if (dst != tid)
+                            wake(dst);
+                } else {
+                    state = barrier_state::pausing;
+                }
+            }
+            break;
+        case barrier_state::pausing:
+            if (owner == shared_image::no_owner) {
+                state = barrier_state::running;
+            } else if (!xcow_ticket::live_count) {
+                img->paused.fetch_add(1, std::memory_order_acq_rel);
+                state = barrier_state::paused;
+            }
+            break;
+        case barrier_state::paused:
+            if (owner == shared_image::no_owner) {
+                img->paused.fetch_sub(1, std::memory_order_acq_rel);
+                state = barrier_state::running;
+            }
+            break;
+        case barrier_state::acquiring:
+            if (!xcow_ticket::live_count && img->paused.load(std::memory_order_acquire) == nworkers - 1) {
+                state = barrier_state::exclusive;
+                // nobody is using the metadata, the only time the cache can be trimmed with several workers
+                if (img->cache)
+                    img->cache->trim();
+                for (const auto &h : exclusive_cmds)
+                    submitted_async |= execute(h.sq, h.cmd, h.tag);
+                exclusive_cmds.clear();
+            }
+            break;
+        case barrier_state::exclusive:
+            if (!xcow_ticket::live_count) {
+                img->barrier_owner.store(shared_image::no_owner, std::memory_order_release);
+                state = barrier_state::running;
+                for (size_t dst = 0; dst < nworkers; dst++)
+                    if (dst != tid)
+                        wake(dst);
+            }
+            break;
+        }
+        if (state == barrier_state::running) {
+            while (!held_cmds.empty()) {
+                const auto &h = held_cmds.front();
+                submitted_async |= execute(h.sq, h.cmd, h.tag);
+                held_cmds.pop_front();
+            }
+        }
+        return submitted_async;
+    }
+
+    bool inbox_empty() const {
+        for (size_t src = 0; src < nworkers; src++)
+            if (src != tid && !img->rings[src * nworkers + tid]->empty())
+                return false;
+        return true;
+    }
+
+    void idle_poll(int timeout) {
+        for (auto &pfd : pollfds) {
+            pfd.events = POLLIN;
+        }
+        if (nworkers == 1) {
+            if (poll(pollfds.data(), pollfds.size(), timeout) < 0)
+                throw std::system_error(errno, std::generic_category(), "cannot poll queues");
+            return;
+        }
+        img->sleeping[tid].store(true, std::memory_order_relaxed);
+        // pairs with the fence in wake()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool idle = inbox_empty() && std::all_of(backlog.begin(), backlog.end(), [](auto &bl) { return bl.empty(); });
+        if (idle && img->barrier_owner.load(std::memory_order_relaxed) == shared_image::no_owner &&
+            poll(pollfds.data(), pollfds.size(), timeout) < 0)
+            throw std::system_error(errno, std::generic_category(), "cannot poll queues");
+        img->sleeping[tid].store(false, std::memory_order_relaxed);
+        uint64_t val;
+        if (read(img->wakefds[tid], &val, sizeof(val)) < 0 && errno != EAGAIN)
+            throw std::system_error(errno, std::generic_category(), "cannot read wakeup");
+    }
+
     void process_reply(uint16_t ucid, const nm_reply &reply, ncqbuf_t &ncqbuf) {
         nmntfy_response resp{
             .ucid = ucid,
@@ -100,7 +370,7 @@ class worker {
 
 public:
     worker(const worker_arg &arg) {
-        if (!arg.pvm || !arg.pvm_size || arg.sqids.empty() || arg.sqids.size() != arg.sqfds.size())
+        if (!arg.pvm || !arg.pvm_size || arg.sqids.empty() || arg.sqids.size() != arg.sqfds.size() || !arg.img)
             throw std::invalid_argument("worker_arg");
 
         vm = std::make_shared<mapping>(arg.pvm, arg.pvm_size);
@@ -109,16 +379,29 @@ public:
             throw std::system_error(bfd.err(), std::generic_category(), "cannot open blkdev file");
         }
 
-        mapfd = FileDescriptor(arg.mapfile, O_RDWR);
-        if (mapfd.err())
-            throw std::system_error(mapfd.err(), std::generic_category(), "cannot open mapfile");
-        flk = xcow::file_lock(mapfd);
-        deref = std::make_unique<xcow::FileDeref>(mapfd);
-        f = std::make_unique<xcow::XcowFile>(deref.get());
-        controller = nvme_xcow(vm, arg.sqfds.front(), bfd, f.get(), &clock, &wq);
+        img = arg.img;
+        nworkers = img->shards.count;
+        backlog.resize(nworkers);
+        {
+            // the controllers set up the shared file as well
+            auto lk = lock_meta();
+            controller = nvme_xcow(
+                vm,
+                arg.sqfds.front(),
+                bfd,
+                img->f.get(),
+                &img->shards.locks[arg.tid],
+                img->deref.get(),
+                img->log.get(),
+                img->backing.get(),
+                &img->shards,
+                img->cache.get());
+        }
 
         sqids = arg.sqids;
         adm_sqfd = arg.adm_sqfd;
+        stats_interval_s = arg.stats_interval_s;
+        tid = arg.tid;
 
         for (auto &sqfd : arg.sqfds) {
             nsqbufs.emplace_back(sqfd, NMNTFY_SQ_DATA_OFFSET);
@@ -131,17 +414,27 @@ public:
             adm_ncqbuf = ncqbuf_t(arg.adm_sqfd, NMNTFY_CQ_DATA_OFFSET);
             pollfds.push_back(pollfd{.fd = arg.adm_sqfd, .events = POLLIN});
         }
+
+        if (nworkers > 1)
+            pollfds.push_back(pollfd{.fd = img->wakefds[tid], .events = POLLIN});
     }
 
     void run() {
-        timespec last{};
+        std::ostringstream stats_prefix;
+        stats_prefix << "worker" << tid;
+        timespec last{}, last_merge{}, last_stats{}, last_refill{}, last_usage{};
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &last_stats);
+        // deletions left over from a previous run are picked up as well
+        bool merging = adm_sqfd >= 0;
+        // the clusters in use are counted alongside I/O, NUSE reads 0 until then
+        bool counting = adm_sqfd >= 0;
 
         while (true) {
-            bool succeeded = false, submitted_async = false;
-            for (unsigned int ntry = 0; ntry < busypoll_loops; ntry++) {
+            auto [succeeded, submitted_async] = inbox_poll_once();
+            // new commands wait while a barrier is up
+            for (unsigned int ntry = 0; state == barrier_state::running && ntry < busypoll_loops; ntry++) {
                 for (size_t qi = 0; qi < nsqbufs.size(); qi++) {
-                    auto [this_succeeded, this_submitted_async] =
-                        queue_poll_once(qi, sqids[qi], nsqbufs[qi], ncqbufs[qi]);
+                    auto [this_succeeded, this_submitted_async] = queue_poll_once(qi, sqids[qi], nsqbufs[qi]);
                     succeeded |= this_succeeded;
                     submitted_async |= this_submitted_async;
                 }
@@ -155,74 +448,154 @@ public:
 
             submitted_async = false;
             auto wnd = controller->get_pending_completions(std::span(cqebuf));
-            for (auto cqe : wnd.cqes) {
-                auto t = static_cast<xcow_ticket *>(controller->cqe_get_data(cqe));
-                uint32_t tag = t->tag;
-                auto count = --t->count;
-                if (!count) {
-                    if (cqe->res < 0)
-                        printf("unhappy %p %#x %d\n", t, tag, cqe->res);
-
-                    if (tag != noop_tag) {
-                        auto [qi, ucid] = unmake_tag(tag);
-                        nm_reply reply(tag, translate_uring_status(cqe->res), t->aux);
-                        process_reply(ucid, reply, qi == qi_admin ? *adm_ncqbuf : ncqbufs[qi]);
-                    }
-                    auto vblk = t->locked_cluster;
-                    if (cqe->res < 0)
-                        // the only ticket->last we have right now is from do_alloc_one_tx
-                        // refuse commit
-                        t->last.neutralize();
-                    // trigger ticket->last before draining cluster locking work queue
-                    delete t;
-                    if (vblk != UINT64_MAX) {
-                        clock[vblk] = false;
-                        while (auto we = wq.extract(vblk)) {
-                            auto outcome = we.mapped()(cqe->res);
-                            if (std::holds_alternative<xcow_ticket *>(outcome)) {
-                                submitted_async = true;
-                                break;
-                            } else if (std::holds_alternative<nm_reply>(outcome)) {
-                                const auto &reply = std::get<nm_reply>(outcome);
-                                auto [qi, ucid] = unmake_tag(reply.tag);
-                                if (qi != qi_invalid)
-                                    process_reply(ucid, reply, qi == qi_admin ? *adm_ncqbuf : ncqbufs[qi]);
-                            }
-                        }
-                    }
-                }
+            if (!wnd.cqes.empty()) {
+                // commits and the cluster lock work queue change the shared metadata
+                auto lk = lock_meta();
+                for (auto cqe : wnd.cqes)
+                    submitted_async |= controller->complete(cqe, [&](const nm_outcome &outcome) {
+                        if (std::holds_alternative<xcow_ticket *>(outcome))
+                            return true;
+                        else if (std::holds_alternative<nm_reply>(outcome))
+                            return deliver(std::get<nm_reply>(outcome));
+                        return false;
+                    });
             }
             controller->commit_completions(wnd);
+            submitted_async |= barrier_step();
             if (submitted_async) {
                 controller->sq_kick();
             }
+            flush_backlog();
+
+            if (stats_interval_s) {
+                timespec now{};
+                clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+                if (now - last_stats > 1000000000l * stats_interval_s) {
+                    auto lk = lock_meta_shared();
+                    controller->print_stats(stdout, stats_prefix.str().c_str());
+                    last_stats = now;
+                }
+            }
+
+            // the metadata is shared between workers, the first one does all the merging and reports the space in use
+            if (adm_sqfd >= 0 && state == barrier_state::running) {
+                timespec now{};
+                clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+                if (now - last_merge > 1000000l * merge_interval_ms) {
+                    last_merge = now;
+                    auto lk = lock_meta();
+                    merging = controller->merge_step();
+                }
+                if (now - last_usage > 1000000l * (counting ? merge_interval_ms : usage_interval_ms)) {
+                    last_usage = now;
+                    auto lk = lock_meta();
+                    counting = controller->report_usage();
+                }
+            }
 
             if (succeeded) {
                 clock_gettime(CLOCK_MONOTONIC_COARSE, &last);
             } else {
-                if (adm_sqfd >= 0) {
-                    auto [this_succeeded, this_submitted_async] =
-                        queue_poll_once(qi_admin, 0, *adm_nsqbuf, *adm_ncqbuf);
+                if (adm_sqfd >= 0 && state == barrier_state::running) {
+                    auto [this_succeeded, this_submitted_async] = queue_poll_once(qi_admin, 0, *adm_nsqbuf);
                     if (this_submitted_async)
                         controller->sq_kick();
                 }
 
                 timespec now{};
                 clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
-                if (now - last > 1000000l * busypoll_ms) {
+                if (state == barrier_state::running && now - last_refill > 1000000l * zero_refill_interval_ms) {
+                    last_refill = now;
+                    auto lk = lock_meta();
+                    // evicting needs every transaction to be done with the metadata it points to
+                    if (img->cache && nworkers == 1 && !xcow_ticket::live_count)
+                        img->cache->trim();
+                    if (controller->refill_zero_pool())
+                        controller->sq_kick();
+                }
+
+                // a barrier doesn't wait for sleepers
+                if (state == barrier_state::running && now - last > 1000000l * busypoll_ms) {
                     // timeout
-                    for (auto &pfd : pollfds) {
-                        pfd.events = POLLIN;
-                    }
-                    if (poll(pollfds.data(), pollfds.size(), sleeppoll_ms) < 0) {
-                        throw std::system_error(errno, std::generic_category(), "cannot poll queues");
-                    }
+                    controller->log_checkpoint();
+                    // don't let merges wait for the next command
+                    idle_poll(merging || counting ? static_cast<int>(merge_interval_ms) : sleeppoll_ms);
                 }
             }
         }
     }
 };
 
+static std::unique_ptr<shared_image> open_image(
+    const char *mapfile,
+    const char *logfile,
+    size_t cache_budget,
+    size_t nworkers) {
+    auto img = std::make_unique<shared_image>(nworkers);
+    img->mapfd = FileDescriptor(mapfile, O_RDWR);
+    if (img->mapfd.err())
+        throw std::system_error(img->mapfd.err(), std::generic_category(), "cannot open mapfile");
+    img->flk = xcow::file_lock(img->mapfd);
+    if (logfile) {
+        // metadata changes stay in memory until they're logged
+        img->log = std::make_unique<xcow::MetaLog>(logfile, img->mapfd);
+        if (img->log->replayed())
+            printf("replayed %zu metadata log records\n", img->log->replayed());
+        img->deref = std::make_unique<xcow::FileDeref>(img->mapfd, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+        img->log->attach(img->deref.get());
+    } else if (cache_budget) {
+        img->cache = std::make_unique<xcow::CachedDeref>(img->mapfd, cache_budget);
+    } else {
+        img->deref = std::make_unique<xcow::FileDeref>(img->mapfd);
+        // so that flushes only write back what changed
+        img->deref->track_dirty();
+    }
+    if (img->cache)
+        img->f = std::make_unique<xcow::XcowFile>(img->cache.get());
+    else
+        img->f = std::make_unique<xcow::XcowFile>(img->deref.get());
+    if (img->log)
+        // opening might have upgraded the file
+        img->log->checkpoint();
+    img->backing = xcow::BackingImage::open(*img->f);
+
+    if (nworkers > 1) {
+        for (size_t i = 0; i < nworkers * nworkers; i++)
+            img->rings.push_back(std::make_unique<handoff_ring>());
+        for (size_t i = 0; i < nworkers; i++) {
+            auto &efd = img->wakefds.emplace_back(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+            if (efd < 0)
+                throw std::system_error(errno, std::generic_category(), "cannot create eventfd");
+        }
+    }
+    return img;
+}
+
+// the threads share the plan and take its ranges in order
+static void warmup_func(
+    xcow::Deref *meta,
+    const std::vector<std::pair<uint64_t, size_t>> *plan,
+    std::atomic<size_t> *next) {
+    try {
+        for (size_t i; (i = next->fetch_add(1, std::memory_order_relaxed)) < plan->size();)
+            meta->prefetch((*plan)[i].first, (*plan)[i].second);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "metadata warmup stopped: %s\n", e.what());
+    }
+}
+
+static std::optional<xcow::WarmupOrder> parse_warmup_order(const char *s) {
+    if (!strcmp(s, "none"))
+        return xcow::WarmupOrder::none;
+    else if (!strcmp(s, "roots"))
+        return xcow::WarmupOrder::roots;
+    else if (!strcmp(s, "recent"))
+        return xcow::WarmupOrder::recent;
+    else if (!strcmp(s, "address"))
+        return xcow::WarmupOrder::address;
+    return std::nullopt;
+}
+
 // this function forces all worker allocations to happen within its own thread
 static void worker_func(worker_arg arg) {
     worker w(arg);
@@ -237,11 +610,15 @@ int main(int argc, char **argv) { // NOLINT
     const char *arg_memfile = nullptr;
     const char *arg_mapfile = nullptr;
     const char *arg_blkdev = nullptr;
+    const char *arg_logfile = nullptr;
+    unsigned int arg_stats_interval_s = 0;
+    size_t arg_cache_budget = 0;
+    auto arg_warmup = xcow::WarmupOrder::recent;
     size_t nthreads = 1;
     size_t arg_below_4g_mem_size = 2ull << 30;
     int o = 0;
 
-    while ((o = getopt(argc, argv, "g:d:m:M:Fb:j:l:")) != -1) {
+    while ((o = getopt(argc, argv, "g:d:m:M:Fb:j:l:L:s:C:W:")) != -1) {
         switch (o) {
         case 'g':
             arg_iommu_group = optarg;
@@ -264,6 +641,23 @@ int main(int argc, char **argv) { // NOLINT
         case 'l':
             arg_below_4g_mem_size = strtoull(optarg, NULL, 0);
             break;
+        case 'L':
+            arg_logfile = optarg;
+            break;
+        case 's':
+            arg_stats_interval_s = static_cast<unsigned int>(strtoul(optarg, NULL, 0));
+            break;
+        case 'C':
+            arg_cache_budget = strtoull(optarg, NULL, 0);
+            break;
+        case 'W':
+            if (auto order = parse_warmup_order(optarg)) {
+                arg_warmup = *order;
+            } else {
+                fprintf(stderr, "unknown warmup order %s\n", optarg);
+                return 1;
+            }
+            break;
         default:
             printf("unknown flag %d\n", o);
             return 1;
@@ -297,6 +691,16 @@ int main(int argc, char **argv) { // NOLINT
     if (nthreads == 0 || nthreads > sqfds.size()) {
         nthreads = sqfds.size();
     }
+    // log records are only committed from the worker that writes them
+    if (arg_logfile && nthreads != 1) {
+        fprintf(stderr, "metadata log requires a single worker\n");
+        return 1;
+    }
+    // the log tracks changes through the private mapping of the map file
+    if (arg_logfile && arg_cache_budget) {
+        fprintf(stderr, "metadata cache cannot be used with a metadata log\n");
+        return 1;
+    }
 
     std::vector<std::vector<size_t>> worker_sqids(nthreads);
     std::vector<std::vector<int>> worker_sqfds(nthreads);
@@ -309,6 +713,12 @@ int main(int argc, char **argv) { // NOLINT
         }
     }
 
+    auto img = open_image(arg_mapfile, arg_logfile, arg_cache_budget, nthreads);
+    // planned before the workers start changing the metadata, the warmup itself runs while they serve I/O
+    auto plan = img->f->warmup_plan(arg_warmup);
+    xcow::Deref *meta = img->cache ? static_cast<xcow::Deref *>(img->cache.get()) : img->deref.get();
+    std::atomic<size_t> warmup_next = 0;
+
     std::vector<std::thread> workers;
     for (size_t tid = 0; tid < nthreads; tid++) {
         auto &t = workers.emplace_back(
@@ -316,8 +726,10 @@ int main(int argc, char **argv) { // NOLINT
             worker_arg{
                 .sqids = worker_sqids[tid],
                 .sqfds = worker_sqfds[tid],
-                .mapfile = arg_mapfile,
+                .img = img.get(),
                 .blkdev = arg_blkdev,
+                .stats_interval_s = arg_stats_interval_s,
+                .tid = tid,
                 .below_4g_mem_size = arg_below_4g_mem_size,
                 .mfd = mfd,
                 .pvm = static_cast<unsigned char *>(pvm),
@@ -330,6 +742,17 @@ int main(int argc, char **argv) { // NOLINT
         pthread_setname_np(t.native_handle(), tn.str().c_str());
     }
 
+    std::vector<std::thread> warmers;
+    for (size_t i = 0; i < std::min(warmup_threads, plan.size()); i++) {
+        auto &t = warmers.emplace_back(warmup_func, meta, &plan, &warmup_next);
+        std::ostringstream tn;
+        tn << "warmup" << i;
+        pthread_setname_np(t.native_handle(), tn.str().c_str());
+    }
+
+    for (auto &t : warmers) {
+        t.join();
+    }
     for (auto &t : workers) {
         t.join();
     }